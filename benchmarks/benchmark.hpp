@@ -0,0 +1,87 @@
+//---------------------------------------------------------------------------
+/// \file   benchmarks/benchmark.hpp
+/// \brief  Small helpers shared by the benchmark programs.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace hexa {
+namespace bench {
+
+/** Measures the wall clock time since it was constructed. */
+class stopwatch
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    stopwatch() : start_ (clock::now()) { }
+
+    void restart() { start_ = clock::now(); }
+
+    /** Elapsed time in seconds. */
+    double seconds() const
+    {
+        return std::chrono::duration<double>(clock::now() - start_).count();
+    }
+
+private:
+    clock::time_point start_;
+};
+
+/** Print a line with the results of a single run.
+ * @param name     Name of the test
+ * @param ops      Number of operations performed
+ * @param secs     Time it took
+ * @param bytes    Number of bytes processed, or 0 if not applicable */
+inline void report (const std::string& name, size_t ops, double secs,
+                    size_t bytes = 0)
+{
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::fixed << std::setprecision(3)
+              << std::setw(10) << secs << " s"
+              << std::setw(14) << std::setprecision(0) << ops / secs << " ops/s";
+
+    if (bytes > 0)
+        std::cout << std::setw(10) << std::setprecision(1)
+                  << bytes / secs / (1024 * 1024) << " MiB/s";
+
+    std::cout << std::endl;
+}
+
+/** Keep the compiler from optimizing away a result. */
+template <class t>
+inline void do_not_optimize (const t& value)
+{
+#if defined(__GNUC__)
+    asm volatile ("" : : "g"(&value) : "memory");
+#else
+    static const void* volatile sink;
+    sink = &value;
+    (void)sink;
+#endif
+}
+
+} // namespace bench
+} // namespace hexa
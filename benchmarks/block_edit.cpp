@@ -0,0 +1,177 @@
+//---------------------------------------------------------------------------
+// benchmarks/block_edit.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Mining a tunnel through a patch of rolling hills, one block at a time,
+// with sunlight and ambient occlusion.  Handing out the whole chunk for
+// every change, which rebuilds the surfaces and light maps of the chunk
+// and its six neighbors, is compared to changing single blocks, which
+// only patches the faces around them.
+//
+// Usage: benchmark_block_edit [length]
+
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <hexa/block_types.hpp>
+#include <hexa/persistence_leveldb.hpp>
+#include <hexa/voxel_range.hpp>
+#include <hexa/server/extract_surface.hpp>
+#include <hexa/server/world.hpp>
+#include <hexa/server/lightmap/ambient_occlusion_lightmap.hpp>
+#include <hexa/server/lightmap/sun_lightmap.hpp>
+
+#include "benchmark.hpp"
+
+namespace fs = boost::filesystem;
+using namespace hexa;
+
+namespace {
+
+const uint16_t ground = 1;
+
+/** Hills about 16 blocks high, with a period of a few chunks. */
+class hills : public terrain_generator_i
+{
+public:
+    hills (world& w) : terrain_generator_i (w) { }
+
+    static int height (world_coordinates b)
+    {
+        world_vector r (b - world_center);
+        return 8.0 * std::sin(r.x / 11.0) * std::cos(r.y / 7.0);
+    }
+
+    void generate (world_terraingen_access&, const chunk_coordinates& pos,
+                   chunk& cnk) override
+    {
+        for (auto p : every_block_in_chunk)
+        {
+            world_coordinates b (pos * chunk_size + p);
+            cnk[p] = int(b.z - world_center.z) < height(b) ? ground : type::air;
+        }
+    }
+
+    chunk_height estimate_height (world_terraingen_access&, map_coordinates,
+                                  chunk_height) const override
+    {
+        return world_chunk_center.z + 1;
+    }
+};
+
+struct test_world
+{
+    test_world (const fs::path& p)
+        : path  (p)
+        , store (path)
+        , w     (store)
+    {
+        boost::property_tree::ptree conf;
+        w.add_terrain_generator(std::unique_ptr<terrain_generator_i>(
+            new hills(w)));
+        w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+            new sun_lightmap(w, conf)));
+        w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+            new ambient_occlusion_lightmap(w, conf)));
+    }
+
+    ~test_world()
+    {
+        store.close();
+        fs::remove_all(path);
+    }
+
+    fs::path            path;
+    persistence_leveldb store;
+    world               w;
+};
+
+typedef std::function<void(world&, world_coordinates)> dig;
+
+/** Take out a single block, letting the world know only that block
+ *  changed. */
+void dig_block (world& w, world_coordinates pos)
+{
+    auto proxy (w.acquire_write_access(pos >> cnkshift));
+    proxy[pos] = type::air;
+}
+
+/** Take out a single block, but hand out the whole chunk for it. */
+void dig_chunk (world& w, world_coordinates pos)
+{
+    auto proxy (w.acquire_write_access(pos >> cnkshift));
+    proxy.get_chunk(pos >> cnkshift)[pos % chunk_size] = type::air;
+}
+
+void run (const std::string& name, const dig& f, int length)
+{
+    static int count (0);
+    test_world tw ("benchmark_block_edit_" + std::to_string(++count) + ".leveldb");
+
+    // A tunnel two blocks high, running east.  It starts out in the
+    // open, then goes in and out of the hills.
+    std::vector<world_coordinates> blocks;
+    for (int x (0); x < length; ++x)
+    {
+        world_coordinates b (world_center + world_vector(x, 3, -2));
+        blocks.emplace_back(b);
+        blocks.emplace_back(b + world_vector(0, 0, 1));
+    }
+
+    // The surfaces and light maps have to be there already, as if the
+    // players had seen them.
+    for (int x (-1); x <= length / chunk_size + 1; ++x)
+    {
+        for (auto r : cube_range<world_vector>(1))
+        {
+            chunk_coordinates p (world_chunk_center + world_vector(x, 0, 0) + r);
+            tw.w.acquire_read_access().get_compressed_lightmap(p);
+        }
+    }
+
+    bench::stopwatch timer;
+    for (auto& b : blocks)
+        f(tw.w, b);
+
+    bench::report(name, blocks.size(), timer.seconds());
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    int length (argc > 1 ? std::atoi(argv[1]) : 64);
+
+    init_surface_extraction();
+    auto& g (register_new_material(ground));
+    g.name = "ground";
+    g.transparency = 0;
+
+    std::cout << "blocks mined per second" << std::endl;
+    run("whole chunk", dig_chunk, length);
+    run("single blocks", dig_block, length);
+
+    return EXIT_SUCCESS;
+}
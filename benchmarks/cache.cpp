@@ -0,0 +1,203 @@
+//---------------------------------------------------------------------------
+// benchmarks/cache.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Compares lru_cache and clock_cache.  A couple of players wander around
+// the world, and look up the chunks around them; chunks that aren't in
+// the cache are inserted, and the cache is pruned back to its capacity.
+// The capacity is varied to get different hit ratios.  The last test
+// runs the same workload on a sharded_cache from several threads.
+//
+// Usage: benchmark_cache [lookups] [threads]
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/clock_cache.hpp>
+#include <hexa/lru_cache.hpp>
+#include <hexa/sharded_cache.hpp>
+#include <hexa/server/random.hpp>
+
+#include "benchmark.hpp"
+
+using namespace hexa;
+
+namespace {
+
+/** About the size of a cache entry's bookkeeping in the world. */
+struct payload
+{
+    std::array<uint64_t, 8> data;
+};
+
+/** Players that move around a bit, and look at the chunks near them. */
+class workload
+{
+public:
+    workload (uint32_t seed, int players = 8)
+        : rn_ (seed)
+    {
+        for (int i (0); i < players; ++i)
+        {
+            players_.emplace_back(world_chunk_center
+                                  + chunk_coordinates(i * 8, 0, 0));
+        }
+    }
+
+    chunk_coordinates next()
+    {
+        auto& p (players_[prng_next(rn_) % players_.size()]);
+
+        // Every now and then, a player moves to the next chunk.
+        if (prng_next(rn_) % 16 == 0)
+            p.x += (prng_next(rn_) % 3) - 1;
+
+        if (prng_next(rn_) % 16 == 0)
+            p.y += (prng_next(rn_) % 3) - 1;
+
+        // Everything within the view range, but the chunks near the
+        // player are looked at more often.
+        auto offset = [&]{ return int(prng_next(rn_) % 9) - int(prng_next(rn_) % 9)
+                                  + int(prng_next(rn_) % 5) - 2; };
+        return p + chunk_coordinates(offset(), offset(), offset() / 2);
+    }
+
+private:
+    uint32_t                        rn_;
+    std::vector<chunk_coordinates>  players_;
+};
+
+template <class cache>
+void run (const std::string& name, size_t capacity, size_t lookups)
+{
+    cache c;
+    workload w (42);
+    size_t hits (0);
+
+    bench::stopwatch timer;
+    for (size_t i (0); i < lookups; ++i)
+    {
+        auto pos (w.next());
+        auto found (c.try_get(pos));
+        if (found)
+        {
+            ++hits;
+            bench::do_not_optimize(*found);
+            continue;
+        }
+        c[pos].data[0] = i;
+        if (c.size() > capacity)
+            c.prune(capacity);
+    }
+    double secs (timer.seconds());
+
+    bench::report(name + " " + std::to_string(capacity) + ", "
+                  + std::to_string(hits * 100 / lookups) + "% hits",
+                  lookups, secs);
+}
+
+struct unit_weight_payload
+{
+    size_t operator() (const payload&) const { return 1; }
+};
+
+template <class cache>
+void run_threaded (const std::string& name, cache& c, size_t capacity,
+                   size_t lookups, int threads)
+{
+    std::vector<std::thread> pool;
+    bench::stopwatch timer;
+    for (int t (0); t < threads; ++t)
+    {
+        pool.emplace_back([&, t]
+        {
+            workload w (t + 1);
+            for (size_t i (0); i < lookups; ++i)
+            {
+                auto pos (w.next());
+                if (!c.try_get(pos))
+                    c.emplace(pos, payload());
+
+                if (i % 1024 == 0 && t == 0)
+                    c.prune(capacity);
+            }
+        });
+    }
+    for (auto& t : pool)
+        t.join();
+
+    bench::report(name, lookups * threads, timer.seconds());
+}
+
+/** An lru_cache behind a single lock, like the world had before the
+ *  caches were sharded. */
+class locked_lru
+{
+public:
+    boost::optional<payload&> try_get (const chunk_coordinates& k)
+    {
+        std::lock_guard<std::mutex> l (lock_);
+        return cache_.try_get(k);
+    }
+
+    void emplace (const chunk_coordinates& k, payload&& v)
+    {
+        std::lock_guard<std::mutex> l (lock_);
+        cache_[k] = v;
+    }
+
+    void prune (size_t n)
+    {
+        std::lock_guard<std::mutex> l (lock_);
+        cache_.prune(n);
+    }
+
+private:
+    std::mutex                             lock_;
+    lru_cache<chunk_coordinates, payload>  cache_;
+};
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    size_t lookups (argc > 1 ? std::atol(argv[1]) : 4000000);
+    int threads (argc > 2 ? std::atoi(argv[2]) : 4);
+
+    std::cout << "lookups per second" << std::endl;
+    for (size_t capacity : { 1000, 2000, 4000 })
+    {
+        run<lru_cache<chunk_coordinates, payload>>("lru_cache", capacity, lookups);
+        run<clock_cache<chunk_coordinates, payload>>("clock_cache", capacity, lookups);
+    }
+
+    locked_lru single;
+    run_threaded("lru_cache, one lock", single, 2000, lookups, threads);
+
+    sharded_cache<chunk_coordinates, payload, unit_weight_payload> sharded;
+    run_threaded("sharded clock_cache", sharded, 2000, lookups, threads);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+//---------------------------------------------------------------------------
+// benchmarks/cave_carving.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Carves cave corridors out of solid chunks, the same way the cave
+// generator does.  Testing every block against every shape is compared
+// to rasterizing the shapes into column spans.  The section is a lot
+// more crowded than a real one, to get plenty of overlapping shapes per
+// chunk.  Both methods are checked to give identical chunks.
+//
+// Usage: benchmark_cave_carving [corridors] [repeat]
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <boost/math/constants/constants.hpp>
+
+#include <hexa/algorithm.hpp>
+#include <hexa/chunk.hpp>
+#include <hexa/voxel_range.hpp>
+#include <hexa/server/random.hpp>
+#include <hexa/server/voxel_shapes.hpp>
+
+#include "benchmark.hpp"
+
+using namespace boost::math::constants;
+using namespace hexa;
+
+namespace {
+
+const uint16_t stone (1);
+
+/** A bunch of corridors, made the same way as in the cave generator. */
+struct cave_section
+{
+    std::vector<std::unique_ptr<csg::shape>> parts;
+    std::unordered_map<chunk_coordinates, std::vector<size_t>> part_map;
+};
+
+cave_section make_caves (int corridors)
+{
+    cave_section result;
+    uint32_t hash (12345);
+    for (int i (0); i < corridors; ++i)
+    {
+        vec3f pos (prng_next_pos(hash).mod(chunk_coordinates(128, 128, 64)));
+        float total_length (0.0f);
+        float corridor_length ((prng_next(hash) % 80) + 50);
+        yaw_pitch direction (prng_next_f(hash) * pi<float>(),
+                             half_pi<float>() + 0.5f * prng_next_f(hash));
+        float radius (prng_next_f(hash) + 4.0f);
+
+        result.parts.emplace_back(new csg::sphere(pos, radius));
+        while (total_length < corridor_length)
+        {
+            float length (prng_next_f(hash) * 3.0f + 8.0f);
+            float next_radius (clamp(radius + prng_next_f(hash), 0.7f, 9.0f));
+            vec3f next_pos (pos + from_spherical(direction) * length);
+
+            result.parts.emplace_back(new csg::sphere(next_pos, next_radius));
+            result.parts.emplace_back(new csg::truncated_cone(pos, radius, next_pos, next_radius));
+
+            radius = next_radius;
+            pos = next_pos;
+            direction.x += prng_next_f(hash) * 1.2f;
+            direction.y += prng_next_f(hash) * 0.2f;
+            direction.y = clamp(direction.y, pi<float>() * 0.2f, pi<float>() * 0.8f);
+            total_length += length;
+        }
+    }
+
+    for (size_t i (0); i < result.parts.size(); ++i)
+    {
+        for (auto& j : result.parts[i]->chunks())
+            result.part_map[j].emplace_back(i);
+    }
+    return result;
+}
+
+chunk solid_chunk()
+{
+    chunk result;
+    for (auto& b : result)
+        b = stone;
+
+    return result;
+}
+
+/** Test every block against the shapes. */
+void carve_blocks (const cave_section& caves, chunk_coordinates pos,
+                   const std::vector<size_t>& parts, chunk& cnk)
+{
+    vec3f offset (world_vector(pos) * chunk_size);
+    for (auto k : every_block_in_chunk)
+    {
+        auto& blk (cnk[k]);
+        if (blk == type::air)
+            continue;
+
+        vec3f blkpos (offset + vec3f(k));
+        for (auto index : parts)
+        {
+            if (caves.parts[index]->is_inside(blkpos))
+            {
+                blk = type::air;
+                break;
+            }
+        }
+    }
+}
+
+/** Rasterize the shapes, and clear the marked blocks. */
+void carve_spans (const cave_section& caves, chunk_coordinates pos,
+                  const std::vector<size_t>& parts, chunk& cnk)
+{
+    vec3f offset (world_vector(pos) * chunk_size);
+    csg::chunk_mask carve;
+    carve.fill(0);
+    for (auto index : parts)
+        caves.parts[index]->rasterize(offset, carve);
+
+    for (uint8_t y (0); y < chunk_size; ++y)
+    {
+        for (uint8_t x (0); x < chunk_size; ++x)
+        {
+            auto column (carve[x + y * chunk_size]);
+            for (uint8_t z (0); column != 0; ++z, column >>= 1)
+            {
+                if (column & 1)
+                    cnk(x, y, z) = type::air;
+            }
+        }
+    }
+}
+
+template <typename func>
+std::vector<chunk> run (const std::string& name, const cave_section& caves,
+                        int repeat, func carve)
+{
+    std::vector<chunk> result;
+    const chunk solid (solid_chunk());
+
+    bench::stopwatch timer;
+    for (int r (0); r < repeat; ++r)
+    {
+        result.clear();
+        for (auto& p : caves.part_map)
+        {
+            result.emplace_back(solid);
+            carve(caves, p.first, p.second, result.back());
+        }
+    }
+    bench::report(name, caves.part_map.size() * repeat, timer.seconds());
+
+    return result;
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    int corridors (argc > 1 ? std::atoi(argv[1]) : 16);
+    int repeat (argc > 2 ? std::atoi(argv[2]) : 10);
+
+    auto caves (make_caves(corridors));
+    size_t overlaps (0);
+    for (auto& p : caves.part_map)
+        overlaps += p.second.size();
+
+    std::cout << caves.parts.size() << " shapes in " << caves.part_map.size()
+              << " chunks, " << double(overlaps) / caves.part_map.size()
+              << " shapes per chunk (chunks per second)" << std::endl;
+
+    auto blocks (run("every block", caves, repeat, carve_blocks));
+    auto spans  (run("column spans", caves, repeat, carve_spans));
+
+    for (size_t i (0); i < blocks.size(); ++i)
+    {
+        if (!std::equal(blocks[i].begin(), blocks[i].end(), spans[i].begin()))
+        {
+            std::cout << "chunk " << i << " differs" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::cout << "identical results" << std::endl;
+
+    return EXIT_SUCCESS;
+}
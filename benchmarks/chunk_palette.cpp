@@ -0,0 +1,181 @@
+//---------------------------------------------------------------------------
+// benchmarks/chunk_palette.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Packed chunks compared to unpacked ones, on the terrains of the unit
+// tests.  Prints how much memory both take, and how fast surfaces can
+// be extracted from them.
+//
+// Usage: benchmark_chunk_palette [unit test directory] [repeat]
+
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <hexanoise/generator_context.hpp>
+#include <hexanoise/simple_global_variables.hpp>
+
+#include <hexa/block_types.hpp>
+#include <hexa/persistence_leveldb.hpp>
+#include <hexa/voxel_range.hpp>
+#include <hexa/server/extract_surface.hpp>
+#include <hexa/server/init_terrain_generators.hpp>
+#include <hexa/server/voxel_snapshot.hpp>
+#include <hexa/server/world.hpp>
+
+#include "benchmark.hpp"
+
+namespace fs = boost::filesystem;
+namespace pt = boost::property_tree;
+using namespace hexa;
+
+namespace {
+
+/** A world set up the same way as in the unit tests. */
+struct test_world
+{
+    test_world (const fs::path& file)
+        : path  ("benchmark_chunk_palette_" + file.stem().string() + ".leveldb")
+        , store (path)
+        , w     (store)
+        , ctx   (vars)
+    {
+        vars["seed"] = 5.0;
+        vars["one"] = 1.0;
+        vars["two"] = 2.0;
+
+        pt::ptree config;
+        pt::read_json(file.string(), config);
+        init_terrain_gen(w, config, ctx);
+    }
+
+    ~test_world()
+    {
+        store.close();
+        fs::remove_all(path);
+    }
+
+    fs::path                        path;
+    persistence_leveldb             store;
+    world                           w;
+    noise::simple_global_variables  vars;
+    noise::generator_context        ctx;
+};
+
+typedef std::unordered_map<chunk_coordinates, chunk> chunk_map;
+
+size_t memory_usage (const chunk_map& chunks)
+{
+    size_t total (0);
+    for (auto& c : chunks)
+        total += c.second.memory_usage();
+
+    return total;
+}
+
+void extract (const std::string& name, const chunk_map& chunks, int repeat)
+{
+    size_t count (0);
+    bench::stopwatch timer;
+    for (int i (0); i < repeat; ++i)
+    {
+        for (auto r : cube_range<world_vector>(2))
+        {
+            chunk_coordinates pos (world_chunk_center + r);
+            voxel_snapshot snap;
+            snap.fill(pos, 1, [&](chunk_coordinates c)
+            {
+                return &chunks.at(c);
+            });
+            auto s (extract_surface(snap));
+            bench::do_not_optimize(s);
+            ++count;
+        }
+    }
+    bench::report(name, count, timer.seconds());
+}
+
+void run (const fs::path& file, int repeat)
+{
+    test_world tw (file);
+
+    // The terrain around the center of the world, a bit above and below
+    // the surface, plus a border of one chunk.
+    chunk_map packed, unpacked;
+    for (auto r : cube_range<world_vector>(3))
+    {
+        chunk_coordinates pos (world_chunk_center + r);
+        chunk c (tw.w.acquire_read_access().get_chunk(pos));
+        c.compact();
+        packed.emplace(pos, c);
+        c.unpack();
+        unpacked.emplace(pos, std::move(c));
+    }
+
+    std::map<unsigned int, size_t> bits;
+    for (auto& c : packed)
+        ++bits[c.second.bits_per_block()];
+
+    const auto name (file.stem().string());
+    std::cout << name << ": " << packed.size() << " chunks, "
+              << memory_usage(unpacked) / 1024 << " KiB unpacked, "
+              << memory_usage(packed) / 1024 << " KiB packed" << std::endl;
+
+    std::cout << "  bits per block:";
+    for (auto& b : bits)
+        std::cout << " " << b.first << " (" << b.second << "x)";
+    std::cout << std::endl;
+
+    extract(name + ", unpacked", unpacked, repeat);
+    extract(name + ", packed", packed, repeat);
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    fs::path dir (argc > 1 ? argv[1] : "../unit_tests");
+    int repeat (argc > 2 ? std::atoi(argv[2]) : 20);
+
+    init_surface_extraction();
+    register_new_material(1).name = "one";
+    register_new_material(2).name = "two";
+    register_new_material(3).name = "three";
+    register_new_material(4).name = "four";
+    register_new_material(5).name = "five";
+
+    std::cout << "surface extractions per second" << std::endl;
+    for (auto n : { 2, 3, 5, 6 })
+    {
+        auto file (dir / ("terrain_test_" + std::to_string(n) + ".json"));
+        if (!fs::exists(file))
+        {
+            std::cerr << file << " not found" << std::endl;
+            return EXIT_FAILURE;
+        }
+        run(file, repeat);
+    }
+
+    return EXIT_SUCCESS;
+}
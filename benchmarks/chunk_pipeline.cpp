@@ -0,0 +1,161 @@
+//---------------------------------------------------------------------------
+// benchmarks/chunk_pipeline.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Simulates a fresh client asking for the chunks around it, in a world
+// that hasn't been generated yet.  The chunk pipeline is compared to
+// the plain thread pool that used to do this job.
+//
+// Usage: benchmark_chunk_pipeline [radius] [threads]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <hexa/block_types.hpp>
+#include <hexa/algorithm.hpp>
+#include <hexa/persistence_leveldb.hpp>
+#include <hexa/threadpool.hpp>
+#include <hexa/voxel_range.hpp>
+#include <hexa/server/chunk_pipeline.hpp>
+#include <hexa/server/extract_surface.hpp>
+#include <hexa/server/world.hpp>
+#include <hexa/server/lightmap/lamp_lightmap.hpp>
+#include <hexa/server/lightmap/uniform_lightmap.hpp>
+#include <hexa/server/terrain/testpattern_generator.hpp>
+
+#include "benchmark.hpp"
+
+namespace fs = boost::filesystem;
+using namespace hexa;
+
+namespace {
+
+const fs::path db_path ("benchmark_chunk_pipeline.leveldb");
+
+/** A fresh world with a test pattern and two light map generators. */
+struct test_world
+{
+    test_world()
+        : store (db_path)
+        , w (store)
+    {
+        boost::property_tree::ptree conf;
+        w.add_terrain_generator(std::unique_ptr<terrain_generator_i>(
+            new testpattern_generator(w, conf)));
+        w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+            new uniform_lightmap(w, conf)));
+        w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+            new lamp_lightmap(w, conf)));
+    }
+
+    ~test_world()
+    {
+        store.close();
+        fs::remove_all(db_path);
+    }
+
+    persistence_leveldb store;
+    world               w;
+};
+
+/** The chunks a client would ask for, closest ones first. */
+std::vector<chunk_coordinates> view (int radius)
+{
+    std::vector<chunk_coordinates> result;
+    for (auto p : cube_range<world_vector>(radius))
+        result.emplace_back(world_chunk_center + p);
+
+    std::sort(result.begin(), result.end(),
+              [](chunk_coordinates a, chunk_coordinates b)
+    {
+        return   manhattan_distance(a, world_chunk_center)
+               < manhattan_distance(b, world_chunk_center);
+    });
+    return result;
+}
+
+void run_threadpool (const std::vector<chunk_coordinates>& chunks,
+                     unsigned int threads)
+{
+    test_world tw;
+    std::atomic<size_t> delivered (0);
+    bench::stopwatch timer;
+    {
+    threadpool pool (threads);
+    for (auto& p : chunks)
+    {
+        pool.enqueue([&,p]{ prepare_for_player(tw.w, p); ++delivered; });
+    }
+    while (delivered < chunks.size())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bench::report("thread pool, " + std::to_string(threads) + " threads",
+                  delivered, timer.seconds());
+}
+
+void run_pipeline (const std::vector<chunk_coordinates>& chunks,
+                   unsigned int threads)
+{
+    test_world tw;
+    std::atomic<size_t> delivered (0);
+    bench::stopwatch timer;
+    {
+    chunk_pipeline pipeline (tw.w, threads);
+    for (auto& p : chunks)
+        pipeline.request(p, nullptr, [&](chunk_coordinates){ ++delivered; });
+
+    pipeline.wait_idle();
+    }
+    bench::report("chunk pipeline, " + std::to_string(threads) + " threads",
+                  delivered, timer.seconds());
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    int radius (argc > 1 ? std::atoi(argv[1]) : 3);
+    unsigned int threads (argc > 2 ? std::atoi(argv[2])
+                                   : std::max(1u, std::thread::hardware_concurrency()));
+
+    init_surface_extraction();
+    auto& m (register_new_material(1));
+    m.name = "one";
+    m.is_solid = true;
+    m.transparency = 0;
+
+    fs::remove_all(db_path);
+    auto chunks (view(radius));
+    std::cout << chunks.size() << " chunks (chunks per second)" << std::endl;
+
+    run_threadpool(chunks, 1);
+    run_threadpool(chunks, threads);
+    run_pipeline(chunks, threads);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,223 @@
+//---------------------------------------------------------------------------
+// benchmarks/entity_replication.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// A load test for the entity updates.  A crowd of entities wanders around
+// in a 512x512 block area, and a number of players walk among them.
+// Sending everything to everyone is compared to the per-player snapshots.
+// The simulated clients decode every snapshot they get, and lose a
+// couple of packets (and acknowledgements) along the way.
+//
+// Usage: benchmark_entity_replication [entities] [players] [ticks] [loss %]
+
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <vector>
+#include <boost/math/constants/constants.hpp>
+
+#include <hexa/entity_snapshot.hpp>
+#include <hexa/protocol.hpp>
+#include <hexa/server/entity_replicator.hpp>
+
+#include "benchmark.hpp"
+
+using namespace hexa;
+
+namespace {
+
+/** The client side of things. */
+struct client
+{
+    client() : self (0) { }
+
+    uint32_t    self;
+    yaw_pitch   look;
+    std::map<uint16_t, entity_states> snapshots;
+};
+
+class simulation
+{
+public:
+    simulation (int entities, int players, int loss)
+        : rng_  (42)
+        , loss_ (loss)
+        , clients_ (players)
+    {
+        std::uniform_real_distribution<float> place (-256.f, 256.f);
+        std::uniform_real_distribution<float> turn (
+            0.f, boost::math::constants::two_pi<float>());
+
+        for (int i (0); i < entities + players; ++i)
+        {
+            wfpos p (world_center, vector(place(rng_), place(rng_), 0.5f));
+            all_.push_back({ uint32_t(i + 1), p.normalized(), vector(0, 0, 0) });
+        }
+
+        for (int i (0); i < players; ++i)
+        {
+            clients_[i].self = i + 1;
+            clients_[i].look = yaw_pitch(turn(rng_), 1.4f);
+        }
+    }
+
+    /** Everything walks around at a leisurely pace, and a quarter of
+     *  the entities stand still. */
+    void move (float dt)
+    {
+        std::normal_distribution<float> nudge (0.f, 0.5f);
+        for (auto& e : all_)
+        {
+            if (e.id % 4 == 0)
+                continue;
+
+            e.velocity += vector(nudge(rng_), nudge(rng_), 0.f) * dt;
+            e.velocity.x = std::max(-4.f, std::min(4.f, e.velocity.x));
+            e.velocity.y = std::max(-4.f, std::min(4.f, e.velocity.y));
+            e.pos += e.velocity * dt;
+            e.pos.normalize();
+        }
+    }
+
+    /** The old way: every entity goes to every player. */
+    size_t broadcast()
+    {
+        msg::entity_update_physics m;
+        for (auto& e : all_)
+            m.updates.emplace_back(e.id, e.pos, e.velocity);
+
+        return serialize_packet(m).size() * clients_.size();
+    }
+
+    /** The new way.
+     * @return Bytes sent, and the number of snapshots that the clients
+     *         couldn't decode */
+    std::pair<size_t, size_t> replicate (entity_replicator& rep)
+    {
+        for (auto& c : clients_)
+        {
+            rep.update_viewer(&c, c.self, all_[c.self - 1].pos, c.look);
+        }
+
+        size_t bytes (0), failed (0);
+        std::uniform_int_distribution<int> percent (0, 99);
+        rep.tick(all_, [&](const void* owner, msg::entity_snapshot& m)
+        {
+            auto buf (serialize_packet(m));
+            bytes += buf.size();
+            if (percent(rng_) < loss_)
+                return;
+
+            auto& c (*static_cast<client*>(const_cast<void*>(owner)));
+            msg::entity_snapshot received;
+            auto ar (make_deserializer(buf.begin() + 1, buf.end()));
+            received.serialize(ar);
+
+            static const entity_states nothing;
+            const entity_states* base (&nothing);
+            if (received.baseline != 0)
+            {
+                auto found (c.snapshots.find(received.baseline));
+                if (found == c.snapshots.end())
+                {
+                    ++failed;
+                    return;
+                }
+                base = &found->second;
+            }
+
+            entity_states next;
+            if (!apply_snapshot(received, *base, next))
+            {
+                ++failed;
+                return;
+            }
+            c.snapshots[received.sequence] = std::move(next);
+            if (c.snapshots.size() > 32)
+                c.snapshots.erase(c.snapshots.begin());
+
+            if (percent(rng_) >= loss_)
+                rep.acknowledge(owner, received.sequence);
+        });
+
+        return std::make_pair(bytes, failed);
+    }
+
+private:
+    std::mt19937                            rng_;
+    int                                     loss_;
+    std::vector<entity_replicator::entity>  all_;
+    std::vector<client>                     clients_;
+};
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    int entities (argc > 1 ? std::atoi(argv[1]) : 500);
+    int players  (argc > 2 ? std::atoi(argv[2]) : 32);
+    int ticks    (argc > 3 ? std::atoi(argv[3]) : 200);
+    int loss     (argc > 4 ? std::atoi(argv[4]) : 5);
+    const float dt (0.05f);
+
+    std::cout << entities << " entities, " << players << " players, "
+              << loss << "% packet loss (ticks per second)" << std::endl;
+
+    size_t old_bytes (0);
+    {
+    simulation sim (entities, players, loss);
+    bench::stopwatch timer;
+    for (int i (0); i < ticks; ++i)
+    {
+        sim.move(dt);
+        old_bytes += sim.broadcast();
+    }
+    bench::report("broadcast everything", ticks, timer.seconds(), old_bytes);
+    }
+
+    size_t new_bytes (0), failed (0);
+    entity_replicator rep;
+    {
+    simulation sim (entities, players, loss);
+    bench::stopwatch timer;
+    for (int i (0); i < ticks; ++i)
+    {
+        sim.move(dt);
+        auto r (sim.replicate(rep));
+        new_bytes += r.first;
+        failed += r.second;
+    }
+    bench::report("snapshots per player", ticks, timer.seconds(), new_bytes);
+    }
+
+    auto s (rep.stats());
+    std::cout << std::endl
+              << "bytes per player per tick: "
+              << old_bytes / ticks / players << " -> "
+              << new_bytes / ticks / players << std::endl
+              << "snapshots " << s.snapshots << " (" << s.full << " full, "
+              << failed << " undecodable), entity updates " << s.updates
+              << ", unchanged " << s.unchanged << ", postponed "
+              << s.postponed << ", not interested " << s.ignored
+              << std::endl;
+
+    return EXIT_SUCCESS;
+}
+
@@ -0,0 +1,186 @@
+//---------------------------------------------------------------------------
+// benchmarks/extract_surface.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Surface extraction on the terrains of the unit tests.  Looking at the
+// neighbors of every block is compared to the bit mask extractor, and
+// the results of both are checked to be identical.
+//
+// Usage: benchmark_extract_surface [unit test directory] [repeat]
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <hexanoise/generator_context.hpp>
+#include <hexanoise/simple_global_variables.hpp>
+
+#include <hexa/block_types.hpp>
+#include <hexa/persistence_leveldb.hpp>
+#include <hexa/voxel_range.hpp>
+#include <hexa/server/extract_surface.hpp>
+#include <hexa/server/init_terrain_generators.hpp>
+#include <hexa/server/voxel_snapshot.hpp>
+#include <hexa/server/world.hpp>
+
+#include "benchmark.hpp"
+
+namespace fs = boost::filesystem;
+namespace pt = boost::property_tree;
+using namespace hexa;
+
+namespace {
+
+/** A world set up the same way as in the unit tests. */
+struct test_world
+{
+    test_world (const fs::path& file)
+        : path  ("benchmark_extract_surface_" + file.stem().string() + ".leveldb")
+        , store (path)
+        , w     (store)
+        , ctx   (vars)
+    {
+        vars["seed"] = 5.0;
+        vars["one"] = 1.0;
+        vars["two"] = 2.0;
+
+        pt::ptree config;
+        pt::read_json(file.string(), config);
+        init_terrain_gen(w, config, ctx);
+    }
+
+    ~test_world()
+    {
+        store.close();
+        fs::remove_all(path);
+    }
+
+    fs::path                        path;
+    persistence_leveldb             store;
+    world                           w;
+    noise::simple_global_variables  vars;
+    noise::generator_context        ctx;
+};
+
+bool identical (const surface& a, const surface& b)
+{
+    return    a.size() == b.size()
+           && std::equal(a.begin(), a.end(), b.begin(),
+                         [](const faces& x, const faces& y)
+                         { return x == y && x.type == y.type; });
+}
+
+void run (const fs::path& file, int repeat)
+{
+    test_world tw (file);
+
+    // The terrain around the center of the world, a bit above and below
+    // the surface.
+    std::vector<voxel_snapshot> terrain;
+    for (auto r : cube_range<world_vector>(2))
+    {
+        chunk_coordinates pos (world_chunk_center + r);
+        terrain.emplace_back();
+        terrain.back().fill(pos, 1, [&](chunk_coordinates c)
+        {
+            return &tw.w.acquire_read_access().get_chunk(c);
+        });
+    }
+
+    const auto name (file.stem().string());
+    const size_t ops (terrain.size() * repeat);
+    size_t face_count (0), mismatches (0);
+
+    bench::stopwatch timer;
+    for (int i (0); i < repeat; ++i)
+    {
+        for (auto& snap : terrain)
+        {
+            surface_data s (extract_opaque_surface(snap),
+                            extract_transparent_surface(snap));
+            face_count += s.opaque.size() + s.transparent.size();
+            bench::do_not_optimize(s);
+        }
+    }
+    bench::report(name + ", per block", ops, timer.seconds());
+
+    timer.restart();
+    for (int i (0); i < repeat; ++i)
+    {
+        for (auto& snap : terrain)
+        {
+            auto s (extract_surface(snap));
+            face_count -= s.opaque.size() + s.transparent.size();
+            bench::do_not_optimize(s);
+        }
+    }
+    bench::report(name + ", bit masks", ops, timer.seconds());
+
+    for (auto& snap : terrain)
+    {
+        auto s (extract_surface(snap));
+        if (   !identical(s.opaque, extract_opaque_surface(snap))
+            || !identical(s.transparent, extract_transparent_surface(snap)))
+        {
+            ++mismatches;
+        }
+    }
+
+    if (face_count != 0 || mismatches != 0)
+        std::cout << "  " << mismatches << " chunks differ!" << std::endl;
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    fs::path dir (argc > 1 ? argv[1] : "../unit_tests");
+    int repeat (argc > 2 ? std::atoi(argv[2]) : 20);
+
+    init_surface_extraction();
+    register_new_material(1).name = "one";
+    register_new_material(2).name = "two";
+    register_new_material(3).name = "three";
+    register_new_material(4).name = "four";
+
+    // Make one of the soil layers see-through, so the transparent
+    // surfaces get some work as well.
+    auto& five (register_new_material(5));
+    five.name = "five";
+    five.transparency = 100;
+
+    std::cout << "chunks per second" << std::endl;
+    for (auto n : { 2, 3, 5, 6 })
+    {
+        auto file (dir / ("terrain_test_" + std::to_string(n) + ".json"));
+        if (!fs::exists(file))
+        {
+            std::cerr << file << " not found" << std::endl;
+            return EXIT_FAILURE;
+        }
+        run(file, repeat);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,255 @@
+//---------------------------------------------------------------------------
+// benchmarks/lamp_lightmap.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Artificial light in a world with a lamp on every fourth block.  The
+// flood fill light field is compared to casting a ray from every face
+// to every lamp, which is what lamp_lightmap used to do.
+//
+// Usage: benchmark_lamp_lightmap [radius] [updates]
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <hexa/block_types.hpp>
+#include <hexa/algorithm.hpp>
+#include <hexa/geometric.hpp>
+#include <hexa/persistence_leveldb.hpp>
+#include <hexa/voxel_algorithm.hpp>
+#include <hexa/voxel_range.hpp>
+#include <hexa/server/extract_surface.hpp>
+#include <hexa/server/world.hpp>
+#include <hexa/server/world_lightmap_access.hpp>
+#include <hexa/server/lightmap/lamp_lightmap.hpp>
+
+#include "benchmark.hpp"
+
+namespace fs = boost::filesystem;
+using namespace hexa;
+
+namespace {
+
+// Every run gets its own database, the world writes its light maps to
+// storage on the way out.
+const fs::path db_raycast ("benchmark_lamp_lightmap_raycast.leveldb");
+const fs::path db_flood   ("benchmark_lamp_lightmap_flood.leveldb");
+
+const uint16_t ground = 1;
+const uint16_t lamp   = 2;
+
+/** Flat ground, with a lamp on every fourth block. */
+class lamp_city : public terrain_generator_i
+{
+public:
+    lamp_city (world& w) : terrain_generator_i (w) { }
+
+    void generate (world_terraingen_access&, const chunk_coordinates& pos,
+                   chunk& cnk) override
+    {
+        for (auto p : every_block_in_chunk)
+        {
+            world_coordinates b (pos * chunk_size + p);
+            if (b.z < world_center.z)
+                cnk[p] = ground;
+            else if (b.z == world_center.z && b.x % 4 == 0 && b.y % 4 == 0)
+                cnk[p] = lamp;
+            else
+                cnk[p] = type::air;
+        }
+    }
+
+    chunk_height estimate_height (world_terraingen_access&, map_coordinates,
+                                  chunk_height) const override
+    {
+        return world_chunk_center.z + 1;
+    }
+};
+
+/** The old way: a ray from every face to every lamp in a 5x5x5 block
+ *  of chunks. */
+class raycast_lamps : public lightmap_generator_i
+{
+public:
+    raycast_lamps (world& w)
+        : lightmap_generator_i (w, boost::property_tree::ptree())
+    { }
+
+    lightmap& generate (world_lightmap_access& data,
+                        const chunk_coordinates& pos, const surface& s,
+                        lightmap& lightchunk, unsigned int) const override
+    {
+        if (s.empty())
+            return lightchunk;
+
+        const vector half (0.5f, 0.5f, 0.5f);
+        block_vector no (chunk_size * 2, chunk_size * 2, chunk_size * 2);
+
+        std::vector<std::pair<vector, float>> lamps;
+        chunk_base<block, chunk_size*5> nbh;
+        for (auto i : cube_range<block_vector>(2))
+        {
+            block_vector origin (i * chunk_size + no);
+            for (auto& face : data.get_surface(pos + i).opaque)
+            {
+                block_vector p (origin + face.pos);
+                nbh[p] = face.type;
+                uint8_t strength (material_prop[face.type].light_emission);
+                if (strength)
+                    lamps.emplace_back(vector(p - no) + half, strength / 255.f);
+            }
+        }
+
+        auto lmi (std::begin(lightchunk));
+        for (const faces& f : s)
+        {
+            for (int d (0); d < 6; ++d)
+            {
+                if (!f[d])
+                    continue;
+
+                vector normal (dir_vector[d]);
+                vector o (vector(f.pos) + half + (normal * 0.51f));
+                float light_level (0.0f);
+
+                for (auto& l : lamps)
+                {
+                    const vector& lp (l.first);
+                    auto ilp (floor(lp));
+                    if (ilp == f.pos)
+                    {
+                        light_level = 1;
+                        break;
+                    }
+
+                    float weight (l.second * dot_prod(normalize(lp - o), normal)
+                                  / squared_distance(lp, o));
+                    if (weight <= 0)
+                        continue;
+
+                    float power (1.0f);
+                    voxel_raycast(o, lp, [&](vector3<int> rv)
+                    {
+                        return rv == ilp || (power -= 1.0f - material_prop[nbh[rv + no].type].transparency / 255.f) <= 0;
+                    });
+
+                    if (power > 0 && (light_level += power * weight * 6.0f) >= 1)
+                        break;
+                }
+
+                lmi->artificial = clamp(light_level, 0.0f, 1.0f) * 15.4f;
+                ++lmi;
+            }
+        }
+        return lightchunk;
+    }
+
+    unsigned int surface_radius() const override { return 2; }
+};
+
+struct test_world
+{
+    test_world (bool flood_fill)
+        : path  (flood_fill ? db_flood : db_raycast)
+        , store (path)
+        , w (store)
+    {
+        w.add_terrain_generator(std::unique_ptr<terrain_generator_i>(
+            new lamp_city(w)));
+
+        if (flood_fill)
+            w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+                new lamp_lightmap(w, boost::property_tree::ptree())));
+        else
+            w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+                new raycast_lamps(w)));
+    }
+
+    ~test_world()
+    {
+        store.close();
+        fs::remove_all(path);
+    }
+
+    fs::path            path;
+    persistence_leveldb store;
+    world               w;
+};
+
+void run (const std::string& name, bool flood_fill, int radius, int updates)
+{
+    test_world tw (flood_fill);
+
+    std::vector<chunk_coordinates> chunks;
+    for (int y (-radius); y <= radius; ++y)
+    {
+        for (int x (-radius); x <= radius; ++x)
+            chunks.emplace_back(world_chunk_center + world_vector(x, y, 0));
+    }
+
+    // Get the terrain and surfaces out of the way first.
+    for (auto& p : chunks)
+        tw.w.acquire_read_access().get_surface(p);
+
+    bench::stopwatch timer;
+    for (auto& p : chunks)
+        prepare_for_player(tw.w, p);
+
+    bench::report(name + ", new chunks", chunks.size(), timer.seconds());
+
+    // Switch a lamp in the middle off and on again.
+    world_coordinates spot (world_center + world_vector(4, 4, 0));
+    timer.restart();
+    for (int i (0); i < updates; ++i)
+    {
+        auto proxy (tw.w.acquire_write_access(spot / chunk_size));
+        proxy[spot] = (i % 2 == 0) ? type::air : lamp;
+    }
+    bench::report(name + ", lamp switched", updates, timer.seconds());
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    int radius  (argc > 1 ? std::atoi(argv[1]) : 2);
+    int updates (argc > 2 ? std::atoi(argv[2]) : 20);
+
+    init_surface_extraction();
+    auto& g (register_new_material(ground));
+    g.name = "ground";
+    g.transparency = 0;
+    auto& l (register_new_material(lamp));
+    l.name = "lamp";
+    l.transparency = 0;
+    l.light_emission = 255;
+
+    fs::remove_all(db_raycast);
+    fs::remove_all(db_flood);
+    std::cout << (radius * 2 + 1) * (radius * 2 + 1) << " chunks (operations per second)" << std::endl;
+
+    run("ray casting", false, radius, updates);
+    run("flood fill", true, radius, updates);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,334 @@
+//---------------------------------------------------------------------------
+// benchmarks/lightmap.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Sunlight and ambient occlusion light maps for a patch of rolling
+// hills.  Tracing the rays through a voxel_snapshot is compared to
+// looking up every block through the world.  The sunlight is also
+// compared to following the ray_bundle trees recursively, one face at
+// a time, which is how it used to be done.
+//
+// Usage: benchmark_lightmap [radius]
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <hexa/block_types.hpp>
+#include <hexa/lightmap.hpp>
+#include <hexa/persistence_leveldb.hpp>
+#include <hexa/ray_bundle.hpp>
+#include <hexa/voxel_algorithm.hpp>
+#include <hexa/voxel_range.hpp>
+#include <hexa/server/extract_surface.hpp>
+#include <hexa/server/world.hpp>
+#include <hexa/server/world_lightmap_access.hpp>
+#include <hexa/server/lightmap/ambient_occlusion_lightmap.hpp>
+#include <hexa/server/lightmap/sun_lightmap.hpp>
+
+#include "benchmark.hpp"
+
+namespace fs = boost::filesystem;
+using namespace hexa;
+
+namespace {
+
+const uint16_t ground = 1;
+
+/** Hills about 16 blocks high, with a period of a few chunks. */
+class hills : public terrain_generator_i
+{
+public:
+    hills (world& w) : terrain_generator_i (w) { }
+
+    static int height (world_coordinates b)
+    {
+        world_vector r (b - world_center);
+        return 8.0 * std::sin(r.x / 11.0) * std::cos(r.y / 7.0);
+    }
+
+    void generate (world_terraingen_access&, const chunk_coordinates& pos,
+                   chunk& cnk) override
+    {
+        for (auto p : every_block_in_chunk)
+        {
+            world_coordinates b (pos * chunk_size + p);
+            cnk[p] = int(b.z - world_center.z) < height(b) ? ground : type::air;
+        }
+    }
+
+    chunk_height estimate_height (world_terraingen_access&, map_coordinates,
+                                  chunk_height) const override
+    {
+        return world_chunk_center.z + 1;
+    }
+};
+
+/** The sunlight as it was before flat_ray_bundle: the same rays as
+ *  sun_lightmap, but every face follows the ray_bundle tree on its own,
+ *  looking up every block through the world. */
+class tree_sun : public lightmap_generator_i
+{
+    typedef std::array<ray_bundle, 6> rays;
+
+public:
+    tree_sun (world& w, const boost::property_tree::ptree& conf)
+        : lightmap_generator_i (w, conf)
+        , direction_ (-0.4f, 0.75f)
+        , radius_    (3.0f * 0.01745f)
+    {
+        detail_levels_.emplace_back(generate(10, 0));
+        detail_levels_.emplace_back(generate(60, 1));
+        detail_levels_.emplace_back(generate(200, 2));
+    }
+
+    lightmap& generate (world_lightmap_access& data,
+                        const chunk_coordinates& pos, const surface& s,
+                        lightmap& map, unsigned int phase) const override
+    {
+        auto lmi (std::begin(map));
+        for (faces f : s)
+        {
+            world_coordinates blk (pos * chunk_size + f.pos);
+            for (int d (0); d < 6; ++d)
+            {
+                if (!f[d])
+                    continue;
+
+                const ray_bundle& r (detail_levels_[phase][d]);
+                float light (recurse(r, r.weight, blk, data, true));
+                lmi->sunlight = std::min(std::max(light, 0.0f), 1.0f) * 15.4f;
+                ++lmi;
+            }
+        }
+        return map;
+    }
+
+    unsigned int phases() const override { return 3; }
+
+private:
+    void add (rays& r, float raylen, yaw_pitch dir2) const
+    {
+        const vector half (0.5, 0.5, 0.5);
+        for (int d (0); d < 6; ++d)
+        {
+            vector normal (dir_vector[d]);
+            vector origin (half + normal * 0.6f);
+            vector dir    (from_spherical(dir2.x, dir2.y));
+            float weight  (dot_prod(dir, normal));
+            if (weight > 0)
+                r[d].add(voxel_raycast(origin, origin + dir * raylen), weight);
+        }
+    }
+
+    rays generate (float raylen, size_t count) const
+    {
+        rays result;
+        if (count == 0)
+            add(result, raylen, direction_);
+
+        if (count <= 1)
+        {
+            for (int i (0); i < 6; ++i)
+            {
+                double a (((2.* 3.1415827) / 6.) * i);
+                vector2<float> r (sin(a), cos(a));
+                add(result, raylen, direction_ + r * radius_);
+            }
+        }
+
+        for (int i (0); i < 6; ++i)
+        {
+            double a (((2.* 3.1415827) / 6.) * float(i + .5));
+            vector2<float> r (sin(a), cos(a));
+            add(result, raylen, direction_ + r * radius_ * 0.5);
+        }
+
+        float max (0);
+        for (auto& r : result)
+            max = std::max(max, r.weight);
+
+        for (auto& r : result)
+            r.multiply_weight(1.0f / max);
+
+        return result;
+    }
+
+    float recurse (const ray_bundle& r, float ray_power,
+                   const world_coordinates& blk,
+                   world_lightmap_access& data, bool first) const
+    {
+        float temp (0.0f);
+        bool should_recurse (true);
+        for (auto& voxel : r.trunk)
+        {
+            auto type (data[blk + voxel].type);
+            if (first)
+            {
+                first = false;
+                if (material_prop[type].is_custom_block())
+                    continue;
+            }
+
+            temp += 1.0f - material_prop[type].transparency / 255.f;
+            if (temp >= 1.0f)
+            {
+                should_recurse = false;
+                break;
+            }
+        }
+
+        ray_power -= std::min(temp, 1.0f) * r.weight;
+        if (ray_power <= 0.01)
+            return 0.0;
+
+        if (should_recurse)
+        {
+            for (auto& s : r.branches)
+                ray_power = recurse(s, ray_power, blk, data, first);
+        }
+        return ray_power;
+    }
+
+private:
+    yaw_pitch           direction_;
+    float               radius_;
+    std::vector<rays>   detail_levels_;
+};
+
+typedef std::function<void(world&, const boost::property_tree::ptree&)>
+        generators;
+
+void sun_and_ambient (world& w, const boost::property_tree::ptree& conf)
+{
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new sun_lightmap(w, conf)));
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new ambient_occlusion_lightmap(w, conf)));
+}
+
+void flat_sun (world& w, const boost::property_tree::ptree& conf)
+{
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new sun_lightmap(w, conf)));
+}
+
+void tree_sun_only (world& w, const boost::property_tree::ptree& conf)
+{
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new tree_sun(w, conf)));
+}
+
+struct test_world
+{
+    test_world (const fs::path& p, int border, const generators& add)
+        : path  (p)
+        , store (path)
+        , w     (store)
+    {
+        boost::property_tree::ptree conf;
+        conf.put("snapshot_border", border);
+
+        w.add_terrain_generator(std::unique_ptr<terrain_generator_i>(
+            new hills(w)));
+        add(w, conf);
+    }
+
+    ~test_world()
+    {
+        store.close();
+        fs::remove_all(path);
+    }
+
+    fs::path            path;
+    persistence_leveldb store;
+    world               w;
+};
+
+void run (const std::string& name, const generators& add, int border,
+          int radius, unsigned int phases = 2)
+{
+    static int count (0);
+    test_world tw ("benchmark_lightmap_" + std::to_string(++count) + ".leveldb",
+                   border, add);
+
+    std::vector<chunk_coordinates> chunks;
+    for (auto r : cube_range<world_vector>(radius))
+    {
+        if (std::abs(r.z) <= 1)
+            chunks.emplace_back(world_chunk_center + r);
+    }
+
+    // Get the terrain and surfaces out of the way first, including the
+    // chunks around the edges that the rays will pass through.
+    for (auto r : cube_range<world_vector>(radius + 4))
+        tw.w.acquire_read_access().get_chunk(world_chunk_center + r);
+
+    for (auto& p : chunks)
+        tw.w.acquire_read_access().get_surface(p);
+
+    bench::stopwatch timer;
+    for (auto& p : chunks)
+        tw.w.acquire_read_access().get_compressed_lightmap(p);
+
+    bench::report(name + ", phase 0", chunks.size(), timer.seconds());
+
+    for (unsigned int phase (1); phase < phases; ++phase)
+    {
+        timer.restart();
+        for (auto& p : chunks)
+            tw.w.refine_lightmap(p, phase);
+
+        bench::report(name + ", phase " + std::to_string(phase),
+                      chunks.size(), timer.seconds());
+    }
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    int radius (argc > 1 ? std::atoi(argv[1]) : 2);
+
+    init_surface_extraction();
+    auto& g (register_new_material(ground));
+    g.name = "ground";
+    g.transparency = 0;
+
+    std::cout << "light maps per second" << std::endl;
+
+    run("through the world", sun_and_ambient, 0, radius);
+    run("snapshot", sun_and_ambient, 16, radius);
+    run("snapshot, 32 blocks", sun_and_ambient, 32, radius);
+
+    std::cout << std::endl << "sunlight only" << std::endl;
+    run("ray tree, through the world", tree_sun_only, 0, radius, 3);
+    run("flat rays, through the world", flat_sun, 0, radius, 3);
+    run("flat rays, snapshot", flat_sun, 16, radius, 3);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+//---------------------------------------------------------------------------
+// benchmarks/pregenerate.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Pregenerates a block of terrain with the default game's setup, using an
+// increasing number of threads.  Every run starts with an empty world, so
+// all chunks are generated from scratch.  The area data is generated
+// first, so the runs measure terrain generation only.
+//
+// Usage: benchmark_pregenerate [setup.json] [radius] [max threads]
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <hexanoise/generator_context.hpp>
+#include <hexanoise/simple_global_variables.hpp>
+
+#include <hexa/block_types.hpp>
+#include <hexa/persistence_leveldb.hpp>
+#include <hexa/voxel_range.hpp>
+#include <hexa/server/init_terrain_generators.hpp>
+#include <hexa/server/world.hpp>
+
+#include "benchmark.hpp"
+
+namespace fs = boost::filesystem;
+namespace pt = boost::property_tree;
+using namespace hexa;
+
+namespace {
+
+const fs::path db_path ("benchmark_pregenerate.leveldb");
+
+/** A fresh world, set up from a game's setup file. */
+struct test_world
+{
+    test_world (const pt::ptree& config)
+        : store (db_path)
+        , w     (store)
+        , ctx   (vars)
+    {
+        init_terrain_gen(w, config, ctx);
+    }
+
+    ~test_world()
+    {
+        store.close();
+        fs::remove_all(db_path);
+    }
+
+    persistence_leveldb             store;
+    world                           w;
+    noise::simple_global_variables  vars;
+    noise::generator_context        ctx;
+};
+
+/** The columns of chunks around the center of the world, from a few
+ *  chunks below sea level to a few above it. */
+std::vector<chunk_coordinates> columns (int radius)
+{
+    std::vector<chunk_coordinates> result;
+    for (auto p : make_range(world_vector(-radius, -radius, -4),
+                             world_vector(radius + 1, radius + 1, 3)))
+    {
+        result.emplace_back(world_chunk_center + p);
+    }
+    return result;
+}
+
+void run (const pt::ptree& config, const std::vector<chunk_coordinates>& chunks,
+          unsigned int threads)
+{
+    test_world tw (config);
+
+    // Area data is still generated one column at a time; get it out of
+    // the way so it doesn't drown out the terrain generators.
+    for (auto& p : chunks)
+        tw.w.acquire_read_access().get_coarse_height(p);
+
+    std::atomic<size_t> next (0);
+    std::vector<std::thread> pool;
+    bench::stopwatch timer;
+    for (unsigned int t (0); t < threads; ++t)
+    {
+        pool.emplace_back([&]
+        {
+            for (size_t i (next++); i < chunks.size(); i = next++)
+            {
+                auto proxy (tw.w.acquire_read_access());
+                bench::do_not_optimize(proxy.get_chunk(chunks[i]));
+            }
+        });
+    }
+    for (auto& t : pool)
+        t.join();
+
+    bench::report(std::to_string(threads) + " threads", chunks.size(),
+                  timer.seconds());
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    fs::path setup (argc > 1 ? argv[1] : "../data/games/defaultgame/setup.json");
+    int radius (argc > 2 ? std::atoi(argv[2]) : 8);
+    unsigned int max_threads (argc > 3 ? std::atoi(argv[3])
+                                       : std::max(1u, std::thread::hardware_concurrency()));
+
+    // The materials the default game's terrain generators look for.
+    uint16_t id (1);
+    for (auto name : { "stone", "grass", "dirt", "sand", "water" })
+    {
+        auto& m (register_new_material(id++));
+        m.name = name;
+        m.is_solid = true;
+        m.transparency = 0;
+    }
+
+    pt::ptree config;
+    pt::read_json(setup.string(), config);
+
+    fs::remove_all(db_path);
+    auto chunks (columns(radius));
+    std::cout << chunks.size() << " chunks (chunks per second)" << std::endl;
+
+    for (unsigned int threads (1); threads < max_threads; threads *= 2)
+        run(config, chunks, threads);
+
+    run(config, chunks, max_threads);
+
+    return EXIT_SUCCESS;
+}
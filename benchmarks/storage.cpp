@@ -0,0 +1,160 @@
+//---------------------------------------------------------------------------
+// benchmarks/storage.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Compares the LevelDB and region file storage backends.  The first test
+// stores a block of chunks the way the terrain generator would, column by
+// column; the second one reads them back in random order.
+//
+// Usage: benchmark_storage [chunks per side] [random reads]
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/compression.hpp>
+#include <hexa/persistence_leveldb.hpp>
+#include <hexa/persistence_regionfile.hpp>
+#include <hexa/server/random.hpp>
+
+#include "benchmark.hpp"
+
+namespace fs = boost::filesystem;
+using namespace hexa;
+
+namespace {
+
+const auto type (persistent_storage_i::chunk);
+
+/** Something that compresses about as well as a real chunk: a few
+ *  layers of material, with some noise on top. */
+compressed_data make_chunk (chunk_coordinates pos, uint32_t& rn)
+{
+    binary_data buf (chunk_volume * 2, 0);
+    uint8_t material (1 + pos.z % 7);
+    for (size_t i (0); i < buf.size(); i += 2)
+    {
+        buf[i] = i < buf.size() / 2 ? material : 0;
+        if (prng_next(rn) % 16 == 0)
+            buf[i] = prng_next(rn) % 32;
+    }
+    return compress(buf);
+}
+
+std::vector<chunk_coordinates> make_positions (int side)
+{
+    std::vector<chunk_coordinates> result;
+    for (int x (0); x < side; ++x)
+        for (int y (0); y < side; ++y)
+            for (int z (0); z < side; ++z)
+                result.emplace_back(world_chunk_center + chunk_coordinates(x, y, z));
+
+    return result;
+}
+
+/** Make sure everything has been handed to the operating system. */
+void flush (persistence_leveldb& db) { db.flush(); }
+
+/** The region file backend has no write queue; flushing is up to the OS. */
+void flush (persistence_regionfile&) { }
+
+template <class storage>
+void generate_and_store (const std::string& name, storage& db,
+                         const std::vector<chunk_coordinates>& positions)
+{
+    uint32_t rn (1);
+    size_t bytes (0);
+    bench::stopwatch timer;
+    for (auto& pos : positions)
+    {
+        auto data (make_chunk(pos, rn));
+        bytes += data.size();
+        db.store(type, pos, data);
+    }
+    flush(db);
+    bench::report(name + " generate and store", positions.size(),
+                  timer.seconds(), bytes);
+}
+
+template <class storage>
+void random_read (const std::string& name, storage& db,
+                  const std::vector<chunk_coordinates>& positions, size_t count)
+{
+    uint32_t rn (2);
+    size_t bytes (0);
+    bench::stopwatch timer;
+    for (size_t i (0); i < count; ++i)
+    {
+        auto data (db.retrieve(type, positions[prng_next(rn) % positions.size()]));
+        bytes += data.size();
+    }
+    bench::report(name + " random read", count, timer.seconds(), bytes);
+}
+
+void random_read_mapped (persistence_regionfile& db,
+                         const std::vector<chunk_coordinates>& positions,
+                         size_t count)
+{
+    uint32_t rn (2);
+    size_t bytes (0);
+    bench::stopwatch timer;
+    for (size_t i (0); i < count; ++i)
+    {
+        auto data (db.retrieve_mapped(type, positions[prng_next(rn) % positions.size()]));
+        bytes += data->size();
+    }
+    bench::report("regionfile random read (mapped)", count, timer.seconds(), bytes);
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    int side (argc > 1 ? std::atoi(argv[1]) : 32);
+    size_t reads (argc > 2 ? std::atoi(argv[2]) : 200000);
+
+    auto positions (make_positions(side));
+    std::cout << positions.size() << " chunks, " << reads << " random reads"
+              << std::endl;
+
+    fs::path ldb_path ("benchmark_storage.leveldb");
+    fs::path rf_path  ("benchmark_storage.regions");
+    fs::remove_all(ldb_path);
+    fs::remove_all(rf_path);
+
+    {
+    persistence_leveldb ldb (ldb_path);
+    generate_and_store("leveldb", ldb, positions);
+    random_read("leveldb", ldb, positions, reads);
+    }
+
+    {
+    persistence_regionfile rf (rf_path);
+    generate_and_store("regionfile", rf, positions);
+    random_read("regionfile", rf, positions, reads);
+    random_read_mapped(rf, positions, reads);
+    }
+
+    fs::remove_all(ldb_path);
+    fs::remove_all(rf_path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+//---------------------------------------------------------------------------
+// benchmarks/world_contention.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// A few reader threads keep fetching surfaces that are already in the
+// cache, while other threads trigger terrain generation elsewhere.  The
+// readers should not have to wait for the generators.  The readers are
+// run once on their own, and once next to the generators.
+//
+// Usage: benchmark_world_contention [readers] [generators] [rounds]
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <hexa/block_types.hpp>
+#include <hexa/persistence_leveldb.hpp>
+#include <hexa/server/extract_surface.hpp>
+#include <hexa/server/world.hpp>
+#include <hexa/server/terrain/testpattern_generator.hpp>
+
+#include "benchmark.hpp"
+
+namespace fs = boost::filesystem;
+using namespace hexa;
+
+namespace {
+
+const fs::path db_path ("benchmark_world_contention.leveldb");
+
+/** A fresh world with a test pattern. */
+struct test_world
+{
+    test_world()
+        : store (db_path)
+        , w (store)
+    {
+        boost::property_tree::ptree conf;
+        w.add_terrain_generator(std::unique_ptr<terrain_generator_i>(
+            new testpattern_generator(w, conf)));
+    }
+
+    ~test_world()
+    {
+        store.close();
+        fs::remove_all(db_path);
+    }
+
+    persistence_leveldb store;
+    world               w;
+};
+
+void run (int readers, int generators, int rounds)
+{
+    test_world tw;
+
+    std::vector<chunk_coordinates> hot;
+    {
+    auto proxy (tw.w.acquire_read_access());
+    for (uint32_t i (0); i < 16; ++i)
+    {
+        chunk_coordinates p (100 + i, 100, 100);
+        proxy.get_surface(p);
+        hot.push_back(p);
+    }
+    }
+
+    std::atomic<size_t> reads (0), generated (0);
+    std::atomic<int> readers_done (0);
+    std::vector<std::thread> threads;
+    bench::stopwatch timer;
+
+    for (int t (0); t < readers; ++t)
+    {
+        threads.emplace_back([&]
+        {
+            for (int i (0); i < rounds; ++i)
+            {
+                auto proxy (tw.w.acquire_read_access());
+                for (auto& p : hot)
+                    bench::do_not_optimize(proxy.get_surface(p));
+
+                reads += hot.size();
+            }
+            ++readers_done;
+        });
+    }
+
+    // The generators keep going until the readers are done.
+    for (int t (0); t < generators; ++t)
+    {
+        threads.emplace_back([&,t]
+        {
+            for (uint32_t i (0); readers_done < readers; ++i)
+            {
+                auto proxy (tw.w.acquire_read_access());
+                proxy.get_surface(chunk_coordinates(200 + t * 1000 + i, 200, 200));
+                ++generated;
+            }
+        });
+    }
+
+    for (auto& t : threads)
+        t.join();
+
+    double secs (timer.seconds());
+    bench::report(std::to_string(readers) + " readers, "
+                  + std::to_string(generators) + " generators: reads",
+                  reads, secs);
+
+    if (generators > 0)
+        bench::report("  new surfaces", generated, secs);
+}
+
+} // anonymous namespace
+
+int main (int argc, char* argv[])
+{
+    int readers (argc > 1 ? std::atoi(argv[1]) : 4);
+    int generators (argc > 2 ? std::atoi(argv[2]) : 2);
+    int rounds (argc > 3 ? std::atoi(argv[3]) : 2000);
+
+    init_surface_extraction();
+    auto& m (register_new_material(1));
+    m.name = "one";
+    m.is_solid = true;
+    m.transparency = 0;
+
+    fs::remove_all(db_path);
+    std::cout << "cached surface reads per second" << std::endl;
+    run(readers, 0, rounds);
+    run(readers, generators, rounds);
+
+    return EXIT_SUCCESS;
+}
@@ -26,6 +26,7 @@
 #include <vector>
 
 #include "basic_types.hpp"
+#include "pool_allocator.hpp"
 #include "serialize.hpp"
 
 namespace hexa {
@@ -35,7 +36,7 @@ namespace hexa {
  *  kinds of biome info such as temperature or humidity. */
 class area_data
 {
-    typedef std::vector<int16_t>  array_t;
+    typedef std::vector<int16_t, pool_allocator<int16_t, chunk_area>>  array_t;
     array_t buf_;
 
 public:
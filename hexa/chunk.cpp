@@ -0,0 +1,191 @@
+//---------------------------------------------------------------------------
+// chunk.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "chunk.hpp"
+
+#include <algorithm>
+
+namespace hexa {
+
+namespace {
+
+/** The largest palette a chunk can have. */
+const size_t max_palette (256);
+
+/** The number of bits needed to index a palette of a given size. */
+uint8_t index_bits (size_t palette_size)
+{
+    if (palette_size <= 1)
+        return 0;
+    if (palette_size <= 2)
+        return 1;
+    if (palette_size <= 4)
+        return 2;
+    if (palette_size <= 16)
+        return 4;
+
+    return 8;
+}
+
+} // anonymous namespace
+
+void
+chunk::copy_types (size_type first, size_type count, uint16_t* dest) const
+{
+    assert(first + count <= volume());
+    switch (bits_)
+    {
+    case 0:
+        std::fill_n(dest, count, uniform_.type);
+        break;
+
+    case 16:
+        for (size_type i (first); i < first + count; ++i)
+            *dest++ = raw_[i].type;
+        break;
+
+    default:
+        {
+        const uint32_t mask ((1u << bits_) - 1);
+        for (size_type i (first); i < first + count; ++i)
+        {
+            const size_t bit (i * bits_);
+            *dest++ = palette_[(packed_[bit >> 5] >> (bit & 31)) & mask];
+        }
+        }
+    }
+}
+
+void
+chunk::clear (value_type v)
+{
+    bits_ = 0;
+    uniform_ = v;
+    array_t().swap(raw_);
+    palette_t().swap(palette_);
+    packed_t().swap(packed_);
+    is_dirty = true;
+}
+
+void
+chunk::compact()
+{
+    // Packed chunks can't be changed, so they're as small as they get.
+    if (bits_ != 16)
+        return;
+
+    // Blocks usually come in runs, so the palette is only searched when
+    // the material changes.
+    std::vector<uint16_t> palette;
+    uint16_t last (raw_[0].type);
+    palette.push_back(last);
+    for (auto& b : raw_)
+    {
+        if (b.type == last)
+            continue;
+
+        last = b.type;
+        if (std::find(palette.begin(), palette.end(), last) == palette.end())
+        {
+            if (palette.size() == max_palette)
+                return;
+
+            palette.push_back(last);
+        }
+    }
+
+    const uint8_t bits (index_bits(palette.size()));
+    if (bits == 0)
+    {
+        const bool dirty (is_dirty);
+        clear(palette[0]);
+        is_dirty = dirty;
+        return;
+    }
+
+    packed_t packed (chunk_volume * bits / 32, 0);
+    last = palette[0];
+    uint32_t last_index (0);
+    for (size_t i (0); i < chunk_volume; ++i)
+    {
+        const uint16_t t (raw_[i].type);
+        if (t != last)
+        {
+            last = t;
+            last_index = std::find(palette.begin(), palette.end(), t)
+                         - palette.begin();
+        }
+        const size_t bit (i * bits);
+        packed[bit >> 5] |= last_index << (bit & 31);
+    }
+
+    bits_ = bits;
+    palette_.assign(palette.begin(), palette.end());
+    packed_.swap(packed);
+    array_t().swap(raw_);
+}
+
+void
+chunk::unpack_slow()
+{
+    array_t blocks (chunk_volume);
+    copy_types(0, chunk_volume, reinterpret_cast<uint16_t*>(&blocks[0]));
+
+    raw_.swap(blocks);
+    palette_t().swap(palette_);
+    packed_t().swap(packed_);
+    bits_ = 16;
+}
+
+bool
+chunk::operator== (const chunk& compare) const
+{
+    if (bits_ == 0 && compare.bits_ == 0)
+        return uniform_ == compare.uniform_;
+
+    for (size_type i (0); i < chunk_volume; ++i)
+    {
+        if (!(get(i) == compare.get(i)))
+            return false;
+    }
+    return true;
+}
+
+bool
+chunk::is_air() const
+{
+    switch (bits_)
+    {
+    case 0:
+        return uniform_.is_air();
+
+    case 16:
+        return std::all_of(raw_.begin(), raw_.end(),
+                           [](block b){ return b.is_air(); });
+
+    default:
+        return std::all_of(palette_.begin(), palette_.end(),
+                           [](uint16_t t){ return t == type::air; });
+    }
+}
+
+} // namespace hexa
+
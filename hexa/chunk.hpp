@@ -23,11 +23,15 @@
 #pragma once
 
 #include <array>
+#include <cassert>
+#include <iterator>
 #include <memory>
+#include <vector>
 #include <boost/thread/mutex.hpp>
 #include "block_types.hpp"
 #include "chunk_base.hpp"
 #include "compiler_fix.hpp"
+#include "pool_allocator.hpp"
 #include "serialize.hpp"
 
 namespace hexa {
@@ -41,7 +45,7 @@ struct block
     /** Construct a block of a given type. */
     block (uint16_t t = type::air) : type (t) {}
 
-    operator uint16_t () { return type; }
+    operator uint16_t () const { return type; }
 
     /** Check if another block is of the same type. */
     bool operator== (block compare) const
@@ -62,13 +66,83 @@ struct block
 
 /** A cube-shaped section of the game world's terrain, usually 16x16x16.
  *  The size of the cube is defined by \a chunk_size.  The game world is
- *  basically a sparse 3-D array of such chunks. Refer to \a chunk_base
- *  for an example of how to use this class. */
-class chunk : public chunk_base<block>
+ *  basically a sparse 3-D array of such chunks.  Indexing works the same
+ *  as in \a chunk_base.
+ *
+ *  Most chunks only have a couple of different materials, and a lot of
+ *  them are nothing but stone or air.  To save memory, the blocks can be
+ *  packed: a chunk with a single material only stores that material,
+ *  and one with up to 256 materials stores a palette, and an index into
+ *  that palette of 1, 2, 4, or 8 bits for every block.  Chunks with more
+ *  materials than that stay unpacked.
+ *
+ *  Reading from a packed chunk is a bit slower than from an unpacked
+ *  one, and getting a writable reference to a block unpacks the whole
+ *  chunk.  Call compact() when you're done changing it.
+ *
+ * Example:
+ * @code
+
+chunk c;           // All air, and packed
+c[pos] = stone;    // Unpacked now
+c.compact();       // Packed again, with a one bit palette
+
+ * @endcode */
+class chunk
 {
-    typedef chunk_base<block>   base;
+    typedef std::vector<block, pool_allocator<block, chunk_volume>>  array_t;
+    typedef std::vector<uint16_t, recycling_allocator<uint16_t>>    palette_t;
+    typedef std::vector<uint32_t, recycling_allocator<uint32_t>>    packed_t;
 
 public:
+    typedef block                       value_type;
+    typedef size_t                      size_type;
+    typedef array_t::iterator           iterator;
+
+    /** Iterates over the blocks of a chunk that might be packed.  The
+     *  blocks are returned by value. */
+    class const_iterator
+        : public std::iterator<std::random_access_iterator_tag, block,
+                               ptrdiff_t, void, const block>
+    {
+    public:
+        const_iterator() : c_ (nullptr), i_ (0) { }
+        const_iterator(const chunk* c, size_t i) : c_ (c), i_ (i) { }
+
+        const block operator* () const { return c_->get(i_); }
+        const block operator[] (ptrdiff_t n) const { return c_->get(i_ + n); }
+
+        const_iterator& operator++ () { ++i_; return *this; }
+        const_iterator& operator-- () { --i_; return *this; }
+        const_iterator  operator++ (int) { auto t (*this); ++i_; return t; }
+        const_iterator  operator-- (int) { auto t (*this); --i_; return t; }
+        const_iterator& operator+= (ptrdiff_t n) { i_ += n; return *this; }
+        const_iterator& operator-= (ptrdiff_t n) { i_ -= n; return *this; }
+
+        const_iterator operator+ (ptrdiff_t n) const
+            { return const_iterator(c_, i_ + n); }
+        const_iterator operator- (ptrdiff_t n) const
+            { return const_iterator(c_, i_ - n); }
+        ptrdiff_t operator- (const const_iterator& o) const
+            { return ptrdiff_t(i_) - ptrdiff_t(o.i_); }
+
+        bool operator== (const const_iterator& o) const { return i_ == o.i_; }
+        bool operator!= (const const_iterator& o) const { return i_ != o.i_; }
+        bool operator<  (const const_iterator& o) const { return i_ < o.i_; }
+
+        /** The array index of the block. */
+        size_t index() const { return i_; }
+
+    private:
+        const chunk*    c_;
+        size_t          i_;
+    };
+
+public:
+    /** If this flag is set, the storage backends know they're dealing
+     * with a chunk that has been modified in memory. */
+    bool            is_dirty;
+
     /** Chunk version number.
      *  All chunks start at version 0. Every time a write operation
      *  finishes, the version number is increased.  Data that depends on
@@ -78,14 +152,26 @@ public:
     uint32_t        version;
 
 public:
+    /** A packed chunk full of air. */
     chunk()
-        : version(0)
+        : is_dirty (true)
+        , version  (0)
+        , bits_    (0)
+        , uniform_ (type::air)
     { }
 
 #ifdef _MSC_VER
     chunk(chunk&& m)
-        : base(std::move(m))
-    { }
+        : is_dirty (m.is_dirty)
+        , version  (m.version)
+        , bits_    (m.bits_)
+        , uniform_ (m.uniform_)
+        , raw_     (std::move(m.raw_))
+        , palette_ (std::move(m.palette_))
+        , packed_  (std::move(m.packed_))
+    {
+        m.is_dirty = false;
+    }
 
     chunk(const chunk&) = default;
 
@@ -93,8 +179,14 @@ public:
     {
         if (this != &m)
         {
-            version = m.version;
-            base::operator=(std::move(m));
+            is_dirty = m.is_dirty;
+            version  = m.version;
+            bits_    = m.bits_;
+            uniform_ = m.uniform_;
+            raw_     = std::move(m.raw_);
+            palette_ = std::move(m.palette_);
+            packed_  = std::move(m.packed_);
+            m.is_dirty = false;
         }
         return *this;
     }
@@ -109,14 +201,166 @@ public:
 
 #endif
 
-    bool    operator== (const chunk& compare) const
-        { return base::operator==(compare); }
+    /** Indexing operator.  Unpacks the chunk. */
+    block&          operator[] (chunk_index idx)
+        { return operator()(idx.x, idx.y, idx.z); }
 
-    template <class archive>
-    archive& serialize(archive& ar)
+    /** Indexing operator. */
+    const block     operator[] (chunk_index idx) const
+        { return operator()(idx.x, idx.y, idx.z); }
+
+    /** Indexing operator, by array index.  Unpacks the chunk. */
+    block&          operator[] (size_type i)
+    {
+        assert(i < volume());
+        unpack();
+        return raw_[i];
+    }
+
+    /** Indexing operator, by array index. */
+    const block     operator[] (size_type i) const
+        { return get(i); }
+
+    /** Indexing operator.  Unpacks the chunk. */
+    block&          operator() (uint8_t x, uint8_t y, uint8_t z)
+        { return operator[](index(x, y, z)); }
+
+    /** Indexing operator. */
+    const block     operator() (uint8_t x, uint8_t y, uint8_t z) const
+        { return get(index(x, y, z)); }
+
+    /** Get a block by array index, without unpacking anything. */
+    const block get (size_type i) const
+    {
+        assert(i < volume());
+        switch (bits_)
+        {
+        case 0:
+            return uniform_;
+        case 16:
+            return raw_[i];
+        default:
+            {
+            const size_t bit (i * bits_);
+            return palette_[(packed_[bit >> 5] >> (bit & 31))
+                            & ((1u << bits_) - 1)];
+            }
+        }
+    }
+
+    /** Copy the material IDs of a range of blocks.
+     * @param first  Array index of the first block
+     * @param count  Number of blocks
+     * @param dest   Where to put the material IDs */
+    void copy_types (size_type first, size_type count, uint16_t* dest) const;
+
+    iterator        begin()         { unpack(); return raw_.begin(); }
+    iterator        end()           { unpack(); return raw_.end(); }
+    const_iterator  begin() const   { return const_iterator(this, 0); }
+    const_iterator  end() const     { return const_iterator(this, volume()); }
+
+    /** Fill this chunk with a single material.  This packs the chunk. */
+    void clear (value_type v = type::air);
+
+    /** Pack the blocks as tightly as possible. */
+    void compact();
+
+    /** Unpack the blocks, so they can be changed in place. */
+    void unpack()
+    {
+        if (bits_ != 16)
+            unpack_slow();
+    }
+
+    /** The number of bits used for every block: 0 if the whole chunk
+     *  is a single material, 1, 2, 4, or 8 if it uses a palette, and 16
+     *  if it is unpacked. */
+    unsigned int bits_per_block() const { return bits_; }
+
+    /** The number of different materials in a packed chunk. */
+    size_t palette_size() const
+        { return bits_ == 0 ? 1 : palette_.size(); }
+
+    /** The amount of memory used by this chunk, in bytes. */
+    size_t memory_usage() const
+    {
+        return    sizeof(*this) + raw_.capacity() * sizeof(block)
+               + palette_.capacity() * sizeof(uint16_t)
+               + packed_.capacity() * sizeof(uint32_t);
+    }
+
+    bool    operator== (const chunk& compare) const;
+
+    /** Dummy resize function, see chunk_base::resize(). */
+    void resize(size_t dummy) const
+    {
+        assert(dummy == volume());
+    }
+
+    bool    empty() const  { return false; }
+    size_t  size() const   { return chunk_volume; }
+    size_t  length() const { return chunk_size; }
+    size_t  area() const   { return chunk_area; }
+    size_t  volume() const { return chunk_volume; }
+
+    /** Convert an array index to a coordinate index. */
+    chunk_index index_to_pos(size_type i) const
+    {
+        return chunk_index(i % chunk_size, (i / chunk_size) % chunk_size,
+                           (i / chunk_area) % chunk_size);
+    }
+
+    /** Convert an iterator to a coordinate index. */
+    chunk_index index_to_pos(const_iterator i) const
+        { return index_to_pos(i.index()); }
+
+    bool is_air() const;
+
+    template <class obj>
+    serializer<obj>& serialize(serializer<obj>& ar)
     {
-        return ar.raw_data(*this, chunk_volume)(version);
+        if (bits_ == 16)
+            return ar.raw_data(raw_, chunk_volume)(version);
+
+        array_t tmp (chunk_volume);
+        copy_types(0, chunk_volume, reinterpret_cast<uint16_t*>(&tmp[0]));
+        return ar.raw_data(tmp, chunk_volume)(version);
     }
+
+    template <class obj>
+    deserializer<obj>& serialize(deserializer<obj>& ar)
+    {
+        palette_.clear();
+        packed_.clear();
+        bits_ = 16;
+        ar.raw_data(raw_, chunk_volume)(version);
+        compact();
+        return ar;
+    }
+
+private:
+    static size_type index (uint8_t x, uint8_t y, uint8_t z)
+    {
+        assert (x < chunk_size);
+        assert (y < chunk_size);
+        assert (z < chunk_size);
+
+        return x + y * chunk_size + z * chunk_area;
+    }
+
+    void unpack_slow();
+
+private:
+    /** 0 (uniform), 1, 2, 4, 8 (palette), or 16 (unpacked). */
+    uint8_t                 bits_;
+    /** The material, if the whole chunk is made of the same stuff. */
+    block                   uniform_;
+    /** The blocks, if the chunk is unpacked. */
+    array_t                 raw_;
+    /** The materials in this chunk, if it uses a palette. */
+    palette_t               palette_;
+    /** Indices into the palette, packed into 32-bit words. */
+    packed_t                packed_;
 };
 
 } // namespace hexa
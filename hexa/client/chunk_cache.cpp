@@ -80,11 +80,11 @@ chunk_cache::get_coarse_height (const map_coordinates& pos)
     if (found)
         return *found;
 
-    if (!store_.is_available(pos))
+    auto value (store_.try_retrieve(pos));
+    if (!value)
         return undefined_height;
 
-    auto value (store_.retrieve(pos));
-    return heights_[pos] = value;
+    return heights_[pos] = *value;
 }
 
 void
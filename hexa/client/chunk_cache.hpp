@@ -25,9 +25,9 @@
 #include <mutex>
 
 #include <hexa/basic_types.hpp>
+#include <hexa/clock_cache.hpp>
 #include <hexa/compression.hpp>
 #include <hexa/lightmap.hpp>
-#include <hexa/lru_cache.hpp>
 #include <hexa/surface.hpp>
 
 namespace hexa {
@@ -71,13 +71,13 @@ private:
     persistent_storage_i& store_;
     size_t                limit_;
 
-    lru_cache<map_coordinates,   chunk_height>  heights_;
+    clock_cache<map_coordinates,   chunk_height>  heights_;
     mutable std::mutex                          heights_mutex_;
 
-    lru_cache<chunk_coordinates, surface_data>  surfaces_;
+    clock_cache<chunk_coordinates, surface_data>  surfaces_;
     mutable std::mutex                          surfaces_mutex_;
 
-    lru_cache<chunk_coordinates, light_data>    lightmaps_;
+    clock_cache<chunk_coordinates, light_data>    lightmaps_;
     mutable std::mutex                          lightmaps_mutex_;
 };
 
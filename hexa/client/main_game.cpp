@@ -21,6 +21,7 @@
 
 #include "main_game.hpp"
 
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <unordered_set>
@@ -50,6 +51,7 @@
 #include <hexa/protocol.hpp>
 #include <hexa/lightmap.hpp>
 #include <hexa/ray.hpp>
+#include <hexa/surface_delta.hpp>
 #include <hexa/voxel_algorithm.hpp>
 #include <hexa/process.hpp>
 #include <hexa/trace.hpp>
@@ -81,6 +83,9 @@ namespace hexa {
 
 extern po::variables_map global_settings;
 
+/** The number of entity snapshots kept around as a baseline. */
+static const size_t snapshot_history (32);
+
 main_game::main_game (game& the_game, const std::string& host, uint16_t port,
                       unsigned int vd)
     : game_state     (the_game)
@@ -93,6 +98,7 @@ main_game::main_game (game& the_game, const std::string& host, uint16_t port,
     , in_action_     (false)
     , asio_          ([=]{io_.run();})
     , player_entity_ (0xffffffff)
+    , last_snapshot_ (0)
     , waiting_for_data_(true)
     , loading_screen_(false)
     , singleplayer_  (host.empty())
@@ -826,10 +832,14 @@ void main_game::receive (const packet& p)
             entity_update(archive); break;
         case msg::entity_update_physics::msg_id:
             entity_update_physics(archive); break;
+        case msg::entity_snapshot::msg_id:
+            entity_snapshot(archive); break;
         case msg::entity_delete::msg_id:
             entity_delete(archive); break;
         case msg::surface_update::msg_id:
             surface_update(archive); break;
+        case msg::surface_delta_update::msg_id:
+            surface_delta_update(archive); break;
         case msg::lightmap_update::msg_id:
             lightmap_update(archive); break;
         case msg::heightmap_update::msg_id:
@@ -981,24 +991,106 @@ void main_game::entity_update_physics (deserializer<packet>& p)
     auto lock (entities_.acquire_write_lock());
 
     for (auto& upd : msg.updates)
+        set_physics(upd.entity_id, upd.pos, upd.velocity, lag);
+}
+
+void main_game::entity_snapshot (deserializer<packet>& p)
+{
+    msg::entity_snapshot msg;
+    msg.serialize(p);
+
+    auto find_snapshot ([&](uint16_t sequence)
     {
-        auto e (entities_.make(upd.entity_id));
-        auto newpos (upd.pos + upd.velocity * lag);
+        return std::find_if(snapshots_.begin(), snapshots_.end(),
+            [=](const std::pair<uint16_t, entity_states>& s)
+            { return s.first == sequence; });
+    });
 
-        //trace("Set entity %1% to position %2%", upd.entity_id, upd.pos);
-        //trace("  velocity %1%, lag %2%", upd.velocity, lag);
+    // If we don't have the baseline anymore, the server will notice
+    // soon enough and use an older one.
+    static const entity_states nothing;
+    const entity_states* base (&nothing);
+    if (msg.baseline != 0)
+    {
+        auto found (find_snapshot(msg.baseline));
+        if (found == snapshots_.end())
+            return;
 
-        if (   entities_.entity_has_component(e, entity_system::c_position)
-            && entities_.entity_has_component(e, entity_system::c_velocity))
-        {
-            last_known_phys info { newpos, upd.velocity };
-            entities_.set(e, entity_system::c_lag_comp, info);
-        }
+        base = &found->second;
+    }
+
+    entity_states states;
+    if (!apply_snapshot(msg, *base, states))
+        return;
+
+    msg::entity_snapshot_ack ack;
+    ack.sequence = msg.sequence;
+    send(serialize_packet(ack), ack.method());
+
+    // Snapshots that arrive out of order are only good as a baseline.
+    bool newest (   snapshots_.empty()
+                 || int16_t(msg.sequence - last_snapshot_) > 0);
+
+    // Whatever was shown until now, but isn't in the new snapshot, has
+    // to go.  That includes the entities that were left out of a full
+    // snapshot.
+    std::vector<uint32_t> gone;
+    if (newest)
+    {
+        auto shown (find_snapshot(last_snapshot_));
+        if (shown != snapshots_.end())
+            gone = vanished_entities(shown->second, states);
         else
-        {
-            entities_.set_position(e, newpos);
-            entities_.set_velocity(e, upd.velocity);
-        }
+            gone = msg.removed;
+    }
+
+    snapshots_.emplace_back(msg.sequence, std::move(states));
+    if (snapshots_.size() > snapshot_history)
+        snapshots_.pop_front();
+
+    if (!newest)
+        return;
+
+    last_snapshot_ = msg.sequence;
+    int32_t lag_msec (clock::time() - msg.timestamp);
+    float   lag (lag_msec * 0.001f);
+
+    // Only the entities in the message itself have news; the others
+    // could be older than what we got earlier.
+    auto& current (snapshots_.back().second);
+    auto lock (entities_.acquire_write_lock());
+    for (auto id : gone)
+    {
+        if (id != player_entity_)
+            entities_.delete_entity(id);
+    }
+
+    for (auto& upd : msg.updates)
+    {
+        auto& s (current[upd.entity_id]);
+        set_physics(upd.entity_id, s.position(), s.speed(), lag);
+    }
+}
+
+void main_game::set_physics (uint32_t id, const wfpos& pos,
+                             const vector& velocity, float lag)
+{
+    auto e (entities_.make(id));
+    auto newpos (pos + velocity * lag);
+
+    //trace("Set entity %1% to position %2%", id, pos);
+    //trace("  velocity %1%, lag %2%", velocity, lag);
+
+    if (   entities_.entity_has_component(e, entity_system::c_position)
+        && entities_.entity_has_component(e, entity_system::c_velocity))
+    {
+        last_known_phys info { newpos, velocity };
+        entities_.set(e, entity_system::c_lag_comp, info);
+    }
+    else
+    {
+        entities_.set_position(e, newpos);
+        entities_.set_velocity(e, velocity);
     }
 }
 
@@ -1035,6 +1127,36 @@ void main_game::surface_update (deserializer<packet>& p)
     }
 }
 
+void main_game::surface_delta_update (deserializer<packet>& p)
+{
+    msg::surface_delta_update msg;
+    msg.serialize(p);
+
+    trace("receive surface delta %1%", msg.position);
+
+    auto& pos (msg.position);
+    if (!map().is_surface_available(pos) || !map().is_lightmap_available(pos))
+    {
+        request_chunk(pos);
+        return;
+    }
+
+    surface_data srf (map().get_surface(pos));
+    light_data light (map().get_lightmap(pos));
+    auto history (deserialize_as<surface_history>(decompress(msg.history)));
+
+    // If our copy is too old for the deltas, get the whole thing.
+    if (!apply(history, srf, light))
+    {
+        request_chunk(pos);
+        return;
+    }
+
+    map().store_surface(pos, compress(serialize(srf)));
+    map().store_lightmap(pos, compress(serialize(light)));
+    scene_.set(pos, map().get_surface(pos), map().get_lightmap(pos));
+}
+
 void main_game::lightmap_update (deserializer<packet>& p)
 {
     msg::lightmap_update msg;
@@ -23,12 +23,14 @@
 #pragma once
 
 #include <atomic>
+#include <deque>
 #include <unordered_set>
 #include <boost/asio.hpp>
 #include <boost/signals2.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
 
+#include <hexa/entity_snapshot.hpp>
 #include <hexa/entity_system.hpp>
 #include <hexa/persistent_storage_i.hpp>
 #include <hexa/packet.hpp>
@@ -114,14 +116,22 @@ private:
 
     void entity_update(deserializer<packet>& p);
     void entity_update_physics(deserializer<packet>& p);
+    void entity_snapshot(deserializer<packet>& p);
     void entity_delete(deserializer<packet>& p);
     void surface_update(deserializer<packet>& p);
+    void surface_delta_update(deserializer<packet>& p);
     void lightmap_update(deserializer<packet>& p);
     void heightmap_update(deserializer<packet>& p);
     void configure_hotbar(deserializer<packet>& p);
     void global_config(deserializer<packet>& p);
     void print_msg(deserializer<packet>& p);
 
+private:
+    /** Update an entity's position and velocity, as the server saw them
+     *  \a lag seconds ago. */
+    void set_physics (uint32_t id, const wfpos& pos, const vector& velocity,
+                      float lag);
+
 private:
     boost::asio::io_service                io_;
 
@@ -158,6 +168,11 @@ private:
     entity_system       entities_;
     uint32_t            player_entity_;
 
+    /** The last couple of entity snapshots, the next ones from the
+     *  server will build upon these. */
+    std::deque<std::pair<uint16_t, entity_states>> snapshots_;
+    uint16_t            last_snapshot_;
+
     bool                waiting_for_data_;
     mutable bool        loading_screen_;
     bool                singleplayer_;
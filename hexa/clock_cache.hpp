@@ -0,0 +1,371 @@
+//---------------------------------------------------------------------------
+/// \file  clock_cache.hpp
+/// \brief Open-addressed hash table with CLOCK eviction.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+#include <boost/optional.hpp>
+
+namespace hexa {
+
+/** Cache with the same interface as lru_cache, but without the linked
+ *  list.
+ *  The keys are kept in a flat, open-addressed hash table that points
+ *  into an array of slots.  The slots never move, so references to the
+ *  elements stay valid until they are removed.  Instead of keeping the
+ *  elements in order of use, every element has a "referenced" bit that
+ *  is set when it is looked up.  When something has to go, a clock hand
+ *  sweeps over the slots, clearing the bits, and evicts the first element
+ *  that wasn't used since the last sweep.
+ *
+ *  Like lru_cache, this class is not thread-safe; see sharded_cache.
+ *
+ * Example:
+ * @code
+
+hexa::clock_cache<chunk_coordinates, surface_data>  cache;
+
+cache[pos] = build_surface(pos);
+if (cache.try_get(pos))
+    std::cout << "found it" << std::endl;
+
+// Evict elements until there are at most 100 left.
+cache.prune(100, [](chunk_coordinates p, surface_data& s)
+{
+    std::cout << "evicted " << p << std::endl;
+});
+
+ * @endcode */
+template <class key, class value, class hasher = std::hash<key>>
+class clock_cache
+{
+public:
+    typedef key     key_type;     /**< The cache is indexed by this type */
+    typedef value   mapped_type;  /**< The cache returns this type */
+
+private:
+    static const uint32_t no_slot = 0xffffffff;
+
+    struct bucket
+    {
+        uint32_t    hash;
+        uint32_t    slot;
+    };
+
+    struct slot
+    {
+        slot() : hash (0), used (false), referenced (false) { }
+
+        key_type    k;
+        mapped_type v;
+        uint32_t    hash;
+        bool        used;
+        bool        referenced;
+    };
+
+public:
+    /** Construct an empty cache. */
+    clock_cache() : size_ (0), hand_ (0) { }
+
+    /** Fetch an element from the cache, and mark it as used.
+     *  If the key does not exist yet, a new empty element will be
+     *  created. */
+    mapped_type& operator[] (const key_type& k)
+    {
+        const uint32_t h (hash(k));
+        size_t i (find(k, h));
+        if (i != npos)
+        {
+            slot& s (slots_[buckets_[i].slot]);
+            s.referenced = true;
+            return s.v;
+        }
+
+        if ((size_ + 1) * 4 > buckets_.size() * 3)
+            rehash(buckets_.empty() ? 16 : buckets_.size() * 2);
+
+        uint32_t index;
+        if (free_.empty())
+        {
+            index = static_cast<uint32_t>(slots_.size());
+            slots_.emplace_back();
+        }
+        else
+        {
+            index = free_.back();
+            free_.pop_back();
+        }
+
+        slot& s (slots_[index]);
+        s.k = k;
+        s.hash = h;
+        s.used = true;
+        s.referenced = false;
+
+        place(h, index);
+        ++size_;
+
+        return s.v;
+    }
+
+    /** Fetch an element, and mark it as used. */
+    boost::optional<mapped_type&> try_get (const key_type& k)
+    {
+        size_t i (find(k, hash(k)));
+        if (i == npos)
+            return boost::optional<mapped_type&>();
+
+        slot& s (slots_[buckets_[i].slot]);
+        s.referenced = true;
+        return s.v;
+    }
+
+    /** Fetch an element without marking it as used. */
+    boost::optional<mapped_type&> try_get (const key_type& k) const
+    {
+        size_t i (find(k, hash(k)));
+        if (i == npos)
+            return boost::optional<mapped_type&>();
+
+        return slots_[buckets_[i].slot].v;
+    }
+
+    /** Get an element from the cache without marking it as used. */
+    mapped_type& get (const key_type& k) const
+    {
+        size_t i (find(k, hash(k)));
+        if (i == npos)
+            throw std::runtime_error("clock_cache::get: key not found");
+
+        return slots_[buckets_[i].slot].v;
+    }
+
+    /** Mark an element as recently used. */
+    void touch (const key_type& k)
+    {
+        size_t i (find(k, hash(k)));
+        assert(i != npos);
+        if (i != npos)
+            slots_[buckets_[i].slot].referenced = true;
+    }
+
+    /** Remove an element from the cache. */
+    void remove (const key_type& k)
+    {
+        size_t i (find(k, hash(k)));
+        if (i != npos)
+            erase(i);
+    }
+
+    /** Count the number of elements for a given key.
+     *  The returned value is always 0 or 1. */
+    size_t count (const key_type& k) const
+        { return find(k, hash(k)) == npos ? 0 : 1; }
+
+    /** Get the number of elements in the cache. */
+    size_t size() const { return size_; }
+
+    /** Check if the cache is empty. */
+    bool empty() const { return size_ == 0; }
+
+    /** Empty the cache. */
+    void clear()
+    {
+        buckets_.clear();
+        slots_.clear();
+        free_.clear();
+        size_ = 0;
+        hand_ = 0;
+    }
+
+    /** Evict elements until a condition no longer holds.
+     *  The callback is invoked for every element, right before it is
+     *  removed.  This is where dirty elements can be written back.
+     * @param more       Evict as long as more() returns true
+     * @param on_remove  Callback for removed elements
+     * @return The number of elements that were removed */
+    template <class pred, class func>
+    size_t evict_while (pred more, func on_remove)
+    {
+        size_t removed (0);
+        while (size_ > 0 && more())
+        {
+            const uint32_t index (advance());
+            slot& s (slots_[index]);
+            on_remove(static_cast<const key_type&>(s.k), s.v);
+            erase(bucket_of(index));
+            ++removed;
+        }
+        return removed;
+    }
+
+    /** Prune the cache back to a given size.
+     * @post size() <= max_size
+     * @param max_size  The maximum cache size
+     * @param on_remove Callback for removed elements */
+    template <class func>
+    void prune (size_t max_size, func on_remove)
+    {
+        evict_while([&]{ return size_ > max_size; }, on_remove);
+    }
+
+    /** Prune the cache back to a given size.
+     * @post size() <= max_size
+     * @param max_size  The maximum cache size */
+    void prune (size_t max_size)
+    {
+        prune(max_size, [](const key_type&, mapped_type&){ });
+    }
+
+    /** Call a function for every key-value pair in the cache. */
+    template <class func>
+    func for_each (func op) const
+    {
+        for (const slot& s : slots_)
+        {
+            if (s.used)
+                op(s.k, s.v);
+        }
+        return op;
+    }
+
+private:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    uint32_t hash (const key_type& k) const
+    {
+        // Mix the bits, since std::hash is often the identity function,
+        // and linear probing doesn't like clustered hash values.
+        uint64_t h (hasher()(k));
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<uint32_t>(h);
+    }
+
+    size_t mask() const { return buckets_.size() - 1; }
+
+    size_t find (const key_type& k, uint32_t h) const
+    {
+        if (buckets_.empty())
+            return npos;
+
+        for (size_t i (h & mask()); ; i = (i + 1) & mask())
+        {
+            const bucket& b (buckets_[i]);
+            if (b.slot == no_slot)
+                return npos;
+
+            if (b.hash == h && slots_[b.slot].k == k)
+                return i;
+        }
+    }
+
+    size_t bucket_of (uint32_t index) const
+    {
+        for (size_t i (slots_[index].hash & mask()); ; i = (i + 1) & mask())
+        {
+            if (buckets_[i].slot == index)
+                return i;
+        }
+    }
+
+    void place (uint32_t h, uint32_t index)
+    {
+        size_t i (h & mask());
+        while (buckets_[i].slot != no_slot)
+            i = (i + 1) & mask();
+
+        buckets_[i].hash = h;
+        buckets_[i].slot = index;
+    }
+
+    void rehash (size_t bucket_count)
+    {
+        buckets_.assign(bucket_count, bucket { 0, no_slot });
+        for (size_t i (0); i < slots_.size(); ++i)
+        {
+            if (slots_[i].used)
+                place(slots_[i].hash, static_cast<uint32_t>(i));
+        }
+    }
+
+    /** Remove the element in a given bucket.  The elements after it are
+     *  shifted back, so lookups never need tombstones. */
+    void erase (size_t i)
+    {
+        slot& s (slots_[buckets_[i].slot]);
+        s = slot();
+        free_.push_back(buckets_[i].slot);
+        --size_;
+
+        for (size_t j ((i + 1) & mask()); buckets_[j].slot != no_slot;
+             j = (j + 1) & mask())
+        {
+            const size_t home (buckets_[j].hash & mask());
+            if (((j - home) & mask()) >= ((j - i) & mask()))
+            {
+                buckets_[i] = buckets_[j];
+                i = j;
+            }
+        }
+        buckets_[i].slot = no_slot;
+    }
+
+    /** Move the clock hand to the next element that wasn't used since
+     *  the last time the hand passed it. */
+    uint32_t advance()
+    {
+        assert(size_ > 0);
+        for (;;)
+        {
+            if (hand_ >= slots_.size())
+                hand_ = 0;
+
+            slot& s (slots_[hand_]);
+            const uint32_t index (static_cast<uint32_t>(hand_++));
+            if (!s.used)
+                continue;
+
+            if (!s.referenced)
+                return index;
+
+            s.referenced = false;
+        }
+    }
+
+private:
+    std::vector<bucket>     buckets_;
+    /** A deque never moves its elements when it grows. */
+    mutable std::deque<slot> slots_;
+    std::vector<uint32_t>   free_;
+    size_t                  size_;
+    size_t                  hand_;
+};
+
+} // namespace hexa
@@ -22,8 +22,10 @@
 
 #pragma once
 
+#include <memory>
 #include "lz4/lz4.h"
 #include "basic_types.hpp"
+#include "pool_allocator.hpp"
 #include "serialize.hpp"
 
 namespace hexa {
@@ -31,7 +33,7 @@ namespace hexa {
 /** A buffer holding compressed data. */
 class compressed_data
 {
-    typedef std::vector<char> buf_t;
+    typedef std::vector<char, recycling_allocator<char>> buf_t;
 
 public:
     /** The buffer with the compressed data. */
@@ -106,6 +108,17 @@ public:
     }
 };
 
+/** Compressed data that is shared by several owners.
+ *  Once created, the data is never modified, so it can be handed to
+ *  caches and network packets without copying it. */
+typedef std::shared_ptr<const compressed_data> shared_compressed_data;
+
+/** Move compressed data into a shared_compressed_data object. */
+inline shared_compressed_data share (compressed_data&& data)
+{
+    return std::make_shared<const compressed_data>(std::move(data));
+}
+
 
 /** Compress a buffer
  * \param in   The data to be compressed.  Note that this buffer must be
@@ -0,0 +1,166 @@
+//---------------------------------------------------------------------------
+// entity_snapshot.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "entity_snapshot.hpp"
+
+#include <cmath>
+#include <limits>
+
+namespace hexa {
+
+typedef msg::entity_snapshot::value value;
+
+entity_state::entity_state (const wfpos& pos, const vector& vel)
+{
+    for (int i (0); i < 3; ++i)
+    {
+        auto fixed (std::llround(((double)pos.pos[i] + pos.frac[i])
+                                 * position_scale));
+        block[i] = uint32_t(fixed / position_scale);
+        frac[i]  = uint8_t(fixed % position_scale);
+
+        auto v (std::lround(vel[i] * velocity_scale));
+        velocity[i] = int16_t(std::max(-32767l, std::min(32767l, v)));
+    }
+}
+
+wfpos
+entity_state::position() const
+{
+    return wfpos(block, vector(frac) / float(position_scale));
+}
+
+vector
+entity_state::speed() const
+{
+    return vector(velocity) / float(velocity_scale);
+}
+
+value
+encode_entity (uint32_t id, const entity_state& state,
+               const entity_state* base)
+{
+    value result;
+    result.entity_id = id;
+
+    if (base == nullptr)
+    {
+        result.flags = value::absolute;
+        result.block = state.block;
+        result.frac  = state.frac;
+        if (state.velocity != vector3<int16_t>(0, 0, 0))
+        {
+            result.flags |= value::velocity;
+            result.speed = state.velocity;
+        }
+        return result;
+    }
+
+    // Small moves are sent as the difference with the baseline, large
+    // ones (teleports, mostly) as the full position.
+    bool fits (true);
+    for (int i (0); i < 3; ++i)
+    {
+        auto d (state.fixed_point(i) - base->fixed_point(i));
+        if (   d < std::numeric_limits<int16_t>::min()
+            || d > std::numeric_limits<int16_t>::max())
+        {
+            fits = false;
+            break;
+        }
+        result.move[i] = int16_t(d);
+    }
+
+    if (!fits)
+    {
+        result.flags = value::absolute;
+        result.block = state.block;
+        result.frac  = state.frac;
+    }
+    else if (result.move != vector3<int16_t>(0, 0, 0))
+    {
+        result.flags = value::moved;
+    }
+
+    if (state.velocity != base->velocity)
+    {
+        result.flags |= value::velocity;
+        result.speed = state.velocity;
+    }
+
+    return result;
+}
+
+bool apply_snapshot (const msg::entity_snapshot& snapshot,
+                     const entity_states& base, entity_states& result)
+{
+    entity_states next (base);
+    for (auto id : snapshot.removed)
+        next.erase(id);
+
+    for (auto& upd : snapshot.updates)
+    {
+        if (upd.flags & value::absolute)
+        {
+            auto& s (next[upd.entity_id]);
+            s.block = upd.block;
+            s.frac  = upd.frac;
+        }
+        else
+        {
+            auto found (next.find(upd.entity_id));
+            if (found == next.end())
+                return false;
+
+            if (upd.flags & value::moved)
+            {
+                auto& s (found->second);
+                for (int i (0); i < 3; ++i)
+                {
+                    auto fixed (s.fixed_point(i) + upd.move[i]);
+                    s.block[i] = uint32_t(fixed / entity_state::position_scale);
+                    s.frac[i]  = uint8_t(fixed % entity_state::position_scale);
+                }
+            }
+        }
+
+        if (upd.flags & value::velocity)
+            next[upd.entity_id].velocity = upd.speed;
+    }
+
+    result = std::move(next);
+    return true;
+}
+
+std::vector<uint32_t>
+vanished_entities (const entity_states& shown, const entity_states& next)
+{
+    std::vector<uint32_t> result;
+    for (auto& s : shown)
+    {
+        if (!next.count(s.first))
+            result.push_back(s.first);
+    }
+    return result;
+}
+
+} // namespace hexa
+
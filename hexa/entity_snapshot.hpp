@@ -0,0 +1,107 @@
+//---------------------------------------------------------------------------
+/// \file   entity_snapshot.hpp
+/// \brief  Compact encoding of entity positions and velocities
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "basic_types.hpp"
+#include "protocol.hpp"
+#include "wfpos.hpp"
+
+namespace hexa {
+
+/** The position and velocity of an entity, rounded to the precision
+ *  that is sent to the clients.  Positions are rounded to 1/256th of a
+ *  block, velocities to 1/128th of a block per second, up to 256 blocks
+ *  per second.  The server and client both keep track of these rounded
+ *  states, so the deltas between them are exact. */
+class entity_state
+{
+public:
+    enum { position_scale = 256, velocity_scale = 128 };
+
+    world_coordinates   block;
+    vector3<uint8_t>    frac;
+    vector3<int16_t>    velocity;
+
+public:
+    entity_state()
+        : block (0, 0, 0), frac (0, 0, 0), velocity (0, 0, 0)
+    { }
+
+    entity_state (const wfpos& pos, const vector& vel);
+
+    wfpos   position() const;
+    vector  speed() const;
+
+    /** The position in 1/256th blocks, along a given axis. */
+    int64_t fixed_point (int axis) const
+        { return int64_t(block[axis]) * position_scale + frac[axis]; }
+
+    bool operator== (const entity_state& compare) const
+    {
+        return    block == compare.block && frac == compare.frac
+               && velocity == compare.velocity;
+    }
+
+    bool operator!= (const entity_state& compare) const
+        { return !operator==(compare); }
+};
+
+/** The entity states a client knows about, by entity ID. */
+typedef std::unordered_map<uint32_t, entity_state> entity_states;
+
+/** Encode an entity's state for an entity_snapshot message.
+ * @param id     The entity ID
+ * @param state  The current state
+ * @param base   What the client already knows, or nullptr if it
+ *               doesn't know about the entity at all
+ * @return The update, or an update without any flags if the entity
+ *         didn't change since \a base */
+msg::entity_snapshot::value
+encode_entity (uint32_t id, const entity_state& state,
+               const entity_state* base);
+
+/** Apply a snapshot to its baseline.
+ * @param snapshot  The message
+ * @param base      The states in the baseline snapshot; should be empty
+ *                  if the message doesn't have a baseline
+ * @param result    The states in the new snapshot
+ * @return False if the message refers to entities the baseline doesn't
+ *         have, in which case the snapshot cannot be used */
+bool apply_snapshot (const msg::entity_snapshot& snapshot,
+                     const entity_states& base, entity_states& result);
+
+/** Find the entities that disappeared between two snapshots.
+ *  These are the ones the server removed, but also the ones that were
+ *  left out of a full snapshot, or removed in a snapshot that was lost.
+ * @param shown  The states in the snapshot the client is showing
+ * @param next   The states in the snapshot that replaces it
+ * @return The entities in \a shown that are not in \a next */
+std::vector<uint32_t>
+vanished_entities (const entity_states& shown, const entity_states& next);
+
+} // namespace hexa
+
@@ -0,0 +1,77 @@
+//---------------------------------------------------------------------------
+// flat_ray_bundle.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "flat_ray_bundle.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace hexa {
+
+flat_ray_bundle::flat_ray_bundle (const ray_bundle& tree)
+{
+    add(tree);
+
+    // Work backwards, so every subtree is done before its parent.
+    lowest.resize(voxels.size());
+    std::vector<int32_t> subtree (nodes.size());
+    for (auto i (nodes.size()); i-- > 0; )
+    {
+        auto& n (nodes[i]);
+        auto low (std::numeric_limits<int32_t>::max());
+        for (auto child (i + 1); child < n.skip; child = nodes[child].skip)
+            low = std::min(low, subtree[child]);
+
+        for (auto v (n.last); v-- > n.first; )
+        {
+            low = std::min(low, voxels[v].z);
+            lowest[v] = low;
+        }
+        subtree[i] = low;
+    }
+}
+
+std::vector<int32_t>
+flat_ray_bundle::offsets (ptrdiff_t dy, ptrdiff_t dz) const
+{
+    std::vector<int32_t> result;
+    result.reserve(voxels.size());
+    for (auto& v : voxels)
+        result.push_back(v.x + v.y * dy + v.z * dz);
+
+    return result;
+}
+
+void
+flat_ray_bundle::add (const ray_bundle& tree)
+{
+    auto index (nodes.size());
+    nodes.push_back({ uint32_t(voxels.size()), 0, 0, tree.weight });
+    voxels.insert(voxels.end(), tree.trunk.begin(), tree.trunk.end());
+    nodes[index].last = voxels.size();
+
+    for (auto& branch : tree.branches)
+        add(branch);
+
+    nodes[index].skip = nodes.size();
+}
+
+} // namespace hexa
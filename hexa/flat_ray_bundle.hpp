@@ -0,0 +1,100 @@
+//---------------------------------------------------------------------------
+/// \file   flat_ray_bundle.hpp
+/// \brief  A ray bundle flattened into a few contiguous arrays
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "basic_types.hpp"
+#include "ray_bundle.hpp"
+
+namespace hexa {
+
+/** A ray_bundle, compiled into a form that is faster to traverse.
+ *  A ray_bundle is a tree, where every branch has its own vector of
+ *  voxels, and its own vector of sub-branches.  Following the rays
+ *  means chasing pointers all over the heap.  This class stores the
+ *  same tree in depth-first order: all voxels end up in one array, and
+ *  the branches in another.  Every branch knows where its subtree ends,
+ *  so if a branch is blocked, its children can be skipped by jumping
+ *  ahead.  Simply walking through the branches from start to end gives
+ *  the same order as the recursive traversal.
+ *
+ * Example:
+ * @code
+
+flat_ray_bundle flat (tree);
+for (size_t i (0); i < flat.nodes.size(); )
+{
+    auto& n (flat.nodes[i]);
+    if (blocked(flat.voxels.begin() + n.first, flat.voxels.begin() + n.last))
+        i = n.skip;
+    else
+        ++i;
+}
+
+ * @endcode */
+class flat_ray_bundle
+{
+public:
+    /** A single branch of the tree. */
+    struct node
+    {
+        /** Index of the branch's first voxel. */
+        uint32_t    first;
+        /** One past the index of the branch's last voxel. */
+        uint32_t    last;
+        /** Index of the first node that is not part of this subtree. */
+        uint32_t    skip;
+        /** The weight of the branch, \sa ray_bundle::weight */
+        float       weight;
+    };
+
+    /** All branches, in depth-first order. */
+    std::vector<node>           nodes;
+    /** The voxels of all branches, in the same order. */
+    std::vector<world_vector>   voxels;
+    /** For every voxel, the lowest z coordinate of that voxel and all
+     *  voxels that come after it in the same subtree.  Once a ray is
+     *  above the terrain and \a lowest says it won't come down again,
+     *  the rest of its subtree can be skipped. */
+    std::vector<int32_t>        lowest;
+
+public:
+    flat_ray_bundle() { }
+
+    /** Compile a ray bundle. */
+    explicit flat_ray_bundle (const ray_bundle& tree);
+
+    /** Convert the voxels to offsets in a flat array.
+     * @param dy  Distance between two rows of the array
+     * @param dz  Distance between two slices of the array
+     * @return For every voxel, x + y * dy + z * dz */
+    std::vector<int32_t> offsets (ptrdiff_t dy, ptrdiff_t dz) const;
+
+private:
+    void add (const ray_bundle& tree);
+};
+
+} // namespace hexa
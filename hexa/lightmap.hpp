@@ -25,6 +25,7 @@
 #include <memory>
 #include "basic_types.hpp"
 #include "chunk_base.hpp"
+#include "pool_allocator.hpp"
 #include "pos_dir.hpp"
 #include "serialize.hpp"
 
@@ -83,7 +84,7 @@ struct light
  *  array. */
 class lightmap
 {
-    typedef std::vector<light>  data_t;
+    typedef std::vector<light, recycling_allocator<light>>  data_t;
 
 public:
     typedef data_t::value_type      value_type;
@@ -135,9 +136,15 @@ public:
      *  unavoidable). */
     uint16_t    phase;
 
+    /** Set by the server every time it stores a light map in memory.
+     *  Unlike the surface's version, this also changes when only the
+     *  light does.  It is not serialized. */
+    uint64_t    generation;
+
 public:
-    light_data() : phase(0) { }
-    light_data(lightmap o, lightmap t) : opaque(o), transparent(t), phase(0) { }
+    light_data() : phase(0), generation(0) { }
+    light_data(lightmap o, lightmap t)
+        : opaque(o), transparent(t), phase(0), generation(0) { }
 
     bool empty() const { return opaque.empty() && transparent.empty(); }
 
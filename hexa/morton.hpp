@@ -0,0 +1,150 @@
+//---------------------------------------------------------------------------
+/// \file   morton.hpp
+/// \brief  Morton (Z-order) codes for chunk and map coordinates
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include "basic_types.hpp"
+
+namespace hexa {
+
+namespace detail {
+
+/** Insert two zero bits between the lower 16 bits of a number. */
+inline uint64_t morton_spread_3 (uint64_t x)
+{
+    x &= 0xffff;
+    x = (x | x << 32) & 0x001f00000000ffffULL;
+    x = (x | x << 16) & 0x001f0000ff0000ffULL;
+    x = (x | x << 8)  & 0x100f00f00f00f00fULL;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2)  & 0x1249249249249249ULL;
+    return x;
+}
+
+/** Inverse of morton_spread_3(). */
+inline uint32_t morton_compact_3 (uint64_t x)
+{
+    x &= 0x1249249249249249ULL;
+    x = (x | x >> 2)  & 0x10c30c30c30c30c3ULL;
+    x = (x | x >> 4)  & 0x100f00f00f00f00fULL;
+    x = (x | x >> 8)  & 0x001f0000ff0000ffULL;
+    x = (x | x >> 16) & 0x001f00000000ffffULL;
+    x = (x | x >> 32) & 0xffff;
+    return static_cast<uint32_t>(x);
+}
+
+/** Insert a zero bit between the bits of a number. */
+inline uint64_t morton_spread_2 (uint64_t x)
+{
+    x &= 0xffffffff;
+    x = (x | x << 16) & 0x0000ffff0000ffffULL;
+    x = (x | x << 8)  & 0x00ff00ff00ff00ffULL;
+    x = (x | x << 4)  & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | x << 2)  & 0x3333333333333333ULL;
+    x = (x | x << 1)  & 0x5555555555555555ULL;
+    return x;
+}
+
+/** Inverse of morton_spread_2(). */
+inline uint32_t morton_compact_2 (uint64_t x)
+{
+    x &= 0x5555555555555555ULL;
+    x = (x | x >> 1)  & 0x3333333333333333ULL;
+    x = (x | x >> 2)  & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | x >> 4)  & 0x00ff00ff00ff00ffULL;
+    x = (x | x >> 8)  & 0x0000ffff0000ffffULL;
+    x = (x | x >> 16) & 0xffffffff;
+    return static_cast<uint32_t>(x);
+}
+
+inline void put_big_endian_48 (uint64_t v, uint8_t* out)
+{
+    for (int i (5); i >= 0; --i, v >>= 8)
+        out[i] = static_cast<uint8_t>(v);
+}
+
+inline uint64_t get_big_endian_48 (const uint8_t* in)
+{
+    uint64_t v (0);
+    for (int i (0); i < 6; ++i)
+        v = (v << 8) | in[i];
+    return v;
+}
+
+} // namespace detail
+
+/** Size of a 3-D Morton code, in bytes. */
+constexpr size_t morton_code_size = 12;
+
+/** Write the 96-bit Morton code of a chunk position.
+ *  The bits of the three coordinates are interleaved as x, y, z, from
+ *  the most significant bit down.  The code is written in big-endian
+ *  order, so comparing two codes byte by byte (as LevelDB does)
+ *  gives the Z-order of the positions.
+ * @param pos  The position to encode
+ * @param out  Buffer of at least morton_code_size bytes */
+inline void morton_encode (chunk_coordinates pos, uint8_t* out)
+{
+    using namespace detail;
+
+    uint64_t hi (  morton_spread_3(pos.x >> 16) << 2
+                 | morton_spread_3(pos.y >> 16) << 1
+                 | morton_spread_3(pos.z >> 16));
+
+    uint64_t lo (  morton_spread_3(pos.x) << 2
+                 | morton_spread_3(pos.y) << 1
+                 | morton_spread_3(pos.z));
+
+    put_big_endian_48(hi, out);
+    put_big_endian_48(lo, out + 6);
+}
+
+/** Inverse of morton_encode(). */
+inline chunk_coordinates morton_decode (const uint8_t* in)
+{
+    using namespace detail;
+
+    uint64_t hi (get_big_endian_48(in));
+    uint64_t lo (get_big_endian_48(in + 6));
+
+    return chunk_coordinates(
+        morton_compact_3(hi >> 2) << 16 | morton_compact_3(lo >> 2),
+        morton_compact_3(hi >> 1) << 16 | morton_compact_3(lo >> 1),
+        morton_compact_3(hi)      << 16 | morton_compact_3(lo));
+}
+
+/** The 64-bit Morton code of a map position, interleaved as x, y. */
+inline uint64_t morton_encode (map_coordinates pos)
+{
+    using namespace detail;
+    return morton_spread_2(pos.x) << 1 | morton_spread_2(pos.y);
+}
+
+/** Inverse of morton_encode(map_coordinates). */
+inline map_coordinates morton_decode (uint64_t code)
+{
+    using namespace detail;
+    return map_coordinates(morton_compact_2(code >> 1), morton_compact_2(code));
+}
+
+} // namespace hexa
@@ -21,14 +21,18 @@
 
 #include "persistence_leveldb.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <boost/range.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <leveldb/filter_policy.h>
 #include <leveldb/comparator.h>
+#include <leveldb/write_batch.h>
 #include <es/storage.hpp>
 
 #include "log.hpp"
 #include "compiler_fix.hpp"
+#include "morton.hpp"
 #include "trace.hpp"
 
 using namespace boost;
@@ -40,6 +44,12 @@ namespace {
 
 static const uint32_t type_entity = 16;
 
+/** Write a batch once the queue has grown to this many entries... */
+static const size_t batch_size = 256;
+
+/** ...or when it has been sitting there this long. */
+static const std::chrono::milliseconds flush_interval (200);
+
 
 void check (const leveldb::Status& rc)
 {
@@ -47,9 +57,142 @@ void check (const leveldb::Status& rc)
         throw std::runtime_error((boost::format("persistence_leveldb: %1%") % rc.ToString()).str());
 }
 
+/** Records which key layout a database uses. */
+static const char* const layout_key = "hexa:key_layout";
+
+/** What a raw database key refers to. */
+enum class key_kind
+{
+    terrain, height, entity, other
+};
+
+struct decoded_key
+{
+    key_kind            kind;
+    uint32_t            type;
+    chunk_coordinates   pos;
+};
+
+decoded_key decode_key (persistence_leveldb::key_layout layout,
+                        const leveldb::Slice& key)
+{
+    decoded_key result { key_kind::other, 0, chunk_coordinates(0, 0, 0) };
+    auto data (reinterpret_cast<const uint8_t*>(key.data()));
+
+    if (key.size() == 2 * sizeof(uint32_t))
+    {
+        uint32_t k[2];
+        std::memcpy(k, data, sizeof(k));
+        if (k[0] == type_entity)
+            result.kind = key_kind::entity;
+    }
+    else if (layout == persistence_leveldb::key_layout::legacy)
+    {
+        uint32_t k[4];
+        if (key.size() == sizeof(k))
+        {
+            std::memcpy(k, data, sizeof(k));
+            result.kind = key_kind::terrain;
+            result.type = k[0];
+            result.pos = chunk_coordinates(k[1], k[2], k[3]);
+        }
+        else if (key.size() == 3 * sizeof(uint32_t))
+        {
+            std::memcpy(k, data, 3 * sizeof(uint32_t));
+            result.kind = key_kind::height;
+            result.pos = chunk_coordinates(k[1], k[2], 0);
+        }
+    }
+    else
+    {
+        if (key.size() == 1 + morton_code_size)
+        {
+            result.kind = key_kind::terrain;
+            result.type = data[0];
+            result.pos = morton_decode(data + 1);
+        }
+        else if (key.size() == 1 + sizeof(uint64_t))
+        {
+            uint64_t code (0);
+            for (size_t i (1); i < key.size(); ++i)
+                code = (code << 8) | data[i];
+
+            auto xy (morton_decode(code));
+            result.kind = key_kind::height;
+            result.pos = chunk_coordinates(xy.x, xy.y, 0);
+        }
+    }
+
+    return result;
 }
 
-persistence_leveldb::persistence_leveldb(const fs::path& db_file)
+/** Split a box into cubes that each cover a single range of Morton
+ *  codes.  The cubes are added in Z-order.
+ * @param box     The box to split up
+ * @param origin  The corner of the current cube
+ * @param level   The current cube is 2^level chunks wide
+ * @param out     The first and last position of every cube */
+void
+morton_ranges (const aabb<chunk_coordinates>& box, const uint64_t origin[3],
+               unsigned int level,
+               std::vector<std::pair<chunk_coordinates, chunk_coordinates>>& out)
+{
+    const uint64_t size (uint64_t(1) << level);
+    bool inside (true);
+    for (int i (0); i < 3; ++i)
+    {
+        if (origin[i] >= box.second[i] || origin[i] + size <= box.first[i])
+            return;
+
+        if (origin[i] < box.first[i] || origin[i] + size > box.second[i])
+            inside = false;
+    }
+
+    if (inside)
+    {
+        out.emplace_back(chunk_coordinates(origin[0], origin[1], origin[2]),
+                         chunk_coordinates(origin[0] + size - 1,
+                                           origin[1] + size - 1,
+                                           origin[2] + size - 1));
+        return;
+    }
+
+    // The x coordinate ends up in the most significant bit of every
+    // triplet, so this visits the children in Z-order.
+    const uint64_t half (size / 2);
+    for (int c (0); c < 8; ++c)
+    {
+        const uint64_t child[3] { origin[0] + (c >> 2 & 1) * half,
+                                  origin[1] + (c >> 1 & 1) * half,
+                                  origin[2] + (c & 1) * half };
+
+        morton_ranges(box, child, level - 1, out);
+    }
+}
+
+/** Serialize an object straight into a string, which saves a copy when
+ *  it's handed to LevelDB. */
+template <typename obj>
+std::string serialize_to_string (const obj& o)
+{
+    std::string result;
+    make_serializer(result)(o);
+    return result;
+}
+
+}
+
+persistence_leveldb::persistence_leveldb(const fs::path& db_file,
+                                         size_t max_backlog,
+                                         size_t max_missing,
+                                         key_layout new_layout)
+    : layout_ (key_layout::legacy)
+    , max_backlog_ (std::max<size_t>(max_backlog, 1))
+    , max_missing_ (max_missing)
+    , batches_written_ (0)
+    , transaction_depth_ (0)
+    , flush_requested_ (false)
+    , quit_ (false)
 {
     options_.create_if_missing = true;
     options_.filter_policy = leveldb::NewBloomFilterPolicy(10);
@@ -57,53 +200,334 @@ persistence_leveldb::persistence_leveldb(const fs::path& db_file)
     leveldb::DB* tmp;
     check(leveldb::DB::Open(options_, db_file.string(), &tmp));
     db_.reset(tmp);
+
+    std::string layout_name;
+    auto rc (db_->Get(leveldb::ReadOptions(), layout_key, &layout_name));
+    if (rc.ok())
+    {
+        if (layout_name == "morton")
+            layout_ = key_layout::morton;
+        else if (layout_name != "legacy")
+            throw std::runtime_error("persistence_leveldb: unknown key layout " + layout_name);
+    }
+    else
+    {
+        if (!rc.IsNotFound())
+            check(rc);
+
+        // Databases that were made before the layout was recorded are
+        // always in the legacy format.
+        std::unique_ptr<leveldb::Iterator> iter (db_->NewIterator(leveldb::ReadOptions()));
+        iter->SeekToFirst();
+        if (!iter->Valid())
+            layout_ = new_layout;
+
+        layout_name = layout_ == key_layout::morton ? "morton" : "legacy";
+        check(db_->Put(leveldb::WriteOptions(), layout_key, layout_name));
+    }
+
+    writer_ = std::thread([=]{ write_loop(); });
 }
 
 persistence_leveldb::~persistence_leveldb()
 {
-    db_ = nullptr;
-    delete options_.filter_policy;
+    try
+    {
+        close();
+    }
+    catch (std::exception& e)
+    {
+        log_msg("persistence_leveldb: could not write queue on close, %1%", e.what());
+    }
 }
 
 void
 persistence_leveldb::close()
 {
+    if (writer_.joinable())
+    {
+        {
+        std::lock_guard<std::mutex> lock (queue_lock_);
+        quit_ = true;
+        }
+        queue_filled_.notify_one();
+        writer_.join();
+    }
+
     db_ = nullptr;
     delete options_.filter_policy;
     options_.filter_policy = nullptr;
+
+    std::lock_guard<std::mutex> lock (queue_lock_);
+    check_write_error();
 }
 
-void
-persistence_leveldb::store (data_type type, chunk_coordinates xyz,
-                            const compressed_data& data)
+std::string
+persistence_leveldb::make_key (data_type type, chunk_coordinates xyz) const
 {
+    if (layout_ == key_layout::morton)
+    {
+        uint8_t key[1 + morton_code_size];
+        key[0] = static_cast<uint8_t>(type);
+        morton_encode(xyz, key + 1);
+
+        return std::string(reinterpret_cast<const char*>(key), sizeof(key));
+    }
+
     uint32_t key[4];
     key[0] = type;
     key[1] = xyz.x;
     key[2] = xyz.y;
     key[3] = xyz.z;
 
-    auto serialized (serialize(data));
-    leveldb::Slice db_key   (reinterpret_cast<const char*>(key), sizeof(key));
-    leveldb::Slice db_value (reinterpret_cast<const char*>(&*serialized.begin()), serialized.size());
-
-    check(db_->Put(leveldb::WriteOptions(), db_key, db_value));
+    return std::string(reinterpret_cast<const char*>(key), sizeof(key));
 }
 
-void
-persistence_leveldb::store (map_coordinates xy, chunk_height z)
+std::string
+persistence_leveldb::make_key (map_coordinates xy) const
 {
+    if (layout_ == key_layout::morton)
+    {
+        uint8_t key[1 + sizeof(uint64_t)];
+        key[0] = static_cast<uint8_t>(cnk_height);
+        uint64_t code (morton_encode(xy));
+        for (int i (sizeof(uint64_t)); i > 0; --i, code >>= 8)
+            key[i] = static_cast<uint8_t>(code);
+
+        return std::string(reinterpret_cast<const char*>(key), sizeof(key));
+    }
+
     uint32_t key[3];
-    key[0] = data_type::cnk_height;
+    key[0] = cnk_height;
     key[1] = xy.x;
     key[2] = xy.y;
 
-    auto ser (serialize(z));
+    return std::string(reinterpret_cast<const char*>(key), sizeof(key));
+}
 
-    leveldb::Slice db_key   (reinterpret_cast<const char*>(key), sizeof(key));
-    leveldb::Slice db_value (reinterpret_cast<const char*>(&*ser.begin()), ser.size());
+void
+persistence_leveldb::cleanup()
+{
+    {
+    std::lock_guard<std::mutex> lock (queue_lock_);
+    flush_requested_ = true;
+    }
+    queue_filled_.notify_one();
+}
 
-    check(db_->Put(leveldb::WriteOptions(), db_key, db_value));
+void
+persistence_leveldb::flush()
+{
+    std::unique_lock<std::mutex> lock (queue_lock_);
+    flush_requested_ = true;
+    queue_filled_.notify_one();
+    queue_drained_.wait(lock, [&]{ return    write_error_
+                                          || (pending_.empty() && in_flight_.empty()); });
+    check_write_error();
+    lock.unlock();
+
+    // The background thread doesn't sync its batches.  An empty batch
+    // with the sync flag set forces the log file to disk.
+    write_batch(write_queue(), true);
+}
+
+void
+persistence_leveldb::begin_transaction()
+{
+    std::lock_guard<std::mutex> lock (queue_lock_);
+    ++transaction_depth_;
+}
+
+void
+persistence_leveldb::end_transaction()
+{
+    {
+    std::lock_guard<std::mutex> lock (queue_lock_);
+    assert(transaction_depth_ > 0);
+    --transaction_depth_;
+    }
+    queue_filled_.notify_one();
+    queue_drained_.notify_all();
+}
+
+//---------------------------------------------------------------------------
+
+size_t
+persistence_leveldb::batch_threshold() const
+{
+    return std::min(batch_size, max_backlog_);
+}
+
+void
+persistence_leveldb::put (std::string&& key, std::string&& value)
+{
+    std::unique_lock<std::mutex> lock (queue_lock_);
+    check_write_error();
+
+    // Apply back pressure if the background thread can't keep up.  This
+    // doesn't apply inside transactions, since the queue won't be
+    // written until the transaction is finished.
+    queue_drained_.wait(lock, [&]{ return    pending_.size() < max_backlog_
+                                          || transaction_depth_ > 0
+                                          || pending_.count(key)
+                                          || write_error_; });
+    check_write_error();
+
+    missing_.remove(key);
+    pending_[std::move(key)] = std::move(value);
+    if (pending_.size() >= batch_threshold() && transaction_depth_ == 0)
+        queue_filled_.notify_one();
+}
+
+bool
+persistence_leveldb::find_queued (const std::string& key, std::string& value)
+{
+    auto found (pending_.find(key));
+    if (found != pending_.end())
+    {
+        value = found->second;
+        return true;
+    }
+
+    found = in_flight_.find(key);
+    if (found != in_flight_.end())
+    {
+        value = found->second;
+        return true;
+    }
+
+    return false;
+}
+
+void
+persistence_leveldb::remember_missing (const std::string& key,
+                                       uint64_t generation)
+{
+    // If the key was queued or written in the meantime, it might have
+    // been stored after we looked it up.  A queued key may already have
+    // moved on to the batch that is being written, so check both.
+    if (   generation != batches_written_
+        || pending_.count(key)
+        || in_flight_.count(key))
+    {
+        return;
+    }
+
+    missing_[key] = true;
+    missing_.prune(max_missing_);
+}
+
+bool
+persistence_leveldb::get (const std::string& key, std::string& value)
+{
+    uint64_t generation;
+    {
+    std::lock_guard<std::mutex> lock (queue_lock_);
+    if (find_queued(key, value))
+        return true;
+
+    if (missing_.try_get(key))
+        return false;
+
+    generation = batches_written_;
+    }
+
+    auto rc (db_->Get(leveldb::ReadOptions(), key, &value));
+    if (rc.IsNotFound())
+    {
+        std::lock_guard<std::mutex> lock (queue_lock_);
+        remember_missing(key, generation);
+        return false;
+    }
+
+    check(rc);
+    return true;
+}
+
+void
+persistence_leveldb::write_loop()
+{
+    std::unique_lock<std::mutex> lock (queue_lock_);
+    for (;;)
+    {
+        queue_filled_.wait_for(lock, flush_interval, [&]
+        {
+            return    quit_
+                   || (transaction_depth_ == 0
+                       && (flush_requested_ || pending_.size() >= batch_threshold()));
+        });
+
+        // Don't split a transaction over several batches.  When it's
+        // time to quit, write what we have regardless.
+        if (transaction_depth_ > 0 && !quit_)
+            continue;
+
+        if (!pending_.empty())
+        {
+            // Readers can still find the values in in_flight_ while the
+            // batch is being written.
+            in_flight_.swap(pending_);
+            queue_drained_.notify_all();
+
+            bool sync (quit_);
+            lock.unlock();
+            try
+            {
+                write_batch(in_flight_, sync);
+            }
+            catch (...)
+            {
+                log_msg("persistence_leveldb: could not write batch");
+                lock.lock();
+                write_error_ = std::current_exception();
+                queue_drained_.notify_all();
+                break;
+            }
+            lock.lock();
+            in_flight_.clear();
+            ++batches_written_;
+        }
+
+        flush_requested_ = false;
+        queue_drained_.notify_all();
+
+        if (quit_ && pending_.empty())
+            break;
+    }
+}
+
+void
+persistence_leveldb::write_batch (const write_queue& queue, bool sync)
+{
+    leveldb::WriteBatch batch;
+    for (auto& kv : queue)
+        batch.Put(kv.first, kv.second);
+
+    leveldb::WriteOptions opt;
+    opt.sync = sync;
+    check(db_->Write(opt, &batch));
+}
+
+void
+persistence_leveldb::check_write_error()
+{
+    if (write_error_)
+        std::rethrow_exception(write_error_);
+}
+
+//---------------------------------------------------------------------------
+
+void
+persistence_leveldb::store (data_type type, chunk_coordinates xyz,
+                            const compressed_data& data)
+{
+    put(make_key(type, xyz), serialize_to_string(data));
+}
+
+void
+persistence_leveldb::store (map_coordinates xy, chunk_height z)
+{
+    put(make_key(xy), serialize_to_string(z));
 }
 
 //---------------------------------------------------------------------------
@@ -111,16 +535,9 @@ persistence_leveldb::store (map_coordinates xy, chunk_height z)
 compressed_data
 persistence_leveldb::retrieve (data_type type, chunk_coordinates xyz)
 {
-    uint32_t key[4];
-    key[0] = type;
-    key[1] = xyz.x;
-    key[2] = xyz.y;
-    key[3] = xyz.z;
-
-    leveldb::Slice db_key (reinterpret_cast<const char*>(key), sizeof(key));
     std::string result;
-
-    check(db_->Get(leveldb::ReadOptions(), db_key, &result));
+    if (!get(make_key(type, xyz), result))
+        throw not_in_storage_error("persistence_leveldb");
 
     return deserialize_as<compressed_data>(result);
 }
@@ -128,14 +545,10 @@ persistence_leveldb::retrieve (data_type type, chunk_coordinates xyz)
 chunk_height
 persistence_leveldb::retrieve (map_coordinates xy)
 {
-    uint32_t key[3];
-    key[0] = data_type::cnk_height;
-    key[1] = xy.x;
-    key[2] = xy.y;
-
-    leveldb::Slice db_key (reinterpret_cast<const char*>(key), sizeof(key));
     std::string result;
-    check(db_->Get(leveldb::ReadOptions(), db_key, &result));
+    if (!get(make_key(xy), result))
+        throw not_in_storage_error("persistence_leveldb");
+
     assert(result.size() == sizeof(chunk_height));
 
     return deserialize_as<chunk_height>(result);
@@ -143,37 +556,203 @@ persistence_leveldb::retrieve (map_coordinates xy)
 
 //---------------------------------------------------------------------------
 
-bool
-persistence_leveldb::is_available (data_type type, chunk_coordinates xyz)
+boost::optional<compressed_data>
+persistence_leveldb::try_retrieve (data_type type, chunk_coordinates xyz)
 {
-    uint32_t key[4];
-    key[0] = type;
-    key[1] = xyz.x;
-    key[2] = xyz.y;
-    key[3] = xyz.z;
+    std::string result;
+    if (!get(make_key(type, xyz), result))
+        return boost::none;
 
-    leveldb::Slice db_key (reinterpret_cast<const char*>(key), sizeof(key));
+    return deserialize_as<compressed_data>(result);
+}
+
+boost::optional<chunk_height>
+persistence_leveldb::try_retrieve (map_coordinates xy)
+{
     std::string result;
+    if (!get(make_key(xy), result))
+        return boost::none;
+
+    return deserialize_as<chunk_height>(result);
+}
+
+std::vector<boost::optional<compressed_data>>
+persistence_leveldb::try_retrieve (data_type type,
+                                   const std::vector<chunk_coordinates>& list)
+{
+    std::vector<boost::optional<compressed_data>> result (list.size());
+    std::vector<std::pair<std::string, size_t>> lookup;
+    uint64_t generation;
 
-    auto rc (db_->Get(leveldb::ReadOptions(), db_key, &result));
+    {
+    std::lock_guard<std::mutex> lock (queue_lock_);
+    std::string value;
+    for (size_t i (0); i < list.size(); ++i)
+    {
+        auto key (make_key(type, list[i]));
+        if (find_queued(key, value))
+            result[i] = deserialize_as<compressed_data>(value);
+        else if (!missing_.try_get(key))
+            lookup.emplace_back(std::move(key), i);
+    }
+    generation = batches_written_;
+    }
 
-    return !rc.IsNotFound();
+    if (lookup.empty())
+        return result;
+
+    std::sort(lookup.begin(), lookup.end());
+    std::unique_ptr<leveldb::Iterator> iter (db_->NewIterator(leveldb::ReadOptions()));
+    std::vector<std::string> not_found;
+    for (auto& l : lookup)
+    {
+        iter->Seek(l.first);
+        if (iter->Valid() && iter->key().compare(l.first) == 0)
+            result[l.second] = deserialize_as<compressed_data>(iter->value().ToString());
+        else
+            not_found.emplace_back(std::move(l.first));
+    }
+    check(iter->status());
+
+    std::lock_guard<std::mutex> lock (queue_lock_);
+    for (auto& key : not_found)
+        remember_missing(key, generation);
+
+    return result;
 }
 
-bool
-persistence_leveldb::is_available (map_coordinates xy)
+void
+persistence_leveldb::for_each_in_region (data_type type,
+                                         const aabb<chunk_coordinates>& box,
+                                         region_callback op)
 {
-    uint32_t key[3];
-    key[0] = data_type::cnk_height;
-    key[1] = xy.x;
-    key[2] = xy.y;
+    if (layout_ != key_layout::morton)
+    {
+        persistent_storage_i::for_each_in_region(type, box, op);
+        return;
+    }
 
-    leveldb::Slice db_key (reinterpret_cast<const char*>(key), sizeof(key));
-    std::string result;
+    if (!box.is_correct())
+        return;
 
-    auto rc (db_->Get(leveldb::ReadOptions(), db_key, &result));
+    auto in_box ([&](const decoded_key& k)
+    {
+        return    k.kind == key_kind::terrain && k.type == uint32_t(type)
+               && k.pos.x >= box.first.x && k.pos.x < box.second.x
+               && k.pos.y >= box.first.y && k.pos.y < box.second.y
+               && k.pos.z >= box.first.z && k.pos.z < box.second.z;
+    });
+
+    // Queued writes take precedence over the database.  The pending
+    // queue goes last, since it holds the newest values.
+    std::map<std::string, std::pair<chunk_coordinates, std::string>> queued;
+    {
+    std::lock_guard<std::mutex> lock (queue_lock_);
+    for (auto q : { &in_flight_, &pending_ })
+    {
+        for (auto& kv : *q)
+        {
+            auto k (decode_key(layout_, kv.first));
+            if (in_box(k))
+                queued[kv.first] = std::make_pair(k.pos, kv.second);
+        }
+    }
+    }
+
+    // Find the smallest aligned cube that contains the whole box.
+    unsigned int level (0);
+    for (; level < 32; ++level)
+    {
+        if (   box.first.x >> level == (box.second.x - 1) >> level
+            && box.first.y >> level == (box.second.y - 1) >> level
+            && box.first.z >> level == (box.second.z - 1) >> level)
+            break;
+    }
+    const uint64_t mask (~((uint64_t(1) << level) - 1));
+    const uint64_t origin[3] { box.first.x & mask, box.first.y & mask,
+                               box.first.z & mask };
 
-    return !rc.IsNotFound();
+    std::vector<std::pair<chunk_coordinates, chunk_coordinates>> ranges;
+    morton_ranges(box, origin, level, ranges);
+
+    std::unique_ptr<leveldb::Iterator> iter (db_->NewIterator(leveldb::ReadOptions()));
+    for (auto& r : ranges)
+    {
+        auto last (make_key(type, r.second));
+        for (iter->Seek(make_key(type, r.first));
+             iter->Valid() && iter->key().compare(last) <= 0;
+             iter->Next())
+        {
+            if (queued.count(iter->key().ToString()))
+                continue;
+
+            auto pos (morton_decode(reinterpret_cast<const uint8_t*>(iter->key().data()) + 1));
+            op(pos, deserialize_as<compressed_data>(iter->value().ToString()));
+        }
+    }
+    check(iter->status());
+
+    for (auto& kv : queued)
+        op(kv.second.first, deserialize_as<compressed_data>(kv.second.second));
+}
+
+size_t
+persistence_leveldb::import (persistence_leveldb& source,
+                             std::function<void(size_t)> progress)
+{
+    source.flush();
+
+    size_t count (0);
+    std::unique_ptr<leveldb::Iterator> iter (source.db_->NewIterator(leveldb::ReadOptions()));
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next())
+    {
+        auto k (decode_key(source.layout_, iter->key()));
+        switch (k.kind)
+        {
+        case key_kind::terrain:
+            put(make_key(static_cast<data_type>(k.type), k.pos),
+                iter->value().ToString());
+            break;
+
+        case key_kind::height:
+            put(make_key(map_coordinates(k.pos.x, k.pos.y)),
+                iter->value().ToString());
+            break;
+
+        case key_kind::entity:
+            put(iter->key().ToString(), iter->value().ToString());
+            break;
+
+        default:
+            continue;
+        }
+
+        if (++count % 10000 == 0 && progress)
+            progress(count);
+    }
+    check(iter->status());
+
+    flush();
+    if (progress)
+        progress(count);
+
+    return count;
+}
+
+//---------------------------------------------------------------------------
+
+bool
+persistence_leveldb::is_available (data_type type, chunk_coordinates xyz)
+{
+    std::string result;
+    return get(make_key(type, xyz), result);
+}
+
+bool
+persistence_leveldb::is_available (map_coordinates xy)
+{
+    std::string result;
+    return get(make_key(xy), result);
 }
 
 //---------------------------------------------------------------------------
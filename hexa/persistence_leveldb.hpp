@@ -22,22 +22,70 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <boost/thread/mutex.hpp>
 #include <boost/filesystem/path.hpp>
 #include <leveldb/db.h>
+#include "lru_cache.hpp"
 #include "persistent_storage_i.hpp"
 
 
 namespace hexa {
 
-/** Stores the terrain in an leveldb database. */
+/** Stores the terrain in an leveldb database.
+ *  Terrain data is not written to the database right away.  Calls to
+ *  store() are put in a queue, where repeated writes to the same key
+ *  replace each other.  A background thread writes the queue to the
+ *  database as a single leveldb::WriteBatch whenever it grows large
+ *  enough, or every couple of milliseconds.  Reads check the queue
+ *  before going to the database, so the delay is invisible to the rest
+ *  of the program.
+ *
+ *  All writes made between begin_transaction() and end_transaction()
+ *  end up in the same batch.  Entities are still written directly.
+ *
+ *  Keys that turned out not to be in the database are remembered, so
+ *  asking for the same missing chunk again doesn't hit the disk.
+ *
+ *  New databases store terrain data under the Morton code of its
+ *  position, so neighboring chunks end up close to each other on disk.
+ *  Databases made by older versions keep using the old layout until
+ *  they are converted with import(). */
 class persistence_leveldb : public persistent_storage_i
 {
+public:
+    /** How the keys of terrain data are laid out in the database. */
+    enum class key_layout
+    {
+        /** {type, x, y, z} as host-endian 32-bit integers. */
+        legacy,
+        /** A type byte, followed by the big-endian Morton code of the
+         *  position. */
+        morton
+    };
+
 public:
     /** Constructor.
-     * @param db_file  The database file */
-    persistence_leveldb(const boost::filesystem::path& db_file = "world.leveldb");
+     * @param db_file      The database file
+     * @param max_backlog  The maximum number of queued writes; store()
+     *                     blocks until the background thread catches up
+     *                     if the queue grows beyond this.
+     * @param max_missing  The number of missing keys to remember
+     * @param new_layout   The key layout to use if the database is
+     *                     created from scratch.  Existing databases
+     *                     always keep their layout. */
+    persistence_leveldb(const boost::filesystem::path& db_file = "world.leveldb",
+                        size_t max_backlog = 8192,
+                        size_t max_missing = 65536,
+                        key_layout new_layout = key_layout::morton);
 
     ~persistence_leveldb();
 
@@ -51,6 +99,18 @@ public:
     bool is_available (data_type type, chunk_coordinates xyz) override;
     bool is_available (map_coordinates xy) override;
 
+    boost::optional<compressed_data>
+         try_retrieve (data_type type, chunk_coordinates xyz) override;
+    boost::optional<chunk_height>
+         try_retrieve (map_coordinates xy) override;
+
+    /** Fetch a list of elements.
+     *  The keys are looked up in sorted order with a single iterator, so
+     *  LevelDB only has to load every block once. */
+    std::vector<boost::optional<compressed_data>>
+         try_retrieve (data_type type,
+                       const std::vector<chunk_coordinates>& list) override;
+
 
     void store (const es::storage& es) override;
     void store (const es::storage& es, es::storage::iterator i) override;
@@ -58,11 +118,109 @@ public:
     void retrieve (es::storage& es, es::entity entity_id) override;
     bool is_available (es::entity entity_id) override;
 
+    /** Visit every stored element of a given type inside a box.
+     *  With the Morton layout, the box is split into aligned cubes that
+     *  each map onto a single range of keys, and these ranges are
+     *  scanned in order. */
+    void for_each_in_region (data_type type,
+                             const aabb<chunk_coordinates>& box,
+                             region_callback op) override;
+
+    /** The key layout of this database. */
+    key_layout layout() const { return layout_; }
+
+    /** Copy all data from another database into this one.
+     *  The keys are converted to the layout of this database along the
+     *  way.  This is used to migrate old databases to the new layout.
+     * @param source    The database to copy from
+     * @param progress  If set, this is called with the number of
+     *                  copied records every now and then
+     * @return The number of records that were copied */
+    size_t import (persistence_leveldb& source,
+                   std::function<void(size_t)> progress = nullptr);
+
+    /** Wake up the background thread, so it writes the queue to disk. */
+    void cleanup() override;
+
+    /** Block until all queued writes have been synced to disk.
+     *  Don't call this from inside a transaction.
+     * @throw std::runtime_error if the background thread failed to
+     *        write a batch */
+    void flush();
+
+    /** Flush the queue and close the database. */
     void close();
 
+protected:
+    void begin_transaction() override;
+    void end_transaction() override;
+
+private:
+    typedef std::map<std::string, std::string> write_queue;
+
+    std::string make_key (data_type type, chunk_coordinates xyz) const;
+    std::string make_key (map_coordinates xy) const;
+
+    /** The queue length at which the background thread writes a batch.
+     *  This is never more than the backlog limit, or writers that hit
+     *  the limit would wait for a batch that never comes. */
+    size_t batch_threshold() const;
+
+    /** Put a key/value pair in the write queue. */
+    void put (std::string&& key, std::string&& value);
+
+    /** Look up a key in the write queue.
+     *  The caller must hold queue_lock_.
+     * @return True if the key was found, its value is stored in
+     *         \a value in that case. */
+    bool find_queued (const std::string& key, std::string& value);
+
+    /** Remember that a key is not in the database.
+     *  The caller must hold queue_lock_.
+     * @param key         The missing key
+     * @param generation  The value of batches_written_ before the
+     *                    database was checked */
+    void remember_missing (const std::string& key, uint64_t generation);
+
+    /** Look up a key in the write queue, and in the database.
+     * @return True if the key was found */
+    bool get (const std::string& key, std::string& value);
+
+    /** The main loop of the background thread. */
+    void write_loop();
+
+    /** Write the contents of a queue as a single batch. */
+    void write_batch (const write_queue& queue, bool sync);
+
+    /** Throw the error the background thread ran into, if any.
+     *  The caller must hold queue_lock_. */
+    void check_write_error();
+
 private:
     std::unique_ptr<leveldb::DB>    db_;
     leveldb::Options                options_;
+    key_layout                      layout_;
+
+    std::mutex                      queue_lock_;
+    /** Wakes up the background thread. */
+    std::condition_variable         queue_filled_;
+    /** Signals that (part of) the queue has been written. */
+    std::condition_variable         queue_drained_;
+    /** Writes that are waiting for the background thread. */
+    write_queue                     pending_;
+    /** The batch that is currently being written. */
+    write_queue                     in_flight_;
+    size_t                          max_backlog_;
+    /** Keys known to be missing from the database. */
+    lru_cache<std::string, bool>    missing_;
+    size_t                          max_missing_;
+    /** Incremented every time a batch has been written. */
+    uint64_t                        batches_written_;
+    int                             transaction_depth_;
+    bool                            flush_requested_;
+    bool                            quit_;
+    std::exception_ptr              write_error_;
+    std::thread                     writer_;
 };
 
 } // namespace hexa
@@ -52,6 +52,19 @@ public:
         { return false; }
 
 
+    boost::optional<compressed_data>
+        try_retrieve (data_type type, chunk_coordinates xyz) override
+        { return boost::none; }
+
+    boost::optional<chunk_height> try_retrieve (map_coordinates xy) override
+        { return boost::none; }
+
+    std::vector<boost::optional<compressed_data>>
+        try_retrieve (data_type type,
+                      const std::vector<chunk_coordinates>& list) override
+        { return std::vector<boost::optional<compressed_data>>(list.size()); }
+
+
     void store (const es::storage& es) override { }
 
     void store (const es::storage& es, es::storage::iterator entity) override { }
@@ -0,0 +1,664 @@
+//---------------------------------------------------------------------------
+// persistence_regionfile.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "persistence_regionfile.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <boost/filesystem/operations.hpp>
+#include <boost/format.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <es/storage.hpp>
+
+#include "log.hpp"
+
+namespace fs = boost::filesystem;
+using boost::iostreams::mapped_file;
+
+namespace hexa {
+
+namespace {
+
+/** Regions are 2^4 = 16 chunks wide. */
+const uint32_t region_bits = 4;
+const uint32_t region_mask = (1 << region_bits) - 1;
+const uint32_t region_volume = 1 << (region_bits * 3);
+
+/** Height maps cover 64x64 columns. */
+const uint32_t height_map_bits = 6;
+const uint32_t height_map_mask = (1 << height_map_bits) - 1;
+const uint32_t height_map_area = 1 << (height_map_bits * 2);
+
+/** Area data, chunks, surfaces, and light maps. */
+const uint32_t nr_of_types = 4;
+
+const uint32_t sector_size = 256;
+const uint32_t format_version = 1;
+
+/** Files grow in steps of this size, to avoid remapping too often. */
+const uint64_t grow_step = 1 << 20;
+
+struct table_entry
+{
+    /** First sector of the element. */
+    uint32_t    sector;
+    /** Length in bytes, including the length prefix, or 0 if the
+     *  element isn't there. */
+    uint32_t    length;
+};
+
+struct file_header
+{
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    sector_size;
+    uint32_t    reserved;
+    table_entry table[nr_of_types][region_volume];
+};
+
+const uint32_t header_sectors
+    = (sizeof(file_header) + sector_size - 1) / sector_size;
+
+/** Every element starts with the unpacked length of the data. */
+const uint32_t element_prefix = sizeof(uint32_t);
+
+uint32_t sectors_for (uint32_t bytes)
+{
+    return (bytes + sector_size - 1) / sector_size;
+}
+
+void check_type (persistent_storage_i::data_type type)
+{
+    if (uint32_t(type) >= nr_of_types)
+        throw std::invalid_argument("persistence_regionfile: bad data type");
+}
+
+/** Map a file into memory, and make sure it is at least a given size. */
+std::shared_ptr<mapped_file>
+map_file (const fs::path& file, uint64_t min_size)
+{
+    if (!fs::exists(file))
+        std::ofstream create (file.string(), std::ios::binary);
+
+    if (fs::file_size(file) < min_size)
+        fs::resize_file(file, min_size);
+
+    auto result (std::make_shared<mapped_file>());
+    result->open(file.string(), mapped_file::readwrite);
+    if (!result->is_open())
+        throw std::runtime_error("persistence_regionfile: cannot map " + file.string());
+
+    return result;
+}
+
+uint32_t region_index (chunk_coordinates xyz)
+{
+    return   ((xyz.z & region_mask) << (region_bits * 2))
+           | ((xyz.y & region_mask) << region_bits)
+           |  (xyz.x & region_mask);
+}
+
+uint32_t height_map_index (map_coordinates xy)
+{
+    return ((xy.y & height_map_mask) << height_map_bits) | (xy.x & height_map_mask);
+}
+
+} // anonymous namespace
+
+//---------------------------------------------------------------------------
+
+/** A single region file. */
+class persistence_regionfile::region
+{
+public:
+    region (const fs::path& file)
+        : path_ (file)
+        , blobs_ (std::make_shared<char>(0))
+    {
+        bool is_new (!fs::exists(file));
+        map_ = map_file(file, grow_step);
+
+        if (is_new)
+        {
+            std::memset(map_->data(), 0, sizeof(file_header));
+            std::memcpy(header().magic, "HXRF", 4);
+            header().version = format_version;
+            header().sector_size = sector_size;
+        }
+        else if (   std::memcmp(header().magic, "HXRF", 4) != 0
+                 || header().version != format_version
+                 || header().sector_size != sector_size)
+        {
+            throw std::runtime_error("persistence_regionfile: " + file.string()
+                                     + " is not a region file");
+        }
+
+        // Rebuild the sector allocation map from the table.
+        used_.resize(header_sectors, true);
+        for (auto& type : header().table)
+        {
+            for (auto& e : type)
+            {
+                if (e.length == 0)
+                    continue;
+
+                auto end (e.sector + sectors_for(e.length));
+                if (end * uint64_t(sector_size) > map_->size())
+                    throw std::runtime_error("persistence_regionfile: corrupt table in " + file.string());
+
+                if (used_.size() < end)
+                    used_.resize(end, false);
+
+                std::fill(used_.begin() + e.sector, used_.begin() + end, true);
+            }
+        }
+    }
+
+    /** Check if anyone still holds a blob that points into the file. */
+    bool has_blobs() const
+    {
+        return blobs_.use_count() > 1;
+    }
+
+    boost::optional<mapped_blob> read (uint32_t type, uint32_t index)
+    {
+        std::lock_guard<std::mutex> lock (lock_);
+        auto& e (header().table[type][index]);
+        if (e.length == 0)
+            return boost::none;
+
+        const char* ptr (map_->const_data() + e.sector * uint64_t(sector_size));
+        uint32_t unpacked_len;
+        std::memcpy(&unpacked_len, ptr, sizeof(unpacked_len));
+
+        return mapped_blob(std::make_shared<blob_owner>(map_, blobs_),
+                           ptr + element_prefix, e.length - element_prefix,
+                           static_cast<uint16_t>(unpacked_len));
+    }
+
+    bool contains (uint32_t type, uint32_t index)
+    {
+        std::lock_guard<std::mutex> lock (lock_);
+        return header().table[type][index].length != 0;
+    }
+
+    void write (uint32_t type, uint32_t index, const compressed_data& data)
+    {
+        std::lock_guard<std::mutex> lock (lock_);
+
+        const uint32_t length (element_prefix + data.size());
+        const uint32_t needed (sectors_for(length));
+        auto& e (header().table[type][index]);
+
+        // If nobody is looking at the mapped data, freed sectors can be
+        // used again.  Otherwise, leave them alone until later, so the
+        // outstanding mapped_blobs keep pointing at valid data.  The
+        // mapping itself can't tell us this, since blobs from before the
+        // last grow() hold on to an older one.
+        const bool may_reuse (blobs_.use_count() == 1);
+
+        uint32_t start;
+        if (e.length != 0 && may_reuse && needed <= sectors_for(e.length))
+        {
+            start = e.sector;
+            free(start + needed, sectors_for(e.length) - needed);
+        }
+        else
+        {
+            if (e.length != 0)
+                free(e.sector, sectors_for(e.length));
+
+            start = allocate(needed, may_reuse);
+        }
+
+        char* ptr (map_->data() + start * uint64_t(sector_size));
+        uint32_t unpacked_len (data.unpacked_len);
+        std::memcpy(ptr, &unpacked_len, sizeof(unpacked_len));
+        if (!data.empty())
+            std::memcpy(ptr + element_prefix, data.ptr(), data.size());
+
+        // The table is updated last.  Unless the element was overwritten
+        // in place (which only happens if no blobs are outstanding), the
+        // sectors the old entry points to haven't been touched.
+        table_entry& entry (header().table[type][index]);
+        entry.sector = start;
+        entry.length = length;
+    }
+
+private:
+    /** Keeps a mapping alive, and counts as an outstanding blob. */
+    struct blob_owner
+    {
+        blob_owner (std::shared_ptr<mapped_file> m, std::shared_ptr<const void> t)
+            : map (std::move(m)), token (std::move(t))
+        { }
+
+        std::shared_ptr<mapped_file>    map;
+        std::shared_ptr<const void>     token;
+    };
+
+    file_header& header()
+    {
+        return *reinterpret_cast<file_header*>(map_->data());
+    }
+
+    void free (uint32_t start, uint32_t count)
+    {
+        std::fill(used_.begin() + start, used_.begin() + start + count, false);
+    }
+
+    uint32_t allocate (uint32_t count, bool may_reuse)
+    {
+        uint32_t start (used_.size());
+        if (may_reuse)
+        {
+            // First fit.
+            uint32_t run (0);
+            for (uint32_t i (header_sectors); i < used_.size(); ++i)
+            {
+                run = used_[i] ? 0 : run + 1;
+                if (run == count)
+                {
+                    start = i + 1 - count;
+                    break;
+                }
+            }
+        }
+
+        if (start + count > used_.size())
+        {
+            // Trailing free sectors can be used as well.
+            while (may_reuse && start > header_sectors && !used_[start - 1])
+                --start;
+
+            used_.resize(start + count, false);
+            grow((start + count) * uint64_t(sector_size));
+        }
+
+        std::fill(used_.begin() + start, used_.begin() + start + count, true);
+        return start;
+    }
+
+    void grow (uint64_t min_size)
+    {
+        if (min_size <= map_->size())
+            return;
+
+        uint64_t new_size ((min_size + grow_step - 1) / grow_step * grow_step);
+
+        // Outstanding mapped_blobs keep the old mapping alive; the new
+        // one is made next to it.
+        if (map_.use_count() == 1)
+            map_->close();
+
+        map_ = map_file(path_, new_size);
+    }
+
+private:
+    std::mutex                      lock_;
+    fs::path                        path_;
+    std::shared_ptr<mapped_file>    map_;
+    std::vector<bool>               used_;
+    /** Every mapped_blob handed out holds a reference to this, so its
+     *  use count tells how many of them are still around. */
+    std::shared_ptr<const void>     blobs_;
+};
+
+//---------------------------------------------------------------------------
+
+/** The coarse heights of 64x64 columns. */
+class persistence_regionfile::height_map
+{
+public:
+    height_map (const fs::path& file)
+        : map_ (map_file(file, height_map_area * sizeof(uint32_t)))
+    { }
+
+    /** Get the height of a column.
+     * @return The height, or undefined_height if it isn't there */
+    chunk_height get (uint32_t index)
+    {
+        std::lock_guard<std::mutex> lock (lock_);
+        uint32_t v;
+        std::memcpy(&v, map_->const_data() + index * sizeof(v), sizeof(v));
+
+        // 0 means there's nothing there, everything else is offset by one.
+        return v == 0 ? undefined_height : chunk_height(v - 1);
+    }
+
+    void set (uint32_t index, chunk_height h)
+    {
+        std::lock_guard<std::mutex> lock (lock_);
+        uint32_t v (uint32_t(h) + 1);
+        std::memcpy(map_->data() + index * sizeof(v), &v, sizeof(v));
+    }
+
+private:
+    std::mutex                      lock_;
+    std::shared_ptr<mapped_file>    map_;
+};
+
+//---------------------------------------------------------------------------
+
+compressed_data
+persistence_regionfile::mapped_blob::copy() const
+{
+    compressed_data result;
+    result.buf.assign(data_, data_ + size_);
+    result.unpacked_len = unpacked_len_;
+    return result;
+}
+
+//---------------------------------------------------------------------------
+
+persistence_regionfile::persistence_regionfile (const fs::path& dir,
+                                                size_t max_open_regions)
+    : dir_ (dir)
+    , max_open_ (max_open_regions)
+    , entities_loaded_ (false)
+{
+    if (!fs::is_directory(dir_) && !fs::create_directories(dir_))
+        throw std::runtime_error("persistence_regionfile: cannot create " + dir_.string());
+}
+
+persistence_regionfile::~persistence_regionfile()
+{
+    close();
+}
+
+void
+persistence_regionfile::close()
+{
+    std::lock_guard<std::mutex> lock (files_lock_);
+    regions_.clear();
+    retired_.clear();
+    height_maps_.clear();
+}
+
+void
+persistence_regionfile::cleanup()
+{
+    std::lock_guard<std::mutex> lock (files_lock_);
+    for (auto i (retired_.begin()); i != retired_.end(); )
+    {
+        if (i->second.use_count() == 1 && !i->second->has_blobs())
+            i = retired_.erase(i);
+        else
+            ++i;
+    }
+
+    // A region that is still in use can't be closed yet.  Opening its
+    // file a second time would give it a second allocation map, and
+    // sectors that the first one's blobs point to could be handed out
+    // again.
+    regions_.prune(max_open_, [&](const chunk_coordinates& pos,
+                                  std::shared_ptr<region>& r)
+    {
+        if (r && (r.use_count() > 1 || r->has_blobs()))
+            retired_.emplace(pos, std::move(r));
+    });
+    height_maps_.prune(max_open_);
+}
+
+std::shared_ptr<persistence_regionfile::region>
+persistence_regionfile::get_region (chunk_coordinates xyz, bool create)
+{
+    chunk_coordinates rpos (xyz.x >> region_bits, xyz.y >> region_bits,
+                            xyz.z >> region_bits);
+
+    std::lock_guard<std::mutex> lock (files_lock_);
+    auto found (regions_.try_get(rpos));
+    if (found && (*found || !create))
+        return *found;
+
+    std::shared_ptr<region> result;
+    auto retired (retired_.find(rpos));
+    if (retired != retired_.end())
+    {
+        result = std::move(retired->second);
+        retired_.erase(retired);
+        regions_[rpos] = result;
+        return result;
+    }
+
+    auto file (dir_ / (boost::format("r.%1%.%2%.%3%.hxr") % rpos.x % rpos.y % rpos.z).str());
+    if (create || fs::exists(file))
+        result = std::make_shared<region>(file);
+
+    regions_[rpos] = result;
+    return result;
+}
+
+std::shared_ptr<persistence_regionfile::height_map>
+persistence_regionfile::get_height_map (map_coordinates xy, bool create)
+{
+    map_coordinates hpos (xy.x >> height_map_bits, xy.y >> height_map_bits);
+
+    std::lock_guard<std::mutex> lock (files_lock_);
+    auto found (height_maps_.try_get(hpos));
+    if (found && (*found || !create))
+        return *found;
+
+    auto file (dir_ / (boost::format("h.%1%.%2%.hxh") % hpos.x % hpos.y).str());
+    std::shared_ptr<height_map> result;
+    if (create || fs::exists(file))
+        result = std::make_shared<height_map>(file);
+
+    height_maps_[hpos] = result;
+    return result;
+}
+
+//---------------------------------------------------------------------------
+
+void
+persistence_regionfile::store (data_type type, chunk_coordinates xyz,
+                               const compressed_data& data)
+{
+    check_type(type);
+    get_region(xyz, true)->write(type, region_index(xyz), data);
+}
+
+void
+persistence_regionfile::store (map_coordinates xy, chunk_height z)
+{
+    get_height_map(xy, true)->set(height_map_index(xy), z);
+}
+
+compressed_data
+persistence_regionfile::retrieve (data_type type, chunk_coordinates xyz)
+{
+    auto result (retrieve_mapped(type, xyz));
+    if (!result)
+        throw not_in_storage_error("persistence_regionfile");
+
+    return result->copy();
+}
+
+chunk_height
+persistence_regionfile::retrieve (map_coordinates xy)
+{
+    auto result (try_retrieve(xy));
+    if (!result)
+        throw not_in_storage_error("persistence_regionfile");
+
+    return *result;
+}
+
+bool
+persistence_regionfile::is_available (data_type type, chunk_coordinates xyz)
+{
+    check_type(type);
+    auto r (get_region(xyz, false));
+    return r && r->contains(type, region_index(xyz));
+}
+
+bool
+persistence_regionfile::is_available (map_coordinates xy)
+{
+    return try_retrieve(xy).is_initialized();
+}
+
+boost::optional<compressed_data>
+persistence_regionfile::try_retrieve (data_type type, chunk_coordinates xyz)
+{
+    auto result (retrieve_mapped(type, xyz));
+    if (!result)
+        return boost::none;
+
+    return result->copy();
+}
+
+boost::optional<chunk_height>
+persistence_regionfile::try_retrieve (map_coordinates xy)
+{
+    auto m (get_height_map(xy, false));
+    if (!m)
+        return boost::none;
+
+    auto h (m->get(height_map_index(xy)));
+    if (h == undefined_height)
+        return boost::none;
+
+    return h;
+}
+
+std::vector<boost::optional<compressed_data>>
+persistence_regionfile::try_retrieve (data_type type,
+                                      const std::vector<chunk_coordinates>& list)
+{
+    // Lookups are cheap enough as they are; there's nothing to batch.
+    std::vector<boost::optional<compressed_data>> result;
+    result.reserve(list.size());
+    for (auto& xyz : list)
+        result.emplace_back(try_retrieve(type, xyz));
+
+    return result;
+}
+
+boost::optional<persistence_regionfile::mapped_blob>
+persistence_regionfile::retrieve_mapped (data_type type, chunk_coordinates xyz)
+{
+    check_type(type);
+    auto r (get_region(xyz, false));
+    if (!r)
+        return boost::none;
+
+    return r->read(type, region_index(xyz));
+}
+
+//---------------------------------------------------------------------------
+
+void
+persistence_regionfile::load_entities()
+{
+    if (entities_loaded_)
+        return;
+
+    entities_loaded_ = true;
+    std::ifstream file ((dir_ / "entities.hxe").string(), std::ios::binary);
+    uint32_t header[2];
+    while (file.read(reinterpret_cast<char*>(header), sizeof(header)))
+    {
+        std::vector<char> buf (header[1]);
+        if (!buf.empty() && !file.read(&buf[0], buf.size()))
+            throw std::runtime_error("persistence_regionfile: entity file is truncated");
+
+        entities_[header[0]] = std::move(buf);
+    }
+}
+
+void
+persistence_regionfile::write_entities()
+{
+    // Write to a temporary file first, so a crash halfway through won't
+    // leave us without any entities at all.
+    auto file (dir_ / "entities.hxe");
+    auto temp (dir_ / "entities.hxe.tmp");
+    {
+    std::ofstream out (temp.string(), std::ios::binary | std::ios::trunc);
+    for (auto& e : entities_)
+    {
+        uint32_t header[2] { e.first, uint32_t(e.second.size()) };
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(e.second.data(), e.second.size());
+    }
+    if (!out)
+        throw std::runtime_error("persistence_regionfile: cannot write " + temp.string());
+    }
+    fs::rename(temp, file);
+}
+
+void
+persistence_regionfile::store (const es::storage& es)
+{
+    std::lock_guard<std::mutex> lock (entities_lock_);
+    load_entities();
+    for (auto i (es.begin()); i != es.end(); ++i)
+    {
+        auto& buf (entities_[i->first]);
+        buf.clear();
+        es.serialize(i, buf);
+    }
+    write_entities();
+}
+
+void
+persistence_regionfile::store (const es::storage& es, es::storage::iterator i)
+{
+    std::lock_guard<std::mutex> lock (entities_lock_);
+    load_entities();
+    auto& buf (entities_[i->first]);
+    buf.clear();
+    es.serialize(i, buf);
+    write_entities();
+}
+
+void
+persistence_regionfile::retrieve (es::storage& es)
+{
+    std::lock_guard<std::mutex> lock (entities_lock_);
+    load_entities();
+    for (auto& e : entities_)
+    {
+        if (!e.second.empty())
+            es.deserialize(es.make(e.first), e.second);
+    }
+}
+
+void
+persistence_regionfile::retrieve (es::storage& es, es::entity entity_id)
+{
+    std::lock_guard<std::mutex> lock (entities_lock_);
+    load_entities();
+    auto found (entities_.find(entity_id));
+    if (found != entities_.end() && !found->second.empty())
+        es.deserialize(es.make(entity_id), found->second);
+}
+
+bool
+persistence_regionfile::is_available (es::entity entity_id)
+{
+    std::lock_guard<std::mutex> lock (entities_lock_);
+    load_entities();
+    return entities_.count(entity_id) != 0;
+}
+
+} // namespace hexa
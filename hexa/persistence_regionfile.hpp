@@ -0,0 +1,154 @@
+//---------------------------------------------------------------------------
+/// \file   persistence_regionfile.hpp
+/// \brief  Store the game world in memory-mapped region files.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <boost/filesystem/path.hpp>
+#include <boost/optional.hpp>
+#include "clock_cache.hpp"
+#include "persistent_storage_i.hpp"
+
+namespace hexa {
+
+/** Stores the terrain in memory-mapped region files.
+ *  Every file holds the data of a 16x16x16 block of chunks.  It starts
+ *  with a table that gives the location and length of every element,
+ *  followed by the elements themselves, aligned to 256 byte sectors.
+ *  The coarse height map is stored in a separate set of files, one per
+ *  64x64 columns, and the entities in a single file.
+ *
+ *  Elements are read straight from the mapped file, so there is no
+ *  compaction going on in the background, and retrieve_mapped() can
+ *  hand out the compressed data without copying it at all.
+ *
+ *  Data ends up on disk whenever the operating system decides to write
+ *  back the mapped pages, or when the files are closed.  A crash of the
+ *  server won't lose anything, a crash of the machine might. */
+class persistence_regionfile : public persistent_storage_i
+{
+public:
+    /** Compressed data that lives inside a mapped region file.
+     *  The mapping is kept alive for as long as this object exists, and
+     *  the bytes it points to are never overwritten in the meantime. */
+    class mapped_blob
+    {
+    public:
+        mapped_blob (std::shared_ptr<const void> keep_alive,
+                     const char* data, size_t size, uint16_t unpacked_len)
+            : keep_alive_ (std::move(keep_alive))
+            , data_ (data), size_ (size), unpacked_len_ (unpacked_len)
+        { }
+
+        const char* data() const         { return data_; }
+        size_t      size() const         { return size_; }
+        uint16_t    unpacked_len() const { return unpacked_len_; }
+
+        /** Make a copy as a normal compressed_data object. */
+        compressed_data copy() const;
+
+    private:
+        std::shared_ptr<const void> keep_alive_;
+        const char*                 data_;
+        size_t                      size_;
+        uint16_t                    unpacked_len_;
+    };
+
+public:
+    /** Constructor.
+     * @param dir               The directory with the region files.  It
+     *                          is created if it doesn't exist yet.
+     * @param max_open_regions  Close region files if more than this
+     *                          number is opened */
+    persistence_regionfile (const boost::filesystem::path& dir,
+                            size_t max_open_regions = 256);
+
+    ~persistence_regionfile();
+
+    void store (data_type type, chunk_coordinates xyz,
+                const compressed_data& data) override;
+    void store (map_coordinates xy, chunk_height data) override;
+
+    compressed_data retrieve (data_type, chunk_coordinates xyz) override;
+    chunk_height    retrieve (map_coordinates xy) override;
+
+    bool is_available (data_type type, chunk_coordinates xyz) override;
+    bool is_available (map_coordinates xy) override;
+
+    boost::optional<compressed_data>
+         try_retrieve (data_type type, chunk_coordinates xyz) override;
+    boost::optional<chunk_height>
+         try_retrieve (map_coordinates xy) override;
+    std::vector<boost::optional<compressed_data>>
+         try_retrieve (data_type type,
+                       const std::vector<chunk_coordinates>& list) override;
+
+    /** Get an element without copying it out of the region file. */
+    boost::optional<mapped_blob>
+         retrieve_mapped (data_type type, chunk_coordinates xyz);
+
+    void store (const es::storage& es) override;
+    void store (const es::storage& es, es::storage::iterator i) override;
+    void retrieve (es::storage& es) override;
+    void retrieve (es::storage& es, es::entity entity_id) override;
+    bool is_available (es::entity entity_id) override;
+
+    /** Close the least recently used files if too many are open. */
+    void cleanup() override;
+
+    /** Close all files. */
+    void close();
+
+private:
+    class region;
+    class height_map;
+
+    std::shared_ptr<region>     get_region (chunk_coordinates xyz, bool create);
+    std::shared_ptr<height_map> get_height_map (map_coordinates xy, bool create);
+
+    void load_entities();
+    void write_entities();
+
+private:
+    boost::filesystem::path     dir_;
+    size_t                      max_open_;
+
+    std::mutex                  files_lock_;
+    /** Open region files.  Regions that don't have a file yet are
+     *  remembered with a null pointer. */
+    clock_cache<chunk_coordinates, std::shared_ptr<region>>    regions_;
+    /** Regions that were pruned while they were still in use.  They're
+     *  kept open until they aren't, and are reused if they're needed
+     *  again in the meantime. */
+    std::unordered_map<chunk_coordinates, std::shared_ptr<region>> retired_;
+    clock_cache<map_coordinates, std::shared_ptr<height_map>>  height_maps_;
+
+    std::mutex                  entities_lock_;
+    bool                        entities_loaded_;
+    std::map<uint32_t, std::vector<char>> entities_;
+};
+
+} // namespace hexa
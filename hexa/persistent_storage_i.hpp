@@ -22,8 +22,12 @@
 
 #pragma once
 
+#include <functional>
 #include <stdexcept>
+#include <vector>
+#include <boost/optional.hpp>
 #include <boost/thread/mutex.hpp>
+#include "aabb.hpp"
 #include "basic_types.hpp"
 #include "compression.hpp"
 #include "entity_system.hpp"
@@ -86,6 +90,79 @@ public:
         is_available (map_coordinates xy) = 0;
 
 
+    /** Fetch an element if it is in storage.
+     *  This saves a lookup compared to calling is_available() and
+     *  retrieve() in a row.  The default implementation does exactly
+     *  that, backends should override it if they can do better. */
+    virtual boost::optional<compressed_data>
+        try_retrieve (data_type type, chunk_coordinates xyz)
+    {
+        if (!is_available(type, xyz))
+            return boost::none;
+
+        return retrieve(type, xyz);
+    }
+
+    /** Fetch a coarse height if it is in storage. */
+    virtual boost::optional<chunk_height>
+        try_retrieve (map_coordinates xy)
+    {
+        if (!is_available(xy))
+            return boost::none;
+
+        return retrieve(xy);
+    }
+
+    /** Fetch a list of elements in one go.
+     * @param type  The type of data to look up
+     * @param list  The coordinates of the elements
+     * @return A list of the same length as \a list, with the elements
+     *         that are not in storage left empty. */
+    virtual std::vector<boost::optional<compressed_data>>
+        try_retrieve (data_type type, const std::vector<chunk_coordinates>& list)
+    {
+        std::vector<boost::optional<compressed_data>> result;
+        result.reserve(list.size());
+        for (auto& xyz : list)
+            result.emplace_back(try_retrieve(type, xyz));
+
+        return result;
+    }
+
+    /** Callback for for_each_in_region(). */
+    typedef std::function<void(chunk_coordinates, compressed_data&&)>
+            region_callback;
+
+    /** Visit every stored element of a given type inside a box.
+     *  The elements are visited in no particular order.  The default
+     *  implementation looks up every position in the box; backends
+     *  that keep their data in spatial order should override this.
+     * @param type  The type of data to look for
+     * @param box   The box, in chunk coordinates
+     * @param op    Called for every element that was found */
+    virtual void
+        for_each_in_region (data_type type, const aabb<chunk_coordinates>& box,
+                            region_callback op)
+    {
+        std::vector<chunk_coordinates> list;
+        for (auto z (box.first.z); z < box.second.z; ++z)
+        {
+            for (auto y (box.first.y); y < box.second.y; ++y)
+            {
+                for (auto x (box.first.x); x < box.second.x; ++x)
+                    list.emplace_back(x, y, z);
+            }
+        }
+
+        auto found (try_retrieve(type, list));
+        for (size_t i (0); i < list.size(); ++i)
+        {
+            if (found[i])
+                op(list[i], std::move(*found[i]));
+        }
+    }
+
+
 
     virtual void
         store (const es::storage& es) = 0;
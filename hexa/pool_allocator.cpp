@@ -0,0 +1,352 @@
+//---------------------------------------------------------------------------
+// pool_allocator.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "pool_allocator.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <new>
+
+namespace hexa {
+
+namespace {
+
+typedef boost::mutex::scoped_lock   guard;
+
+/** Blocks are aligned to this many bytes. */
+const size_t alignment (16);
+
+/** Try to make slabs at least this large. */
+const size_t slab_size (64 * 1024);
+
+size_t align (size_t bytes)
+{
+    return (bytes + alignment - 1) & ~(alignment - 1);
+}
+
+/** All slab pools, by block size.  The pools are never destroyed, so
+ *  objects with static storage can still free their memory when the
+ *  program ends. */
+struct pool_registry
+{
+    boost::mutex                    lock;
+    std::map<size_t, slab_pool*>    pools;
+};
+
+pool_registry& registry()
+{
+    static pool_registry* r (new pool_registry);
+    return *r;
+}
+
+} // anonymous namespace
+
+//---------------------------------------------------------------------------
+
+slab_pool&
+slab_pool::get (size_t block_size)
+{
+    auto& r (registry());
+    guard lock (r.lock);
+    auto& p (r.pools[block_size]);
+    if (p == nullptr)
+        p = new slab_pool(block_size);
+
+    return *p;
+}
+
+slab_pool::slab_pool (size_t block_size)
+    : block_size_         (block_size)
+    , stride_             (align(sizeof(header)) + align(block_size))
+    , blocks_per_slab_    (std::max<size_t>(4, slab_size / stride_))
+    , available_          (nullptr)
+    , empty_slabs_        (0)
+    , slabs_              (0)
+    , allocations_        (0)
+    , system_allocations_ (0)
+    , in_use_             (0)
+{ }
+
+void*
+slab_pool::allocate()
+{
+    guard lock (lock_);
+    if (available_ == nullptr)
+        available_ = new_slab();
+
+    slab* s (available_);
+    if (s->used == 0)
+        --empty_slabs_;
+
+    header* h (s->free);
+    s->free = h->next_free;
+    ++s->used;
+    if (s->free == nullptr)
+        unlink(s);
+
+    ++allocations_;
+    ++in_use_;
+
+    return reinterpret_cast<char*>(h) + align(sizeof(header));
+}
+
+void
+slab_pool::deallocate (void* ptr)
+{
+    if (ptr == nullptr)
+        return;
+
+    header* h (reinterpret_cast<header*>(static_cast<char*>(ptr)
+                                         - align(sizeof(header))));
+    slab* s (h->owner);
+
+    guard lock (lock_);
+    assert(s->used > 0);
+    if (s->free == nullptr)
+    {
+        // The slab was full, so it's available again.
+        s->prev = nullptr;
+        s->next = available_;
+        if (available_)
+            available_->prev = s;
+
+        available_ = s;
+    }
+    h->next_free = s->free;
+    s->free = h;
+    --s->used;
+    --in_use_;
+
+    if (s->used == 0)
+    {
+        // Keep one empty slab around, give the rest back.
+        if (empty_slabs_ > 0)
+        {
+            unlink(s);
+            ::operator delete(s);
+            --slabs_;
+        }
+        else
+        {
+            ++empty_slabs_;
+        }
+    }
+}
+
+allocator_statistics
+slab_pool::stats() const
+{
+    guard lock (lock_);
+    allocator_statistics result;
+    result.name = std::to_string(block_size_) + " byte blocks";
+    result.allocations = allocations_;
+    result.system_allocations = system_allocations_;
+    result.in_use = in_use_;
+    result.bytes_in_use = in_use_ * block_size_;
+    result.bytes_reserved = slabs_ * blocks_per_slab_ * stride_;
+
+    return result;
+}
+
+slab_pool::slab*
+slab_pool::new_slab()
+{
+    char* mem (static_cast<char*>(::operator new(align(sizeof(slab))
+                                                 + blocks_per_slab_ * stride_)));
+    slab* s (reinterpret_cast<slab*>(mem));
+    s->prev = nullptr;
+    s->next = nullptr;
+    s->free = nullptr;
+    s->used = 0;
+
+    // Thread the blocks on the free list back to front, so they are
+    // handed out in memory order.
+    char* first (mem + align(sizeof(slab)));
+    for (size_t i (blocks_per_slab_); i-- > 0; )
+    {
+        header* h (reinterpret_cast<header*>(first + i * stride_));
+        h->owner = s;
+        h->next_free = s->free;
+        s->free = h;
+    }
+
+    ++slabs_;
+    ++empty_slabs_;
+    ++system_allocations_;
+
+    return s;
+}
+
+void
+slab_pool::unlink (slab* s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        available_ = s->next;
+
+    if (s->next)
+        s->next->prev = s->prev;
+
+    s->prev = s->next = nullptr;
+}
+
+//---------------------------------------------------------------------------
+
+recycling_arena&
+recycling_arena::get()
+{
+    // Never destroyed, see pool_registry.
+    static recycling_arena* a (new recycling_arena);
+    return *a;
+}
+
+recycling_arena::recycling_arena()
+    : cached_bytes_       (0)
+    , allocations_        (0)
+    , system_allocations_ (0)
+    , in_use_             (0)
+    , bytes_in_use_       (0)
+{
+    free_.fill(nullptr);
+}
+
+unsigned int
+recycling_arena::size_class (size_t bytes)
+{
+    unsigned int c (0);
+    while ((size_t(1) << (c + min_class)) < bytes)
+        ++c;
+
+    return c;
+}
+
+void*
+recycling_arena::allocate (size_t bytes)
+{
+    if (bytes > max_size)
+    {
+        guard lock (lock_);
+        ++allocations_;
+        ++system_allocations_;
+        ++in_use_;
+        bytes_in_use_ += bytes;
+
+        return ::operator new(bytes);
+    }
+
+    const unsigned int c (size_class(bytes));
+    const size_t size (size_t(1) << (c + min_class));
+    {
+        guard lock (lock_);
+        ++allocations_;
+        ++in_use_;
+        bytes_in_use_ += size;
+
+        free_buffer* buf (free_[c]);
+        if (buf)
+        {
+            free_[c] = buf->next;
+            cached_bytes_ -= size;
+            return buf;
+        }
+        ++system_allocations_;
+    }
+
+    return ::operator new(size);
+}
+
+void
+recycling_arena::deallocate (void* ptr, size_t bytes)
+{
+    if (ptr == nullptr)
+        return;
+
+    if (bytes > max_size)
+    {
+        {
+        guard lock (lock_);
+        --in_use_;
+        bytes_in_use_ -= bytes;
+        }
+        ::operator delete(ptr);
+        return;
+    }
+
+    const unsigned int c (size_class(bytes));
+    const size_t size (size_t(1) << (c + min_class));
+    {
+        guard lock (lock_);
+        --in_use_;
+        bytes_in_use_ -= size;
+
+        if (cached_bytes_ + size <= cache_limit)
+        {
+            free_buffer* buf (static_cast<free_buffer*>(ptr));
+            buf->next = free_[c];
+            free_[c] = buf;
+            cached_bytes_ += size;
+            return;
+        }
+    }
+
+    ::operator delete(ptr);
+}
+
+allocator_statistics
+recycling_arena::stats() const
+{
+    guard lock (lock_);
+    allocator_statistics result;
+    result.name = "buffers";
+    result.allocations = allocations_;
+    result.system_allocations = system_allocations_;
+    result.in_use = in_use_;
+    result.bytes_in_use = bytes_in_use_;
+    result.bytes_reserved = bytes_in_use_ + cached_bytes_;
+
+    return result;
+}
+
+//---------------------------------------------------------------------------
+
+std::vector<allocator_statistics>
+allocator_stats()
+{
+    std::vector<slab_pool*> pools;
+    {
+    auto& r (registry());
+    guard lock (r.lock);
+    for (auto& p : r.pools)
+        pools.push_back(p.second);
+    }
+
+    std::vector<allocator_statistics> result;
+    for (auto p : pools)
+        result.push_back(p->stats());
+
+    result.push_back(recycling_arena::get().stats());
+
+    return result;
+}
+
+} // namespace hexa
@@ -0,0 +1,240 @@
+//---------------------------------------------------------------------------
+/// \file   pool_allocator.hpp
+/// \brief  Slab pools and a recycling arena for the game's data buffers.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
+namespace hexa {
+
+/** Usage counters of a slab pool or the recycling arena. */
+struct allocator_statistics
+{
+    std::string name;
+
+    /** Total number of allocations. */
+    size_t  allocations;
+    /** Number of times memory had to be requested from the system. */
+    size_t  system_allocations;
+    /** Number of blocks or buffers currently handed out. */
+    size_t  in_use;
+    /** Memory currently handed out, in bytes. */
+    size_t  bytes_in_use;
+    /** Memory held by the allocator, handed out or not, in bytes. */
+    size_t  bytes_reserved;
+};
+
+/** Hands out blocks of a fixed size.
+ *  The blocks are carved out of larger slabs.  A freed block goes back
+ *  to its slab, and is handed out again before anything else.  Slabs
+ *  that are completely free are returned to the system, except for one
+ *  that is kept around to absorb churn.
+ *
+ *  Pools are not created directly, use get() to find the shared pool
+ *  for a given block size.  All functions are thread-safe. */
+class slab_pool
+{
+public:
+    /** Get the pool for a given block size.
+     * @param block_size  The size of the blocks, in bytes
+     * @return The pool; it lives until the program ends */
+    static slab_pool& get (size_t block_size);
+
+    /** Get a block from the pool. */
+    void*   allocate();
+
+    /** Return a block to the pool. */
+    void    deallocate (void* ptr);
+
+    /** The size of the blocks handed out by this pool. */
+    size_t  block_size() const { return block_size_; }
+
+    allocator_statistics stats() const;
+
+private:
+    slab_pool (size_t block_size);
+
+    struct slab;
+
+    /** Sits in front of every block. */
+    struct header
+    {
+        slab*   owner;
+        header* next_free;
+    };
+
+    struct slab
+    {
+        slab*   prev;
+        slab*   next;
+        header* free;
+        size_t  used;
+    };
+
+    slab*   new_slab();
+    void    unlink (slab* s);
+
+private:
+    mutable boost::mutex lock_;
+    size_t          block_size_;
+    size_t          stride_;
+    size_t          blocks_per_slab_;
+
+    /** Slabs with at least one free block. */
+    slab*           available_;
+    size_t          empty_slabs_;
+    size_t          slabs_;
+
+    size_t          allocations_;
+    size_t          system_allocations_;
+    size_t          in_use_;
+};
+
+/** Keeps freed buffers of varying sizes around for reuse.
+ *  Sizes are rounded up to a power of two, and every size gets its own
+ *  free list.  Freed buffers are kept until the arena holds \a cache_limit
+ *  bytes; after that they go back to the system.  Buffers larger than
+ *  \a max_size are not recycled at all.  All functions are thread-safe. */
+class recycling_arena
+{
+public:
+    /** Buffers up to this size are recycled. */
+    static const size_t max_size = 128 * 1024;
+
+    /** Free buffers the arena holds on to, in bytes. */
+    static const size_t cache_limit = 16 * 1024 * 1024;
+
+    /** The arena shared by all recycling_allocators. */
+    static recycling_arena& get();
+
+    void*   allocate (size_t bytes);
+    void    deallocate (void* ptr, size_t bytes);
+
+    allocator_statistics stats() const;
+
+private:
+    recycling_arena();
+
+    /** Every buffer is at least this large, so it can hold a link. */
+    static const unsigned int min_class = 6;
+    static const unsigned int classes   = 18 - min_class;
+
+    struct free_buffer { free_buffer* next; };
+
+    static unsigned int size_class (size_t bytes);
+
+private:
+    mutable boost::mutex lock_;
+    std::array<free_buffer*, classes> free_;
+
+    size_t  cached_bytes_;
+    size_t  allocations_;
+    size_t  system_allocations_;
+    size_t  in_use_;
+    size_t  bytes_in_use_;
+};
+
+/** The statistics of all slab pools and the recycling arena. */
+std::vector<allocator_statistics> allocator_stats();
+
+/** Standard allocator that takes arrays of exactly \a elements objects
+ *  from a slab pool, and everything else from the recycling arena.
+ *
+ * Example:
+ * @code
+
+// Resizing to 4096 elements gets its memory from the pool.
+std::vector<uint16_t, pool_allocator<uint16_t, 4096>> blocks (4096);
+
+ * @endcode */
+template <class type, size_t elements>
+class pool_allocator
+{
+public:
+    typedef type        value_type;
+
+    template <class u>
+    struct rebind { typedef pool_allocator<u, elements> other; };
+
+    pool_allocator() { }
+
+    template <class u>
+    pool_allocator (const pool_allocator<u, elements>&) { }
+
+    type* allocate (size_t n)
+    {
+        if (n == elements)
+            return static_cast<type*>(pool().allocate());
+
+        return static_cast<type*>(recycling_arena::get().allocate(n * sizeof(type)));
+    }
+
+    void deallocate (type* ptr, size_t n)
+    {
+        if (n == elements)
+            pool().deallocate(ptr);
+        else
+            recycling_arena::get().deallocate(ptr, n * sizeof(type));
+    }
+
+    bool operator== (const pool_allocator&) const { return true; }
+    bool operator!= (const pool_allocator&) const { return false; }
+
+private:
+    static slab_pool& pool()
+    {
+        static slab_pool& p (slab_pool::get(elements * sizeof(type)));
+        return p;
+    }
+};
+
+/** Standard allocator that gets its memory from the recycling arena. */
+template <class type>
+class recycling_allocator
+{
+public:
+    typedef type        value_type;
+
+    recycling_allocator() { }
+
+    template <class u>
+    recycling_allocator (const recycling_allocator<u>&) { }
+
+    type* allocate (size_t n)
+    {
+        return static_cast<type*>(recycling_arena::get().allocate(n * sizeof(type)));
+    }
+
+    void deallocate (type* ptr, size_t n)
+    {
+        recycling_arena::get().deallocate(ptr, n * sizeof(type));
+    }
+
+    bool operator== (const recycling_allocator&) const { return true; }
+    bool operator!= (const recycling_allocator&) const { return false; }
+};
+
+} // namespace hexa
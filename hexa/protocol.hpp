@@ -335,6 +335,76 @@ public:
     }
 };
 
+/** Positions and velocities of the entities around a player.
+ * This replaces entity_update_physics.  Every player gets its own
+ * snapshot, with only the entities it is interested in, and only those
+ * that changed since the last snapshot it acknowledged (see
+ * entity_snapshot_ack).  Positions and velocities are rounded to a
+ * fixed precision, see \ref hexa::entity_state. */
+class entity_snapshot : public msg_i
+{
+public:
+    enum { msg_id = 14 };
+    uint8_t type() const { return msg_id; }
+    reliability method() const { return unreliable; }
+
+    struct value
+    {
+        enum flag_t
+        {
+            /** The full position follows. */
+            absolute = 1,
+            /** The distance it moved since the baseline follows. */
+            moved    = 2,
+            /** The velocity follows. */
+            velocity = 4
+        };
+
+        uint32_t            entity_id;
+        uint8_t             flags;
+        world_coordinates   block;  /**< Only if absolute. */
+        vector3<uint8_t>    frac;   /**< Only if absolute. */
+        vector3<int16_t>    move;   /**< Only if moved. */
+        vector3<int16_t>    speed;  /**< Only if velocity. */
+
+        value() : entity_id (0), flags (0) { }
+
+        template<class archive>
+        archive& serialize(archive& ar)
+        {
+            ar(entity_id)(flags);
+            if (flags & absolute)
+                ar(block)(frac);
+            else if (flags & moved)
+                ar(move);
+
+            if (flags & velocity)
+                ar(speed);
+
+            return ar;
+        }
+    };
+
+    clientclock_t           timestamp;
+    /** Sequence number of this snapshot, never 0. */
+    uint16_t                sequence;
+    /** The snapshot this one builds upon, or 0 for none. */
+    uint16_t                baseline;
+    /** Entities that are new, or changed since the baseline. */
+    std::vector<value>      updates;
+    /** Entities the player isn't interested in anymore. */
+    std::vector<uint32_t>   removed;
+
+    entity_snapshot() : timestamp (0), sequence (0), baseline (0) { }
+
+    /** (De)serialize this message. */
+    template <class archive>
+    void serialize(archive& ar)
+    {
+        ar(timestamp)(sequence)(baseline)(updates)(removed);
+    }
+};
+
 /** Remove an entity completely. */
 class entity_delete : public msg_i
 {
@@ -423,6 +493,24 @@ public:
     }
 };
 
+/** The changes to a chunk's surface and light map since a couple of
+ *  versions ago.  If the client's copy is too old for these, it has to
+ *  ask for the whole thing with request_surfaces. */
+class surface_delta_update : public msg_i
+{
+public:
+    enum { msg_id = 17 };
+    uint8_t type() const { return msg_id; }
+    reliability method() const { return reliable; }
+
+    chunk_coordinates   position; /**< Position of the chunk. */
+    compressed_data     history;  /**< Compressed surface_history. */
+
+    /** (De)serialize this message. */
+    template <class archive>
+    void serialize(archive& ar) { ar(position)(history); }
+};
+
 /** Register player stat info. */
 class player_stat_register : public msg_i
 {
@@ -577,6 +665,21 @@ public:
     void serialize(archive& ar) { ar(text); }
 };
 
+/** Let the server know an entity snapshot has arrived, so it can be
+ *  used as the baseline for the next ones. */
+class entity_snapshot_ack : public msg_i
+{
+public:
+    enum { msg_id = 132 };
+    uint8_t type() const { return msg_id; }
+    reliability method() const { return unreliable; }
+
+    uint16_t    sequence;
+
+    template <class archive>
+    void serialize(archive& ar) { ar(sequence); }
+};
+
 /** Request chunk surface data. */
 class request_surfaces : public msg_i
 {
@@ -747,5 +850,32 @@ binary_data serialize_packet(message_t& m)
     return result;
 }
 
+/** Serialize a surface update straight from the compressed data.
+ *  This gives the same result as serialize_packet() on a surface_update
+ *  message, but saves copying the data into the message first. */
+inline binary_data
+serialize_surface_update (chunk_coordinates position,
+                          const compressed_data& terrain,
+                          const compressed_data& light)
+{
+    binary_data result;
+    result.reserve(32 + terrain.size() + light.size());
+    result.push_back(surface_update::msg_id);
+    make_serializer(result)(position)(terrain)(light);
+    return result;
+}
+
+/** Serialize a surface delta update straight from the compressed data. */
+inline binary_data
+serialize_surface_delta (chunk_coordinates position,
+                         const compressed_data& history)
+{
+    binary_data result;
+    result.reserve(32 + history.size());
+    result.push_back(surface_delta_update::msg_id);
+    make_serializer(result)(position)(history);
+    return result;
+}
+
 }} // namespace hexa::msg
 
@@ -20,6 +20,8 @@
 //---------------------------------------------------------------------------
 
 #include "ray_bundle.hpp"
+#include <algorithm>
+#include <cstdlib>
 #include <boost/range/algorithm.hpp>
 
 using namespace std;
@@ -106,5 +108,20 @@ void ray_bundle::multiply_weight(float factor)
         branch.multiply_weight(factor);
 }
 
+int ray_bundle::reach() const
+{
+    int result (0);
+    for (auto& v : trunk)
+    {
+        for (int i (0); i < 3; ++i)
+            result = std::max(result, std::abs(v[i]));
+    }
+
+    for (auto& branch : branches)
+        result = std::max(result, branch.reach());
+
+    return result;
+}
+
 } // namespace hexa
 
@@ -66,6 +66,10 @@ public:
     /** Multiply all weights in the tree by a given value. */
     void multiply_weight(float factor);
 
+    /** The furthest any voxel in the tree is from the origin, measured
+     ** along a single axis. */
+    int reach() const;
+
     bool operator==(world_vector comp) const
         { return trunk.front() == comp; }
 };
@@ -198,7 +198,8 @@ public:
         return *this;
     }
 
-    self& operator() (const std::vector<char>& val)
+    template <class alloc>
+    self& operator() (const std::vector<char, alloc>& val)
     {
         if (val.size() > 65535)
             throw std::runtime_error("array too long");
@@ -210,8 +211,8 @@ public:
         return *this;
     }
 
-    template <class t>
-    self& operator() (const std::vector<t>& val)
+    template <class t, class alloc>
+    self& operator() (const std::vector<t, alloc>& val)
     {
         uint16_t array_size (val.size());
         write(htons(array_size));
@@ -474,7 +475,8 @@ public:
         return *this;
     }
 
-    self& operator() (std::vector<char>& val)
+    template <class alloc>
+    self& operator() (std::vector<char, alloc>& val)
     {
         uint16_t len;
         (*this)(len);
@@ -491,8 +493,8 @@ public:
         return *this;
     }
 
-    template <class t>
-    self& operator() (std::vector<t>& val)
+    template <class t, class alloc>
+    self& operator() (std::vector<t, alloc>& val)
     {
         uint16_t len;
         (*this)(len);
@@ -0,0 +1,425 @@
+//---------------------------------------------------------------------------
+// server/chunk_pipeline.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "chunk_pipeline.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <hexa/log.hpp>
+#include <hexa/voxel_range.hpp>
+
+#include "world.hpp"
+
+namespace hexa {
+
+chunk_pipeline::chunk_pipeline (world& w, unsigned int threads,
+                                unsigned int terrain_jobs)
+    : world_ (w)
+    , terrain_jobs_ (terrain_jobs == 0 ? std::numeric_limits<unsigned int>::max()
+                                       : terrain_jobs)
+    , running_terrain_ (0)
+    , busy_ (0)
+    , merged_ (0)
+    , stop_ (false)
+    , sequence_ (0)
+{
+    pending_.fill(0);
+    finished_.fill(0);
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int i (0); i < threads; ++i)
+        workers_.emplace_back([=]{ worker(); });
+}
+
+chunk_pipeline::~chunk_pipeline()
+{
+    stop();
+}
+
+void
+chunk_pipeline::stop()
+{
+    {
+    std::lock_guard<std::mutex> lock (lock_);
+    stop_ = true;
+    }
+    work_available_.notify_all();
+    idle_.notify_all();
+
+    for (auto& w : workers_)
+        w.join();
+
+    workers_.clear();
+    tasks_.clear();
+    for (auto& q : ready_)
+        q.clear();
+}
+
+void
+chunk_pipeline::request (chunk_coordinates pos, const void* owner,
+                         callback on_done)
+{
+    const key root { lightmap, pos };
+
+    // The easy way out: somebody else already asked for this one.
+    uint64_t since;
+    {
+    std::lock_guard<std::mutex> lock (lock_);
+    if (stop_)
+        return;
+
+    auto found (tasks_.find(root));
+    if (found != tasks_.end())
+    {
+        auto& cbs (found->second->callbacks);
+        if (std::none_of(cbs.begin(), cbs.end(),
+                [=](const std::pair<const void*, callback>& c)
+                { return c.first == owner; }))
+        {
+            cbs.emplace_back(owner, std::move(on_done));
+        }
+        ++merged_;
+        return;
+    }
+
+    since = sequence_;
+    lookups_.insert(since);
+    }
+
+    // Looking up the dependencies can throw, the lookup has to end
+    // either way.
+    struct lookup_guard
+    {
+        chunk_pipeline&     p;
+        uint64_t            since;
+
+        ~lookup_guard()
+        {
+            std::lock_guard<std::mutex> lock (p.lock_);
+            p.end_lookup(since);
+        }
+    } ended { *this, since };
+
+    // Find out what needs to be done, stopping at tasks that are already
+    // on their way.
+    std::unordered_map<key, std::vector<key>, key_hash> deps;
+    std::vector<key> todo { root };
+    while (!todo.empty())
+    {
+        auto k (todo.back());
+        todo.pop_back();
+        if (deps.count(k))
+            continue;
+
+        {
+        std::lock_guard<std::mutex> lock (lock_);
+        if (tasks_.count(k))
+            continue;
+        }
+
+        auto& list (deps[k]);
+        list = dependencies(k);
+        todo.insert(todo.end(), list.begin(), list.end());
+    }
+
+    std::lock_guard<std::mutex> lock (lock_);
+    if (stop_)
+        return;
+
+    auto t (add_task(root, deps, since));
+    t->callbacks.emplace_back(owner, std::move(on_done));
+}
+
+void
+chunk_pipeline::end_lookup (uint64_t since)
+{
+    lookups_.erase(lookups_.find(since));
+    if (lookups_.empty())
+    {
+        recently_finished_.clear();
+        return;
+    }
+
+    // Forget the tasks that none of the remaining lookups can have seen
+    // before they were finished.
+    const auto oldest (*lookups_.begin());
+    for (auto i (recently_finished_.begin()); i != recently_finished_.end(); )
+    {
+        if (i->second <= oldest)
+            i = recently_finished_.erase(i);
+        else
+            ++i;
+    }
+}
+
+void
+chunk_pipeline::cancel (const void* owner)
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    for (auto& t : tasks_)
+    {
+        auto& cbs (t.second->callbacks);
+        cbs.erase(std::remove_if(cbs.begin(), cbs.end(),
+                      [=](const std::pair<const void*, callback>& c)
+                      { return c.first == owner; }),
+                  cbs.end());
+    }
+}
+
+bool
+chunk_pipeline::is_idle() const
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    return tasks_.empty() && busy_ == 0;
+}
+
+void
+chunk_pipeline::wait_idle()
+{
+    std::unique_lock<std::mutex> lock (lock_);
+    idle_.wait(lock, [&]{ return stop_ || (tasks_.empty() && busy_ == 0); });
+}
+
+chunk_pipeline::statistics
+chunk_pipeline::stats() const
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    statistics result;
+    result.pending  = pending_;
+    result.finished = finished_;
+    result.merged   = merged_;
+    result.lookups  = lookups_.size();
+    return result;
+}
+
+std::vector<chunk_pipeline::key>
+chunk_pipeline::dependencies (const key& k)
+{
+    std::vector<key> result;
+    auto proxy (world_.acquire_read_access());
+
+    switch (k.stage)
+    {
+    case terrain:
+        break;
+
+    case surface:
+        for (auto rel : neumann_neighborhood)
+        {
+            auto p (k.pos + rel);
+            if (!proxy.is_air_chunk(p) && !proxy.is_chunk_available(p))
+                result.push_back({ terrain, p });
+        }
+        break;
+
+    case lightmap:
+        if (proxy.is_lightmap_available(k.pos))
+            break;
+
+        for (auto rel : cube_range<world_vector>(world_.lightmap_surface_radius()))
+        {
+            auto p (k.pos + rel);
+            if (!proxy.is_air_chunk(p) && !proxy.is_surface_available(p))
+                result.push_back({ surface, p });
+        }
+        break;
+
+    default:
+        assert(false);
+    }
+
+    return result;
+}
+
+chunk_pipeline::task_ptr
+chunk_pipeline::add_task (const key& k,
+                          std::unordered_map<key, std::vector<key>, key_hash>& deps,
+                          uint64_t since)
+{
+    auto found (tasks_.find(k));
+    if (found != tasks_.end())
+        return found->second;
+
+    auto t (std::make_shared<task>(k));
+    tasks_.emplace(k, t);
+    ++pending_[k.stage];
+
+    for (auto& d : deps[k])
+    {
+        // Already done by someone else since we looked it up.  If it
+        // failed, this task will try again on its own.
+        if (!tasks_.count(d))
+        {
+            auto done (recently_finished_.find(d));
+            if (done != recently_finished_.end() && done->second > since)
+                continue;
+        }
+
+        auto dt (add_task(d, deps, since));
+        dt->dependents.push_back(t);
+        ++t->waiting_for;
+    }
+
+    if (t->waiting_for == 0)
+        make_ready(t);
+
+    return t;
+}
+
+void
+chunk_pipeline::make_ready (const task_ptr& t)
+{
+    assert(!t->queued);
+    t->queued = true;
+    ready_[t->id.stage].push_back(t);
+    work_available_.notify_one();
+}
+
+void
+chunk_pipeline::run (const key& k)
+{
+    auto proxy (world_.acquire_read_access());
+
+    switch (k.stage)
+    {
+    case terrain:
+        proxy.get_chunk(k.pos);
+        break;
+
+    case surface:
+        proxy.get_surface(k.pos);
+        break;
+
+    case lightmap:
+        // Make sure the compressed versions are cached as well, since
+        // that's what the callbacks will be sending out.
+        proxy.get_compressed_surface(k.pos);
+        proxy.get_compressed_lightmap(k.pos);
+        break;
+
+    default:
+        assert(false);
+    }
+}
+
+void
+chunk_pipeline::worker()
+{
+    std::unique_lock<std::mutex> lock (lock_);
+    for (;;)
+    {
+        if (stop_)
+            return;
+
+        // Finish chunks before starting new ones.
+        task_ptr t;
+        if (!ready_[lightmap].empty())
+        {
+            t = ready_[lightmap].front();
+            ready_[lightmap].pop_front();
+        }
+        else if (!ready_[surface].empty())
+        {
+            t = ready_[surface].front();
+            ready_[surface].pop_front();
+        }
+        else if (!ready_[terrain].empty() && running_terrain_ < terrain_jobs_)
+        {
+            t = ready_[terrain].front();
+            ready_[terrain].pop_front();
+            ++running_terrain_;
+        }
+
+        if (!t)
+        {
+            work_available_.wait(lock);
+            continue;
+        }
+
+        ++busy_;
+        lock.unlock();
+
+        bool success (true);
+        try
+        {
+            run(t->id);
+        }
+        catch (std::exception& e)
+        {
+            log_msg("chunk pipeline: cannot process %1%: %2%", t->id.pos,
+                    std::string(e.what()));
+            success = false;
+        }
+
+        lock.lock();
+        const auto stage (t->id.stage);
+        if (stage == terrain)
+        {
+            --running_terrain_;
+            work_available_.notify_one();
+        }
+
+        tasks_.erase(t->id);
+        --pending_[stage];
+        ++finished_[stage];
+        ++sequence_;
+        if (!lookups_.empty())
+            recently_finished_[t->id] = sequence_;
+
+        // If a dependency failed, the task that needed it will try again
+        // on its own, and report the error if it fails as well.
+        for (auto& dep : t->dependents)
+        {
+            if (--dep->waiting_for == 0)
+                make_ready(dep);
+        }
+
+        const auto pos (t->id.pos);
+        auto callbacks (std::move(t->callbacks));
+        t.reset();
+
+        if (success && !callbacks.empty())
+        {
+            lock.unlock();
+            for (auto& cb : callbacks)
+            {
+                try
+                {
+                    cb.second(pos);
+                }
+                catch (std::exception& e)
+                {
+                    log_msg("chunk pipeline: callback failed: %1%",
+                            std::string(e.what()));
+                }
+            }
+            lock.lock();
+        }
+
+        --busy_;
+        if (busy_ == 0 && tasks_.empty())
+            idle_.notify_all();
+    }
+}
+
+} // namespace hexa
@@ -0,0 +1,226 @@
+//---------------------------------------------------------------------------
+/// \file   server/chunk_pipeline.hpp
+/// \brief  Schedules terrain generation, surfaces, and light maps
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+
+namespace hexa {
+
+class world;
+
+/** Gets chunks ready to be sent to the players.
+ *  Before a chunk can be sent, three things have to happen: the terrain
+ *  of the chunk and its six neighbors must be generated, its surface
+ *  has to be extracted, and the light map has to be calculated.  The
+ *  light map might also need the surfaces of the chunks around it.
+ *
+ *  The pipeline splits this up into separate tasks, and keeps track of
+ *  which task is waiting for which.  A task only runs once everything it
+ *  needs is available, so the worker threads never block each other
+ *  by recursing into the same neighbors.  Every task is only scheduled
+ *  once, no matter how many players ask for it.  Work that's already
+ *  in memory or in storage is skipped altogether.
+ *
+ *  When a task is ready, the ones closest to completing a chunk go
+ *  first: light maps before surfaces, surfaces before terrain.
+ *
+ * Example:
+ * @code
+
+chunk_pipeline pipeline (world);
+pipeline.request(pos, peer, [=](chunk_coordinates p){ send_surface(p, peer); });
+
+ * @endcode */
+class chunk_pipeline
+{
+public:
+    /** The stages a chunk goes through. */
+    enum stage_t
+    {
+        terrain, surface, lightmap, nr_of_stages
+    };
+
+    /** Called when a chunk's surface and light map are available. */
+    typedef std::function<void(chunk_coordinates)> callback;
+
+    /** Number of tasks in every stage. */
+    struct statistics
+    {
+        /** Tasks that are waiting or running. */
+        std::array<size_t, nr_of_stages> pending;
+        /** Total number of tasks that were finished. */
+        std::array<size_t, nr_of_stages> finished;
+        /** Requests that were merged with one that was already running. */
+        size_t merged;
+        /** Requests that are still looking up their dependencies. */
+        size_t lookups;
+    };
+
+public:
+    /** Constructor.
+     * @param w             The game world
+     * @param threads       The number of worker threads, or 0 to use one
+     *                      thread per core
+     * @param terrain_jobs  The maximum number of terrain generation tasks
+     *                      that can run at the same time, or 0 to let
+     *                      every worker thread generate terrain.  Lower
+     *                      this to keep some workers free for surfaces
+     *                      and light maps while the world is being
+     *                      generated. */
+    chunk_pipeline (world& w, unsigned int threads = 0,
+                    unsigned int terrain_jobs = 0);
+
+    chunk_pipeline (const chunk_pipeline&) = delete;
+
+    ~chunk_pipeline();
+
+    /** Request a chunk's surface and light map.
+     *  The callback is invoked from one of the worker threads, once both
+     *  are available.  If the same owner has already requested the same
+     *  chunk, and it isn't finished yet, the request is ignored.
+     * @param pos       The chunk's position
+     * @param owner     Identifies who made the request, used for
+     *                  cancel()
+     * @param on_done   Callback */
+    void request (chunk_coordinates pos, const void* owner, callback on_done);
+
+    /** Drop all callbacks of a given owner.
+     *  The work itself is still done.  Note that a callback that's
+     *  already running might still be busy when this function returns. */
+    void cancel (const void* owner);
+
+    /** Check if there is nothing left to do. */
+    bool is_idle() const;
+
+    /** Wait until all requests have been handled. */
+    void wait_idle();
+
+    /** Stop the worker threads.  Pending requests are dropped. */
+    void stop();
+
+    /** Get the number of pending and finished tasks. */
+    statistics stats() const;
+
+private:
+    struct key
+    {
+        stage_t             stage;
+        chunk_coordinates   pos;
+
+        bool operator== (const key& k) const
+            { return stage == k.stage && pos == k.pos; }
+    };
+
+    struct key_hash
+    {
+        size_t operator() (const key& k) const
+            { return std::hash<chunk_coordinates>()(k.pos) * 3 + k.stage; }
+    };
+
+    struct task
+    {
+        task (key k) : id (k), waiting_for (0), queued (false) { }
+
+        key                         id;
+        /** Number of unfinished tasks this one depends on. */
+        unsigned int                waiting_for;
+        /** The tasks that depend on this one. */
+        std::vector<std::shared_ptr<task>> dependents;
+        /** Callbacks to invoke once this task is done. */
+        std::vector<std::pair<const void*, callback>> callbacks;
+        bool                        queued;
+    };
+
+    typedef std::shared_ptr<task> task_ptr;
+
+private:
+    /** Find the tasks that a given task depends on, skipping the ones
+     *  that are already available.  This is done without holding the
+     *  lock, since it might have to go to storage. */
+    std::vector<key> dependencies (const key& k);
+
+    /** Add a task to the graph, along with everything it depends on.
+     *  Dependencies that were finished after the lookup started are
+     *  left out.  The caller must hold lock_.
+     * @param since  The value of sequence_ when the lookup started */
+    task_ptr add_task (const key& k,
+                       std::unordered_map<key, std::vector<key>, key_hash>& deps,
+                       uint64_t since);
+
+    /** Mark the end of a lookup that started at a given sequence
+     *  number.  The caller must hold lock_. */
+    void end_lookup (uint64_t since);
+
+    /** Put a task in the ready queue.  The caller must hold lock_. */
+    void make_ready (const task_ptr& t);
+
+    /** Actually do the work for a task. */
+    void run (const key& k);
+
+    void worker();
+
+private:
+    world&                  world_;
+    const unsigned int      terrain_jobs_;
+
+    mutable std::mutex      lock_;
+    std::condition_variable work_available_;
+    std::condition_variable idle_;
+
+    std::unordered_map<key, task_ptr, key_hash> tasks_;
+    /** Tasks that can run right away, one queue per stage. */
+    std::array<std::deque<task_ptr>, nr_of_stages> ready_;
+
+    unsigned int            running_terrain_;
+    size_t                  busy_;
+    std::array<size_t, nr_of_stages> pending_;
+    std::array<size_t, nr_of_stages> finished_;
+    size_t                  merged_;
+    bool                    stop_;
+
+    /** Incremented every time a task is finished. */
+    uint64_t                sequence_;
+    /** The sequence numbers at which the running lookups started. */
+    std::multiset<uint64_t> lookups_;
+    /** Tasks that were finished while a lookup was running, with the
+     *  sequence number at which they finished.  These have to be
+     *  remembered, because a lookup might have seen them before they
+     *  were finished, and would otherwise add them a second time. */
+    std::unordered_map<key, uint64_t, key_hash> recently_finished_;
+
+    std::vector<std::thread> workers_;
+};
+
+} // namespace hexa
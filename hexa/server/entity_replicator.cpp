@@ -0,0 +1,229 @@
+//---------------------------------------------------------------------------
+// server/entity_replicator.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "entity_replicator.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+#include <boost/math/constants/constants.hpp>
+#include <hexa/algorithm.hpp>
+
+namespace hexa {
+
+using boost::math::constants::pi;
+
+namespace {
+
+/** Entities that are already known stay until they're this much
+ *  further away than the view radius. */
+const float keep_margin (1.1f);
+
+/** ... or this far outside the view cone, in radians. */
+const float keep_angle (0.2f);
+
+/** Is snapshot \a a newer than \a b, taking wraparound into account? */
+inline bool is_newer (uint16_t a, uint16_t b)
+{
+    return int16_t(a - b) > 0;
+}
+
+} // anonymous namespace
+
+entity_replicator::entity_replicator (float radius, float near_radius,
+                                      float view_angle, unsigned int history)
+    : radius_         (radius)
+    , near_radius_    (near_radius)
+    , cos_view_angle_ (std::cos(std::min(view_angle, pi<float>())))
+    , cos_keep_angle_ (std::cos(std::min(view_angle + keep_angle, pi<float>())))
+    , history_        (std::max(1u, history))
+    , tick_           (0)
+{
+    stats_.snapshots = 0;
+    stats_.full      = 0;
+    stats_.updates   = 0;
+    stats_.unchanged = 0;
+    stats_.postponed = 0;
+    stats_.ignored   = 0;
+}
+
+void
+entity_replicator::update_viewer (const void* owner, uint32_t self,
+                                  const wfpos& pos, yaw_pitch look)
+{
+    auto& p (players_[owner]);
+    p.has_viewer = true;
+    p.self = self;
+    p.pos = pos;
+    p.look = from_spherical(look);
+}
+
+void
+entity_replicator::remove (const void* owner)
+{
+    players_.erase(owner);
+}
+
+void
+entity_replicator::acknowledge (const void* owner, uint16_t sequence)
+{
+    auto found (players_.find(owner));
+    if (found == players_.end())
+        return;
+
+    auto& p (found->second);
+    if (p.acked != 0 && !is_newer(sequence, p.acked))
+        return;
+
+    auto snapshot (std::find_if(p.sent.begin(), p.sent.end(),
+        [=](const std::pair<uint16_t, entity_states>& s)
+        { return s.first == sequence; }));
+
+    if (snapshot == p.sent.end())
+        return;
+
+    // Everything before it won't be needed anymore.
+    p.sent.erase(p.sent.begin(), snapshot);
+    p.acked = sequence;
+}
+
+bool
+entity_replicator::is_interesting (const player& p, const vector& rel,
+                                   bool known) const
+{
+    const float d (length(rel));
+    if (d <= near_radius_)
+        return true;
+
+    if (d > (known ? radius_ * keep_margin : radius_))
+        return false;
+
+    return dot_prod(rel, p.look) >= d * (known ? cos_keep_angle_
+                                               : cos_view_angle_);
+}
+
+unsigned int
+entity_replicator::interval (float distance) const
+{
+    if (distance <= near_radius_)
+        return 1;
+
+    if (distance <= radius_ * 0.5f)
+        return 2;
+
+    return 4;
+}
+
+void
+entity_replicator::tick (const std::vector<entity>& entities,
+                         const sender& send)
+{
+    static const entity_states nothing;
+    ++tick_;
+
+    for (auto& i : players_)
+    {
+        auto& p (i.second);
+        if (!p.has_viewer)
+            continue;
+
+        msg::entity_snapshot snapshot;
+        snapshot.sequence = p.next;
+
+        // Build upon the last snapshot the player has seen, if we still
+        // have it.
+        const entity_states* base (&nothing);
+        if (p.acked != 0 && !p.sent.empty() && p.sent.front().first == p.acked)
+        {
+            base = &p.sent.front().second;
+            snapshot.baseline = p.acked;
+        }
+
+        entity_states next (*base);
+        std::unordered_set<uint32_t> seen;
+        for (auto& e : entities)
+        {
+            auto known (base->find(e.id));
+            const bool is_known (known != base->end());
+            const vector rel (e.pos.relative_to(p.pos));
+
+            if (e.id != p.self && !is_interesting(p, rel, is_known))
+            {
+                ++stats_.ignored;
+                continue;
+            }
+            seen.insert(e.id);
+
+            // Things that are far away don't need to be updated as often;
+            // spread them out over the ticks.
+            if (is_known && (tick_ + e.id) % interval(length(rel)) != 0)
+            {
+                ++stats_.postponed;
+                continue;
+            }
+
+            entity_state state (e.pos, e.velocity);
+            auto upd (encode_entity(e.id, state,
+                                    is_known ? &known->second : nullptr));
+            if (upd.flags == 0)
+            {
+                ++stats_.unchanged;
+                continue;
+            }
+
+            snapshot.updates.emplace_back(upd);
+            next[e.id] = state;
+        }
+
+        for (auto& known : *base)
+        {
+            if (!seen.count(known.first))
+            {
+                snapshot.removed.push_back(known.first);
+                next.erase(known.first);
+            }
+        }
+
+        if (snapshot.updates.empty() && snapshot.removed.empty())
+            continue;
+
+        if (++p.next == 0)
+            p.next = 1;
+
+        p.sent.emplace_back(snapshot.sequence, std::move(next));
+        if (p.sent.size() > history_)
+        {
+            p.sent.pop_front();
+            if (p.sent.front().first != p.acked)
+                p.acked = 0;
+        }
+
+        ++stats_.snapshots;
+        if (snapshot.baseline == 0)
+            ++stats_.full;
+
+        stats_.updates += snapshot.updates.size();
+        send(i.first, snapshot);
+    }
+}
+
+} // namespace hexa
+
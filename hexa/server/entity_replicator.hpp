@@ -0,0 +1,164 @@
+//---------------------------------------------------------------------------
+/// \file   server/entity_replicator.hpp
+/// \brief  Decide which entity updates go to which player
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/entity_snapshot.hpp>
+#include <hexa/protocol.hpp>
+#include <hexa/wfpos.hpp>
+
+namespace hexa {
+
+/** Builds the entity snapshots for every player.
+ *  A player only gets the entities it is interested in: those within
+ *  the view radius and in front of it, and anything that is really
+ *  close by.  Entities further away are updated less often.
+ *
+ *  Every snapshot only has the entities that changed since the last
+ *  snapshot the player acknowledged.  If the acknowledgements don't
+ *  come in, the snapshots are relative to an older one, and if that one
+ *  is too old, the player gets everything again.
+ *
+ *  This class is not thread-safe; it is meant to be used by the thread
+ *  that runs the network.
+ *
+ * Example:
+ * @code
+
+entity_replicator rep;
+rep.update_viewer(peer, player_id, player_pos, player_look);
+rep.tick(entities, [&](const void* peer, msg::entity_snapshot& m)
+{
+    send(peer, serialize_packet(m));
+});
+
+ * @endcode */
+class entity_replicator
+{
+public:
+    /** An entity, as it is in the entity system. */
+    struct entity
+    {
+        uint32_t    id;
+        wfpos       pos;
+        vector      velocity;
+    };
+
+    /** Sends a snapshot to a player. */
+    typedef std::function<void(const void*, msg::entity_snapshot&)> sender;
+
+    struct statistics
+    {
+        /** Snapshots sent. */
+        size_t  snapshots;
+        /** Snapshots that weren't relative to an earlier one. */
+        size_t  full;
+        /** Entity updates sent, for all players combined. */
+        size_t  updates;
+        /** Entities that didn't change since the baseline. */
+        size_t  unchanged;
+        /** Entity updates that were put off because they are far away. */
+        size_t  postponed;
+        /** Entities the players weren't interested in. */
+        size_t  ignored;
+    };
+
+public:
+    /** Constructor.
+     * @param radius        Entities further away than this number of
+     *                      blocks aren't sent
+     * @param near_radius   Entities within this distance are always sent,
+     *                      even if the player is looking the other way
+     * @param view_angle    Half the angle of the view cone, in radians
+     * @param history       Number of snapshots to remember for every
+     *                      player, waiting to be acknowledged */
+    entity_replicator (float radius = 128.f, float near_radius = 16.f,
+                       float view_angle = 1.2f, unsigned int history = 32);
+
+    entity_replicator (const entity_replicator&) = delete;
+
+    /** Tell the replicator where a player is, and where it's looking.
+     *  Players that haven't been placed yet don't get any snapshots.
+     * @param owner  The player's connection
+     * @param self   The player's own entity, which is always sent */
+    void update_viewer (const void* owner, uint32_t self, const wfpos& pos,
+                        yaw_pitch look);
+
+    /** Forget about a player. */
+    void remove (const void* owner);
+
+    /** A player received a snapshot. */
+    void acknowledge (const void* owner, uint16_t sequence);
+
+    /** Build and send the snapshots for all players.
+     * @param entities  All entities with a position and velocity
+     * @param send      Called for every player that has something new */
+    void tick (const std::vector<entity>& entities, const sender& send);
+
+    statistics stats() const { return stats_; }
+
+private:
+    struct player
+    {
+        player() : has_viewer (false), self (0), next (1), acked (0) { }
+
+        bool        has_viewer;
+        uint32_t    self;
+        wfpos       pos;
+        vector      look;
+
+        /** Sequence number of the next snapshot. */
+        uint16_t    next;
+        /** Last snapshot the player acknowledged, or 0. */
+        uint16_t    acked;
+        /** The snapshots that were sent since then, oldest first. */
+        std::deque<std::pair<uint16_t, entity_states>> sent;
+    };
+
+    /** Is a player interested in an entity?
+     * @param known  The player already knows about the entity, so it
+     *               should be a bit more reluctant to let it go */
+    bool is_interesting (const player& p, const vector& rel, bool known) const;
+
+    /** Every how many ticks an entity at a given distance is updated. */
+    unsigned int interval (float distance) const;
+
+private:
+    const float         radius_;
+    const float         near_radius_;
+    const float         cos_view_angle_;
+    const float         cos_keep_angle_;
+    const unsigned int  history_;
+
+    std::map<const void*, player> players_;
+    unsigned int        tick_;
+    statistics          stats_;
+};
+
+} // namespace hexa
+
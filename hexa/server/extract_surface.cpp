@@ -21,6 +21,8 @@
 
 #include "extract_surface.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <hexa/voxel_range.hpp>
 
@@ -85,67 +87,97 @@ init_surface_extraction()
     }
 }
 
-surface
-extract_opaque_surface (const world_subsection_read& terrain)
+namespace {
+
+/** The index offsets of the six neighbors of a block. */
+std::array<ptrdiff_t, 6> neighbor_offsets (const voxel_snapshot& terrain)
 {
-    assert(!chunk_outer_shell.empty());
-    assert(!chunk_inner_core.empty());
+    std::array<ptrdiff_t, 6> result;
+    for (int dir (0); dir < 6; ++dir)
+        result[dir] = terrain.offset(dir_vector[dir]);
 
-    surface result;
-    result.reserve(256);
+    return result;
+}
 
-    // Cache the center chunk
-    const chunk& center_chunk (terrain.get_chunk({0,0,0}));
+/** The exposed faces of an opaque block.  Custom blocks always have all
+ *  six, transparent blocks and air have none. */
+uint8_t opaque_faces (const uint16_t* types, ptrdiff_t idx,
+                      const std::array<ptrdiff_t, 6>& neighbor)
+{
+    uint16_t type (types[idx]);
+    if (type == type::air)
+        return 0;
 
-    for (chunk_index i : chunk_outer_shell)
-    {
-        uint16_t type (center_chunk[i].type);
-        if (type == type::air)
-            continue;
+    if (material_prop[type].is_custom_block())
+        return 0x3f;
 
-        if (material_prop[type].is_custom_block())
-        {
-            result.emplace_back(i, 0x3f, type);
-        }
-        else if (!type::is_transparent(type))
-        {
-            uint8_t dirs (0);
-            for (uint8_t dir (0); dir < 6; ++dir)
-            {
-                uint16_t other_type (terrain[i + dir_vector[dir]].type);
+    if (type::is_transparent(type))
+        return 0;
 
-                if (!type::is_visually_solid(other_type))
-                    dirs += (1 << dir);
-            }
+    uint8_t dirs (0);
+    for (uint8_t dir (0); dir < 6; ++dir)
+    {
+        uint16_t other_type (types[idx + neighbor[dir]]);
 
-            if (dirs != 0)
-                result.emplace_back(i, dirs, type);
-        }
+        if (!type::is_visually_solid(other_type))
+            dirs += (1 << dir);
     }
+    return dirs;
+}
+
+/** The exposed faces of a transparent block.  Faces between two blocks
+ *  that look the same are left out. */
+uint8_t transparent_faces (const uint16_t* types, ptrdiff_t idx,
+                           const std::array<ptrdiff_t, 6>& neighbor)
+{
+    uint16_t type (types[idx]);
+    if (type == type::air)
+        return 0;
 
-    for (chunk_index i : chunk_inner_core)
+    const auto& m (material_prop[type]);
+    if (!m.is_transparent() || m.is_custom_block())
+        return 0;
+
+    uint8_t dirs (0);
+    for (uint8_t dir (0); dir < 6; ++dir)
     {
-        uint16_t type (center_chunk[i].type);
-        if (type == type::air)
-            continue;
+        uint16_t other_type (types[idx + neighbor[dir]]);
 
-        if (material_prop[type].is_custom_block())
+        if (   type != other_type
+            && !type::is_visually_solid(other_type)
+            && m.textures[dir] != material_prop[other_type].textures[dir^1])
         {
-            result.emplace_back(i, 0x3f, type);
+            dirs += (1 << dir);
         }
-        else if (!type::is_transparent(type))
-        {
-            uint8_t dirs (0);
-            for (uint8_t dir (0); dir < 6; ++dir)
-            {
-                uint16_t other_type (center_chunk[i + dir_vector[dir]].type);
+    }
+    return dirs;
+}
 
-                if (!type::is_visually_solid(other_type))
-                    dirs += (1 << dir);
-            }
+} // anonymous namespace
 
+surface
+extract_opaque_surface (const voxel_snapshot& terrain)
+{
+    assert(!chunk_outer_shell.empty());
+    assert(!chunk_inner_core.empty());
+    assert(terrain.border() >= 1);
+
+    surface result;
+    result.reserve(256);
+
+    const uint16_t* types (terrain.types());
+    const auto neighbor (neighbor_offsets(terrain));
+
+    // The outer shell first, then the inner core; the order of the
+    // faces has to match the light maps that were stored earlier.
+    for (auto* part : { &chunk_outer_shell, &chunk_inner_core })
+    {
+        for (chunk_index i : *part)
+        {
+            auto idx (terrain.index(world_vector(i)));
+            auto dirs (opaque_faces(types, idx, neighbor));
             if (dirs != 0)
-                result.emplace_back(i, dirs, type);
+                result.emplace_back(i, dirs, types[idx]);
         }
     }
 
@@ -153,73 +185,363 @@ extract_opaque_surface (const world_subsection_read& terrain)
 }
 
 surface
-extract_transparent_surface (const world_subsection_read& terrain)
+extract_transparent_surface (const voxel_snapshot& terrain)
 {
     assert(!chunk_outer_shell.empty());
     assert(!chunk_inner_core.empty());
+    assert(terrain.border() >= 1);
 
     surface result;
 
-    // Cache the center chunk
-    const chunk& center_chunk (terrain.get_chunk({0,0,0}));
+    const uint16_t* types (terrain.types());
+    const auto neighbor (neighbor_offsets(terrain));
+
+    for (auto* part : { &chunk_outer_shell, &chunk_inner_core })
+    {
+        for (chunk_index i : *part)
+        {
+            auto idx (terrain.index(world_vector(i)));
+            auto dirs (transparent_faces(types, idx, neighbor));
+            if (dirs != 0)
+                result.emplace_back(i, dirs, types[idx]);
+        }
+    }
+
+    return result;
+}
+
+namespace {
+
+/** A row of blocks along the x axis, plus one border block on either
+ *  side, fits in 18 bits. */
+const int mask_side (chunk_size + 2);
+
+/** One word per row, for all rows in a snapshot with a border of one.
+ *  Bit x + 1 is the block at x, so bit 0 is the border block at x = -1. */
+typedef std::array<uint32_t, mask_side * mask_side> row_masks;
+
+const uint32_t inner_row (0xffff);
+
+inline int row (int y, int z)
+{
+    return (y + 1) + (z + 1) * mask_side;
+}
+
+enum : uint8_t
+{
+    solid_bit       = 1,
+    opaque_bit      = 2,
+    custom_bit      = 4,
+    transparent_bit = 8
+};
+
+/** How a material shows up in the masks. */
+uint8_t classify (uint16_t type)
+{
+    auto& m (material_prop[type]);
+    uint8_t result (m.is_visually_solid() ? solid_bit : 0);
+    if (type == type::air)
+        return result;
+
+    if (m.is_custom_block())
+        result |= custom_bit;
+    else if (m.is_transparent())
+        result |= transparent_bit;
+    else
+        result |= opaque_bit;
+
+    return result;
+}
 
-    for (chunk_index i : chunk_outer_shell)
+/** The blocks of a chunk as bit masks. */
+struct block_masks
+{
+    /** Visually solid blocks, including the border. */
+    row_masks   solid;
+    /** Opaque, custom, and transparent blocks in the chunk itself.
+     *  These are shifted one bit down, so bit x is the block at x. */
+    row_masks   opaque;
+    row_masks   custom;
+    row_masks   transparent;
+
+    block_masks (const voxel_snapshot& terrain)
     {
-        uint16_t type (center_chunk[i].type);
-        if (type == type::air)
-            continue;
+        const uint16_t* types (terrain.types());
 
-        const auto& m (material_prop[type]);
-        if (!m.is_transparent() || m.is_custom_block())
-            continue;
+        // Remember the flags of the materials seen so far, so the
+        // material properties only have to be looked up once per type.
+        std::array<uint16_t, 64> cached_type;
+        std::array<uint8_t, 64>  cached_flags;
+        cached_type.fill(type::air);
+        cached_flags.fill(classify(type::air));
 
-        uint8_t dirs (0);
-        for (uint8_t dir (0); dir < 6; ++dir)
+        auto flags ([&](uint16_t type) -> uint32_t
         {
-            uint16_t other_type (terrain[i + dir_vector[dir]].type);
+            const int slot (type & 63);
+            if (cached_type[slot] != type)
+            {
+                cached_type[slot]  = type;
+                cached_flags[slot] = classify(type);
+            }
+            return cached_flags[slot];
+        });
 
-            if (   type != other_type
-                && !type::is_visually_solid(other_type)
-                && m.textures[dir] != material_prop[other_type].textures[dir^1])
+        for (int z (-1); z <= chunk_size; ++z)
+        {
+            for (int y (-1); y <= chunk_size; ++y)
             {
-                dirs += (1 << dir);
+                const bool inner_y (y >= 0 && y < chunk_size);
+                const bool inner_z (z >= 0 && z < chunk_size);
+                const int r (row(y, z));
+
+                solid[r] = opaque[r] = custom[r] = transparent[r] = 0;
+
+                // The edges and corners are never looked at.
+                if (!inner_y && !inner_z)
+                    continue;
+
+                // The border rows only matter for the blocks next to
+                // the chunk, not for the border blocks next to those.
+                const int first (inner_y && inner_z ? 0 : 1);
+                const int last  (inner_y && inner_z ? mask_side : mask_side - 1);
+                const uint32_t used (((1u << last) - 1) & ~((1u << first) - 1));
+
+                auto line (types + terrain.index(world_vector(-1, y, z)));
+
+                // Most rows are all air, or all rock.
+                const uint16_t first_type (line[first]);
+                int x (first + 1);
+                while (x < last && line[x] == first_type)
+                    ++x;
+
+                uint32_t s (0), o (0), c (0), t (0);
+                if (x == last)
+                {
+                    const uint32_t f (flags(first_type));
+                    s = (f & solid_bit)       ? used : 0;
+                    o = (f & opaque_bit)      ? used : 0;
+                    c = (f & custom_bit)      ? used : 0;
+                    t = (f & transparent_bit) ? used : 0;
+                }
+                else
+                {
+                    for (x = first; x < last; ++x)
+                    {
+                        const uint32_t f (flags(line[x]));
+                        s |= (f & 1) << x;
+                        o |= ((f >> 1) & 1) << x;
+                        c |= ((f >> 2) & 1) << x;
+                        t |= ((f >> 3) & 1) << x;
+                    }
+                }
+
+                solid[r] = s;
+                if (inner_y && inner_z)
+                {
+                    opaque[r]      = (o >> 1) & inner_row;
+                    custom[r]      = (c >> 1) & inner_row;
+                    transparent[r] = (t >> 1) & inner_row;
+                }
             }
         }
-
-        if (dirs != 0)
-            result.emplace_back(i, dirs, type);
     }
 
-    for (chunk_index i : chunk_inner_core)
+    /** For every direction, the blocks in a row whose neighbor in that
+     *  direction is not visually solid. */
+    std::array<uint32_t, 6> open (int y, int z) const
     {
-        uint16_t type (center_chunk[i].type);
-        if (type == type::air)
-            continue;
+        const uint32_t s (solid[row(y, z)]);
+        return {{ ~(s >> 2)                     & inner_row,
+                  ~s                            & inner_row,
+                  ~(solid[row(y + 1, z)] >> 1)  & inner_row,
+                  ~(solid[row(y - 1, z)] >> 1)  & inner_row,
+                  ~(solid[row(y, z + 1)] >> 1)  & inner_row,
+                  ~(solid[row(y, z - 1)] >> 1)  & inner_row }};
+    }
+};
 
-        const auto& m (material_prop[type]);
-        if (!m.is_transparent() || m.is_custom_block())
-            continue;
+/** The blocks of a row that are part of the chunk's outer shell.
+ *  The faces in the shell come first, \sa init_surface_extraction */
+inline uint32_t shell (int y, int z)
+{
+    if (y == 0 || y == chunk_size - 1 || z == 0 || z == chunk_size - 1)
+        return inner_row;
 
-        uint8_t dirs (0);
-        for (uint8_t dir (0); dir < 6; ++dir)
-        {
-            uint16_t other_type (center_chunk[i + dir_vector[dir]].type);
+    return 0x0001 | (1u << (chunk_size - 1));
+}
+
+/** The index of the lowest bit that is set, with a de Bruijn sequence. */
+inline int lowest_bit (uint32_t x)
+{
+    static const int position[32] = {
+        0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+        31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9 };
+
+    return position[((x & (0 - x)) * 0x077CB531u) >> 27];
+}
+
+inline uint8_t gather (const std::array<uint32_t, 6>& open, int x)
+{
+    uint8_t result (0);
+    for (int dir (0); dir < 6; ++dir)
+        result |= ((open[dir] >> x) & 1) << dir;
+
+    return result;
+}
+
+} // anonymous namespace
+
+surface_data
+extract_surface (const voxel_snapshot& terrain)
+{
+    assert(terrain.border() >= 1);
+
+    surface opaque, transparent;
+    opaque.reserve(256);
+
+    const block_masks masks (terrain);
+    const uint16_t* types (terrain.types());
+    const auto neighbor (neighbor_offsets(terrain));
 
-            if (   type != other_type
-                && !type::is_visually_solid(other_type)
-                && m.textures[dir] != material_prop[other_type].textures[dir^1])
+    // The outer shell first, then the inner core; the order of the
+    // faces has to match the light maps that were stored earlier.
+    for (int part (0); part < 2; ++part)
+    {
+        for (int z (0); z < chunk_size; ++z)
+        {
+            for (int y (0); y < chunk_size; ++y)
             {
-                dirs += (1 << dir);
+                const int r (row(y, z));
+                const uint32_t in_part (part == 0 ? shell(y, z)
+                                                  : ~shell(y, z) & inner_row);
+
+                const uint32_t o (masks.opaque[r] & in_part);
+                const uint32_t c (masks.custom[r] & in_part);
+                const uint32_t t (masks.transparent[r] & in_part);
+                if ((o | c | t) == 0)
+                    continue;
+
+                const auto open (masks.open(y, z));
+                const auto line (terrain.index(world_vector(0, y, z)));
+                const uint32_t any_open (open[0] | open[1] | open[2]
+                                         | open[3] | open[4] | open[5]);
+
+                uint32_t emit ((o & any_open) | c);
+                while (emit)
+                {
+                    const int x (lowest_bit(emit));
+                    emit &= emit - 1;
+
+                    chunk_index i (x, y, z);
+                    auto type (types[line + x]);
+                    if (c & (1u << x))
+                        opaque.emplace_back(i, 0x3f, type);
+                    else
+                        opaque.emplace_back(i, gather(open, x), type);
+                }
+
+                // Transparent blocks also need to look at the type of
+                // their neighbors, but only where the neighbor isn't
+                // solid.
+                uint32_t check (t & any_open);
+                while (check)
+                {
+                    const int x (lowest_bit(check));
+                    check &= check - 1;
+
+                    chunk_index i (x, y, z);
+                    auto idx (line + x);
+                    auto type (types[idx]);
+                    const auto& m (material_prop[type]);
+
+                    uint8_t dirs (0);
+                    for (uint8_t dir (0); dir < 6; ++dir)
+                    {
+                        if (!((open[dir] >> x) & 1))
+                            continue;
+
+                        uint16_t other_type (types[idx + neighbor[dir]]);
+                        if (   type != other_type
+                            && m.textures[dir] != material_prop[other_type].textures[dir^1])
+                        {
+                            dirs += (1 << dir);
+                        }
+                    }
+
+                    if (dirs != 0)
+                        transparent.emplace_back(i, dirs, type);
+                }
             }
         }
+    }
 
-        if (dirs != 0)
-            result.emplace_back(i, dirs, type);
+    return surface_data(std::move(opaque), std::move(transparent));
+}
+
+namespace {
+
+/** Replace the faces of a number of blocks in a surface.
+ * @param old     The surface before the change
+ * @param blocks  The blocks that were looked at again, in surface order
+ * @param fresh   The new faces of those blocks, in surface order
+ * @return The updated surface */
+surface merge (const surface& old, const std::vector<chunk_index>& blocks,
+               const surface& fresh)
+{
+    surface result;
+    result.reserve(old.size() + fresh.size());
+
+    auto b (blocks.begin());
+    auto f (fresh.begin());
+    for (auto& e : old)
+    {
+        while (f != fresh.end() && surface_order(f->pos, e.pos))
+            result.push_back(*f++);
+
+        while (b != blocks.end() && surface_order(*b, e.pos))
+            ++b;
+
+        if (b == blocks.end() || *b != e.pos)
+            result.push_back(e);
     }
+    result.insert(result.end(), f, fresh.end());
 
     return result;
 }
 
+} // anonymous namespace
+
+surface_data
+patch_surface (const surface_data& old, const voxel_snapshot& terrain,
+               std::vector<chunk_index> blocks)
+{
+    assert(terrain.border() >= 1);
+
+    std::sort(blocks.begin(), blocks.end(), surface_order);
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+    const uint16_t* types (terrain.types());
+    const auto neighbor (neighbor_offsets(terrain));
+
+    surface opaque, transparent;
+    for (auto i : blocks)
+    {
+        auto idx (terrain.index(world_vector(i)));
+        auto dirs (opaque_faces(types, idx, neighbor));
+        if (dirs != 0)
+            opaque.emplace_back(i, dirs, types[idx]);
+
+        dirs = transparent_faces(types, idx, neighbor);
+        if (dirs != 0)
+            transparent.emplace_back(i, dirs, types[idx]);
+    }
+
+    surface_data result (merge(old.opaque, blocks, opaque),
+                         merge(old.transparent, blocks, transparent));
+    result.version = old.version;
+
+    return result;
+}
 
 } // namespace hexa
 
@@ -23,7 +23,7 @@
 
 #pragma once
 
-#include "world_subsection.hpp"
+#include "voxel_snapshot.hpp"
 #include <hexa/surface.hpp>
 
 namespace hexa {
@@ -38,13 +38,13 @@ init_surface_extraction();
  *  that can be seen, the ones that are right next to a transparent block
  *  type.  Because the visibility of the faces at the outer edges of the
  *  chunk can only be determined by looking at the blocks in the chunk
- *  right next to it, this function requires a neighborhood<> as its
- *  input.
- * @param terrain  The chunk to determine the surface of, with its
- *                 six immediate neighboring chunks
+ *  right next to it, this function requires a snapshot with a border
+ *  of at least one block as its input.
+ * @param terrain  The chunk to determine the surface of, with the
+ *                 blocks right next to it
  * @return The potentially visible surface */
 surface
-extract_opaque_surface (const world_subsection_read& terrain);
+extract_opaque_surface (const voxel_snapshot& terrain);
 
 /** Find all potentially visible transparent faces in a chunk.
  *  If two solid blocks are right next to each other, the two touching
@@ -52,13 +52,42 @@ extract_opaque_surface (const world_subsection_read& terrain);
  *  that can be seen, the ones that are right next to a transparent block
  *  type.  Because the visibility of the faces at the outer edges of the
  *  chunk can only be determined by looking at the blocks in the chunk
- *  right next to it, this function requires a neighborhood<> as its
- *  input.
- * @param terrain  The chunk to determine the surface of, with its
- *                 six immediate neighboring chunks
+ *  right next to it, this function requires a snapshot with a border
+ *  of at least one block as its input.
+ * @param terrain  The chunk to determine the surface of, with the
+ *                 blocks right next to it
  * @return The potentially visible surface */
 surface
-extract_transparent_surface (const world_subsection_read& terrain);
+extract_transparent_surface (const voxel_snapshot& terrain);
+
+/** Find the opaque and transparent surfaces of a chunk in one go.
+ *  This gives exactly the same result as extract_opaque_surface() and
+ *  extract_transparent_surface(), faces in the same order and all.
+ *  Instead of looking at the six neighbors of every block, it first
+ *  turns the snapshot into bit masks, with one 32-bit word for every
+ *  row of blocks.  The exposed faces in a row are then found with a
+ *  handful of shifts and ANDs, and only the blocks that actually have
+ *  a visible face are looked at individually.
+ * @param terrain  The chunk to determine the surface of, with a border
+ *                 of at least one block
+ * @return The potentially visible surfaces */
+surface_data
+extract_surface (const voxel_snapshot& terrain);
+
+/** Bring a surface up to date after a few blocks have changed.
+ *  Only the given blocks are looked at again; their faces replace the
+ *  ones they had before, and all other faces are copied as they are.
+ *  A block that changed affects the faces of its six neighbors as well,
+ *  so those have to be in the list too.
+ * @param old      The surfaces before the change
+ * @param terrain  The chunk after the change, with a border of at least
+ *                 one block
+ * @param blocks   The blocks whose faces might be different
+ * @return The same surfaces as extract_surface() would give, with the
+ *         same version number as \a old */
+surface_data
+patch_surface (const surface_data& old, const voxel_snapshot& terrain,
+               std::vector<chunk_index> blocks);
 
 } // namespace hexa
 
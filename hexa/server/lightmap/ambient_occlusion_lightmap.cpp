@@ -43,12 +43,6 @@ typedef std::array<unsigned int, 3> triangle;
 
 namespace {
 
-
-float opacity (uint16_t t)
-{
-    return 1.0f - (material_prop[t].transparency / 255.f);
-}
-
 std::vector<vector> golden_spiral (int count)
 {
     // Based on an implementation by Patrick Boucher.
@@ -82,10 +76,11 @@ std::vector<vector> golden_spiral (int count)
 ambient_occlusion_lightmap::ambient_occlusion_lightmap
             (world& c, const ptree& config)
     : lightmap_generator_i (c, config)
+    , rays_ (config.get<int>("snapshot_border", 16))
 {
-    detail_levels_.emplace_back(precalc(10, 10));
-    detail_levels_.emplace_back(precalc(30, 40));
-    detail_levels_.emplace_back(precalc(60, 100));
+    rays_.add_phase(precalc(10, 10));
+    rays_.add_phase(precalc(30, 40));
+    rays_.add_phase(precalc(60, 100));
 }
 
 ambient_occlusion_lightmap::rays
@@ -131,50 +126,6 @@ ambient_occlusion_lightmap::precalc (float ambient_raylen, unsigned int count) c
 ambient_occlusion_lightmap::~ambient_occlusion_lightmap ()
 { }
 
-float
-ambient_occlusion_lightmap::recurse (const ray_bundle& r, float ray_power,
-                                     const world_coordinates& blk,
-                                     world_lightmap_access& data,
-                                     bool first) const
-{
-    float temp (0.0f);
-    bool should_recurse (true);
-
-    for (auto& voxel : r.trunk)
-    {
-        auto type (data[blk + voxel].type);
-
-        // If the very first block we traverse is a custom block, we
-        // skip it.
-        if (first)
-        {
-            first = false;
-            if (material_prop[type].is_custom_block())
-                continue;
-        }
-
-        temp += opacity(type);
-        if (temp >= 1.0f)
-        {
-            should_recurse = false;
-            break;
-        }
-    }
-
-    ray_power -= std::min(temp, 1.0f) * r.weight;
-
-    if (ray_power <= 0.01)
-        return 0.0;
-
-    if (should_recurse)
-    {
-        for (auto& s : r.branches)
-            ray_power = recurse(s, ray_power, blk, data, first);
-    }
-
-    return ray_power;
-}
-
 lightmap&
 ambient_occlusion_lightmap::generate (world_lightmap_access& data,
                                       const chunk_coordinates& pos,
@@ -182,20 +133,35 @@ ambient_occlusion_lightmap::generate (world_lightmap_access& data,
                                       lightmap& lightchunk,
                                       unsigned int phase) const
 {
-    assert(phase < detail_levels_.size());
+    assert(phase < rays_.phases());
     trace("for %1%", world_vector(pos - world_chunk_center));
 
-    auto lmi (std::begin(lightchunk));
-    for (faces f : s)
+    // Trace all faces that point the same way together, so the rays
+    // can be followed for several faces at once.  Faces that point
+    // down don't get any ambient light.
+    std::array<std::vector<chunk_index>, 5> by_dir;
+    for (const faces& f : s)
     {
-        world_coordinates blk (pos * chunk_size + f.pos);
+        for (int d (0); d < 5; ++d)
+        {
+            if (f[d])
+                by_dir[d].push_back(f.pos);
+        }
+    }
 
+    std::array<std::vector<float>, 5> light;
+    for (int d (0); d < 5; ++d)
+        light[d] = rays_.cast(data, pos, phase, d, by_dir[d]);
+
+    std::array<size_t, 5> next {{ 0, 0, 0, 0, 0 }};
+    auto lmi (std::begin(lightchunk));
+    for (const faces& f : s)
+    {
         for (int d (0) ; d < 5; ++d)
         {
             if (f[d])
             {
-                const ray_bundle& r (detail_levels_[phase][d]);
-                float light_level (recurse(r, r.weight, blk, data));
+                float light_level (light[d][next[d]++]);
 
                 if (d < 4)
                     light_level += d * 0.05f;
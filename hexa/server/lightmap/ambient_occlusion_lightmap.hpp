@@ -27,6 +27,7 @@
 #include <hexa/basic_types.hpp>
 #include <hexa/ray_bundle.hpp>
 #include "lightmap_generator_i.hpp"
+#include "ray_occlusion.hpp"
 
 namespace hexa {
 
@@ -35,8 +36,7 @@ template <class> class neighborhood;
 /** Ambient occlusion of the sky light. */
 class ambient_occlusion_lightmap : public lightmap_generator_i
 {
-    typedef std::array<ray_bundle, 6>  rays;
-    std::vector<rays> detail_levels_;
+    typedef occlusion_rays::directions rays;
 
 public:
     ambient_occlusion_lightmap(world& cache,
@@ -52,13 +52,14 @@ public:
 
     unsigned int phases() const { return 3; }
 
+    unsigned int influence_radius (unsigned int phase) const override
+        { return rays_.reach(phase); }
+
 private:
     rays  precalc (float length, unsigned int count) const;
 
-    float recurse(const ray_bundle& r, float ray_power,
-                  const world_coordinates& blk,
-                  world_lightmap_access& data,
-                  bool first = true) const;
+private:
+    occlusion_rays  rays_;
 };
 
 } // namespace hexa
@@ -22,157 +22,55 @@
 #include "lamp_lightmap.hpp"
 
 #include <algorithm>
-#include <array>
-#include <unordered_set>
-#include <iostream>
+#include <cassert>
 
-#include <boost/math/constants/constants.hpp>
-#include <boost/range/algorithm.hpp>
-#include <boost/range/adaptors.hpp>
+#include <hexa/block_types.hpp>
+#include <hexa/lightmap.hpp>
+#include <hexa/pos_dir.hpp>
 
-#include <hexa/voxel_algorithm.hpp>
-#include <hexa/voxel_range.hpp>
-
-#include "../world.hpp"
 #include "../world_lightmap_access.hpp"
 
-using namespace boost;
-using namespace boost::adaptors;
-using namespace boost::range;
 using namespace boost::property_tree;
 
 namespace hexa {
 
-namespace {
-
-float opacity (uint16_t t)
-{
-    return 1.0f - (material_prop[t].transparency / 255.f);
-}
-
-} // anonymous namespace
-
-
-////////////////////////////////////////////////////////////////////////////
-
-
 lamp_lightmap::lamp_lightmap (world& c, const ptree& conf)
     : lightmap_generator_i (c, conf)
+    , max_chunks_ (conf.get<size_t>("max_chunks", 8192))
 {
 }
 
 lamp_lightmap::~lamp_lightmap ()
 { }
 
-struct lamp
-{
-    lamp(vector p, float s)
-        : pos(p + vector(0.5, 0.5, 0.5))
-        , str(s)
-    { }
-
-    vector  pos;
-    float   str;
-};
-
 lightmap&
 lamp_lightmap::generate (world_lightmap_access& data,
                          const chunk_coordinates& pos,
                          const surface& s,
                          lightmap& lightchunk, unsigned int phase) const
 {
-    static const float boost (6.0f);
-
     if (s.empty())
         return lightchunk;
 
-    const vector half (0.5f, 0.5f, 0.5f);
-    block_vector no (chunk_size * 2, chunk_size * 2, chunk_size * 2);
-
-    // Go through all the surfaces in the chunks surrounding the current
-    // chunk we're making a lightmap for (a 5x5x5 Moore neighborhood).
-    // Put all the block types in a flat array (we'll need to access them
-    // quite often, this speeds up the traversal) and place the point light
-    // sources.
-    //
-    std::vector<lamp> lamps;
-    chunk_base<block, chunk_size*5> nbh;
-    for (auto i : cube_range<block_vector>(2))
-    {
-        auto& cp (data.get_surface(pos + i));
-
-        block_vector origin (i * chunk_size + no);
-        for (auto& face : cp.opaque)
-        {
-            block_vector pos (origin + face.pos);
-            nbh[pos] = face.type;
-
-            uint8_t strength (material_prop[face.type].light_emission) ;
-            if (strength)
-                lamps.push_back(lamp(pos - no, strength / 255.f));
-        }
-        for (auto& face : cp.transparent)
-        {
-            block_vector pos (origin + face.pos);
-            nbh[face.pos] = face.type;
-
-            uint8_t strength (material_prop[face.type].light_emission) ;
-            if (strength)
-                lamps.push_back(lamp(pos - no, strength / 255.f));
-        }
-    }
+    auto lock (field_.lock());
+    if (field_.size() > max_chunks_)
+        field_.clear();
 
-    if (lamps.empty())
-        return lightchunk;
+    field_.prepare(data, pos, 1);
 
+    const world_coordinates origin (pos * chunk_size);
     auto lmi (std::begin(lightchunk));
     for (const faces& f : s)
     {
+        world_coordinates blk (origin + f.pos);
+        auto own (light_field::emission(f.type));
+
         for (int d (0); d < 6; ++d)
         {
             if (!f[d])
                 continue;
 
-            vector normal (dir_vector[d]);
-            vector o (vector(f.pos) + half + (normal * 0.51f));
-
-            float light_level (0.0f);
-
-            for (auto& lamp : lamps)
-            {
-                const vector& lp (lamp.pos);
-                auto ilp (floor(lp));
-
-                if (ilp == f.pos)
-                {
-                    light_level = 1;
-                    break;
-                }
-
-                float weight (lamp.str * dot_prod(normalize(lp - o), normal) / squared_distance(lp, o));
-                if (weight <= 0)
-                    continue;
-
-                float power (1.0f);
-                // Follow the line from the middle of the face to the lamp.
-                // Stop right before the lamp block is found.  Decrease the
-                // light power for every block that is not completely
-                // transparent.
-                voxel_raycast(o, lp, [&](vector3<int> rv)
-                {
-                    return rv == ilp || (power -= opacity(nbh[rv + no])) <= 0;
-                });
-
-                if (power > 0)
-                {
-                    light_level += power * weight * boost;
-                    if (light_level >= 1)
-                        break;
-                }
-            }
-
-            light_level = clamp(light_level, 0.0f, 1.0f);
-            lmi->artificial = light_level * 15.4f;
+            lmi->artificial = std::max(own, field_.level(blk + dir_vector[d]));
             ++lmi;
         }
     }
@@ -181,5 +79,12 @@ lamp_lightmap::generate (world_lightmap_access& data,
     return lightchunk;
 }
 
-} // namespace hexa
+std::vector<chunk_coordinates>
+lamp_lightmap::chunk_changed (world_lightmap_access& data,
+                              const chunk_coordinates& pos)
+{
+    auto lock (field_.lock());
+    return field_.update(data, pos);
+}
 
+} // namespace hexa
@@ -22,15 +22,22 @@
 
 #pragma once
 
-#include <array>
 #include <vector>
 #include <hexa/basic_types.hpp>
-#include <hexa/ray_bundle.hpp>
 #include "lightmap_generator_i.hpp"
+#include "light_field.hpp"
 
 namespace hexa {
 
-/** Artificial light sources. */
+/** Artificial light sources.
+ *  The light from the lamps is spread out over the blocks by a
+ *  light_field, every face simply takes the light level of the block
+ *  in front of it.
+ *
+ *  Configuration:
+ *  - max_chunks: The light field is thrown away and built up again
+ *                when it covers more chunks than this (default 8192,
+ *                4 kB per chunk) */
 class lamp_lightmap : public lightmap_generator_i
 {
 public:
@@ -44,10 +51,23 @@ public:
                                lightmap& chunk,
                                unsigned int phase = 0) const;
 
-    unsigned int phases() const { return 3; }
+    std::vector<chunk_coordinates>
+        chunk_changed (world_lightmap_access& data,
+                       const chunk_coordinates& pos) override;
+
+    /** Light reaches one chunk away, and the faces at the edge of a
+     *  chunk look at the blocks in the next one, so the light field
+     *  needs the terrain up to two chunks away. */
+    unsigned int surface_radius() const { return 2; }
+
+    /** A face takes the light level of the block in front of it, and
+     *  light fades out after max_level steps. */
+    unsigned int influence_radius (unsigned int) const override
+        { return light_field::max_level + 1; }
 
 private:
+    mutable light_field field_;
+    size_t              max_chunks_;
 };
 
 } // namespace hexa
-
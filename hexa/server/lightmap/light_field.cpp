@@ -0,0 +1,271 @@
+//---------------------------------------------------------------------------
+// server/lightmap/light_field.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "light_field.hpp"
+
+#include <algorithm>
+
+#include <hexa/block_types.hpp>
+#include <hexa/pos_dir.hpp>
+#include <hexa/voxel_range.hpp>
+
+#include "../world_lightmap_access.hpp"
+
+namespace hexa {
+
+namespace {
+
+constexpr uint32_t cnkmask = chunk_size - 1;
+
+/** Position of a block within its chunk's volume. */
+inline size_t offset (world_coordinates p)
+{
+    return (p.x & cnkmask) + (p.y & cnkmask) * chunk_size
+           + (p.z & cnkmask) * chunk_size * chunk_size;
+}
+
+/** The world position of a block in a chunk, by its offset. */
+inline world_coordinates block_at (chunk_coordinates cnk, size_t i)
+{
+    return world_coordinates(cnk.x * chunk_size + i % chunk_size,
+                             cnk.y * chunk_size + (i / chunk_size) % chunk_size,
+                             cnk.z * chunk_size + i / (chunk_size * chunk_size));
+}
+
+} // anonymous namespace
+
+uint8_t
+light_field::emission (uint16_t type)
+{
+    return (material_prop[type].light_emission * max_level + 127) / 255;
+}
+
+uint8_t
+light_field::attenuation (uint16_t type)
+{
+    return 1 + ((255 - material_prop[type].transparency) * max_level + 254) / 255;
+}
+
+void
+light_field::prepare (world_lightmap_access& data, chunk_coordinates pos,
+                      unsigned int radius)
+{
+    // Light doesn't travel further than one chunk, so the lamps in the
+    // chunks right outside the radius have to be taken into account too.
+    for (auto rel : cube_range<world_vector>(radius + 1))
+    {
+        chunk_coordinates p (pos + rel);
+        if (!seeded_.count(p))
+            seed(data, p);
+    }
+}
+
+uint8_t
+light_field::level (world_coordinates pos) const
+{
+    auto found (volumes_.find(pos >> cnkshift));
+    if (found == volumes_.end())
+        return 0;
+
+    return (*found->second)[offset(pos)];
+}
+
+std::vector<chunk_coordinates>
+light_field::update (world_lightmap_access& data, chunk_coordinates pos)
+{
+    // The neighbors have to be complete first, otherwise we can't tell
+    // which light came in from outside.
+    prepare(data, pos, 0);
+    touched_.clear();
+
+    std::deque<std::pair<world_coordinates, uint8_t>> dark;
+    std::deque<world_coordinates> relight;
+
+    // Take away all light in the chunk, and everything that got its
+    // light by passing through it.
+    cell(pos * chunk_size);
+    auto& vol (*volumes_[pos]);
+    for (size_t i (0); i < vol.size(); ++i)
+    {
+        if (vol[i] > 0)
+        {
+            dark.emplace_back(block_at(pos, i), vol[i]);
+            set(dark.back().first, vol[i], 0);
+        }
+    }
+    unlight(data, dark, relight);
+
+    // Then fill it up again, starting at its own lamps, and at the lit
+    // blocks around it.
+    for (size_t i (0); i < vol.size(); ++i)
+    {
+        auto p (block_at(pos, i));
+        auto e (emission(data[p].type));
+        if (e > vol[i])
+        {
+            set(p, vol[i], e);
+            relight.push_back(p);
+        }
+    }
+
+    for (size_t i (0); i < vol.size(); ++i)
+    {
+        auto p (block_at(pos, i));
+        for (int d (0); d < 6; ++d)
+        {
+            world_coordinates n (p + dir_vector[d]);
+            if ((n >> cnkshift) != pos && level(n) > 0)
+                relight.push_back(n);
+        }
+    }
+    spread(data, relight);
+
+    return std::vector<chunk_coordinates>(touched_.begin(), touched_.end());
+}
+
+void
+light_field::clear()
+{
+    volumes_.clear();
+    seeded_.clear();
+}
+
+void
+light_field::seed (world_lightmap_access& data, chunk_coordinates pos)
+{
+    seeded_.insert(pos);
+
+    std::deque<world_coordinates> queue;
+    auto& cnk (data.get_chunk(pos));
+    for (size_t i (0); i < cnk.size(); ++i)
+    {
+        auto e (emission(cnk[i].type));
+        if (e == 0)
+            continue;
+
+        auto p (block_at(pos, i));
+        auto& c (cell(p));
+        if (e > c)
+        {
+            set(p, c, e);
+            queue.push_back(p);
+        }
+    }
+    spread(data, queue);
+}
+
+void
+light_field::spread (world_lightmap_access& data,
+                     std::deque<world_coordinates>& queue)
+{
+    while (!queue.empty())
+    {
+        auto p (queue.front());
+        queue.pop_front();
+
+        auto lvl (level(p));
+        for (int d (0); d < 6; ++d)
+        {
+            world_coordinates n (p + dir_vector[d]);
+            auto cost (attenuation(data[n].type));
+            if (lvl <= cost)
+                continue;
+
+            auto& c (cell(n));
+            if (c < lvl - cost)
+            {
+                set(n, c, lvl - cost);
+                queue.push_back(n);
+            }
+        }
+    }
+}
+
+void
+light_field::unlight (world_lightmap_access& data,
+                      std::deque<std::pair<world_coordinates, uint8_t>>& queue,
+                      std::deque<world_coordinates>& relight)
+{
+    while (!queue.empty())
+    {
+        auto p (queue.front().first);
+        auto lvl (queue.front().second);
+        queue.pop_front();
+
+        for (int d (0); d < 6; ++d)
+        {
+            world_coordinates n (p + dir_vector[d]);
+            auto found (volumes_.find(n >> cnkshift));
+            if (found == volumes_.end())
+                continue;
+
+            auto& c ((*found->second)[offset(n)]);
+            if (c == 0)
+                continue;
+
+            if (c < lvl)
+            {
+                // This one might have been lit by p, so it goes dark as
+                // well.  If it's a lamp, it will light up again on its
+                // own.
+                queue.emplace_back(n, c);
+                set(n, c, 0);
+
+                auto e (emission(data[n].type));
+                if (e > 0)
+                {
+                    set(n, c, e);
+                    relight.push_back(n);
+                }
+            }
+            else
+            {
+                // Lit by something else, use it to fill the gap.
+                relight.push_back(n);
+            }
+        }
+    }
+}
+
+uint8_t&
+light_field::cell (world_coordinates pos)
+{
+    auto& vol (volumes_[pos >> cnkshift]);
+    if (!vol)
+    {
+        vol.reset(new volume);
+        std::fill(vol->begin(), vol->end(), 0);
+    }
+
+    return (*vol)[offset(pos)];
+}
+
+void
+light_field::set (world_coordinates pos, uint8_t& cell, uint8_t value)
+{
+    if (cell != value)
+    {
+        cell = value;
+        touched_.insert(pos >> cnkshift);
+    }
+}
+
+} // namespace hexa
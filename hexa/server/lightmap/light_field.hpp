@@ -0,0 +1,148 @@
+//---------------------------------------------------------------------------
+/// \file   server/lightmap/light_field.hpp
+/// \brief  Artificial light levels for every block, spread by flood fill
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/chunk_base.hpp>
+
+namespace hexa {
+
+class world_lightmap_access;
+
+/** The light level of every block, as cast by the lamps in the world.
+ *  Blocks that emit light start out at their own light level.  From
+ *  there, the light spreads out to the six neighbors, losing one level
+ *  per step, and more if it passes through a block that isn't fully
+ *  transparent.  Opaque blocks stop the light altogether.  Since the
+ *  brightest lamp has level 15, light never travels further than one
+ *  chunk away from the chunk it started in.
+ *
+ *  Light levels are kept per chunk.  The lamps in a chunk are only
+ *  spread out once ("seeded"); after that, changing a chunk only
+ *  takes away the light that passed through it, and spreads out the
+ *  light from its edges and its own lamps again.  Light maps can look
+ *  up a level in constant time.
+ *
+ *  The caller has to hold lock() while using any of the other
+ *  functions.
+ *
+ * Example:
+ * @code
+
+auto l (field.lock());
+field.prepare(data, pos, 1);
+auto level (field.level(pos * chunk_size));
+
+ * @endcode */
+class light_field
+{
+public:
+    /** The highest possible light level. */
+    static constexpr uint8_t max_level = 15;
+
+    /** How bright a material is, from 0 to max_level. */
+    static uint8_t emission (uint16_t type);
+
+    /** How many light levels are lost when going through a material.
+     *  Opaque materials return more than max_level. */
+    static uint8_t attenuation (uint16_t type);
+
+public:
+    light_field() { }
+
+    light_field (const light_field&) = delete;
+
+    /** Get exclusive access to the light field. */
+    std::unique_lock<std::mutex> lock()
+        { return std::unique_lock<std::mutex>(mutex_); }
+
+    /** Make sure all light that can reach the chunks in a given radius
+     *  has been spread out.
+     * @param data   Access to the terrain
+     * @param pos    The center chunk
+     * @param radius Radius in chunks, 0 to only do \a pos itself */
+    void prepare (world_lightmap_access& data, chunk_coordinates pos,
+                  unsigned int radius = 0);
+
+    /** Look up the light level of a block.
+     *  This is only correct if the block's chunk was prepared. */
+    uint8_t level (world_coordinates pos) const;
+
+    /** Update the light after the blocks in a chunk have changed.
+     * @param data   Access to the terrain, which already has the changes
+     * @param pos    The chunk that was changed
+     * @return The chunks where the light level of at least one block
+     *         went up or down */
+    std::vector<chunk_coordinates>
+         update (world_lightmap_access& data, chunk_coordinates pos);
+
+    /** The number of chunks that have light levels in memory. */
+    size_t size() const { return volumes_.size(); }
+
+    /** Forget everything.  The light levels will be calculated again
+     *  when they are needed. */
+    void clear();
+
+private:
+    typedef chunk_base<uint8_t> volume;
+
+    /** Spread out the light from the lamps in a single chunk. */
+    void seed (world_lightmap_access& data, chunk_coordinates pos);
+
+    /** Spread out the light from a number of blocks whose levels are
+     *  already set. */
+    void spread (world_lightmap_access& data,
+                 std::deque<world_coordinates>& queue);
+
+    /** Take away the light that came from a number of blocks.
+     *  The blocks' light levels must already be set to zero.  Blocks
+     *  that turn out to be lit by something else are added to
+     *  \a relight, so spread() can fill the gaps again. */
+    void unlight (world_lightmap_access& data,
+                  std::deque<std::pair<world_coordinates, uint8_t>>& queue,
+                  std::deque<world_coordinates>& relight);
+
+    /** Get the light level of a block, creating the chunk's volume if
+     *  it doesn't exist yet. */
+    uint8_t& cell (world_coordinates pos);
+
+    /** Set a light level, and remember the chunk has changed. */
+    void set (world_coordinates pos, uint8_t& cell, uint8_t value);
+
+private:
+    std::mutex  mutex_;
+    std::unordered_map<chunk_coordinates, std::unique_ptr<volume>> volumes_;
+    /** Chunks whose lamps have been spread out. */
+    std::unordered_set<chunk_coordinates> seeded_;
+    /** Chunks that were changed by the current update. */
+    std::unordered_set<chunk_coordinates> touched_;
+};
+
+} // namespace hexa
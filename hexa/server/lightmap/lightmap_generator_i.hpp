@@ -22,6 +22,7 @@
 
 #pragma once
 
+#include <vector>
 #include <boost/property_tree/ptree.hpp>
 #include <hexa/basic_types.hpp>
 #include <hexa/surface.hpp>
@@ -67,6 +68,34 @@ public:
      *  function should return the number of phases this generator supports. */
     virtual unsigned int phases() const { return 1; }
 
+    /** How far away the generator looks for surfaces of other chunks.
+     *  If this returns 2, generating a light map for a chunk requires the
+     *  surfaces of the 5x5x5 chunks around it.  This is only used to
+     *  schedule the work; the surfaces are always fetched on demand
+     *  anyway. */
+    virtual unsigned int surface_radius() const { return 0; }
+
+    /** How far the effect of a changed block reaches.
+     *  When only a few blocks were changed, the faces further away
+     *  than this keep their old light values.  The distance is measured
+     *  in blocks along each axis.  The default of one chunk is only a
+     *  guess, generators should override this.
+     * @param phase Level of detail \sa phases */
+    virtual unsigned int influence_radius (unsigned int /*phase*/) const
+        { return chunk_size; }
+
+    /** Called when the blocks in a chunk have been changed.
+     *  Generators that keep their own data between calls can bring it up
+     *  to date here.  The world takes care of updating the light maps
+     *  around the changes, \sa influence_radius
+     * @param data  Access to the world data, which has the changes already
+     * @param pos   The chunk that was changed
+     * @return Other chunks that need a new light map */
+    virtual std::vector<chunk_coordinates>
+        chunk_changed (world_lightmap_access& /*data*/,
+                       const chunk_coordinates& /*pos*/)
+        { return { }; }
+
 protected:
     /** The game world. */
     world&  cache_;
@@ -0,0 +1,405 @@
+//---------------------------------------------------------------------------
+// server/lightmap/ray_occlusion.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "ray_occlusion.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#  define HEXA_RAY_SSE
+#  include <xmmintrin.h>
+#endif
+
+#include <hexa/block_types.hpp>
+
+#include "../voxel_snapshot.hpp"
+#include "../world_lightmap_access.hpp"
+
+namespace hexa {
+
+namespace {
+
+// Four lanes of floats, with SSE if we have it.  Comparisons return a
+// bit mask with one bit per lane.
+
+#ifdef HEXA_RAY_SSE
+
+struct float4
+{
+    __m128 v;
+
+    float4 (__m128 x) : v (x) { }
+    explicit float4 (float x) : v (_mm_set1_ps(x)) { }
+    explicit float4 (const float* x) : v (_mm_loadu_ps(x)) { }
+
+    void store (float* x) const { _mm_storeu_ps(x, v); }
+};
+
+inline float4 operator+ (float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator- (float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator* (float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 min (float4 a, float4 b) { return _mm_min_ps(a.v, b.v); }
+
+inline int less (float4 a, float4 b)
+    { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+
+inline int less_equal (float4 a, float4 b)
+    { return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+
+/** Keep the lanes whose bit is set in \a mask, zero the others. */
+inline float4 select (int mask, float4 a)
+{
+    // Multiplying by 1 or 0 only needs SSE1, unlike bitwise masks.
+    static const float lane[16][4] = {
+        {0,0,0,0}, {1,0,0,0}, {0,1,0,0}, {1,1,0,0},
+        {0,0,1,0}, {1,0,1,0}, {0,1,1,0}, {1,1,1,0},
+        {0,0,0,1}, {1,0,0,1}, {0,1,0,1}, {1,1,0,1},
+        {0,0,1,1}, {1,0,1,1}, {0,1,1,1}, {1,1,1,1} };
+
+    return _mm_mul_ps(a.v, _mm_loadu_ps(lane[mask]));
+}
+
+#else
+
+struct float4
+{
+    float v[4];
+
+    float4 () { }
+    explicit float4 (float x) { std::fill(v, v + 4, x); }
+    explicit float4 (const float* x) { std::copy(x, x + 4, v); }
+
+    void store (float* x) const { std::copy(v, v + 4, x); }
+};
+
+template <typename op>
+inline float4 apply (float4 a, float4 b, op f)
+{
+    float4 r;
+    for (int i (0); i < 4; ++i)
+        r.v[i] = f(a.v[i], b.v[i]);
+    return r;
+}
+
+template <typename op>
+inline int compare (float4 a, float4 b, op f)
+{
+    int r (0);
+    for (int i (0); i < 4; ++i)
+        r |= f(a.v[i], b.v[i]) << i;
+    return r;
+}
+
+inline float4 operator+ (float4 a, float4 b) { return apply(a, b, [](float x, float y){ return x + y; }); }
+inline float4 operator- (float4 a, float4 b) { return apply(a, b, [](float x, float y){ return x - y; }); }
+inline float4 operator* (float4 a, float4 b) { return apply(a, b, [](float x, float y){ return x * y; }); }
+inline float4 min (float4 a, float4 b) { return apply(a, b, [](float x, float y){ return std::min(x, y); }); }
+inline int less (float4 a, float4 b) { return compare(a, b, [](float x, float y){ return x < y; }); }
+inline int less_equal (float4 a, float4 b) { return compare(a, b, [](float x, float y){ return x <= y; }); }
+
+inline float4 select (int mask, float4 a)
+{
+    for (int i (0); i < 4; ++i)
+    {
+        if (!(mask & (1 << i)))
+            a.v[i] = 0.0f;
+    }
+    return a;
+}
+
+#endif
+
+/** Below this many faces, a snapshot with a border isn't worth it. */
+const size_t few_faces (32);
+
+/** Marks the voxels that lie outside the snapshot. */
+const int32_t outside (std::numeric_limits<int32_t>::min());
+
+/** The blocks around up to four faces.  Blocks close by are looked up
+ *  in a snapshot, the ones further away go through the world.  Blocks
+ *  above the ceiling (\sa world_lightmap_access::get_ceiling) are air,
+ *  and don't have to be looked up at all. */
+class terrain_voxels
+{
+public:
+    terrain_voxels (world_lightmap_access& data, const voxel_snapshot& snap,
+                    const flat_ray_bundle& r, const int32_t* offsets,
+                    chunk_coordinates pos, const chunk_index* faces,
+                    int lanes, chunk_height ceiling)
+        : data_    (data)
+        , types_   (snap.types())
+        , opacity_ (snap.opacities())
+        , voxels_  (r.voxels)
+        , lowest_  (r.lowest)
+        , offsets_ (offsets)
+    {
+        for (int l (0); l < lanes; ++l)
+        {
+            base_[l]   = snap.index(world_vector(faces[l]));
+            blk_[l]    = pos * chunk_size + faces[l];
+            chunks_[l] = nullptr;
+
+            int64_t above (std::numeric_limits<int32_t>::max());
+            if (ceiling != undefined_height)
+                above = int64_t(ceiling) * chunk_size - blk_[l].z;
+
+            above_[l] = std::min<int64_t>(above, std::numeric_limits<int32_t>::max());
+        }
+    }
+
+    /** Check if a ray has cleared the terrain: from this voxel on, it
+     *  stays above the ceiling. */
+    bool clear (int lane, uint32_t voxel) const
+    {
+        return lowest_[voxel] >= above_[lane];
+    }
+
+    uint16_t type (int lane, uint32_t voxel)
+    {
+        auto o (offsets_[voxel]);
+        return o != outside ? types_[base_[lane] + o] : far(lane, voxel);
+    }
+
+    float opacity (int lane, uint32_t voxel)
+    {
+        auto o (offsets_[voxel]);
+        if (o != outside)
+            return opacity_[base_[lane] + o];
+
+        return 1.0f - material_prop[far(lane, voxel)].transparency / 255.f;
+    }
+
+private:
+    /** Look up a block through the world.  Every lane remembers the
+     *  last chunk it used, since the rays of four faces are usually in
+     *  different chunks. */
+    uint16_t far (int lane, uint32_t voxel)
+    {
+        world_coordinates p (blk_[lane] + voxels_[voxel]);
+        chunk_coordinates c (p >> cnkshift);
+        if (chunks_[lane] == nullptr || c != chunk_pos_[lane])
+        {
+            chunk_pos_[lane] = c;
+            chunks_[lane] = &data_.get_chunk(c);
+        }
+        return (*chunks_[lane])[p % chunk_size].type;
+    }
+
+private:
+    world_lightmap_access&              data_;
+    const uint16_t*                     types_;
+    const float*                        opacity_;
+    const std::vector<world_vector>&    voxels_;
+    const std::vector<int32_t>&         lowest_;
+    const int32_t*                      offsets_;
+
+    size_t              base_[4];
+    world_coordinates   blk_[4];
+    int32_t             above_[4];
+    chunk_coordinates   chunk_pos_[4];
+    const chunk*        chunks_[4];
+};
+
+/** Follow a bundle of rays for up to four faces at once.
+ *  This gives exactly the same results as following the ray_bundle
+ *  tree recursively for every face: every face (lane) keeps track of
+ *  its own light level, and of the subtree it is skipping because a
+ *  trunk was blocked.  A node is only skipped if it is skipped by all
+ *  lanes.  A lane that has cleared the terrain only passes through air
+ *  from there on, so the rest of its subtree is skipped as well.
+ * @param r       The rays
+ * @param voxels  Where to look up the blocks, \sa terrain_voxels
+ * @param lanes   The number of faces, 1 to 4
+ * @param result  The light that gets through, for every lane */
+template <class voxel_source>
+void trace_lanes (const flat_ray_bundle& r, voxel_source& voxels,
+                  int lanes, float* result)
+{
+    const float4 one (1.0f), cutoff (0.01f);
+    const uint32_t end (r.nodes.size());
+
+    float4 power (r.nodes[0].weight);
+    int alive ((1 << lanes) - 1);
+    uint32_t resume[4] = { 0, 0, 0, 0 };
+
+    for (uint32_t i (0); i < end && alive; )
+    {
+        // Which lanes take part in this node?  Lanes that were blocked
+        // further up the tree are waiting for the end of that subtree.
+        int active (0);
+        uint32_t next (end);
+        for (int l (0); l < lanes; ++l)
+        {
+            if (!(alive & (1 << l)))
+                continue;
+
+            if (i >= resume[l])
+                active |= 1 << l;
+            else
+                next = std::min(next, resume[l]);
+        }
+
+        if (active == 0)
+        {
+            i = next;
+            continue;
+        }
+
+        auto& n (r.nodes[i]);
+        float4 temp (0.0f);
+        int clear (0);
+        for (uint32_t v (n.first); v < n.last; ++v)
+        {
+            float o[4] = { 0, 0, 0, 0 };
+            for (int l (0); l < lanes; ++l)
+            {
+                if (!(active & ~clear & (1 << l)))
+                    continue;
+
+                if (voxels.clear(l, v))
+                {
+                    clear |= 1 << l;
+                    continue;
+                }
+
+                // If the very first block we traverse is a custom block,
+                // we skip it.
+                if (v == 0 && material_prop[voxels.type(l, v)].is_custom_block())
+                    continue;
+
+                o[l] = voxels.opacity(l, v);
+            }
+
+            temp = temp + float4(o);
+            if ((less(temp, one) & active & ~clear) == 0)
+                break;
+        }
+
+        int blocked (~less(temp, one) & active);
+        power = power - select(active, min(temp, one) * float4(n.weight));
+        alive &= ~(less_equal(power, cutoff) & active);
+
+        for (int l (0); l < lanes; ++l)
+        {
+            if ((blocked | clear) & (1 << l))
+                resume[l] = n.skip;
+        }
+        ++i;
+    }
+
+    float p[4];
+    power.store(p);
+    for (int l (0); l < lanes; ++l)
+        result[l] = (alive & (1 << l)) ? p[l] : 0.0f;
+}
+
+} // anonymous namespace
+
+occlusion_rays::occlusion_rays (int max_border)
+    : max_border_ (max_border)
+{
+}
+
+void
+occlusion_rays::add_phase (const directions& rays)
+{
+    std::array<flat_ray_bundle, 6> flat;
+    int reach (0);
+    for (int d (0); d < 6; ++d)
+    {
+        reach = std::max(reach, rays[d].reach());
+        if (!rays[d].trunk.empty())
+            flat[d] = flat_ray_bundle(rays[d]);
+    }
+    bundles_.emplace_back(std::move(flat));
+    reach_.push_back(reach);
+}
+
+std::vector<float>
+occlusion_rays::cast (world_lightmap_access& data, chunk_coordinates pos,
+                      unsigned int phase, int dir,
+                      const std::vector<chunk_index>& faces) const
+{
+    std::vector<float> result (faces.size(), 0.0f);
+    auto& r (bundles_[phase][dir]);
+    if (r.nodes.empty())
+        return result;
+
+    // The short rays of the lower phases fit in a snapshot of the
+    // terrain completely, the long ones only start out in it.  Filling
+    // a snapshot takes about as long as following the rays of a few
+    // dozen faces through the world, so if only a couple of faces are
+    // lit again after a block was changed, it's not worth it.
+    unsigned int border (std::min(reach_[phase], max_border_));
+    if (faces.size() < few_faces && !data.has_snapshot(pos, border))
+        border = 0;
+
+    auto& snap (data.get_snapshot(pos, border));
+    auto& offsets (this->offsets(snap, phase, dir));
+    auto ceiling (data.get_ceiling(pos, reach_[phase]));
+
+    for (size_t i (0); i < faces.size(); i += 4)
+    {
+        int lanes (std::min<size_t>(4, faces.size() - i));
+        terrain_voxels voxels (data, snap, r, offsets.data(), pos,
+                               &faces[i], lanes, ceiling);
+        trace_lanes(r, voxels, lanes, &result[i]);
+    }
+    return result;
+}
+
+const std::vector<int32_t>&
+occlusion_rays::offsets (const voxel_snapshot& snap, unsigned int phase,
+                         int dir) const
+{
+    std::lock_guard<std::mutex> l (lock_);
+    auto key (std::make_pair(snap.side(), phase));
+    auto found (offsets_.find(key));
+    if (found == offsets_.end())
+    {
+        // Faces can be anywhere in the chunk, so only the voxels that
+        // are no further away than the border are always inside the
+        // snapshot.
+        const int border (snap.border());
+        offset_table table;
+        for (int d (0); d < 6; ++d)
+        {
+            auto& r (bundles_[phase][d]);
+            table[d] = r.offsets(snap.offset({0, 1, 0}), snap.offset({0, 0, 1}));
+            for (size_t i (0); i < r.voxels.size(); ++i)
+            {
+                auto& v (r.voxels[i]);
+                if (   std::abs(v.x) > border || std::abs(v.y) > border
+                    || std::abs(v.z) > border)
+                {
+                    table[d][i] = outside;
+                }
+            }
+        }
+        found = offsets_.emplace(key, std::move(table)).first;
+    }
+
+    return found->second[dir];
+}
+
+} // namespace hexa
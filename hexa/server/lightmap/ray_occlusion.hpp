@@ -0,0 +1,116 @@
+//---------------------------------------------------------------------------
+/// \file   server/lightmap/ray_occlusion.hpp
+/// \brief  Trace bundles of rays through the terrain
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/flat_ray_bundle.hpp>
+#include <hexa/ray_bundle.hpp>
+
+namespace hexa {
+
+class voxel_snapshot;
+class world_lightmap_access;
+
+/** The rays of a light map generator, for all six directions and every
+ *  phase.
+ *  The sun and ambient occlusion light maps both work the same way:
+ *  for every face, a bundle of rays is followed outwards, and every
+ *  block along the way takes away some of the light, depending on its
+ *  opacity.  Branches are skipped once their trunk is fully blocked.
+ *
+ *  The bundles are flattened (\sa flat_ray_bundle), and four faces are
+ *  traced at once with SSE.  The blocks close to the chunk come from a
+ *  voxel_snapshot; rays that reach further than the snapshot's border
+ *  look up the rest of their blocks through the world.  Once a ray has
+ *  climbed above the highest terrain around the chunk, the rest of it
+ *  is known to be air and isn't traced at all.
+ *
+ * Example:
+ * @code
+
+occlusion_rays rays (16);
+rays.add_phase(bundles);
+auto light (rays.cast(data, pos, 0, dir_up, faces));
+
+ * @endcode */
+class occlusion_rays
+{
+public:
+    typedef std::array<ray_bundle, 6> directions;
+
+public:
+    /** Constructor.
+     * @param max_border  The largest snapshot border to use; blocks
+     *                    further away are looked up through the world */
+    occlusion_rays (int max_border);
+
+    occlusion_rays (const occlusion_rays&) = delete;
+
+    /** Add the rays for the next phase. */
+    void add_phase (const directions& rays);
+
+    /** The number of phases. */
+    unsigned int phases() const { return bundles_.size(); }
+
+    /** How far the rays of a phase reach, in blocks along any axis. */
+    unsigned int reach (unsigned int phase) const { return reach_[phase]; }
+
+    /** Find out how much light reaches a number of faces that all
+     *  point in the same direction.
+     * @param data   Access to the terrain
+     * @param pos    The chunk the faces are in
+     * @param phase  Which rays to use
+     * @param dir    The direction the faces point in
+     * @param faces  The positions of the faces within the chunk
+     * @return The light for every face, from 0 to the weight of the
+     *         bundle */
+    std::vector<float> cast (world_lightmap_access& data,
+                             chunk_coordinates pos,
+                             unsigned int phase, int dir,
+                             const std::vector<chunk_index>& faces) const;
+
+private:
+    /** The offsets of a bundle's voxels in a snapshot.  These are
+     *  calculated the first time a snapshot of a given size is used. */
+    const std::vector<int32_t>& offsets (const voxel_snapshot& snap,
+                                         unsigned int phase, int dir) const;
+
+private:
+    int                                         max_border_;
+    std::vector<std::array<flat_ray_bundle, 6>> bundles_;
+    std::vector<int>                            reach_;
+
+    typedef std::array<std::vector<int32_t>, 6> offset_table;
+
+    mutable std::mutex                          lock_;
+    /** Offset tables, by snapshot size and phase. */
+    mutable std::map<std::pair<int, unsigned int>, offset_table> offsets_;
+};
+
+} // namespace hexa
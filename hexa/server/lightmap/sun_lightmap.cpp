@@ -37,16 +37,6 @@ namespace hexa {
 
 typedef std::array<unsigned int, 3> triangle;
 
-namespace {
-
-float opacity (uint16_t t)
-{
-    return 1.0f - (material_prop[t].transparency / 255.f);
-}
-
-} // anonymous namespace
-
-
 ////////////////////////////////////////////////////////////////////////////
 
 
@@ -54,10 +44,11 @@ sun_lightmap::sun_lightmap (world& c, const ptree& conf)
     : lightmap_generator_i (c, conf)
     , direction_ (-0.4f, 0.75f)
     , radius_    (3.0f * 0.01745f)
+    , rays_      (conf.get<int>("snapshot_border", 16))
 {
-    detail_levels_.emplace_back(generate(10, 0));
-    detail_levels_.emplace_back(generate(60, 1));
-    detail_levels_.emplace_back(generate(200, 2));
+    rays_.add_phase(generate(10, 0));
+    rays_.add_phase(generate(60, 1));
+    rays_.add_phase(generate(200, 2));
 }
 
 sun_lightmap::~sun_lightmap ()
@@ -127,49 +118,6 @@ sun_lightmap::generate (float raylen, size_t count) const
     return result;
 }
 
-float
-sun_lightmap::recurse (const ray_bundle& r, float ray_power,
-                       const world_coordinates& blk,
-                       world_lightmap_access& data,
-                       bool first) const
-{
-    float temp (0.0f);
-    bool should_recurse (true);
-    for (auto& voxel : r.trunk)
-    {
-        auto type (data[blk + voxel].type);
-
-        // If the very first block we traverse is a custom block, we
-        // skip it.
-        if (first)
-        {
-            first = false;
-            if (material_prop[type].is_custom_block())
-                continue;
-        }
-
-        temp += opacity(type);
-        if (temp >= 1.0f)
-        {
-            should_recurse = false;
-            break;
-        }
-    }
-
-    ray_power -= std::min(temp, 1.0f) * r.weight;
-
-    if (ray_power <= 0.01)
-        return 0.0;
-
-    if (should_recurse)
-    {
-        for (auto& s : r.branches)
-            ray_power = recurse(s, ray_power, blk, data, first);
-    }
-
-    return ray_power;
-}
-
 lightmap&
 sun_lightmap::generate (world_lightmap_access& data,
                         const chunk_coordinates& pos,
@@ -179,19 +127,32 @@ sun_lightmap::generate (world_lightmap_access& data,
 {
     trace((boost::format("for %1%") % world_vector(pos - world_chunk_center)).str());
 
-    auto lmi (std::begin(lightchunk));
-
-    for (faces f : s)
+    // Trace all faces that point the same way together, so the rays
+    // can be followed for several faces at once.
+    std::array<std::vector<chunk_index>, 6> by_dir;
+    for (const faces& f : s)
     {
-        world_coordinates blk (pos * chunk_size + f.pos);
+        for (int d (0); d < 6; ++d)
+        {
+            if (f[d])
+                by_dir[d].push_back(f.pos);
+        }
+    }
 
+    std::array<std::vector<float>, 6> light;
+    for (int d (0); d < 6; ++d)
+        light[d] = rays_.cast(data, pos, phase, d, by_dir[d]);
+
+    std::array<size_t, 6> next {{ 0, 0, 0, 0, 0, 0 }};
+    auto lmi (std::begin(lightchunk));
+    for (const faces& f : s)
+    {
         for (int d (0); d < 6; ++d)
         {
             if (!f[d])
                 continue;
 
-            const ray_bundle& r (detail_levels_[phase][d]);
-            float light_level (recurse(r, r.weight, blk, data));
+            float light_level (light[d][next[d]++]);
             lmi->sunlight = clamp(light_level, 0.0f, 1.0f) * 15.4f;
             ++lmi;
         }
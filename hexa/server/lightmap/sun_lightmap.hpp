@@ -28,6 +28,7 @@
 #include <hexa/basic_types.hpp>
 #include <hexa/ray_bundle.hpp>
 #include "lightmap_generator_i.hpp"
+#include "ray_occlusion.hpp"
 
 namespace hexa {
 
@@ -36,8 +37,7 @@ template <class> class neighborhood;
 /** Directional sunlight and soft shadows. */
 class sun_lightmap : public lightmap_generator_i
 {
-    typedef std::array<ray_bundle, 6>  rays;
-    std::vector<rays> detail_levels_;
+    typedef occlusion_rays::directions rays;
 
 public:
     sun_lightmap(world& cache, const boost::property_tree::ptree& conf);
@@ -53,18 +53,17 @@ public:
 
     unsigned int phases() const { return 3; }
 
+    unsigned int influence_radius (unsigned int phase) const override
+        { return rays_.reach(phase); }
+
 private:
     void  add (rays& r, float length, yaw_pitch dir) const;
     rays  generate (float len, size_t count) const;
 
-    float recurse(const ray_bundle& r, float ray_power,
-                  const world_coordinates& blk,
-                  world_lightmap_access& data,
-                  bool first = true) const;
-
 private:
-    yaw_pitch   direction_;
-    float       radius_;
+    yaw_pitch       direction_;
+    float           radius_;
+    occlusion_rays  rays_;
 };
 
 } // namespace hexa
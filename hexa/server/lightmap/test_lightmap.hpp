@@ -43,6 +43,9 @@ public:
                                const surface& s,
                                lightmap& chunk,
                                unsigned int phase = 0) const;
+
+    unsigned int influence_radius (unsigned int) const override
+        { return 0; }
 };
 
 } // namespace hexa
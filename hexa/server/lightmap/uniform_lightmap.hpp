@@ -41,6 +41,9 @@ public:
                                lightmap& chunk,
                                unsigned int phase = 0) const;
 
+    unsigned int influence_radius (unsigned int) const override
+        { return 0; }
+
 private:
     uint8_t sun_;
     uint8_t amb_;
@@ -0,0 +1,227 @@
+//---------------------------------------------------------------------------
+// server/lightmap_refiner.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "lightmap_refiner.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <hexa/algorithm.hpp>
+#include <hexa/log.hpp>
+
+#include "chunk_pipeline.hpp"
+#include "world.hpp"
+
+namespace hexa {
+
+lightmap_refiner::lightmap_refiner (world& w, chunk_pipeline& pipeline,
+                                    callback on_refined, unsigned int radius)
+    : world_        (w)
+    , pipeline_     (pipeline)
+    , on_refined_   (std::move(on_refined))
+    , radius_       (radius)
+    , stop_         (false)
+    , refined_      (0)
+{
+}
+
+lightmap_refiner::~lightmap_refiner()
+{
+    stop();
+}
+
+void
+lightmap_refiner::start()
+{
+    if (thread_.joinable())
+        return;
+
+    stop_ = false;
+    thread_ = std::thread([=]{ worker(); });
+}
+
+void
+lightmap_refiner::stop()
+{
+    {
+    std::lock_guard<std::mutex> lock (lock_);
+    stop_ = true;
+    }
+    wakeup_.notify_all();
+
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void
+lightmap_refiner::add (const void* owner, chunk_coordinates pos)
+{
+    if (world_.lightmap_phases() < 2)
+        return;
+
+    std::lock_guard<std::mutex> lock (lock_);
+    auto& c (candidates_[pos]);
+
+    // The light map might have been regenerated since the last time,
+    // because the terrain was changed.  Checking the lower phases
+    // again is cheap, since nothing is generated if the light map
+    // already has that level of detail.
+    c.next_phase = 1;
+    if (std::find(c.owners.begin(), c.owners.end(), owner) == c.owners.end())
+        c.owners.push_back(owner);
+}
+
+void
+lightmap_refiner::update_viewer (const void* owner, chunk_coordinates pos)
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    viewers_[owner] = pos;
+}
+
+void
+lightmap_refiner::remove (const void* owner)
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    viewers_.erase(owner);
+
+    for (auto i (candidates_.begin()); i != candidates_.end(); )
+    {
+        auto& o (i->second.owners);
+        o.erase(std::remove(o.begin(), o.end(), owner), o.end());
+
+        if (o.empty())
+            i = candidates_.erase(i);
+        else
+            ++i;
+    }
+}
+
+bool
+lightmap_refiner::refine_one()
+{
+    chunk_coordinates pos;
+    unsigned int phase;
+
+    {
+    std::lock_guard<std::mutex> lock (lock_);
+
+    // Pick the candidate closest to one of its owners.  Every phase
+    // that's already done makes a chunk count as further away, so the
+    // coarsest light maps close by are taken care of first.
+    float best (std::numeric_limits<float>::max());
+    for (auto i (candidates_.begin()); i != candidates_.end(); )
+    {
+        float dist (std::numeric_limits<float>::max());
+        for (auto o : i->second.owners)
+        {
+            auto v (viewers_.find(o));
+            if (v == viewers_.end())
+                continue;
+
+            dist = std::min<float>(dist,
+                        length(vector3<float>(world_vector(i->first - v->second))));
+        }
+
+        if (dist > radius_)
+        {
+            i = candidates_.erase(i);
+            continue;
+        }
+
+        float score (dist * i->second.next_phase);
+        if (score < best)
+        {
+            best = score;
+            pos = i->first;
+            phase = i->second.next_phase;
+        }
+        ++i;
+    }
+
+    if (best == std::numeric_limits<float>::max())
+        return false;
+    }
+
+    shared_compressed_data result;
+    bool failed (false);
+    try
+    {
+        result = world_.refine_lightmap(pos, phase);
+    }
+    catch (std::exception& e)
+    {
+        log_msg("cannot refine light map %1%: %2%", pos, std::string(e.what()));
+        failed = true;
+    }
+
+    std::vector<const void*> owners;
+    {
+    std::lock_guard<std::mutex> lock (lock_);
+    auto found (candidates_.find(pos));
+    if (found != candidates_.end())
+    {
+        owners = found->second.owners;
+        if (failed || phase + 1 >= world_.lightmap_phases())
+            candidates_.erase(found);
+        else
+            found->second.next_phase = phase + 1;
+    }
+    }
+
+    if (result)
+    {
+        ++refined_;
+        if (on_refined_ && !owners.empty())
+            on_refined_(pos, result, owners);
+    }
+
+    return true;
+}
+
+size_t
+lightmap_refiner::queued() const
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    return candidates_.size();
+}
+
+void
+lightmap_refiner::worker()
+{
+    for (;;)
+    {
+        {
+        std::lock_guard<std::mutex> lock (lock_);
+        if (stop_)
+            return;
+        }
+
+        // Back off while the pipeline is busy with new chunks, they're
+        // more important than better light.
+        if (pipeline_.is_idle() && refine_one())
+            continue;
+
+        std::unique_lock<std::mutex> lock (lock_);
+        wakeup_.wait_for(lock, std::chrono::milliseconds(100),
+                         [&]{ return stop_; });
+    }
+}
+
+} // namespace hexa
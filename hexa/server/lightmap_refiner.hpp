@@ -0,0 +1,145 @@
+//---------------------------------------------------------------------------
+/// \file   server/lightmap_refiner.hpp
+/// \brief  Upgrades light maps to higher phases in the background
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/compression.hpp>
+
+namespace hexa {
+
+class chunk_pipeline;
+class world;
+
+/** Refines the light maps that were sent to the players.
+ *  New light maps are generated at phase 0, which is fast but coarse,
+ *  so the players get to see the terrain as soon as possible.  This
+ *  class keeps track of the chunks the players have received, and
+ *  regenerates their light maps at the higher phases whenever the chunk
+ *  pipeline has nothing else to do.  Chunks close to a player are
+ *  refined first, and chunks that are out of everyone's range are
+ *  forgotten.
+ *
+ *  Every refinement is a single light map at a single phase, so the
+ *  background thread never keeps the CPU busy for long once new
+ *  requests come in.
+ *
+ * Example:
+ * @code
+
+lightmap_refiner refiner (world, pipeline,
+    [&](chunk_coordinates pos, const shared_compressed_data& light,
+        const std::vector<const void*>& owners)
+    {
+        for (auto o : owners)
+            send_lightmap(pos, light, o);
+    });
+refiner.start();
+refiner.add(peer, pos);
+
+ * @endcode */
+class lightmap_refiner
+{
+public:
+    /** Called with a refined light map, and the owners that should get
+     *  it. */
+    typedef std::function<void(chunk_coordinates,
+                               const shared_compressed_data&,
+                               const std::vector<const void*>&)> callback;
+
+public:
+    /** Constructor.
+     * @param w          The game world
+     * @param pipeline   Refinement only happens while this is idle
+     * @param on_refined Invoked from the background thread
+     * @param radius     Chunks further away from the owners than this
+     *                   number of chunks are not refined */
+    lightmap_refiner (world& w, chunk_pipeline& pipeline,
+                      callback on_refined, unsigned int radius = 8);
+
+    lightmap_refiner (const lightmap_refiner&) = delete;
+
+    ~lightmap_refiner();
+
+    /** Start the background thread. */
+    void start();
+
+    /** Stop the background thread. */
+    void stop();
+
+    /** Let the refiner know an owner has received a chunk. */
+    void add (const void* owner, chunk_coordinates pos);
+
+    /** Update the position of an owner. */
+    void update_viewer (const void* owner, chunk_coordinates pos);
+
+    /** Forget about an owner. */
+    void remove (const void* owner);
+
+    /** Refine the most urgent light map by one phase.
+     *  This is what the background thread does, it's only public for
+     *  the unit tests.
+     * @return False if there was nothing to do */
+    bool refine_one();
+
+    /** The number of chunks that might still need refining. */
+    size_t queued() const;
+
+    /** The number of light maps that were refined so far. */
+    size_t refined() const { return refined_; }
+
+private:
+    struct candidate
+    {
+        /** The next phase to try. */
+        unsigned int                next_phase;
+        /** The owners that have the chunk. */
+        std::vector<const void*>    owners;
+    };
+
+    void worker();
+
+private:
+    world&                  world_;
+    chunk_pipeline&         pipeline_;
+    callback                on_refined_;
+    const float             radius_;
+
+    mutable std::mutex      lock_;
+    std::condition_variable wakeup_;
+    std::unordered_map<chunk_coordinates, candidate> candidates_;
+    std::unordered_map<const void*, chunk_coordinates> viewers_;
+    bool                    stop_;
+
+    std::atomic<size_t>     refined_;
+    std::thread             thread_;
+};
+
+} // namespace hexa
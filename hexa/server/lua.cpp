@@ -37,6 +37,7 @@
 #include <hexa/trace.hpp>
 #include <hexa/vector3.hpp>
 #include <hexa/voxel_algorithm.hpp>
+#include <hexa/voxel_range.hpp>
 
 #include "player.hpp"
 #include "network.hpp"
@@ -86,6 +87,14 @@ static aabb<vector> vecf_to_bb (const vector& in)
     return aabb<vector>({-in.x, -in.y, 0.0f}, in);
 }
 
+static uint16_t to_material (const object& in)
+{
+    if (luabind::type(in) == LUA_TSTRING)
+        return find_material(object_cast<std::string>(in));
+
+    return object_cast<uint16_t>(in);
+}
+
 int add_file_and_line(lua_State* L)
 {
    lua_Debug d;
@@ -415,6 +424,8 @@ lua::lua(server_entity_system& entities, world &w)
         def("change_block", lua::change_block),
         def("change_block", lua::change_block_s),
         def("get_block", get_block),
+        def("edit_region", edit_region),
+        def("set_blocks", set_blocks),
         def("on_authenticate_player", on_authenticate_player),
         def("on_login", on_login),
         def("on_action", on_action),
@@ -1029,8 +1040,7 @@ void lua::change_block(const world_coordinates& p, uint16_t type)
     trace("Change block %1% to %2%", p, type);
     auto proxy (gameworld().acquire_write_access(p >> cnkshift));
     trace("(Got write access)");
-    auto& cnk (proxy.get_chunk(p >> cnkshift));
-    cnk[p % chunk_size] = type;
+    proxy[p] = type;
 }
 
 void lua::change_block_s(const world_coordinates& p, const std::string& type)
@@ -1056,6 +1066,53 @@ uint16_t lua::get_block(const world_coordinates& p)
     return hexa::get_block(gameworld(), p);
 }
 
+void lua::edit_region(const aabb<world_coordinates>& box,
+                      const object& callback)
+{
+    trace("Edit region %1%", box);
+    if (!box.is_correct())
+        return;
+
+    // The script gets to see every block first.  The world isn't locked
+    // while it runs, so it can look around on its own as well.
+    std::vector<std::pair<world_coordinates, uint16_t>> changes;
+    for (auto c : to_chunk_range(box))
+    {
+        chunk cnk (gameworld().acquire_read_access().get_chunk(c));
+
+        aabb<world_coordinates> cnk_box (c);
+        cnk_box *= chunk_size;
+        for (auto p : range<world_coordinates>(intersection(box, cnk_box)))
+        {
+            uint16_t old (cnk[p % chunk_size].type);
+            object result (call_function<object>(callback, p, old));
+            if (luabind::type(result) == LUA_TNIL)
+                continue;
+
+            uint16_t replace (to_material(result));
+            if (replace != old)
+                changes.emplace_back(p, replace);
+        }
+    }
+
+    hexa::set_blocks(gameworld(), changes);
+}
+
+void lua::set_blocks(const object& blocks)
+{
+    std::vector<std::pair<world_coordinates, uint16_t>> changes;
+    for (luabind::iterator i (blocks), end; i != end; ++i)
+    {
+        object entry (*i);
+        object pos (entry[1]), material (entry[2]);
+        changes.emplace_back(object_cast<world_coordinates>(pos),
+                             to_material(material));
+    }
+
+    trace("Set %1% blocks", changes.size());
+    hexa::set_blocks(gameworld(), changes);
+}
+
 luabind::object
 lua::raycast(const wfpos& origin, const yaw_pitch& dir, float range)
 {
@@ -36,6 +36,7 @@ extern "C" {
 #include <luabind/object.hpp>
 #include <boost/filesystem/path.hpp>
 
+#include <hexa/aabb.hpp>
 #include <hexa/basic_types.hpp>
 #include <hexa/ip_address.hpp>
 #include <hexa/ray.hpp>
@@ -105,6 +106,19 @@ public:
     static uint16_t
     get_block(const world_coordinates& p);
 
+    /** Change the blocks in a box.
+     *  The callback is called with the position and the material of
+     *  every block in the box, and returns its new material, or nil to
+     *  leave it alone.  All changes are written in one go. */
+    static void
+    edit_region(const aabb<world_coordinates>& box,
+                const luabind::object& callback);
+
+    /** Change a list of blocks in one go.
+     * @param blocks  A table of { position, material } pairs */
+    static void
+    set_blocks(const luabind::object& blocks);
+
     static luabind::object
     raycast(const wfpos& origin, const yaw_pitch& dir, float range);
 
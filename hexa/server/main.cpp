@@ -180,6 +180,26 @@ int main (int argc, char* argv[])
             "which game to start")
         ("log", po::value<bool>()->default_value(true),
             "log debug info to file")
+        ("cache-chunks", po::value<unsigned int>()->default_value(256),
+            "memory budget for the chunk cache, in MiB")
+        ("cache-surfaces", po::value<unsigned int>()->default_value(128),
+            "memory budget for the surface cache, in MiB")
+        ("cache-lightmaps", po::value<unsigned int>()->default_value(64),
+            "memory budget for the lightmap cache, in MiB")
+        ("cache-areas", po::value<unsigned int>()->default_value(32),
+            "memory budget for the area data cache, in MiB")
+        ("cache-heights", po::value<unsigned int>()->default_value(8),
+            "memory budget for the coarse height map cache, in MiB")
+        ("cache-compressed", po::value<unsigned int>()->default_value(64),
+            "memory budget for compressed surfaces and lightmaps, in MiB")
+        ("view-radius", po::value<unsigned int>()->default_value(32),
+            "drop chunk requests further away from the player than this, in chunks")
+        ("refine-radius", po::value<unsigned int>()->default_value(8),
+            "improve the light maps up to this distance from the player, in chunks")
+        ("update-rate", po::value<unsigned int>()->default_value(10),
+            "how many times per second changed chunks are sent to the players")
+        ("player-bandwidth", po::value<unsigned int>()->default_value(256),
+            "maximum bandwidth for sending changed chunks to a player, in KiB/s")
         ;
 
     po::options_description cmdline;
@@ -288,6 +308,17 @@ int main (int argc, char* argv[])
         //memory_cache                storage (db_per);
         hexa::server_entity_system  entities;
         hexa::world                 world (db_per);
+
+        auto mib ([&](const char* opt){ return size_t(vm[opt].as<unsigned int>()) << 20; });
+        cache_limits limits;
+        limits.chunks     = mib("cache-chunks");
+        limits.surfaces   = mib("cache-surfaces");
+        limits.lightmaps  = mib("cache-lightmaps");
+        limits.areas      = mib("cache-areas");
+        limits.heights    = mib("cache-heights");
+        limits.compressed = mib("cache-compressed");
+        world.set_cache_limits(limits);
+
         hexa::lua                   scripting (entities, world);
         hexa::network               server (vm["port"].as<unsigned int>(), world, entities, scripting);
         std::thread                 asio_thread ([&]{ io_srv.run(); log_msg("io_service::run() done"); });
@@ -369,7 +400,9 @@ int main (int argc, char* argv[])
         asio_thread.join();
 
         log_msg("Saving state...");
+        world.flush();
         db_per.store(entities);
+        db_per.flush();
 
         log_msg("Shutting down...");
     }
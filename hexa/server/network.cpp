@@ -21,10 +21,13 @@
 
 #include "network.hpp"
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <thread>
+#include <unordered_map>
 
 #include <boost/format.hpp>
 #include <boost/math/constants/constants.hpp>
@@ -84,6 +87,27 @@ network::network(uint16_t port, world& w, server_entity_system& entities,
     , world_    (w)
     , es_       (entities)
     , lua_      (scripting)
+    , pipeline_ (w)
+    , requests_ (pipeline_, global_settings.count("view-radius")
+                            ? global_settings["view-radius"].as<unsigned int>()
+                            : 32)
+    , refiner_  (w, pipeline_,
+                 [&](chunk_coordinates pos, const shared_compressed_data& light,
+                     const std::vector<const void*>& owners)
+                 { send_lightmap(pos, light, owners); },
+                 global_settings.count("refine-radius")
+                 ? global_settings["refine-radius"].as<unsigned int>()
+                 : 8)
+    , updates_  (global_settings.count("view-radius")
+                 ? global_settings["view-radius"].as<unsigned int>()
+                 : 32,
+                 (global_settings.count("player-bandwidth")
+                  ? global_settings["player-bandwidth"].as<unsigned int>()
+                  : 256) * 1024)
+    , update_interval_ (std::chrono::milliseconds(1000 /
+                 std::max(1u, global_settings.count("update-rate")
+                              ? global_settings["update-rate"].as<unsigned int>()
+                              : 10)))
     , running_  (false)
 {
     world_.on_update_surface.connect([&](chunk_coordinates pos)
@@ -95,6 +119,8 @@ network::network(uint16_t port, world& w, server_entity_system& entities,
     {
         send_coarse_height(pos);
     });
+
+    refiner_.start();
 }
 
 network::~network()
@@ -106,6 +132,7 @@ void network::run()
 {
     running_.store(true);
     int count (0);
+    auto next_update (update_queue::clock::now());
     //auto last_tick (steady_clock::now());
     //auto started (last_tick);
 
@@ -141,30 +168,8 @@ void network::run()
         // Send changes in the entity system
         ++count;
         //count = total_seconds * 20;
-        if (count % 200 == 0)
-        {
-            //trace("network tick");
-
-            msg::entity_update_physics msg;
-            auto lock (es_.acquire_read_lock());
-
-            es_.for_each<wfpos, vector>(entity_system::c_position,
-                                        entity_system::c_velocity,
-                [&](es::storage::iterator i,
-                    wfpos& p_,
-                    vector& v_)
-            {
-                msg.updates.emplace_back(i->first, p_, v_);
-                return false;
-            });
-
-            auto n (clock::now());
-            for (auto& c : connections_)
-            {
-                msg.timestamp = n - clock_offset_[c.second];
-                send(c.second, serialize_packet(msg), msg.method());
-            }
-        }
+        if (count % 50 == 0)
+            send_entities();
 
         if (count % 899 == 0)
         {
@@ -189,6 +194,19 @@ void network::run()
             }
         }
 
+        // Bring the chunk requests up to date with where the players
+        // are, and keep the pipeline busy.
+        if (count % 20 == 0)
+            dispatch_requests();
+
+        // Send the chunks that changed since the last time.
+        auto now (update_queue::clock::now());
+        if (now >= next_update)
+        {
+            flush_updates(now);
+            next_update = now + update_interval_;
+        }
+
         // Flush caches every now and then
         if (count % 2077 == 0)
         {
@@ -307,6 +325,10 @@ void network::on_connect (ENetPeer* c)
 void network::on_disconnect (ENetPeer* c)
 {
     clock_offset_.erase(c);
+    requests_.remove(c);
+    refiner_.remove(c);
+    updates_.remove(c);
+    replication_.remove(c);
 
     auto e (entities_.find(c));
     if (e == entities_.end())
@@ -354,6 +376,7 @@ void network::on_receive (ENetPeer* c, const packet& p)
         case msg::request_heights::msg_id:  req_heights (info);     break;
         case msg::request_surfaces::msg_id: req_chunks  (info);     break;
         case msg::look_at::msg_id:          look_at     (info);     break;
+        case msg::entity_snapshot_ack::msg_id: snapshot_ack(info);  break;
         case msg::motion::msg_id:           motion      (info);     break;
         case msg::button_press::msg_id:     button_press(info);     break;
         case msg::button_release::msg_id:   button_release(info);   break;
@@ -395,40 +418,52 @@ void network::send_surface(const chunk_coordinates& cpos)
     trace("broadcast surface %1%", world_vector(cpos - world_chunk_center));
     auto proxy (world_.acquire_read_access());
 
-    msg::surface_update reply;
-    reply.position = cpos;
-    reply.terrain  = proxy.get_compressed_surface(cpos);
-    reply.light    = proxy.get_compressed_lightmap(cpos);
+    // The packet is built once, and shared by everyone who gets it.
+    auto packet (std::make_shared<const binary_data>(
+        msg::serialize_surface_update(cpos, *proxy.get_compressed_surface(cpos),
+                                            *proxy.get_compressed_lightmap(cpos))));
 
     for (auto& conn : connections_)
     {
         auto plr_pos (es_.get<wfpos>(conn.first, entity_system::c_position));
         auto dist (manhattan_distance(cpos, plr_pos.pos / chunk_size));
         if (dist < 64)
-            send(conn.second, serialize_packet(reply), reply.method());
+        {
+            send(conn.second, packet, msg::surface_update().method());
+            refiner_.add(conn.second, cpos);
+        }
     }
 }
 
-void network::send_surface_queue(const chunk_coordinates& cpos, ENetPeer* dest)
-{
-    trace("new job: surface %1%", world_vector(cpos - world_chunk_center));
-    jobs.push({ job::surface_and_lightmap, cpos, dest });
-}
-
 void network::send_surface(const chunk_coordinates& cpos, ENetPeer* dest)
 {
     trace("send surface %1%", world_vector(cpos - world_chunk_center));
     auto proxy (world_.acquire_read_access());
 
-    msg::surface_update reply;
-    reply.position = cpos;
-    reply.terrain  = proxy.get_compressed_surface(cpos);
-    reply.light    = proxy.get_compressed_lightmap(cpos);
+    auto packet (std::make_shared<const binary_data>(
+        msg::serialize_surface_update(cpos, *proxy.get_compressed_surface(cpos),
+                                            *proxy.get_compressed_lightmap(cpos))));
 
-    send(dest, serialize_packet(reply), reply.method());
+    send(dest, packet, msg::surface_update().method());
+    refiner_.add(dest, cpos);
     trace("send surface %1% done", world_vector(cpos - world_chunk_center));
 }
 
+void network::send_lightmap(const chunk_coordinates& cpos,
+                            const shared_compressed_data& light,
+                            const std::vector<const void*>& dest)
+{
+    trace("send refined lightmap %1%", world_vector(cpos - world_chunk_center));
+
+    msg::lightmap_update msg;
+    msg.position = cpos;
+    msg.data = *light;
+    auto packet (std::make_shared<const binary_data>(serialize_packet(msg)));
+
+    for (auto peer : dest)
+        send(static_cast<ENetPeer*>(const_cast<void*>(peer)), packet, msg.method());
+}
+
 void network::send_coarse_height(chunk_coordinates pos)
 {
     trace("broadcast heightmap %1%", map_rel_coordinates(pos - map_chunk_center));
@@ -685,8 +720,12 @@ void network::login (packet_info& info)
         pcp.z = ch - 1;
 
     trace("Request terrain %1% for player", pcp);
-    workers_.enqueue([=]{ prepare_for_player(world_, pcp);
-                          send_surface_queue(pcp, info.conn); });
+    auto conn (info.conn);
+    requests_.update_viewer(conn, start_pos / chunk_size, yaw_pitch(0, 0));
+    refiner_.update_viewer(conn, start_pos / chunk_size);
+    updates_.update_viewer(conn, start_pos / chunk_size);
+    requests_.request(conn, pcp, [=](chunk_coordinates p){ send_surface(p, conn); });
+    requests_.dispatch();
 
 /*
     try
@@ -872,8 +911,8 @@ void network::req_chunks (const packet_info& info)
             }
 
             // If all the data we need is available, send it immediately.
-            // Otherwise, send a job down the queue and ask the terrain
-            // generator to call us back when it's done.
+            // Otherwise, queue it for the chunk pipeline, which will call
+            // us back when it's done.
             //
             if (chunk_ok && light_ok)
             {
@@ -883,10 +922,9 @@ void network::req_chunks (const packet_info& info)
             else
             {
                 trace("generate surface and lightmap");
-                workers_.enqueue( [=]{
-                    prepare_for_player(world_, req.position);
-                    send_surface_queue(req.position, info.conn);
-                });
+                auto conn (info.conn);
+                requests_.request(conn, req.position,
+                    [=](chunk_coordinates p){ send_surface(p, conn); });
             }
         }
         catch (std::exception& e)
@@ -897,6 +935,29 @@ void network::req_chunks (const packet_info& info)
     }
 }
 
+void network::dispatch_requests()
+{
+    {
+    auto lock (es_.acquire_read_lock());
+    es_.for_each<wfpos, yaw_pitch>(entity_system::c_position,
+                                   entity_system::c_lookat,
+        [&](es::storage::iterator i, wfpos& p_, yaw_pitch& look)
+    {
+        auto conn (connections_.find(i->first));
+        if (conn != connections_.end())
+        {
+            requests_.update_viewer(conn->second, p_.pos / chunk_size, look);
+            refiner_.update_viewer(conn->second, p_.pos / chunk_size);
+            updates_.update_viewer(conn->second, p_.pos / chunk_size);
+        }
+
+        return false;
+    });
+    }
+
+    requests_.dispatch();
+}
+
 void network::motion (const packet_info& info)
 {
     auto msg (make<msg::motion>(info.p));
@@ -932,6 +993,12 @@ void network::look_at (const packet_info& info)
     es_.set_lookat(info.plr, msg.look);
 }
 
+void network::snapshot_ack (const packet_info& info)
+{
+    auto msg (make<msg::entity_snapshot_ack>(info.p));
+    replication_.acknowledge(info.conn, msg.sequence);
+}
+
 void network::button_press (const packet_info& info)
 {
     auto msg (make<msg::button_press>(info.p));
@@ -1056,8 +1123,82 @@ void network::tick()
 
 void network::on_update_surface (const chunk_coordinates& pos)
 {
-    for (auto& conn : connections_)
-        send_surface_queue(pos, conn.second);
+    // This is called by whichever thread changed the world, so the
+    // surface is only marked here.  It goes out in flush_updates().
+    updates_.changed(pos);
+}
+
+void network::send_entities ()
+{
+    std::vector<entity_replicator::entity> all;
+    {
+    auto lock (es_.acquire_read_lock());
+    es_.for_each<wfpos, yaw_pitch>(entity_system::c_position,
+                                   entity_system::c_lookat,
+        [&](es::storage::iterator i, wfpos& p_, yaw_pitch& look)
+    {
+        auto conn (connections_.find(i->first));
+        if (conn != connections_.end())
+            replication_.update_viewer(conn->second, i->first, p_, look);
+
+        return false;
+    });
+
+    es_.for_each<wfpos, vector>(entity_system::c_position,
+                                entity_system::c_velocity,
+        [&](es::storage::iterator i, wfpos& p_, vector& v_)
+    {
+        all.push_back({ i->first, p_, v_ });
+        return false;
+    });
+    }
+
+    auto n (clock::now());
+    replication_.tick(all, [&](const void* owner, msg::entity_snapshot& m)
+    {
+        auto dest (static_cast<ENetPeer*>(const_cast<void*>(owner)));
+        m.timestamp = n - clock_offset_[dest];
+        send(dest, serialize_packet(m), m.method());
+    });
+}
+
+void network::flush_updates (update_queue::clock::time_point now)
+{
+    // Every chunk is packed once, no matter how many players get it.
+    std::unordered_map<chunk_coordinates,
+                       std::shared_ptr<const binary_data>> packets;
+
+    updates_.flush(now, [&](const void* owner, chunk_coordinates pos)
+    {
+        trace("send update %1%", world_vector(pos - world_chunk_center));
+        auto& packet (packets[pos]);
+        if (!packet)
+        {
+            auto proxy (world_.acquire_read_access());
+            auto srf (proxy.get_compressed_surface(pos));
+            auto light (proxy.get_compressed_lightmap(pos));
+            auto history (proxy.get_compressed_history(pos));
+
+            // The recent changes are usually a lot smaller than the
+            // whole surface.  Clients that missed too many of them will
+            // ask for the rest.
+            if (history && history->size() < srf->size() + light->size())
+            {
+                packet = std::make_shared<const binary_data>(
+                    msg::serialize_surface_delta(pos, *history));
+            }
+            else
+            {
+                packet = std::make_shared<const binary_data>(
+                    msg::serialize_surface_update(pos, *srf, *light));
+            }
+        }
+
+        auto dest (static_cast<ENetPeer*>(const_cast<void*>(owner)));
+        send(dest, packet, msg::surface_update().method());
+        refiner_.add(dest, pos);
+        return packet->size();
+    });
 }
 
 } // namespace hexa
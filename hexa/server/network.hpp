@@ -32,8 +32,12 @@
 
 #include <hexa/concurrent_queue.hpp>
 #include <hexa/ray.hpp>
-#include <hexa/threadpool.hpp>
 
+#include "chunk_pipeline.hpp"
+#include "entity_replicator.hpp"
+#include "lightmap_refiner.hpp"
+#include "request_queue.hpp"
+#include "update_queue.hpp"
 #include "udp_server.hpp"
 #include "player.hpp"
 
@@ -100,26 +104,46 @@ private:
     void button_press   (const packet_info& p);
     void button_release (const packet_info& p);
     void look_at        (const packet_info& p);
+    void snapshot_ack   (const packet_info& p);
     void motion         (const packet_info& p);
     void console        (const packet_info& p);
     void unknown        (const packet_info& p);
 
 private:
     void tick();
+    void dispatch_requests();
     void send_surface (const chunk_coordinates& pos);
-    void send_surface_queue (const chunk_coordinates& pos, ENetPeer* dest);
     void send_surface (const chunk_coordinates& pos, ENetPeer* dest);
+    void send_lightmap (const chunk_coordinates& pos,
+                        const shared_compressed_data& light,
+                        const std::vector<const void*>& dest);
     void send_coarse_height (chunk_coordinates pos);
     void send_height  (const map_coordinates& pos, ENetPeer* dest);
     void kick_player  (ENetPeer* dest, const std::string& kickmsg);
 
     void on_update_surface (const chunk_coordinates& pos);
+    void flush_updates (update_queue::clock::time_point now);
+    void send_entities ();
 
 private:
     world&                  world_;
     server_entity_system&   es_;
     lua&                    lua_;
-    threadpool              workers_;
+    /** Prepares chunks for the players.  The callbacks send the
+     *  surfaces straight from the pipeline's worker threads; this is
+     *  safe because udp_server::send() is guarded by a mutex, and ENet
+     *  doesn't free its peers until the host is destroyed. */
+    chunk_pipeline          pipeline_;
+    /** Decides which of the players' requests go to the pipeline next. */
+    request_queue           requests_;
+    /** Sends better light maps to the players when there's time. */
+    lightmap_refiner        refiner_;
+    /** Sends the chunks that changed to the players who can see them. */
+    update_queue            updates_;
+    /** How often updates_ is flushed. */
+    update_queue::clock::duration update_interval_;
+    /** Sends the players the entities around them. */
+    entity_replicator       replication_;
 
     std::unordered_map<ENetPeer*, uint64_t> clock_offset_;
     std::unordered_map<ENetPeer*, uint32_t> entities_;
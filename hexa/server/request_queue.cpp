@@ -0,0 +1,275 @@
+//---------------------------------------------------------------------------
+// server/request_queue.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "request_queue.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <hexa/algorithm.hpp>
+
+namespace hexa {
+
+request_queue::request_queue (chunk_pipeline& pipeline,
+                              unsigned int view_radius,
+                              size_t max_in_flight,
+                              size_t max_per_player,
+                              clock::duration deadline)
+    : pipeline_         (pipeline)
+    , view_radius_      (view_radius)
+    , max_in_flight_    (std::max<size_t>(1, max_in_flight))
+    , max_per_player_   (std::max<size_t>(1, max_per_player))
+    , deadline_         (deadline)
+    , last_served_      (nullptr)
+    , in_flight_        (0)
+    , dispatched_       (0)
+    , expired_          (0)
+    , out_of_range_     (0)
+{
+}
+
+float
+request_queue::priority (chunk_coordinates viewer,
+                         const vector3<float>& look,
+                         chunk_coordinates pos)
+{
+    vector3<float> rel (world_vector(pos - viewer));
+    float dist (length(rel));
+    if (dist < 2.f)
+        return dist;
+
+    return dist * (2.f - dot_prod(rel, look) / dist);
+}
+
+void
+request_queue::update_viewer (const void* owner, chunk_coordinates pos,
+                              yaw_pitch look)
+{
+    auto dir (from_spherical(look));
+
+    std::lock_guard<std::mutex> lock (lock_);
+    auto& p (players_[owner]);
+
+    // Don't bother resorting the queue if the player is only fidgeting.
+    if (   p.has_viewer && p.pos == pos
+        && dot_prod(p.look, dir) > std::cos(0.1f))
+    {
+        return;
+    }
+
+    p.has_viewer = true;
+    p.pos = pos;
+    p.look = dir;
+    p.sorted = false;
+}
+
+void
+request_queue::request (const void* owner, chunk_coordinates pos,
+                        callback on_done)
+{
+    const auto deadline (clock::now() + deadline_);
+
+    std::lock_guard<std::mutex> lock (lock_);
+    auto& p (players_[owner]);
+
+    if (!p.has_viewer)
+    {
+        p.has_viewer = true;
+        p.pos = pos;
+    }
+
+    auto flying (p.in_flight.find(pos));
+    if (flying != p.in_flight.end())
+    {
+        flying->second = deadline;
+        return;
+    }
+
+    if (p.queued.count(pos))
+    {
+        for (auto& r : p.queue)
+        {
+            if (r.pos == pos)
+            {
+                r.deadline = deadline;
+                break;
+            }
+        }
+        return;
+    }
+
+    p.queued.insert(pos);
+    p.queue.push_back({ pos, deadline, std::move(on_done), 0.f });
+    p.sorted = false;
+}
+
+void
+request_queue::remove (const void* owner)
+{
+    {
+    std::lock_guard<std::mutex> lock (lock_);
+    auto found (players_.find(owner));
+    if (found == players_.end())
+        return;
+
+    in_flight_ -= found->second.in_flight.size();
+    if (last_served_ == owner)
+        last_served_ = nullptr;
+
+    players_.erase(found);
+    }
+
+    pipeline_.cancel(owner);
+}
+
+void
+request_queue::prune (player& p, clock::time_point now)
+{
+    // Requests that made it to the pipeline but never came back, because
+    // the chunk couldn't be generated, shouldn't take up a slot forever.
+    for (auto i (p.in_flight.begin()); i != p.in_flight.end(); )
+    {
+        if (i->second < now)
+        {
+            i = p.in_flight.erase(i);
+            --in_flight_;
+            ++expired_;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    auto last (std::remove_if(p.queue.begin(), p.queue.end(),
+        [&](const pending& r)
+    {
+        if (r.deadline < now)
+            ++expired_;
+        else if (length(vector3<float>(world_vector(r.pos - p.pos))) > view_radius_)
+            ++out_of_range_;
+        else
+            return false;
+
+        p.queued.erase(r.pos);
+        return true;
+    }));
+    p.queue.erase(last, p.queue.end());
+
+    if (!p.sorted)
+    {
+        for (auto& r : p.queue)
+            r.prio = priority(p.pos, p.look, r.pos);
+
+        std::sort(p.queue.begin(), p.queue.end(),
+                  [](const pending& a, const pending& b)
+                  { return a.prio > b.prio; });
+
+        p.sorted = true;
+    }
+}
+
+void
+request_queue::dispatch (clock::time_point now)
+{
+    std::vector<job> jobs;
+
+    {
+    std::lock_guard<std::mutex> lock (lock_);
+    for (auto& p : players_)
+        prune(p.second, now);
+
+    // Hand out the free slots one at a time, starting with the player
+    // after the one that was served last.
+    bool progress (true);
+    while (in_flight_ < max_in_flight_ && progress)
+    {
+        progress = false;
+        auto start (players_.upper_bound(last_served_));
+        for (size_t n (0); n < players_.size() && in_flight_ < max_in_flight_; ++n)
+        {
+            if (start == players_.end())
+                start = players_.begin();
+
+            auto& p (start->second);
+            if (!p.queue.empty() && p.in_flight.size() < max_per_player_)
+            {
+                auto& r (p.queue.back());
+                p.queued.erase(r.pos);
+                p.in_flight[r.pos] = r.deadline;
+                jobs.emplace_back(start->first, std::move(r));
+                p.queue.pop_back();
+
+                ++in_flight_;
+                ++dispatched_;
+                last_served_ = start->first;
+                progress = true;
+            }
+            ++start;
+        }
+    }
+    }
+
+    // The pipeline might have to go to storage to find out what needs to
+    // be done, so this happens after releasing the lock.
+    for (auto& j : jobs)
+    {
+        auto owner (j.first);
+        auto on_done (std::move(j.second.on_done));
+        pipeline_.request(j.second.pos, owner,
+            [=](chunk_coordinates pos)
+            {
+                finished(owner, pos);
+                on_done(pos);
+                dispatch();
+            });
+    }
+}
+
+void
+request_queue::finished (const void* owner, chunk_coordinates pos)
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    auto found (players_.find(owner));
+    if (found == players_.end())
+        return;
+
+    if (found->second.in_flight.erase(pos))
+        --in_flight_;
+}
+
+request_queue::statistics
+request_queue::stats() const
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    statistics result;
+    result.queued       = 0;
+    result.in_flight    = in_flight_;
+    result.dispatched   = dispatched_;
+    result.expired      = expired_;
+    result.out_of_range = out_of_range_;
+
+    for (auto& p : players_)
+        result.queued += p.second.queue.size();
+
+    return result;
+}
+
+} // namespace hexa
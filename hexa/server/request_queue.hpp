@@ -0,0 +1,195 @@
+//---------------------------------------------------------------------------
+/// \file   server/request_queue.hpp
+/// \brief  Per-player priority queues for chunk requests
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/vector3.hpp>
+
+#include "chunk_pipeline.hpp"
+
+namespace hexa {
+
+/** Decides which chunk requests are handed to the chunk pipeline next.
+ *  Every player gets a queue of its own, sorted by how soon the player
+ *  is going to need a chunk: close by and in front of the camera goes
+ *  first, far away and behind the player last.  Only a limited number
+ *  of requests is given to the pipeline at any time, so the queues can
+ *  still be reordered when a player moves or turns around.
+ *
+ *  Requests for chunks that have left the player's view radius are
+ *  dropped, and so are requests that have waited longer than the
+ *  deadline; the client will ask again if it still needs them.  The
+ *  free slots in the pipeline are handed out round-robin, one request
+ *  per player at a time, so a player who is exploring fast cannot
+ *  starve the others.
+ *
+ * Example:
+ * @code
+
+request_queue queue (pipeline);
+queue.update_viewer(peer, player_chunk, head_angle);
+queue.request(peer, pos, [=](chunk_coordinates p){ send_surface(p, peer); });
+queue.dispatch();
+
+ * @endcode */
+class request_queue
+{
+public:
+    typedef std::chrono::steady_clock   clock;
+    typedef chunk_pipeline::callback    callback;
+
+    struct statistics
+    {
+        /** Requests waiting in the queues. */
+        size_t  queued;
+        /** Requests handed to the pipeline that haven't finished yet. */
+        size_t  in_flight;
+        /** Total number of requests handed to the pipeline. */
+        size_t  dispatched;
+        /** Requests that were dropped because they took too long. */
+        size_t  expired;
+        /** Requests that were dropped because the player moved away. */
+        size_t  out_of_range;
+    };
+
+public:
+    /** Constructor.
+     * @param pipeline      The pipeline that does the actual work
+     * @param view_radius   Requests further away from the player than
+     *                      this number of chunks are dropped
+     * @param max_in_flight Maximum number of requests in the pipeline,
+     *                      for all players combined
+     * @param max_per_player Maximum number of requests in the pipeline
+     *                      for a single player
+     * @param deadline      Requests that haven't been handled within
+     *                      this time are dropped */
+    request_queue (chunk_pipeline& pipeline,
+                   unsigned int view_radius = 32,
+                   size_t max_in_flight = 64,
+                   size_t max_per_player = 16,
+                   clock::duration deadline = std::chrono::seconds(30));
+
+    request_queue (const request_queue&) = delete;
+
+    /** Tell the queue where a player is, and which way it is looking.
+     *  Until this is called, a player's requests are served in order of
+     *  distance to the first chunk it asked for. */
+    void update_viewer (const void* owner, chunk_coordinates pos,
+                        yaw_pitch look);
+
+    /** Queue a request.
+     *  Asking for a chunk that is already queued or in the pipeline for
+     *  the same player only resets its deadline.
+     * @param owner     Identifies the player
+     * @param pos       The chunk's position
+     * @param on_done   Invoked from one of the pipeline's worker threads
+     *                  once the surface and light map are available */
+    void request (const void* owner, chunk_coordinates pos,
+                  callback on_done);
+
+    /** Forget about a player, and cancel its callbacks in the pipeline. */
+    void remove (const void* owner);
+
+    /** Drop requests that are out of range or too old, and fill up the
+     *  free slots in the pipeline.  This is also done automatically
+     *  every time a request is finished. */
+    void dispatch (clock::time_point now = clock::now());
+
+    statistics stats() const;
+
+    /** How urgently a viewer needs a given chunk, lower is sooner.
+     *  This is the distance in chunks, multiplied by a factor that goes
+     *  from 1 for chunks straight ahead to 3 for chunks right behind.
+     *  The chunks directly around the player always count as being in
+     *  front of it, since they're needed no matter where it looks.
+     * @param viewer    The chunk the viewer is in
+     * @param look      The direction the viewer is looking in, must be
+     *                  normalized
+     * @param pos       The chunk to rate */
+    static float priority (chunk_coordinates viewer,
+                           const vector3<float>& look,
+                           chunk_coordinates pos);
+
+private:
+    struct pending
+    {
+        chunk_coordinates   pos;
+        clock::time_point   deadline;
+        callback            on_done;
+        float               prio;
+    };
+
+    struct player
+    {
+        player() : has_viewer (false), look (1, 0, 0), sorted (true) { }
+
+        bool                has_viewer;
+        chunk_coordinates   pos;
+        vector3<float>      look;
+
+        /** Waiting requests.  Once sorted, the most urgent one is at
+         *  the back. */
+        std::vector<pending> queue;
+        std::unordered_set<chunk_coordinates> queued;
+        bool                sorted;
+
+        /** Requests in the pipeline, with their deadlines. */
+        std::unordered_map<chunk_coordinates, clock::time_point> in_flight;
+    };
+
+    typedef std::pair<const void*, pending> job;
+
+private:
+    /** Remove stale requests and sort the queue.  The caller must hold
+     *  lock_. */
+    void prune (player& p, clock::time_point now);
+
+    /** Called by the pipeline when a request is done. */
+    void finished (const void* owner, chunk_coordinates pos);
+
+private:
+    chunk_pipeline&         pipeline_;
+    const float             view_radius_;
+    const size_t            max_in_flight_;
+    const size_t            max_per_player_;
+    const clock::duration   deadline_;
+
+    mutable std::mutex      lock_;
+    std::map<const void*, player> players_;
+    /** The player that got the last free slot. */
+    const void*             last_served_;
+    size_t                  in_flight_;
+
+    size_t                  dispatched_;
+    size_t                  expired_;
+    size_t                  out_of_range_;
+};
+
+} // namespace hexa
@@ -22,12 +22,14 @@
 #include "cave_generator.hpp"
 
 #include <cassert>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <boost/math/constants/constants.hpp>
 
 #include <hexa/block_types.hpp>
+#include <hexa/clock_cache.hpp>
 #include <hexa/container_uptr.hpp>
-#include <hexa/lru_cache.hpp>
 #include <hexa/trace.hpp>
 #include <hexa/voxel_range.hpp>
 
@@ -69,10 +71,15 @@ struct cave_generator::impl
 #endif
     };
 
-    /** Most recently used caves. */
-    lru_cache<cave_section, cave>  cache;
-
+    typedef std::shared_ptr<const cave> cave_ptr;
 
+    /** Recently used caves.  Several chunks can be generated at the
+     ** same time, so the cache is guarded by a mutex.  The caves are
+     ** never changed once they're made, and a shared pointer keeps them
+     ** alive while a chunk is being carved, even if they are evicted
+     ** by another thread in the meantime. */
+    clock_cache<cave_section, cave_ptr>  cache;
+    std::mutex                           cache_lock;
 
     impl(const ptree& conf)
         : section_size(8, 8, 4)
@@ -139,45 +146,70 @@ struct cave_generator::impl
         return result;
     }
 
-    const cave& get_cave (cave_section pos)
+    cave_ptr get_cave (cave_section pos)
     {
+        {
+        std::lock_guard<std::mutex> lock (cache_lock);
         auto cached (cache.try_get(pos));
         if (cached)
             return *cached;
+        }
+
+        // Making a cave takes a while, so other threads are allowed to
+        // use the cache in the meantime.  If two threads make the same
+        // cave, the first one wins.
+        auto made (std::make_shared<const cave>(make_cave(pos)));
 
+        std::lock_guard<std::mutex> lock (cache_lock);
+        auto& result (cache[pos]);
+        if (result == nullptr)
+            result = std::move(made);
+
+        auto copy (result);
         cache.prune(128);
-        return cache[pos] = make_cave(pos);
+        return copy;
     }
 
     void generate(world_terraingen_access& data,
                   const chunk_coordinates& pos,
                   chunk& cnk)
     {
+        // Mark everything that has to be carved out first, so every block
+        // is written at most once, no matter how many shapes overlap.
+        csg::chunk_mask carve;
+        carve.fill(0);
+        bool empty (true);
+
         cave_section csp (pos / section_size);
         for (auto i : surroundings(csp, 1))
         {
             vec3f offset (world_vector(pos - (i * section_size)) * chunk_size);
 
-            auto& cavesystem (get_cave(i));
+            auto cavesystem_ptr (get_cave(i));
+            auto& cavesystem (*cavesystem_ptr);
             auto found (cavesystem.part_map.find(pos));
             if (found != cavesystem.part_map.end())
             {
-                for (auto k : every_block_in_chunk)
+                for (auto index : found->second)
+                    cavesystem.parts[index]->rasterize(offset, carve);
+
+                empty = false;
+            }
+        }
+
+        if (empty)
+            return;
+
+        const chunk& read_only (cnk);
+        for (uint8_t y (0); y < chunk_size; ++y)
+        {
+            for (uint8_t x (0); x < chunk_size; ++x)
+            {
+                auto column (carve[x + y * chunk_size]);
+                for (uint8_t z (0); column != 0; ++z, column >>= 1)
                 {
-                    auto& blk (cnk[k]);
-                    if (blk == type::air)
-                        continue;
-
-                    vec3f blkpos (offset + vec3f(k));
-                    for (auto index : found->second)
-                    {
-                        auto& carve_shape (cavesystem.parts[index]);
-                        if (carve_shape->is_inside(blkpos))
-                        {
-                            blk = type::air;
-                            break;
-                        }
-                    }
+                    if ((column & 1) && read_only(x, y, z) != type::air)
+                        cnk(x, y, z) = type::air;
                 }
             }
         }
@@ -38,6 +38,11 @@ class world;
  * The server generates the game world on the fly.  This is done by a chain of
  * generation modules.  Usually, the first few create the general shape of the
  * land, and later modules add ores, strata, flora, caves, and other details.
+ *
+ * The world generates several chunks at the same time, so generate() can be
+ * called from different threads at once, for different chunks.  Modules
+ * that keep state between calls, such as caches, have to protect it.
+ * Height estimates and area data are still produced one at a time.
  */
 class terrain_generator_i
 {
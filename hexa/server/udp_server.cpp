@@ -21,6 +21,8 @@
 
 #include "udp_server.hpp"
 
+#include <cassert>
+#include <new>
 #include <stdexcept>
 #include <string>
 #include <boost/format.hpp>
@@ -30,6 +32,27 @@ using boost::format;
 
 namespace hexa {
 
+namespace {
+
+uint32_t packet_flags (msg::reliability method)
+{
+    switch (method)
+    {
+    case msg::unreliable: return ENET_PACKET_FLAG_UNSEQUENCED;
+    case msg::reliable:
+    case msg::sequenced:  return ENET_PACKET_FLAG_RELIABLE;
+    }
+    return 0;
+}
+
+/** Release the shared buffer once ENet is done with a packet. */
+void release_shared_packet (ENetPacket* pkt)
+{
+    delete static_cast<shared_packet*>(pkt->userData);
+}
+
+} // anonymous namespace
+
 udp_server::udp_server(uint16_t port, uint16_t max_users)
     : sv_ (nullptr)
 {
@@ -85,22 +108,33 @@ void udp_server::poll (uint16_t milliseconds)
 void udp_server::send (ENetPeer* peer, const binary_data& msg,
                        msg::reliability method) const
 {
-    uint32_t flags (0);
-
-    switch (method)
-    {
-    case msg::unreliable: flags = ENET_PACKET_FLAG_UNSEQUENCED; break;
-    case msg::reliable:
-    case msg::sequenced:  flags = ENET_PACKET_FLAG_RELIABLE; break;
-    }
-
-    auto pkt (enet_packet_create(&msg[0], msg.size(), flags));
+    auto pkt (enet_packet_create(&msg[0], msg.size(), packet_flags(method)));
     {
     boost::lock_guard<boost::mutex> lock (enet_mutex_);
     enet_peer_send(peer, 0, pkt);
     }
 }
 
+void udp_server::send (ENetPeer* peer, const shared_packet& msg,
+                       msg::reliability method) const
+{
+    assert(msg && !msg->empty());
+
+    // ENet doesn't modify the data of NO_ALLOCATE packets, the const_cast
+    // is only there to satisfy its interface.
+    auto pkt (enet_packet_create(const_cast<uint8_t*>(&(*msg)[0]), msg->size(),
+                                 packet_flags(method) | ENET_PACKET_FLAG_NO_ALLOCATE));
+    if (!pkt)
+        throw std::bad_alloc();
+
+    pkt->userData = new shared_packet(msg);
+    pkt->freeCallback = release_shared_packet;
+
+    boost::lock_guard<boost::mutex> lock (enet_mutex_);
+    if (enet_peer_send(peer, 0, pkt) < 0)
+        enet_packet_destroy(pkt);
+}
+
 void udp_server::disconnect (ENetPeer* peer)
 {
     enet_peer_disconnect_now(peer, 0);
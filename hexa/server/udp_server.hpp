@@ -22,6 +22,7 @@
 
 #pragma once
 
+#include <memory>
 #include <vector>
 #include <boost/thread/mutex.hpp>
 #include <enet/enet.h>
@@ -29,6 +30,10 @@
 
 namespace hexa {
 
+/** A serialized message that can be sent to several peers at once.
+ *  The buffer must not be modified once it has been created. */
+typedef std::shared_ptr<const binary_data> shared_packet;
+
 class udp_server
 {
 public:
@@ -40,6 +45,13 @@ public:
     void send (ENetPeer* dest, const binary_data& msg,
                msg::reliability method) const;
 
+    /** Send a shared message.
+     *  Unlike the other version of send(), this doesn't make a copy of
+     *  the data.  ENet refers to the buffer directly, and keeps it alive
+     *  until the packet has been delivered. */
+    void send (ENetPeer* dest, const shared_packet& msg,
+               msg::reliability method) const;
+
     void broadcast (const binary_data& msg,
                     msg::reliability method) const;
 
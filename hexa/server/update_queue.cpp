@@ -0,0 +1,199 @@
+//---------------------------------------------------------------------------
+// server/update_queue.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "update_queue.hpp"
+
+#include <algorithm>
+#include <tuple>
+#include <vector>
+#include <hexa/algorithm.hpp>
+
+namespace hexa {
+
+update_queue::update_queue (unsigned int view_radius, size_t budget)
+    : view_radius_  (view_radius)
+    , budget_       (std::max<size_t>(1, budget))
+    , sent_         (0)
+    , bytes_        (0)
+    , coalesced_    (0)
+    , out_of_range_ (0)
+    , throttled_    (0)
+{
+}
+
+bool
+update_queue::in_range (const player& p, chunk_coordinates pos) const
+{
+    return squared_length(world_vector(pos - p.pos))
+           <= view_radius_ * view_radius_;
+}
+
+void
+update_queue::update_viewer (const void* owner, chunk_coordinates pos)
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    auto& p (players_[owner]);
+    p.has_viewer = true;
+    p.pos = pos;
+}
+
+void
+update_queue::remove (const void* owner)
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    players_.erase(owner);
+}
+
+void
+update_queue::changed (chunk_coordinates pos)
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    for (auto& p : players_)
+    {
+        if (!p.second.has_viewer)
+            continue;
+
+        if (!in_range(p.second, pos))
+            ++out_of_range_;
+        else if (!p.second.dirty.insert(pos).second)
+            ++coalesced_;
+    }
+}
+
+void
+update_queue::flush (clock::time_point now, const sender& send)
+{
+    // The chunks every player gets this time around, closest first, and
+    // how many bytes it is allowed to receive.
+    typedef std::tuple<const void*, std::vector<chunk_coordinates>, double> batch;
+    std::vector<batch> batches;
+
+    {
+    std::lock_guard<std::mutex> lock (lock_);
+    for (auto& i : players_)
+    {
+        auto& p (i.second);
+        if (!p.has_viewer)
+            continue;
+
+        if (p.last_flush == clock::time_point())
+        {
+            p.credit = budget_;
+        }
+        else
+        {
+            std::chrono::duration<double> elapsed (now - p.last_flush);
+            p.credit = std::min(budget_, p.credit + budget_ * elapsed.count());
+        }
+        p.last_flush = now;
+
+        if (p.dirty.empty())
+            continue;
+
+        if (p.credit <= 0)
+        {
+            ++throttled_;
+            continue;
+        }
+
+        std::vector<chunk_coordinates> todo;
+        todo.reserve(p.dirty.size());
+        for (auto& pos : p.dirty)
+        {
+            if (in_range(p, pos))
+                todo.push_back(pos);
+            else
+                ++out_of_range_;
+        }
+        p.dirty.clear();
+
+        const auto center (p.pos);
+        std::sort(todo.begin(), todo.end(),
+                  [=](chunk_coordinates a, chunk_coordinates b)
+        {
+            return   squared_length(world_vector(a - center))
+                   < squared_length(world_vector(b - center));
+        });
+
+        batches.emplace_back(i.first, std::move(todo), p.credit);
+    }
+    }
+
+    // Getting the data ready and sending it happens without the lock, so
+    // the world can tell us about new changes in the meantime.
+    std::vector<size_t> done;
+    size_t count (0), bytes (0);
+    for (auto& b : batches)
+    {
+        auto& todo (std::get<1>(b));
+        auto& credit (std::get<2>(b));
+        size_t n (0);
+        for (; n < todo.size() && credit > 0; ++n)
+        {
+            auto size (send(std::get<0>(b), todo[n]));
+            credit -= size;
+            bytes += size;
+        }
+        count += n;
+        done.push_back(n);
+    }
+
+    // Whatever didn't fit in the budget waits for the next flush.
+    std::lock_guard<std::mutex> lock (lock_);
+    sent_ += count;
+    bytes_ += bytes;
+    for (size_t i (0); i < batches.size(); ++i)
+    {
+        auto found (players_.find(std::get<0>(batches[i])));
+        if (found == players_.end())
+            continue;
+
+        auto& p (found->second);
+        auto& todo (std::get<1>(batches[i]));
+        p.credit = std::get<2>(batches[i]);
+        if (done[i] < todo.size())
+        {
+            ++throttled_;
+            p.dirty.insert(todo.begin() + done[i], todo.end());
+        }
+    }
+}
+
+update_queue::statistics
+update_queue::stats() const
+{
+    std::lock_guard<std::mutex> lock (lock_);
+    statistics result;
+    result.pending      = 0;
+    result.sent         = sent_;
+    result.bytes        = bytes_;
+    result.coalesced    = coalesced_;
+    result.out_of_range = out_of_range_;
+    result.throttled    = throttled_;
+
+    for (auto& p : players_)
+        result.pending += p.second.dirty.size();
+
+    return result;
+}
+
+} // namespace hexa
+
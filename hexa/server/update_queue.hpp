@@ -0,0 +1,149 @@
+//---------------------------------------------------------------------------
+/// \file   server/update_queue.hpp
+/// \brief  Collect changed chunks and send them to the players in batches
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_set>
+
+#include <hexa/basic_types.hpp>
+
+namespace hexa {
+
+/** Keeps track of which chunks have to be sent to the players again
+ *  after they changed.
+ *  Every player has a set of dirty chunks.  A chunk that changes a
+ *  couple of times before it is sent only goes out once, with whatever
+ *  it looks like by then.  Chunks further away than the view radius
+ *  aren't sent at all; the player will ask for them when it gets there.
+ *
+ *  The dirty chunks are sent in flush(), which is meant to be called at
+ *  a fixed rate.  The closest chunks go first, and every player has a
+ *  bandwidth budget.  Once that is used up, the rest of the chunks have
+ *  to wait for the next flush.
+ *
+ * Example:
+ * @code
+
+update_queue queue (32, 64 * 1024);
+queue.update_viewer(peer, player_chunk);
+queue.changed(pos);
+queue.flush(update_queue::clock::now(),
+            [&](const void* peer, chunk_coordinates p){ return send(peer, p); });
+
+ * @endcode */
+class update_queue
+{
+public:
+    typedef std::chrono::steady_clock   clock;
+
+    /** Sends a chunk to a player, and returns the size of the message
+     *  in bytes. */
+    typedef std::function<size_t(const void*, chunk_coordinates)> sender;
+
+    struct statistics
+    {
+        /** Chunks waiting to be sent, for all players combined. */
+        size_t  pending;
+        /** Total number of chunks sent. */
+        size_t  sent;
+        /** Total number of bytes sent. */
+        size_t  bytes;
+        /** Changes that were folded into one that was already pending. */
+        size_t  coalesced;
+        /** Changes that weren't sent because they were out of the
+         *  player's view radius. */
+        size_t  out_of_range;
+        /** Times a player ran out of bandwidth during a flush. */
+        size_t  throttled;
+    };
+
+public:
+    /** Constructor.
+     * @param view_radius   Changes further away from the player than
+     *                      this number of chunks are not sent
+     * @param budget        Bandwidth for every player, in bytes per
+     *                      second.  A player that didn't get anything
+     *                      for a while can use up to a second's worth in
+     *                      a single flush. */
+    update_queue (unsigned int view_radius = 32, size_t budget = 256 * 1024);
+
+    update_queue (const update_queue&) = delete;
+
+    /** Tell the queue where a player is.  Players that haven't been
+     *  placed yet don't get any updates. */
+    void update_viewer (const void* owner, chunk_coordinates pos);
+
+    /** Forget about a player. */
+    void remove (const void* owner);
+
+    /** Mark a chunk as changed, for all players that can see it. */
+    void changed (chunk_coordinates pos);
+
+    /** Send the dirty chunks, as far as the budgets allow.  The lock is
+     *  not held while \a send runs, so it's free to go to the world for
+     *  the data, even if another thread is committing changes.  Only one
+     *  thread should call this at a time.
+     * @param now   The current time, for the budgets
+     * @param send  Called for every chunk that goes out */
+    void flush (clock::time_point now, const sender& send);
+
+    statistics stats() const;
+
+private:
+    struct player
+    {
+        player() : has_viewer (false), credit (0) { }
+
+        bool                has_viewer;
+        chunk_coordinates   pos;
+
+        std::unordered_set<chunk_coordinates> dirty;
+
+        /** How many bytes the player can still be sent.  Goes below zero
+         *  if the last message was larger than what was left. */
+        double              credit;
+        clock::time_point   last_flush;
+    };
+
+    /** Is a chunk close enough to a player to be sent? */
+    bool in_range (const player& p, chunk_coordinates pos) const;
+
+private:
+    const float             view_radius_;
+    const double            budget_;
+
+    mutable std::mutex      lock_;
+    std::map<const void*, player> players_;
+
+    size_t                  sent_;
+    size_t                  bytes_;
+    size_t                  coalesced_;
+    size_t                  out_of_range_;
+    size_t                  throttled_;
+};
+
+} // namespace hexa
+
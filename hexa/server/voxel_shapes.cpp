@@ -21,9 +21,120 @@
 
 #include "voxel_shapes.hpp"
 
+#include <algorithm>
+#include <utility>
+
 namespace hexa {
 namespace csg {
 
+namespace {
+
+/** How far the analytical end of a span is allowed to be off from what
+ *  is_inside() decides, in voxels.  The rounding errors of is_inside()
+ *  are orders of magnitude smaller than this. */
+const double margin (0.25);
+
+/** Part of a column, in voxels relative to the chunk.  Voxels with a z
+ *  in [first, last] might be inside the shape; those in [sure_first,
+ *  sure_last] are inside for certain. */
+struct column_span
+{
+    double  first;
+    double  last;
+    double  sure_first;
+    double  sure_last;
+};
+
+const column_span whole_column { 0, chunk_size - 1, 0, chunk_size - 1 };
+const column_span unsure_column { 0, chunk_size - 1, 0, -1 };
+const column_span empty_column { 0, -1, 0, -1 };
+
+/** The part of a column that is in both spans. */
+column_span clip (const column_span& a, const column_span& b)
+{
+    return { std::max(a.first, b.first), std::min(a.last, b.last),
+             std::max(a.sure_first, b.sure_first),
+             std::min(a.sure_last, b.sure_last) };
+}
+
+/** The span where a * (z - center)^2 < d, with a > 0. */
+column_span quadratic_span (double center, double a, double d)
+{
+    // If d is only slightly negative, rounding errors might still put
+    // a voxel or two inside.
+    if (d < -a * margin * margin)
+        return empty_column;
+
+    const double half (std::sqrt(std::max(d, 0.0) / a));
+    return { center - half - margin, center + half + margin,
+             center - half + margin, center + half - margin };
+}
+
+/** The span where lo <= d0 + d1 * z <= hi. */
+column_span linear_span (double d0, double d1, double lo, double hi)
+{
+    const double tolerance (1e-3);
+    if (std::abs(d1) < tolerance)
+    {
+        // Barely changes along the column; it's all or nothing.
+        const double d_end (d0 + d1 * (chunk_size - 1));
+        const double d_min (std::min(d0, d_end)), d_max (std::max(d0, d_end));
+
+        if (d_max < lo - tolerance || d_min > hi + tolerance)
+            return empty_column;
+
+        if (d_min >= lo + tolerance && d_max <= hi - tolerance)
+            return whole_column;
+
+        return unsure_column;
+    }
+
+    double z1 ((lo - d0) / d1), z2 ((hi - d0) / d1);
+    if (z1 > z2)
+        std::swap(z1, z2);
+
+    return { z1 - margin, z2 + margin, z1 + margin, z2 - margin };
+}
+
+/** Set the bits of a column.  The sure part of the span is filled in
+ *  one go, the rest is tested voxel by voxel. */
+template <typename test>
+void fill_column (chunk_column& column, const column_span& s, test inside)
+{
+    const int first (std::ceil(std::max(s.first, -1.0)));
+    const int last  (std::floor(std::min(s.last, double(chunk_size))));
+    const int lo    (std::max(0, first));
+    const int hi    (std::min(chunk_size - 1, last));
+    if (lo > hi)
+        return;
+
+    int sure_lo (std::ceil(std::max(s.sure_first, double(lo))));
+    int sure_hi (std::floor(std::min(s.sure_last, double(hi))));
+    if (sure_lo > sure_hi)
+    {
+        sure_lo = hi + 1;
+        sure_hi = hi;
+    }
+    else
+    {
+        const unsigned int bits ((2u << sure_hi) - (1u << sure_lo));
+        column |= static_cast<chunk_column>(bits);
+    }
+
+    for (int z (lo); z < sure_lo; ++z)
+    {
+        if (inside(z))
+            column |= 1u << z;
+    }
+    for (int z (sure_hi + 1); z <= hi; ++z)
+    {
+        if (inside(z))
+            column |= 1u << z;
+    }
+}
+
+} // anonymous namespace
+
 std::set<world_vector>
 shape::chunks() const
 {
@@ -35,6 +146,38 @@ shape::chunks() const
     return result;
 }
 
+void
+shape::rasterize (const vec3f& origin, chunk_mask& mask) const
+{
+    rasterize_box(origin, aabb<vec3f>(origin, origin + vec3f(chunk_size)), mask);
+}
+
+void
+shape::rasterize_box (const vec3f& origin, const aabb<vec3f>& box,
+                      chunk_mask& mask) const
+{
+    // One voxel of slack on every side, against rounding errors.
+    vec3i lo, hi;
+    for (int i (0); i < 3; ++i)
+    {
+        lo[i] = std::max<int>(0, std::floor(box.first[i] - origin[i]) - 1);
+        hi[i] = std::min<int>(chunk_size - 1, std::ceil(box.second[i] - origin[i]) + 1);
+    }
+
+    for (int y (lo.y); y <= hi.y; ++y)
+    {
+        for (int x (lo.x); x <= hi.x; ++x)
+        {
+            auto& column (mask[x + y * chunk_size]);
+            for (int z (lo.z); z <= hi.z; ++z)
+            {
+                if (is_inside(origin + vec3f(x, y, z)))
+                    column |= 1u << z;
+            }
+        }
+    }
+}
+
 
 
 sphere::sphere(vec3f center, float radius)
@@ -86,6 +229,27 @@ sphere::is_inside (const vec3f& p) const
     return squared_distance(center_, p) < sq_radius_;
 }
 
+void
+sphere::rasterize (const vec3f& origin, chunk_mask& mask) const
+{
+    const double center_z (double(center_.z) - origin.z);
+
+    for (int y (0); y < chunk_size; ++y)
+    {
+        const double dy (double(origin.y) + y - center_.y);
+        for (int x (0); x < chunk_size; ++x)
+        {
+            const double dx (double(origin.x) + x - center_.x);
+            auto span (quadratic_span(center_z, 1.0, sq_radius_ - dx * dx - dy * dy));
+
+            fill_column(mask[x + y * chunk_size], span, [&](int z)
+            {
+                return sphere::is_inside(origin + vec3f(x, y, z));
+            });
+        }
+    }
+}
+
 
 
 
@@ -195,6 +359,58 @@ bool truncated_cone::is_inside (const vec3f& p) const
     return length(pd - norm_axis_ * dist) < cone_radius;
 }
 
+void
+truncated_cone::rasterize (const vec3f& origin, chunk_mask& mask) const
+{
+    // Along a column, the squared distance to the axis minus the squared
+    // radius of the cone is a quadratic a*z^2 + b*z + c.  If the axis is
+    // close to vertical, a gets small, and the ends of the span become
+    // too sensitive to rounding errors; fall back to testing every voxel
+    // around the end caps.  (bbox_ only covers one corner of each cap.)
+    const double nx (norm_axis_.x), ny (norm_axis_.y), nz (norm_axis_.z);
+    const double slope (radius_delta_);
+    const double a ((1.0 - nz * nz) - square(slope * nz));
+    if (a < 0.25)
+    {
+        const vec3f r1 (radius1_), r2 (radius1_ + radius_delta_ * length_);
+        rasterize_box(origin, aabb<vec3f>(pt1_ - r1, pt1_ + r1)
+                              + aabb<vec3f>(pt2_ - r2, pt2_ + r2), mask);
+        return;
+    }
+
+    // The direction of a column, projected on the plane of the axis.
+    const double p1x (-nx * nz), p1y (-ny * nz), p1z (1.0 - nz * nz);
+    const double oz (double(origin.z) - pt1_.z);
+
+    for (int y (0); y < chunk_size; ++y)
+    {
+        const double oy (double(origin.y) + y - pt1_.y);
+        for (int x (0); x < chunk_size; ++x)
+        {
+            const double ox (double(origin.x) + x - pt1_.x);
+
+            // Distance along the axis at z = 0.
+            const double d0 (ox * nx + oy * ny + oz * nz);
+            auto span (linear_span(d0, nz, 0.0, length_));
+            if (span.first > span.last)
+                continue;
+
+            const double p0x (ox - nx * d0), p0y (oy - ny * d0), p0z (oz - nz * d0);
+            const double c0 (radius1_ + slope * d0), c1 (slope * nz);
+            const double b (2.0 * (p0x * p1x + p0y * p1y + p0z * p1z - c0 * c1));
+            const double c (p0x * p0x + p0y * p0y + p0z * p0z - c0 * c0);
+
+            span = clip(span, quadratic_span(-b / (2.0 * a), a,
+                                             b * b / (4.0 * a) - c));
+
+            fill_column(mask[x + y * chunk_size], span, [&](int z)
+            {
+                return truncated_cone::is_inside(origin + vec3f(x, y, z));
+            });
+        }
+    }
+}
+
 
 
 plane::plane (const vec3f& normal, const vec3f& pt)
@@ -22,7 +22,9 @@
 
 #pragma once
 
+#include <array>
 #include <cmath>
+#include <cstdint>
 #include <initializer_list>
 #include <memory>
 #include <set>
@@ -36,6 +38,15 @@
 namespace hexa {
 namespace csg {
 
+/** A column of voxels along the z axis of a chunk, one bit per voxel.
+ *  Bit z stands for the voxel at height z. */
+typedef uint16_t chunk_column;
+
+static_assert(chunk_size <= 16, "a chunk column has to fit in 16 bits");
+
+/** All the columns of a chunk, indexed by x + y * chunk_size. */
+typedef std::array<chunk_column, chunk_area> chunk_mask;
+
 class shape
 {
 public:
@@ -46,6 +57,22 @@ public:
     virtual bool is_inside (const vec3f& p) const = 0;
 
     virtual std::set<world_vector> chunks() const;
+
+    /** Mark the voxels of a chunk that are inside this shape.
+     *  The result is exactly the same as calling is_inside() for every
+     *  voxel.  The default implementation does just that; shapes that
+     *  know where a column enters and leaves them fill the middle of
+     *  the span in one go, and only test the voxels near its ends.
+     * @param origin  The position of voxel (0,0,0) of the chunk
+     * @param mask    A bit is set for every voxel inside the shape.
+     *                Bits that were already set are left alone. */
+    virtual void rasterize (const vec3f& origin, chunk_mask& mask) const;
+
+protected:
+    /** Call is_inside() for every voxel of a chunk that lies in a box.
+     *  The box has to enclose every point that is inside the shape. */
+    void rasterize_box (const vec3f& origin, const aabb<vec3f>& box,
+                        chunk_mask& mask) const;
 };
 
 class sphere : public shape
@@ -61,6 +88,8 @@ public:
 
     virtual bool is_inside (const vec3f& p) const override;
 
+    virtual void rasterize (const vec3f& origin, chunk_mask& mask) const override;
+
 protected:
     bool intersects (const aabb<vec3f>& box) const;
 
@@ -137,6 +166,8 @@ public:
 
     virtual bool is_inside (const vec3f& p) const override;
 
+    virtual void rasterize (const vec3f& origin, chunk_mask& mask) const override;
+
 protected:
     vec3f       pt1_;
     vec3f       pt2_;
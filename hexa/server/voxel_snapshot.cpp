@@ -0,0 +1,121 @@
+//---------------------------------------------------------------------------
+// server/voxel_snapshot.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "voxel_snapshot.hpp"
+
+#include <algorithm>
+
+#include <hexa/block_types.hpp>
+#include <hexa/chunk.hpp>
+
+namespace hexa {
+
+voxel_snapshot::voxel_snapshot()
+    : pos_    (0, 0, 0)
+    , border_ (0)
+    , side_   (0)
+    , area_   (0)
+{
+}
+
+void
+voxel_snapshot::fill (chunk_coordinates pos, unsigned int border,
+                      const chunk_source& source)
+{
+    pos_    = pos;
+    border_ = border;
+    side_   = chunk_size + 2 * border;
+    area_   = side_ * side_;
+
+    // Every block gets overwritten below, so if the snapshot is reused
+    // for the same border size, this won't touch the memory at all.
+    types_.resize(area_ * side_);
+    opacity_.resize(area_ * side_);
+
+    const int lo (-border_);
+    const int hi (chunk_size + border_);
+    const int cnk_lo (-((border_ + chunk_size - 1) / chunk_size));
+    const int cnk_hi ((chunk_size - 1 + border_) / chunk_size);
+
+    const float air_opacity (1.0f - material_prop[type::air].transparency / 255.f);
+
+    // Most snapshots only have a handful of materials, so a full lookup
+    // table isn't worth it.
+    uint16_t last_type (type::air);
+    float    last_opacity (air_opacity);
+
+    for (int cz (cnk_lo); cz <= cnk_hi; ++cz)
+    {
+        for (int cy (cnk_lo); cy <= cnk_hi; ++cy)
+        {
+            for (int cx (cnk_lo); cx <= cnk_hi; ++cx)
+            {
+                world_vector c (cx, cy, cz);
+                const chunk* cnk (source(pos + c));
+
+                // The part of this chunk that overlaps the snapshot,
+                // relative to the center chunk's corner.
+                world_vector from (c * chunk_size);
+                world_vector to   (from + world_vector(chunk_size, chunk_size, chunk_size));
+                for (int i (0); i < 3; ++i)
+                {
+                    from[i] = std::max(from[i], lo);
+                    to[i]   = std::min(to[i], hi);
+                }
+
+                const int len (to.x - from.x);
+                for (int z (from.z); z < to.z; ++z)
+                {
+                    for (int y (from.y); y < to.y; ++y)
+                    {
+                        auto dest (index(world_vector(from.x, y, z)));
+                        if (cnk == nullptr)
+                        {
+                            std::fill_n(types_.begin() + dest, len, type::air);
+                            std::fill_n(opacity_.begin() + dest, len, air_opacity);
+                            continue;
+                        }
+
+                        // Packed chunks are unpacked a row at a time.
+                        cnk->copy_types((from.x - cx * chunk_size)
+                                        + (y - cy * chunk_size) * chunk_size
+                                        + (z - cz * chunk_size) * chunk_area,
+                                        len, &types_[dest]);
+
+                        for (int x (0); x < len; ++x, ++dest)
+                        {
+                            auto t (types_[dest]);
+                            if (t != last_type)
+                            {
+                                last_type = t;
+                                last_opacity = 1.0f - material_prop[t].transparency / 255.f;
+                            }
+
+                            opacity_[dest] = last_opacity;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+} // namespace hexa
@@ -0,0 +1,135 @@
+//---------------------------------------------------------------------------
+/// \file   server/voxel_snapshot.hpp
+/// \brief  A chunk and its surroundings, copied into a flat array
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+
+namespace hexa {
+
+class chunk;
+
+/** A copy of the blocks in a chunk, plus a border of blocks around it,
+ *  in a single contiguous array.
+ *  Light map generators and surface extraction look at a lot of blocks
+ *  around a chunk.  Going through world_lightmap_access for every one
+ *  of them means a hash lookup and a division per block.  A snapshot
+ *  costs one copy up front, after which every block is an array index
+ *  away, and a step in any direction is a fixed offset.
+ *
+ *  Next to the material of every block, the snapshot also stores its
+ *  opacity (1 minus the material's transparency), which is what the
+ *  ray casters need.
+ *
+ *  The blocks are addressed relative to the corner of the center chunk,
+ *  so the valid range is [-border, chunk_size + border) along every
+ *  axis.
+ *
+ * Example:
+ * @code
+
+voxel_snapshot snap;
+snap.fill(pos, 2, [&](chunk_coordinates c) { return &w.get_chunk(c); });
+
+auto i (snap.index(world_vector(3, 4, 5)));
+if (snap.type(i + snap.offset(dir_vector[dir_up])) == type::air)
+    ...
+
+ * @endcode */
+class voxel_snapshot
+{
+public:
+    /** Fetches a chunk, or returns nullptr if the snapshot should have
+     *  air there instead. */
+    typedef std::function<const chunk*(chunk_coordinates)> chunk_source;
+
+public:
+    voxel_snapshot();
+
+    /** Copy the blocks around a chunk.
+     * @param pos     The center chunk
+     * @param border  The number of blocks to include on every side
+     * @param source  Provides the chunks; it is only asked for the
+     *                chunks that overlap the snapshot */
+    void fill (chunk_coordinates pos, unsigned int border,
+               const chunk_source& source);
+
+    /** The position of the center chunk. */
+    chunk_coordinates position() const { return pos_; }
+
+    /** The size of the border around the center chunk, in blocks. */
+    unsigned int border() const { return border_; }
+
+    /** The length of one side of the snapshot, in blocks. */
+    int side() const { return side_; }
+
+    /** Check if a block is part of the snapshot.
+     * @param rel  Position relative to the center chunk's corner */
+    bool contains (world_vector rel) const
+    {
+        return    rel.x >= -border_ && rel.x < side_ - border_
+               && rel.y >= -border_ && rel.y < side_ - border_
+               && rel.z >= -border_ && rel.z < side_ - border_;
+    }
+
+    /** The array index of a block.
+     * @param rel  Position relative to the center chunk's corner */
+    size_t index (world_vector rel) const
+    {
+        return   (rel.x + border_)
+               + (rel.y + border_) * side_
+               + (rel.z + border_) * area_;
+    }
+
+    /** The difference in array index between two blocks that are
+     *  \a delta apart. */
+    ptrdiff_t offset (world_vector delta) const
+    {
+        return delta.x + delta.y * side_ + delta.z * area_;
+    }
+
+    /** The material of the block at a given index. */
+    uint16_t type (size_t i) const { return types_[i]; }
+
+    /** How much light a block blocks, from 0 (air) to 1 (opaque). */
+    float opacity (size_t i) const { return opacity_[i]; }
+
+    /** The materials of all blocks, in index order. */
+    const uint16_t* types() const { return types_.data(); }
+
+    /** The opacity of all blocks, in index order. */
+    const float* opacities() const { return opacity_.data(); }
+
+private:
+    chunk_coordinates       pos_;
+    int                     border_;
+    int                     side_;
+    int                     area_;
+    std::vector<uint16_t>   types_;
+    std::vector<float>      opacity_;
+};
+
+} // namespace hexa
@@ -21,12 +21,18 @@
 
 #include "world.hpp"
 
+#include <algorithm>
+#include <bitset>
+#include <boost/format.hpp>
 #include <boost/range/adaptor/reversed.hpp>
+#include <boost/thread/locks.hpp>
 
 #include <hexa/geometric.hpp>
+#include <hexa/pool_allocator.hpp>
 #include <hexa/ray.hpp>
 #include <hexa/trace.hpp>
 #include <hexa/voxel_algorithm.hpp>
+#include <hexa/voxel_range.hpp>
 
 #include "extract_surface.hpp"
 #include "world_subsection.hpp"
@@ -58,12 +64,133 @@ type unpack_as (const compressed_data& data)
     return deserialize_as<type>(tmp);
 }
 
+/** The number of changes remembered for every chunk. */
+const size_t max_history (8);
+
+/** Rough estimate of the bookkeeping overhead of a single cache entry:
+ *  the list node, the hash map node, and the bucket pointer. */
+constexpr size_t entry_overhead = 96;
+
+template <typename type, typename alloc>
+size_t vector_bytes (const std::vector<type, alloc>& v)
+{
+    return v.capacity() * sizeof(type);
+}
+
+template <typename cache>
+cache_statistics::cache
+stats (const cache& c, size_t limit, const std::atomic<size_t>& evicted)
+{
+    return { c.size(), c.weight(), limit, evicted.load() };
+}
+
+/** The position of a block in a chunk, as a single number. */
+inline size_t flat_index (chunk_index i)
+{
+    return i.x + i.y * chunk_size + i.z * chunk_area;
+}
+
+/** The number of faces of a block. */
+inline size_t face_count (const faces& f)
+{
+    size_t result (0);
+    for (int d (0); d < 6; ++d)
+        result += f[d];
+
+    return result;
+}
+
+/** How far a block is from a box, along the axis where it's furthest. */
+inline int distance (world_vector p, world_vector lo, world_vector hi)
+{
+    int result (0);
+    for (int i (0); i < 3; ++i)
+        result = std::max(result, std::max(lo[i] - p[i], p[i] - hi[i]));
+
+    return result;
+}
+
+/** Which chunk a block is in, relative to the chunk at (0, 0, 0). */
+inline int chunk_offset (int x)
+{
+    return x >= 0 ? x / chunk_size : -((chunk_size - 1 - x) / chunk_size);
+}
+
 } // anonymous namespace
 
 //---------------------------------------------------------------------------
 
+size_t
+cache_weight::operator() (const chunk& c) const
+{
+    return entry_overhead + c.memory_usage();
+}
+
+size_t
+cache_weight::operator() (const area_data& a) const
+{
+    return entry_overhead + sizeof(a) + a.size() * sizeof(int16_t);
+}
+
+size_t
+cache_weight::operator() (const surface_data& s) const
+{
+    return entry_overhead + sizeof(s) + vector_bytes(s.opaque)
+           + vector_bytes(s.transparent);
+}
+
+size_t
+cache_weight::operator() (const light_data& l) const
+{
+    return entry_overhead + sizeof(l) + vector_bytes(l.opaque.data)
+           + vector_bytes(l.transparent.data);
+}
+
+size_t
+cache_weight::operator() (chunk_height) const
+{
+    return entry_overhead + sizeof(chunk_height);
+}
+
+size_t
+cache_weight::operator() (const shared_compressed_data& d) const
+{
+    // The shared_ptr's control block is allocated with the object.
+    return entry_overhead + sizeof(compressed_data) + 16
+           + (d ? d->buf.capacity() : 0);
+}
+
+size_t
+cache_weight::operator() (const surface_history& h) const
+{
+    size_t result (entry_overhead + vector_bytes(h));
+    for (auto& d : h)
+    {
+        result +=   vector_bytes(d.opaque.runs) + vector_bytes(d.opaque.inserted)
+                  + vector_bytes(d.transparent.runs)
+                  + vector_bytes(d.transparent.inserted)
+                  + vector_bytes(d.opaque_light.runs)
+                  + vector_bytes(d.opaque_light.inserted)
+                  + vector_bytes(d.transparent_light.runs)
+                  + vector_bytes(d.transparent_light.inserted);
+    }
+    return result;
+}
+
+//---------------------------------------------------------------------------
+
 world::world (persistent_storage_i &storage)
     : storage_(storage)
+    , evicted_chunks_(0)
+    , evicted_surfaces_(0)
+    , evicted_lightmaps_(0)
+    , evicted_areas_(0)
+    , evicted_heights_(0)
+    , evicted_compressed_(0)
+    , compressed_hits_(0)
+    , compressed_misses_(0)
+    , written_back_(0)
+    , light_generation_(0)
     , seed_(0)
 {
     empty.clear();
@@ -99,10 +226,205 @@ world::add_lightmap_generator (std::unique_ptr<lightmap_generator_i>&& gen)
     lightgen_.emplace_back(std::move(gen));
 }
 
+unsigned int
+world::lightmap_surface_radius() const
+{
+    unsigned int result (0);
+    for (auto& gen : lightgen_)
+        result = std::max(result, gen->surface_radius());
+
+    return result;
+}
+
+unsigned int
+world::lightmap_phases() const
+{
+    unsigned int result (1);
+    for (auto& gen : lightgen_)
+        result = std::max(result, gen->phases());
+
+    return result;
+}
+
+void
+world::set_cache_limits (const cache_limits& limits)
+{
+    limits_ = limits;
+}
+
 void
 world::cleanup()
 {
-    ///\todo Implement cleanup()
+    {
+    boost::unique_lock<boost::shared_mutex> exclusive (lock);
+
+    // Write everything back first, so the chunks we're about to evict
+    // are guaranteed to be clean.
+    write_back_dirty_chunks();
+
+    evicted_chunks_ += chunks_.prune(limits_.chunks,
+        [](const chunk_coordinates&, chunk& c){ assert(!c.is_dirty); });
+
+    evicted_surfaces_  += surfaces_.prune(limits_.surfaces);
+    evicted_lightmaps_ += lightmaps_.prune(limits_.lightmaps);
+    evicted_areas_     += area_data_.prune(limits_.areas);
+    evicted_heights_   += coarse_heights_.prune(limits_.heights);
+
+    // Both caches share one budget.
+    evicted_compressed_ += compressed_surfaces_.prune(limits_.compressed / 2);
+    evicted_compressed_ += compressed_lightmaps_.prune(limits_.compressed / 2);
+
+    history_.prune(limits_.history);
+    }
+
+    storage_.cleanup();
+
+    auto s (statistics());
+    trace((boost::format("world cache: %1% chunks (%2% kB), %3% surfaces "
+                         "(%4% kB), %5% lightmaps (%6% kB), %7% compressed "
+                         "(%8% kB, %9% hits, %10% misses), %11% written back")
+           % s.chunks.entries % (s.chunks.bytes / 1024)
+           % s.surfaces.entries % (s.surfaces.bytes / 1024)
+           % s.lightmaps.entries % (s.lightmaps.bytes / 1024)
+           % s.compressed.entries % (s.compressed.bytes / 1024)
+           % s.compressed_hits % s.compressed_misses
+           % s.written_back).str());
+
+    for (auto& a : allocator_stats())
+    {
+        trace((boost::format("allocator %1%: %2% in use (%3% kB of %4% kB), "
+                             "%5% allocations, %6% from the system")
+               % a.name % a.in_use % (a.bytes_in_use / 1024)
+               % (a.bytes_reserved / 1024) % a.allocations
+               % a.system_allocations).str());
+    }
+}
+
+void
+world::flush()
+{
+    {
+    boost::unique_lock<boost::shared_mutex> exclusive (lock);
+    write_back_dirty_chunks();
+    }
+    storage_.cleanup();
+}
+
+shared_compressed_data
+world::refine_lightmap (chunk_coordinates pos, unsigned int phase)
+{
+    constexpr auto store_light (persistent_storage_i::light);
+
+    if (phase >= lightmap_phases())
+        return nullptr;
+
+    // The expensive part is done while other threads can still read.
+    light_data lm;
+    uint64_t generation;
+    {
+    boost::shared_lock<boost::shared_mutex> shared (lock);
+    if (!is_lightmap_available(pos))
+        return nullptr;
+
+    auto& current (get_lightmap(pos));
+    if (current.phase >= phase)
+        return nullptr;
+
+    generation = current.generation;
+    lm = generate_lightmap(pos, phase);
+    }
+
+    auto packed (share(pack(lm)));
+
+    boost::unique_lock<boost::shared_mutex> exclusive (lock);
+
+    // Someone might have changed the terrain or the light in the
+    // meantime, in which case the new light map is already out of date.
+    if (get_lightmap(pos).generation != generation)
+        return nullptr;
+
+    // A light map that is waiting for its chunk to be written back is
+    // stored along with it.
+    if (!dirty_lightmaps_.count(pos))
+        storage_.store(store_light, pos, *packed);
+
+    lm.generation = ++light_generation_;
+    lightmaps_.assign(pos, std::move(lm));
+    compressed_lightmaps_.assign(pos, packed);
+
+    return packed;
+}
+
+cache_statistics
+world::statistics()
+{
+    cache_statistics result;
+    result.chunks    = stats(chunks_, limits_.chunks, evicted_chunks_);
+    result.surfaces  = stats(surfaces_, limits_.surfaces, evicted_surfaces_);
+    result.lightmaps = stats(lightmaps_, limits_.lightmaps, evicted_lightmaps_);
+    result.areas     = stats(area_data_, limits_.areas, evicted_areas_);
+    result.heights   = stats(coarse_heights_, limits_.heights, evicted_heights_);
+
+    auto srf (stats(compressed_surfaces_, limits_.compressed, evicted_compressed_));
+    auto lm  (stats(compressed_lightmaps_, limits_.compressed, evicted_compressed_));
+    result.compressed = srf;
+    result.compressed.entries += lm.entries;
+    result.compressed.bytes   += lm.bytes;
+    result.compressed_hits   = compressed_hits_.load();
+    result.compressed_misses = compressed_misses_.load();
+
+    {
+    boost::shared_lock<boost::shared_mutex> shared (lock);
+    result.dirty_chunks = dirty_chunks_.size();
+    }
+    result.written_back = written_back_.load();
+
+    return result;
+}
+
+void
+world::write_back_dirty_chunks()
+{
+    if (dirty_chunks_.empty() && dirty_surfaces_.empty()
+        && dirty_lightmaps_.empty())
+    {
+        return;
+    }
+
+    {
+    auto batch (storage_.transaction());
+    for (auto& pos : dirty_chunks_)
+    {
+        auto& cnk (chunks_.get(pos));
+        storage_.store(persistent_storage_i::chunk, pos, pack(cnk));
+        cnk.is_dirty = false;
+    }
+
+    // The compressed caches are only pruned after a write-back, so the
+    // packed versions are usually still around.
+    for (auto& pos : dirty_surfaces_)
+    {
+        auto packed (compressed_surfaces_.try_get(pos));
+        if (packed)
+            storage_.store(persistent_storage_i::surface, pos, **packed);
+        else
+            storage_.store(persistent_storage_i::surface, pos, pack(surfaces_.get(pos)));
+    }
+
+    for (auto& pos : dirty_lightmaps_)
+    {
+        auto packed (compressed_lightmaps_.try_get(pos));
+        if (packed)
+            storage_.store(persistent_storage_i::light, pos, **packed);
+        else
+            storage_.store(persistent_storage_i::light, pos, pack(lightmaps_.get(pos)));
+    }
+    }
+
+    written_back_ += dirty_chunks_.size();
+    dirty_chunks_.clear();
+    dirty_surfaces_.clear();
+    dirty_lightmaps_.clear();
 }
 
 //---------------------------------------------------------------------------
@@ -123,28 +445,65 @@ world::get_chunk_writable (chunk_coordinates pos)
     assert(pos.y < chunk_world_limit.y);
     assert(pos.z < chunk_world_limit.z);
 
+    constexpr auto store_chunk (persistent_storage_i::chunk);
+
     auto found (chunks_.try_get(pos));
     if (found)
         return *found;
 
-    auto& result (chunks_[pos]);
-    if (storage_.is_available(persistent_storage_i::chunk, pos))
+    auto stored (storage_.try_retrieve(store_chunk, pos));
+    if (stored)
     {
-        auto compressed (storage_.retrieve(persistent_storage_i::chunk, pos));
-        result = unpack_as<chunk>(compressed);
+        auto loaded (unpack_as<chunk>(*stored));
+        loaded.is_dirty = false;
+        return chunks_.emplace(pos, std::move(loaded));
+    }
+
+    // Different chunks are generated in parallel, but if another thread
+    // is already working on this one, wait for it to finish.
+    {
+    std::unique_lock<std::mutex> lock (chunks_in_progress_lock_);
+    while (chunks_in_progress_.count(pos))
+        chunk_generated_.wait(lock);
+
+    // Another thread might have generated it while we were waiting.
+    found = chunks_.try_get(pos);
+    if (found)
+        return *found;
+
+    chunks_in_progress_.insert(pos);
     }
-    else if (!is_air_chunk(pos, get_coarse_height(pos)))
+
+    struct done_guard
+    {
+        world&              w;
+        chunk_coordinates   pos;
+
+        ~done_guard()
+        {
+            {
+            std::lock_guard<std::mutex> lock (w.chunks_in_progress_lock_);
+            w.chunks_in_progress_.erase(pos);
+            }
+            w.chunk_generated_.notify_all();
+        }
+    } done { *this, pos };
+
+    chunk result;
+    if (!is_air_chunk(pos, get_coarse_height(pos)))
     {
         result = generate_chunk(pos);
-        storage_.store(persistent_storage_i::chunk, pos, pack(result));
+        result.compact();
     }
     else
     {
         adjust_coarse_height(pos);
-        storage_.store(persistent_storage_i::chunk, pos, pack(result));
     }
 
-    return result;
+    storage_.store(store_chunk, pos, pack(result));
+    result.is_dirty = false;
+
+    return chunks_.emplace(pos, std::move(result));
 }
 
 const area_data&
@@ -166,30 +525,33 @@ world::get_area_data_writable (map_coordinates pos2d, uint16_t index)
     if (i)
         return *i;
 
-    auto& ad (area_data_[pos]);
-    if (storage_.is_available(store_area, pos))
+    auto stored (storage_.try_retrieve(store_area, pos));
+    if (stored)
+        return area_data_.emplace(pos, unpack_as<area_data>(*stored));
+
+    if (index >= areagen_.size())
     {
-        ad = unpack_as<area_data>(storage_.retrieve(store_area, pos));
+        trace("ERROR: index %1% of %2%", index, areagen_.size());
+        throw std::out_of_range("area_data index out of range");
     }
-    else
-    {
-        if (index >= areagen_.size())
-        {
-            trace("ERROR: index %1% of %2%", index, areagen_.size());
-            throw std::out_of_range("area_data index out of range");
-        }
 
-        auto& generator (areagen_[index]);
-        ad = generator->generate(pos2d);
+    std::lock_guard<std::recursive_mutex> gen_lock (generation_lock_);
 
-        world_terraingen_access proxy (*this);
-        for (auto& tg : terraingen_)
-            tg->generate(proxy, generator->name(), pos2d, ad);
+    i = area_data_.try_get(pos);
+    if (i)
+        return *i;
 
-        if (generator->should_write_to_file())
-            storage_.store(store_area, pos, pack(ad));
-    }
-    return ad;
+    auto& generator (areagen_[index]);
+    auto ad (generator->generate(pos2d));
+
+    world_terraingen_access proxy (*this);
+    for (auto& tg : terraingen_)
+        tg->generate(proxy, generator->name(), pos2d, ad);
+
+    if (generator->should_write_to_file())
+        storage_.store(store_area, pos, pack(ad));
+
+    return area_data_.emplace(pos, std::move(ad));
 }
 
 const surface_data&
@@ -208,19 +570,15 @@ world::get_surface (chunk_coordinates pos)
     if (i)
         return *i;
 
-    auto& srf (surfaces_[pos]);
-    if (storage_.is_available(store_surface, pos))
-    {
-        srf = unpack_as<surface_data>(storage_.retrieve(store_surface, pos));
-    }
-    else
-    {
-        // Build a surface and store it.
-        srf = build_surface(pos);
-        storage_.store(store_surface, pos, pack(srf));
-    }
+    auto stored (storage_.try_retrieve(store_surface, pos));
+    if (stored)
+        return surfaces_.emplace(pos, unpack_as<surface_data>(*stored));
+
+    // Build a surface and store it.
+    auto srf (build_surface(pos));
+    storage_.store(store_surface, pos, pack(srf));
 
-    return srf;
+    return surfaces_.emplace(pos, std::move(srf));
 }
 
 const light_data&
@@ -236,17 +594,19 @@ world::get_lightmap (chunk_coordinates pos)
     if (i)
         return *i;
 
-    auto& lm (lightmaps_[pos]);
-    if (storage_.is_available(store_light, pos))
+    auto stored (storage_.try_retrieve(store_light, pos));
+    if (stored)
     {
-        lm = unpack_as<light_data>(storage_.retrieve(store_light, pos));
+        auto lm (unpack_as<light_data>(*stored));
+        lm.generation = ++light_generation_;
+        return lightmaps_.emplace(pos, std::move(lm));
     }
-    else
-    {
-        lm = generate_lightmap(pos);
-        storage_.store(store_light, pos, pack(lm));
-    }
-    return lm;
+
+    auto lm (generate_lightmap(pos));
+    storage_.store(store_light, pos, pack(lm));
+    lm.generation = ++light_generation_;
+
+    return lightmaps_.emplace(pos, std::move(lm));
 }
 
 
@@ -260,36 +620,66 @@ world::get_coarse_height (map_coordinates pos)
     if (i)
         return *i;
 
-    if (storage_.is_available(pos))
-        return coarse_heights_[pos] = storage_.retrieve(pos);
+    auto stored (storage_.try_retrieve(pos));
+    if (stored)
+        return coarse_heights_.emplace(pos, std::move(*stored));
+
+    std::lock_guard<std::recursive_mutex> gen_lock (generation_lock_);
+
+    i = coarse_heights_.try_get(pos);
+    if (i)
+        return *i;
 
     return set_coarse_height({pos.x, pos.y, generate_coarse_height(pos)});
 }
 
-compressed_data
+shared_compressed_data
 world::get_compressed_surface (chunk_coordinates pos)
 {
-    if (storage_.is_available(persistent_storage_i::surface, pos))
-        return storage_.retrieve(persistent_storage_i::surface, pos);
+    return get_compressed(compressed_surfaces_, persistent_storage_i::surface,
+                          pos, [&]{ return pack(get_surface(pos)); });
+}
+
+shared_compressed_data
+world::get_compressed_lightmap(chunk_coordinates pos)
+{
+    return get_compressed(compressed_lightmaps_, persistent_storage_i::light,
+                          pos, [&]{ return pack(get_lightmap(pos)); });
+}
 
-    auto& srf (get_surface(pos));
-    auto result (pack(srf));
-    storage_.store(persistent_storage_i::surface, pos, result);
+shared_compressed_data
+world::get_compressed_history (chunk_coordinates pos)
+{
+    auto found (history_.try_get(pos));
+    if (!found)
+        return nullptr;
 
-    return result;
+    return share(pack(*found));
 }
 
-compressed_data
-world::get_compressed_lightmap(chunk_coordinates pos)
+template <typename func>
+shared_compressed_data
+world::get_compressed (sharded_cache<chunk_coordinates, shared_compressed_data,
+                                     cache_weight>& cache,
+                       persistent_storage_i::data_type type,
+                       chunk_coordinates pos, func build)
 {
-    if (storage_.is_available(persistent_storage_i::light, pos))
-        return storage_.retrieve(persistent_storage_i::light, pos);
+    auto cached (cache.try_get(pos));
+    if (cached)
+    {
+        ++compressed_hits_;
+        return *cached;
+    }
+    ++compressed_misses_;
 
-    auto& lm (get_lightmap(pos));
-    auto result (pack(lm));
-    storage_.store(persistent_storage_i::light, pos, result);
+    auto stored (storage_.try_retrieve(type, pos));
+    if (stored)
+        return cache.emplace(pos, share(std::move(*stored)));
 
-    return result;
+    auto result (share(build()));
+    storage_.store(type, pos, *result);
+
+    return cache.emplace(pos, std::move(result));
 }
 
 
@@ -297,34 +687,272 @@ world::get_compressed_lightmap(chunk_coordinates pos)
 
 
 void
-world::commit_write (chunk_coordinates pos)
+world::commit_write (const std::unordered_map<chunk_coordinates,
+                                              chunk_changes>& changes)
 {
-    adjust_coarse_height(pos);
-    storage_.store(persistent_storage_i::chunk, pos, pack(chunks_.get(pos)));
+    // The caller holds an exclusive lock on the world, so there is no need
+    // to worry about readers holding references to the elements we're
+    // about to replace.  The chunks, surfaces, and light maps are written
+    // to storage later on, together, by cleanup() or flush().
+    //
+    // All changes are in place by now.  First find out which surfaces
+    // and light maps they affect, then update each of those only once.
+    std::unordered_set<chunk_coordinates> relight, rebuild, updated;
+    std::unordered_map<chunk_coordinates, std::vector<chunk_index>> touched;
+    std::unordered_map<chunk_coordinates,
+                       std::pair<world_vector, world_vector>> nearby;
+
+    // What the surfaces and light maps looked like before, so the clients
+    // can be sent only the difference.
+    std::unordered_map<chunk_coordinates,
+                       std::pair<surface_data, light_data>> before;
+    auto remember ([&](chunk_coordinates p)
+    {
+        if (   !before.count(p) && is_surface_available(p)
+            && is_lightmap_available(p))
+        {
+            before.emplace(p, std::make_pair(get_surface(p), get_lightmap(p)));
+        }
+    });
 
-    // Update the surface and the six surrounding surfaces.
-    for (auto rel : neumann_neighborhood)
+    int radius (1);
+    for (auto& gen : lightgen_)
+        radius = std::max<int>(radius, gen->influence_radius(0));
+
+    for (auto& change : changes)
+    {
+        const auto pos (change.first);
+        adjust_coarse_height(pos);
+        auto& cnk (chunks_.get(pos));
+        cnk.is_dirty = true;
+        cnk.compact();
+        chunks_.reweigh(pos);
+        dirty_chunks_.insert(pos);
+
+        // Light map generators with data of their own update it first,
+        // and tell us which other chunks are affected.
+        {
+        world_lightmap_access proxy (*this);
+        for (auto& gen : lightgen_)
+        {
+            for (auto& p : gen->chunk_changed(proxy, pos))
+                relight.insert(p);
+        }
+        }
+
+        if (change.second.everything)
+        {
+            // Rebuild the surface and the six surrounding surfaces.
+            for (auto rel : neumann_neighborhood)
+                rebuild.insert(pos + rel);
+
+            continue;
+        }
+
+        if (change.second.blocks.empty())
+            continue;
+
+        // The faces of a changed block and the faces of its neighbors
+        // need another look.  Only if the block is on the border of the
+        // chunk, this involves the surface of the chunk next to it.
+        world_vector lo (chunk_size, chunk_size, chunk_size), hi (-1, -1, -1);
+        for (auto blk : change.second.blocks)
+        {
+            world_vector b (blk);
+            for (int i (0); i < 3; ++i)
+            {
+                lo[i] = std::min(lo[i], b[i]);
+                hi[i] = std::max(hi[i], b[i]);
+            }
+
+            touched[pos].push_back(blk);
+            for (auto& d : dir_vector)
+            {
+                world_coordinates n (pos * chunk_size + b + d);
+                touched[n >> cnkshift].push_back(n % chunk_size);
+            }
+        }
+
+        // Every chunk with faces close enough to the changes gets its
+        // light map updated, including the ones that only touch the
+        // chunk along an edge or a corner.  Changes in several chunks
+        // are combined into one box around all of them.
+        world_vector first, last;
+        for (int i (0); i < 3; ++i)
+        {
+            first[i] = chunk_offset(lo[i] - radius);
+            last[i]  = chunk_offset(hi[i] + radius);
+        }
+
+        for (auto rel : make_range(first, last + world_vector(1, 1, 1)))
+        {
+            const world_vector p_lo (lo - rel * chunk_size);
+            const world_vector p_hi (hi - rel * chunk_size);
+            auto found (nearby.find(pos + rel));
+            if (found == nearby.end())
+            {
+                nearby.emplace(pos + rel, std::make_pair(p_lo, p_hi));
+                continue;
+            }
+
+            auto& box (found->second);
+            for (int i (0); i < 3; ++i)
+            {
+                box.first[i]  = std::min(box.first[i], p_lo[i]);
+                box.second[i] = std::max(box.second[i], p_hi[i]);
+            }
+        }
+    }
+
+    for (auto& p : rebuild)
     {
-        auto p (pos + rel);
+        relight.erase(p);
         if (!is_air_chunk(p, get_coarse_height(p)))
         {
-            auto srf (build_surface(p));
+            remember(p);
+            replace_surface(p, build_surface(p));
+            replace_lightmap(p, generate_lightmap(p));
+            updated.insert(p);
+        }
+        else
+        {
+            compressed_surfaces_.remove(p);
+            compressed_lightmaps_.remove(p);
+        }
+    }
+
+    for (auto& near : nearby)
+    {
+        const chunk_coordinates p (near.first);
+        const world_vector p_lo (near.second.first);
+        const world_vector p_hi (near.second.second);
+        const auto blocks (touched.find(p));
+
+        if (rebuild.count(p))
+            continue;
+
+        if (is_air_chunk(p, get_coarse_height(p)))
+        {
+            if (blocks != touched.end())
+            {
+                compressed_surfaces_.remove(p);
+                compressed_lightmaps_.remove(p);
+            }
+            continue;
+        }
 
-            if (is_surface_available(p))
-                srf.version = get_surface(p).version + 1;
+        if (blocks != touched.end())
+        {
+            relight.erase(p);
+            remember(p);
+            if (!is_surface_available(p) || !is_lightmap_available(p))
+            {
+                replace_surface(p, build_surface(p));
+                replace_lightmap(p, generate_lightmap(p));
+                updated.insert(p);
+                continue;
+            }
+
+            voxel_snapshot nbh;
+            fill_surface_snapshot(p, nbh);
+            auto& before (get_surface(p));
+            auto after (patch_surface(before, nbh, blocks->second));
+            auto lm (patch_lightmap(p, before, after, get_lightmap(p),
+                                    blocks->second, p_lo, p_hi));
+
+            replace_surface(p, std::move(after));
+            replace_lightmap(p, std::move(lm));
+            updated.insert(p);
+        }
+        else if (is_surface_available(p) && is_lightmap_available(p))
+        {
+            relight.erase(p);
+            auto& srf (get_surface(p));
+            auto& old (get_lightmap(p));
+            auto lm (patch_lightmap(p, srf, srf, old, {}, p_lo, p_hi));
+
+            // The changes might not have cast any shadows on this chunk.
+            if (lm.opaque == old.opaque && lm.transparent == old.transparent)
+                continue;
+
+            remember(p);
+            replace_lightmap(p, std::move(lm));
+            updated.insert(p);
+        }
+    }
 
-            surfaces_[p] = srf;
-            storage_.store(persistent_storage_i::surface, p, pack(srf));
+    // Light maps that haven't been made yet will pick up the changes
+    // when they're generated.
+    for (auto& p : relight)
+    {
+        if (!is_lightmap_available(p))
+            continue;
 
-            auto lm (generate_lightmap(p));
-            lightmaps_[p] = lm;
-            storage_.store(persistent_storage_i::light, p, pack(lm));
+        remember(p);
+        replace_lightmap(p, generate_lightmap(p));
+        updated.insert(p);
+    }
 
-            on_update_surface(p);
+    // Let everyone know only once per chunk, no matter how many of the
+    // changes it was affected by.
+    for (auto& p : updated)
+    {
+        auto old (before.find(p));
+        surface_delta delta;
+        if (   old != before.end()
+            && make_delta(old->second.first, old->second.second,
+                          get_surface(p), get_lightmap(p), delta))
+        {
+            add_history(p, std::move(delta));
+        }
+        else
+        {
+            history_.remove(p);
         }
+
+        on_update_surface(p);
     }
 }
 
+void
+world::replace_surface (chunk_coordinates pos, surface_data&& srf)
+{
+    if (is_surface_available(pos))
+        srf.version = get_surface(pos).version + 1;
+
+    // The compressed forms are needed for storage anyway, keep them
+    // around for the clients that will ask for them.
+    auto packed (share(pack(srf)));
+    surfaces_.assign(pos, std::move(srf));
+    compressed_surfaces_.assign(pos, std::move(packed));
+    dirty_surfaces_.insert(pos);
+}
+
+void
+world::add_history (chunk_coordinates pos, surface_delta&& delta)
+{
+    surface_history h;
+    auto found (history_.try_get(pos));
+    if (found)
+        h = *found;
+
+    if (h.size() >= max_history)
+        h.erase(h.begin(), h.end() - (max_history - 1));
+
+    h.emplace_back(std::move(delta));
+    history_.assign(pos, std::move(h));
+}
+
+void
+world::replace_lightmap (chunk_coordinates pos, light_data&& lm)
+{
+    auto packed (share(pack(lm)));
+    lm.generation = ++light_generation_;
+    lightmaps_.assign(pos, std::move(lm));
+    compressed_lightmaps_.assign(pos, std::move(packed));
+    dirty_lightmaps_.insert(pos);
+}
+
 world_read
 world::acquire_read_access()
 {
@@ -339,6 +967,28 @@ world::acquire_write_access (const chunk_coordinates &pos)
     return proxy;
 }
 
+world_write
+world::acquire_write_access (const std::vector<chunk_coordinates>& chunks)
+{
+    world_write proxy (*this);
+    for (auto& pos : chunks)
+    {
+        if (!proxy.has_chunk(pos))
+            proxy.add(pos, get_chunk_writable(pos));
+    }
+    return proxy;
+}
+
+world_write
+world::acquire_write_access (const range<chunk_coordinates>& chunks)
+{
+    world_write proxy (*this);
+    for (auto pos : chunks)
+        proxy.add(pos, get_chunk_writable(pos));
+
+    return proxy;
+}
+
 //---------------------------------------------------------------------------
 
 bool
@@ -382,27 +1032,30 @@ world::generate_chunk (chunk_coordinates pos)
     return cnk;
 }
 
-light_data&
+light_data
 world::generate_lightmap (chunk_coordinates pos, int level)
 {
     world_lightmap_access proxy (*this);
-    light_data& result (lightmaps_[pos]);
+    light_data result;
     auto& surf (get_surface(pos));
 
     result.opaque.resize(count_faces(surf.opaque));
     if (!result.opaque.empty())
     {
         for (auto& gen : lightgen_)
-            gen->generate(proxy, pos, surf.opaque, result.opaque, level);
+            gen->generate(proxy, pos, surf.opaque, result.opaque,
+                          std::min<unsigned int>(level, gen->phases() - 1));
     }
 
     result.transparent.resize(count_faces(surf.transparent));
     if (!result.transparent.empty())
     {
         for (auto& gen : lightgen_)
-            gen->generate(proxy, pos, surf.transparent, result.transparent, level);
+            gen->generate(proxy, pos, surf.transparent, result.transparent,
+                          std::min<unsigned int>(level, gen->phases() - 1));
     }
 
+    result.phase = level;
     return result;
 }
 
@@ -431,7 +1084,7 @@ world::generate_coarse_height (map_coordinates pos)
 chunk_height
 world::set_coarse_height(chunk_coordinates pos)
 {
-    coarse_heights_[pos] = pos.z;
+    coarse_heights_.assign(pos, pos.z);
     storage_.store(pos, pos.z);
     on_update_coarse_height(pos);
     return pos.z;
@@ -440,6 +1093,8 @@ world::set_coarse_height(chunk_coordinates pos)
 void
 world::adjust_coarse_height (chunk_coordinates pos)
 {
+    std::lock_guard<std::recursive_mutex> gen_lock (generation_lock_);
+
     auto current (get_coarse_height(pos));
     if (needs_chunk_height_adjustment(pos, current))
     {
@@ -448,16 +1103,198 @@ world::adjust_coarse_height (chunk_coordinates pos)
     }
 }
 
+void
+world::prefetch_chunks (const std::vector<chunk_coordinates>& list)
+{
+    std::vector<chunk_coordinates> missing;
+    for (auto& p : list)
+    {
+        if (chunks_.count(p) == 0 && !is_air_chunk(p, get_coarse_height(p)))
+            missing.emplace_back(p);
+    }
+
+    if (missing.size() < 2)
+        return;
+
+    auto found (storage_.try_retrieve(persistent_storage_i::chunk, missing));
+    for (size_t i (0); i < missing.size(); ++i)
+    {
+        if (!found[i])
+            continue;
+
+        // If another thread beat us to it, emplace() keeps its copy.
+        auto loaded (unpack_as<chunk>(*found[i]));
+        loaded.is_dirty = false;
+        chunks_.emplace(missing[i], std::move(loaded));
+    }
+}
+
+std::unique_ptr<voxel_snapshot>
+world::borrow_snapshot()
+{
+    std::lock_guard<std::mutex> l (snapshot_pool_lock_);
+    if (snapshot_pool_.empty())
+        return std::unique_ptr<voxel_snapshot>(new voxel_snapshot);
+
+    auto result (std::move(snapshot_pool_.back()));
+    snapshot_pool_.pop_back();
+    return result;
+}
+
+void
+world::return_snapshot (std::unique_ptr<voxel_snapshot> snap)
+{
+    std::lock_guard<std::mutex> l (snapshot_pool_lock_);
+    snapshot_pool_.emplace_back(std::move(snap));
+}
+
 surface_data
 world::build_surface (chunk_coordinates pos)
 {
-    world_subsection_read nbh;
+    voxel_snapshot nbh;
+    fill_surface_snapshot(pos, nbh);
+
+    return extract_surface(nbh);
+}
 
+void
+world::fill_surface_snapshot (chunk_coordinates pos, voxel_snapshot& nbh)
+{
+    std::vector<chunk_coordinates> neighbors;
     for (auto rel : neumann_neighborhood)
-        nbh.add(rel, get_chunk(pos + rel));
+        neighbors.emplace_back(pos + rel);
 
-    return surface_data(extract_opaque_surface(nbh),
-                        extract_transparent_surface(nbh));
+    prefetch_chunks(neighbors);
+
+    // Only the six chunks that share a face with this one matter, the
+    // corners and edges of the snapshot can stay empty.
+    nbh.fill(pos, 1, [&](chunk_coordinates p) -> const chunk*
+    {
+        world_vector rel (p - pos);
+        if (   std::abs(rel.x) + std::abs(rel.y) + std::abs(rel.z) > 1
+            || is_air_chunk(p, get_coarse_height(p)))
+        {
+            return nullptr;
+        }
+
+        return &get_chunk(p);
+    });
+}
+
+light_data
+world::patch_lightmap (chunk_coordinates pos,
+                       const surface_data& before, const surface_data& after,
+                       const light_data& old,
+                       const std::vector<chunk_index>& fresh,
+                       world_vector lo, world_vector hi)
+{
+    std::bitset<chunk_volume> is_fresh;
+    for (auto i : fresh)
+        is_fresh.set(flat_index(i));
+
+    // A generator can overwrite what the ones before it came up with,
+    // so if a face is lit again by one generator, it has to be lit
+    // again by all the ones that come after it as well.
+    std::vector<int> radius (lightgen_.size());
+    int furthest (0);
+    for (size_t i (lightgen_.size()); i-- > 0; )
+    {
+        furthest = std::max<int>(furthest, lightgen_[i]->influence_radius(0));
+        radius[i] = furthest;
+    }
+
+    world_lightmap_access proxy (*this);
+    auto patch ([&](const surface& srf_before, const surface& srf_after,
+                    const lightmap& lm_before)
+    {
+        lightmap result;
+        result.resize(count_faces(srf_after));
+
+        // Copy the values of the faces that are still there.  These are
+        // in the same order as before, only the faces of the fresh
+        // blocks have to be skipped.
+        const bool carry_over (lm_before.size() == count_faces(srf_before));
+        std::vector<bool> must (srf_after.size(), !carry_over);
+        if (carry_over)
+        {
+            auto bi (srf_before.begin());
+            auto oi (lm_before.begin());
+            auto li (result.begin());
+            for (size_t k (0); k < srf_after.size(); ++k)
+            {
+                auto& f (srf_after[k]);
+                auto n (face_count(f));
+                if (is_fresh[flat_index(f.pos)])
+                {
+                    must[k] = true;
+                    li += n;
+                    continue;
+                }
+
+                while (bi != srf_before.end() && bi->pos != f.pos)
+                {
+                    oi += face_count(*bi);
+                    ++bi;
+                }
+                assert(bi != srf_before.end());
+                if (bi == srf_before.end())
+                {
+                    must[k] = true;
+                    li += n;
+                    continue;
+                }
+
+                std::copy(oi, oi + n, li);
+                oi += n;
+                li += n;
+                ++bi;
+            }
+        }
+
+        for (size_t g (0); g < lightgen_.size(); ++g)
+        {
+            surface part;
+            lightmap part_lm;
+            std::vector<size_t> offsets;
+
+            size_t offset (0);
+            for (size_t k (0); k < srf_after.size(); ++k)
+            {
+                auto& f (srf_after[k]);
+                auto n (face_count(f));
+                if (must[k] || distance(world_vector(f.pos), lo, hi) <= radius[g])
+                {
+                    part.push_back(f);
+                    offsets.push_back(offset);
+                    for (size_t j (0); j < n; ++j)
+                        part_lm.push_back(result.data[offset + j]);
+                }
+                offset += n;
+            }
+            if (part.empty())
+                continue;
+
+            lightgen_[g]->generate(proxy, pos, part, part_lm, 0);
+
+            auto li (part_lm.begin());
+            for (size_t k (0); k < part.size(); ++k)
+            {
+                auto n (face_count(part[k]));
+                std::copy(li, li + n, result.begin() + offsets[k]);
+                li += n;
+            }
+        }
+
+        return result;
+    });
+
+    light_data result;
+    result.opaque      = patch(before.opaque, after.opaque, old.opaque);
+    result.transparent = patch(before.transparent, after.transparent,
+                               old.transparent);
+    result.phase = 0;
+
+    return result;
 }
 
 //--------------------------------------------------------------------------
@@ -501,5 +1338,20 @@ raycast(world& w, const wfpos& origin, const yaw_pitch& direction,
     return tuple_type(origin.pos, origin.pos);
 }
 
-} // namespace hexa
+void
+set_blocks (world& w,
+            const std::vector<std::pair<world_coordinates, uint16_t>>& blocks)
+{
+    if (blocks.empty())
+        return;
 
+    std::vector<chunk_coordinates> chunks;
+    for (auto& b : blocks)
+        chunks.emplace_back(b.first >> cnkshift);
+
+    auto proxy (w.acquire_write_access(chunks));
+    for (auto& b : blocks)
+        proxy[b.first] = b.second;
+}
+
+} // namespace hexa
@@ -22,13 +22,18 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <boost/signals2.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include <hexa/basic_types.hpp>
 #include <hexa/chunk.hpp>
@@ -38,12 +43,16 @@
 #include <hexa/lru_cache.hpp>
 #include <hexa/persistent_storage_i.hpp>
 #include <hexa/read_write_lockable.hpp>
+#include <hexa/sharded_cache.hpp>
 #include <hexa/surface.hpp>
+#include <hexa/surface_delta.hpp>
+#include <hexa/voxel_range.hpp>
 
 #include "area/area_generator_i.hpp"
 #include "lightmap/lightmap_generator_i.hpp"
 #include "terrain/terrain_generator_i.hpp"
 
+#include "voxel_snapshot.hpp"
 #include "world_read.hpp"
 #include "world_write.hpp"
 
@@ -52,6 +61,63 @@ namespace hexa {
 class world_lightmap_access;
 class world_terraingen_access;
 
+/** Estimates how many bytes a cached element occupies in memory.
+ *  This includes the heap allocations of the element itself, and a
+ *  rough guess for the overhead of the cache's bookkeeping. */
+struct cache_weight
+{
+    size_t operator() (const chunk& c) const;
+    size_t operator() (const area_data& a) const;
+    size_t operator() (const surface_data& s) const;
+    size_t operator() (const light_data& l) const;
+    size_t operator() (chunk_height h) const;
+    size_t operator() (const shared_compressed_data& d) const;
+    size_t operator() (const surface_history& h) const;
+};
+
+/** Memory budgets for the world's caches, in bytes. */
+struct cache_limits
+{
+    size_t  chunks     = 256 * 1024 * 1024;
+    size_t  surfaces   = 128 * 1024 * 1024;
+    size_t  lightmaps  =  64 * 1024 * 1024;
+    size_t  areas      =  32 * 1024 * 1024;
+    size_t  heights    =   8 * 1024 * 1024;
+    /** Compressed surfaces and light maps, ready to be sent. */
+    size_t  compressed =  64 * 1024 * 1024;
+    /** The last few changes to the surfaces and light maps. */
+    size_t  history    =   8 * 1024 * 1024;
+};
+
+/** Resident sizes and eviction counters of the world's caches. */
+struct cache_statistics
+{
+    struct cache
+    {
+        size_t  entries;  /**< Number of elements in memory. */
+        size_t  bytes;    /**< Estimated memory use. */
+        size_t  limit;    /**< The configured budget. */
+        size_t  evicted;  /**< Total number of evicted elements. */
+    };
+
+    cache   chunks;
+    cache   surfaces;
+    cache   lightmaps;
+    cache   areas;
+    cache   heights;
+    cache   compressed;
+
+    /** Requests for compressed data that were served from memory. */
+    size_t  compressed_hits;
+    /** Requests for compressed data that had to go to storage. */
+    size_t  compressed_misses;
+
+    /** Number of modified chunks waiting to be written to storage. */
+    size_t  dirty_chunks;
+    /** Total number of modified chunks written back to storage. */
+    size_t  written_back;
+};
+
 /** The game world.
  *  This class takes care of several things:
  *  - Keeping chunk data (and the associated surfaces, light maps, and
@@ -59,6 +125,16 @@ class world_terraingen_access;
  *  - Writing the cached data to disk on changes.
  *  - Calling the terrain generators when new chunks are accessed.
  *  - Providing mutexed read and write access to the rest of the application.
+ *
+ *  Any number of threads can hold a world_read at the same time.  The
+ *  caches are split into shards with their own locks, so readers only
+ *  have to wait for each other if they happen to touch the same shard at
+ *  the same moment.  A world_write has exclusive access to the world.
+ *
+ *  Modified chunks are not written to storage right away; they are
+ *  marked dirty and written in a single batch by cleanup() or flush().
+ *  cleanup() also evicts the least recently used elements from the
+ *  caches until they fit in their memory budgets again.
  */
 class world
 {
@@ -84,6 +160,16 @@ public:
     /** Get write access to a given chunk. */
     world_write acquire_write_access (const chunk_coordinates& pos);
 
+    /** Get write access to a number of chunks at once.
+     *  The changes are committed together once the world_write goes out
+     *  of scope, so a surface or light map that several of them have an
+     *  effect on is only updated once. */
+    world_write acquire_write_access (const std::vector<chunk_coordinates>& chunks);
+
+    /** Get write access to a range of chunks at once.
+     * \sa to_chunk_range() */
+    world_write acquire_write_access (const range<chunk_coordinates>& chunks);
+
     /** Terrain generation seed. */
     uint32_t    seed() const { return seed_; }
 
@@ -108,14 +194,53 @@ public:
     /** Add a lightmap generator. */
     void add_lightmap_generator(std::unique_ptr<lightmap_generator_i>&& gen);
 
-    /** Flush data from memory to disk. */
+    /** The number of chunks around a given position whose surfaces are
+     *  needed to generate its light map.
+     *  \sa lightmap_generator_i::surface_radius */
+    unsigned int lightmap_surface_radius() const;
+
+    /** The number of detail levels the light maps can have.
+     *  \sa lightmap_generator_i::phases */
+    unsigned int lightmap_phases() const;
+
+    /** Set the memory budgets for the caches.
+     *  These are enforced the next time cleanup() is called. */
+    void set_cache_limits (const cache_limits& limits);
+
+    /** Get the memory budgets for the caches. */
+    cache_limits get_cache_limits() const { return limits_; }
+
+    /** Write modified chunks to disk, and evict elements from the caches
+     *  until they fit in their budgets again.
+     *  This waits until all world_read and world_write objects have
+     *  been released, so don't call it while holding one. */
     void cleanup();
 
+    /** Write modified chunks to disk, without evicting anything. */
+    void flush();
+
+    /** Regenerate a chunk's light map at a higher level of detail.
+     *  The new light map replaces the old one in memory and in storage.
+     *  Nothing is done if the light map doesn't exist yet, or if it is
+     *  already at this phase or higher.  Like cleanup(), this shouldn't
+     *  be called while holding a world_read or world_write.
+     * @param pos    The chunk's position
+     * @param phase  The level of detail, \sa lightmap_phases
+     * @return The new light map in compressed form, or a null pointer
+     *         if nothing was done */
+    shared_compressed_data refine_lightmap (chunk_coordinates pos,
+                                            unsigned int phase);
+
+    /** Get the current sizes of the caches, and the eviction counters.
+     *  Like cleanup(), this shouldn't be called while holding a
+     *  world_write. */
+    cache_statistics statistics();
+
 protected: // Only available through world_read and world_write
 
-    /** world_read and world_write use this to synchronize */
-    //readers_writer_lock  lock;
-    std::mutex      single_lock;
+    /** world_read and world_write use this to synchronize.
+     *  Readers hold a shared lock, writers an exclusive one. */
+    boost::shared_mutex     lock;
 
     /** Returns a read-only chunk. */
     const chunk&    get_chunk (chunk_coordinates pos);
@@ -125,10 +250,18 @@ protected: // Only available through world_read and world_write
      *  world_write object will call commit_write(). */
     chunk&          get_chunk_writable (chunk_coordinates pos);
 
-    /** Commit the changes to a chunk.
+    /** Commit the changes to a number of chunks.
      *  This will make sure the database, surfaces, light maps, and
-     *  compressed data will be updated accordingly. */
-    void            commit_write (chunk_coordinates pos);
+     *  compressed data will be updated accordingly.  If only a few
+     *  blocks were changed, only the faces around them are looked at
+     *  again, and only the light within each generator's
+     *  influence_radius() is recalculated.  Every surface and light
+     *  map is updated at most once, and on_update_surface is fired once
+     *  for each of them.
+     * @param changes  The chunks that were changed, and the blocks in
+     *                 them that were handed out for writing */
+    void            commit_write (const std::unordered_map<chunk_coordinates,
+                                                           chunk_changes>& changes);
 
     const area_data&
                     get_area_data (map_coordinates pos, uint16_t index);
@@ -146,9 +279,19 @@ protected: // Only available through world_read and world_write
 
     compressed_data get_compressed_chunk (chunk_coordinates pos);
 
-    compressed_data get_compressed_surface(chunk_coordinates pos);
+    /** Get a surface in compressed form, ready to be sent to a client.
+     *  The returned data is shared and must not be modified. */
+    shared_compressed_data get_compressed_surface(chunk_coordinates pos);
+
+    /** Get a light map in compressed form, ready to be sent to a client.
+     *  The returned data is shared and must not be modified. */
+    shared_compressed_data get_compressed_lightmap (chunk_coordinates pos);
 
-    compressed_data get_compressed_lightmap (chunk_coordinates pos);
+    /** Get the last few changes to a surface and its light map in
+     *  compressed form, as a surface_history.  Clients that have one of
+     *  the older versions can use this to catch up.
+     * @return A null pointer if the chunk hasn't changed recently */
+    shared_compressed_data get_compressed_history (chunk_coordinates pos);
 
 
     bool    is_area_available (map_coordinates pos, uint16_t idx) const;
@@ -172,8 +315,10 @@ private:
     /** Generate the terrain of a given chunk. */
     chunk  generate_chunk (chunk_coordinates pos);
 
-    /** Generate the lightmap of a given chunk. */
-    light_data& generate_lightmap (chunk_coordinates pos, int level = 0);
+    /** Generate the lightmap of a given chunk.
+     *  Generators that have fewer phases than requested use their
+     *  highest one. */
+    light_data  generate_lightmap (chunk_coordinates pos, int level = 0);
 
     chunk_height generate_coarse_height (map_coordinates pos);
 
@@ -184,6 +329,70 @@ private:
     /** Build a new surface at the given location. */
     surface_data build_surface (chunk_coordinates pos);
 
+    /** Fill a snapshot with a chunk and the blocks right next to it,
+     *  which is all that is needed to find its surface. */
+    void fill_surface_snapshot (chunk_coordinates pos, voxel_snapshot& nbh);
+
+    /** Recalculate part of a light map.
+     *  The faces that are new, and the faces within a generator's
+     *  influence_radius() of the changed blocks, get new light values
+     *  from that generator.  All other faces keep their old values.
+     * @param pos     The chunk
+     * @param before  The surface that goes with \a old
+     * @param after   The new surface
+     * @param old     The old light map
+     * @param fresh   The blocks whose faces have to be lit in any case
+     * @param lo, hi  The corners of the box that contains the changed
+     *                blocks, relative to the chunk
+     * @return The new light map, at phase 0 */
+    light_data patch_lightmap (chunk_coordinates pos,
+                               const surface_data& before,
+                               const surface_data& after,
+                               const light_data& old,
+                               const std::vector<chunk_index>& fresh,
+                               world_vector lo, world_vector hi);
+
+    /** Replace a surface.  It is stored at the next write-back. */
+    void replace_surface (chunk_coordinates pos, surface_data&& srf);
+
+    /** Replace a light map.  It is stored at the next write-back. */
+    void replace_lightmap (chunk_coordinates pos, light_data&& lm);
+
+    /** Add a change to a chunk's history, forgetting the oldest one if
+     *  it's getting too long. */
+    void add_history (chunk_coordinates pos, surface_delta&& delta);
+
+    /** Load a list of chunks from storage with a single batch lookup.
+     *  Chunks that are already in memory, or are not in storage yet,
+     *  are skipped. */
+    void prefetch_chunks (const std::vector<chunk_coordinates>& list);
+
+    /** Write all dirty chunks, surfaces, and light maps to storage in
+     *  one transaction.
+     *  The caller must hold an exclusive lock on the world. */
+    void write_back_dirty_chunks();
+
+    /** Take a voxel snapshot from the pool, or make a new one.
+     *  Snapshots are a few hundred kilobytes, and every light map needs
+     *  one, so they are recycled instead of allocated every time. */
+    std::unique_ptr<voxel_snapshot> borrow_snapshot();
+
+    /** Put a snapshot back in the pool. */
+    void return_snapshot (std::unique_ptr<voxel_snapshot> snap);
+
+    /** Look up compressed data in a cache, then in storage, and build
+     *  it if it's not there yet.
+     * @param cache  The cache to use
+     * @param type   The type of data in storage
+     * @param pos    The position of the chunk
+     * @param build  Function that returns the compressed data */
+    template <typename func>
+    shared_compressed_data
+        get_compressed (sharded_cache<chunk_coordinates, shared_compressed_data,
+                                      cache_weight>& cache,
+                        persistent_storage_i::data_type type,
+                        chunk_coordinates pos, func build);
+
 private:
     persistent_storage_i& storage_;
 
@@ -191,14 +400,69 @@ private:
     vector_uptr<terrain_generator_i>    terraingen_;
     vector_uptr<lightmap_generator_i>   lightgen_;
 
-    template<typename t> using cache_map = lru_cache<chunk_coordinates, t>;
+    template<typename t> using cache_map
+        = sharded_cache<chunk_coordinates, t, cache_weight>;
 
     cache_map<area_data>        area_data_;
     cache_map<chunk>            chunks_;
     cache_map<surface_data>     surfaces_;
     cache_map<light_data>       lightmaps_;
 
-    lru_cache<map_coordinates, chunk_height> coarse_heights_;
+    /** Surfaces and light maps in compressed form, so the ones that are
+     *  requested a lot don't have to be fetched from storage every time.
+     *  commit_write() replaces the entries of the chunks it changes, so
+     *  they always match the current version of the surface. */
+    cache_map<shared_compressed_data> compressed_surfaces_;
+    cache_map<shared_compressed_data> compressed_lightmaps_;
+
+    /** How the surfaces and light maps got to their current versions.
+     *  A chunk's history is dropped whenever a change to it couldn't be
+     *  recorded, so it never has any gaps. */
+    cache_map<surface_history>  history_;
+
+    sharded_cache<map_coordinates, chunk_height, cache_weight> coarse_heights_;
+
+    /** Chunks that were changed since they were last written to storage.
+     *  Only accessed with an exclusive lock on the world. */
+    std::unordered_set<chunk_coordinates> dirty_chunks_;
+
+    /** Surfaces and light maps that were changed along with the dirty
+     *  chunks.  They're written back in the same transaction, so the
+     *  storage never has them out of step with their chunks. */
+    std::unordered_set<chunk_coordinates> dirty_surfaces_;
+    std::unordered_set<chunk_coordinates> dirty_lightmaps_;
+
+    cache_limits                limits_;
+
+    std::atomic<size_t>         evicted_chunks_;
+    std::atomic<size_t>         evicted_surfaces_;
+    std::atomic<size_t>         evicted_lightmaps_;
+    std::atomic<size_t>         evicted_areas_;
+    std::atomic<size_t>         evicted_heights_;
+    std::atomic<size_t>         evicted_compressed_;
+    std::atomic<size_t>         compressed_hits_;
+    std::atomic<size_t>         compressed_misses_;
+    std::atomic<size_t>         written_back_;
+
+    /** Hands out the light maps' generation numbers. */
+    std::atomic<uint64_t>       light_generation_;
+
+    /** The area generators keep internal state, so only one thread at a
+     *  time is allowed to run them.  The same goes for the coarse height
+     *  map.  Terrain generators are thread-safe, and don't need this
+     *  lock; readers that only hit the caches or the database never touch
+     *  it either. */
+    std::recursive_mutex        generation_lock_;
+
+    /** Chunks that are being generated right now.  A thread that needs
+     *  one of these waits until it's done, instead of generating it a
+     *  second time. */
+    std::unordered_set<chunk_coordinates> chunks_in_progress_;
+    std::mutex                  chunks_in_progress_lock_;
+    std::condition_variable     chunk_generated_;
+
+    std::mutex                  snapshot_pool_lock_;
+    vector_uptr<voxel_snapshot> snapshot_pool_;
 
     uint32_t                    seed_;
 };
@@ -212,6 +476,13 @@ get_block (world& w, world_coordinates pos)
     return w.acquire_read_access().get_block(pos);
 }
 
+/** Convenience function to change a number of blocks at once.
+ *  The chunks involved are locked together, and their surfaces and light
+ *  maps are only updated once, after all blocks have been written. */
+void
+set_blocks (world& w,
+            const std::vector<std::pair<world_coordinates, uint16_t>>& blocks);
+
 /** Convenience function to read the coarse map height. */
 inline chunk_height
 coarse_height (world& w, map_coordinates pos)
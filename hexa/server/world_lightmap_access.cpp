@@ -21,6 +21,8 @@
 
 #include "world_lightmap_access.hpp"
 
+#include <algorithm>
+
 #include "world.hpp"
 
 namespace hexa {
@@ -35,10 +37,15 @@ world_lightmap_access::world_lightmap_access(world &w)
     : w_(w)
     , cached_pos_(-1, -1, -1)
     , cached_cnk_(dummy_)
+    , ceiling_pos_(-1, -1)
+    , ceiling_radius_(0)
+    , ceiling_(undefined_height)
 { }
 
 world_lightmap_access::~world_lightmap_access()
 {
+    if (snapshot_)
+        w_.return_snapshot(std::move(snapshot_));
 }
 
 const chunk&
@@ -53,6 +60,75 @@ world_lightmap_access::get_chunk (const chunk_coordinates& pos)
     return cached_cnk_;
 }
 
+const voxel_snapshot&
+world_lightmap_access::get_snapshot (const chunk_coordinates& pos,
+                                     unsigned int border)
+{
+    if (has_snapshot(pos, border))
+        return *snapshot_;
+
+    if (!snapshot_)
+        snapshot_ = w_.borrow_snapshot();
+
+    // Generators tend to ask for slightly different borders; rounding
+    // them up means they can usually share the same snapshot.
+    border = (border + 3) & ~3u;
+
+    snapshot_->fill(pos, border, [&](chunk_coordinates c) -> const chunk*
+    {
+        // Chunks above the coarse height map are air, there's no need
+        // to copy them.
+        if (is_air_chunk(c, w_.get_coarse_height(c)))
+            return nullptr;
+
+        return &w_.get_chunk(c);
+    });
+
+    return *snapshot_;
+}
+
+bool
+world_lightmap_access::has_snapshot (const chunk_coordinates& pos,
+                                     unsigned int border) const
+{
+    return    snapshot_
+           && snapshot_->position() == pos
+           && snapshot_->border() >= border;
+}
+
+chunk_height
+world_lightmap_access::get_ceiling (const chunk_coordinates& pos,
+                                   unsigned int radius)
+{
+    map_coordinates center (pos);
+    if (center == ceiling_pos_ && radius <= ceiling_radius_)
+        return ceiling_;
+
+    // A block within the radius of any block in the center chunk is at
+    // most this many chunks away.
+    const int r (radius / chunk_size + 1);
+    chunk_height result (0);
+    for (int y (-r); y <= r && result != undefined_height; ++y)
+    {
+        for (int x (-r); x <= r; ++x)
+        {
+            auto h (w_.get_coarse_height(center + map_rel_coordinates(x, y)));
+            if (h == undefined_height)
+            {
+                result = undefined_height;
+                break;
+            }
+            result = std::max(result, h);
+        }
+    }
+
+    ceiling_pos_    = center;
+    ceiling_radius_ = radius;
+    ceiling_        = result;
+
+    return result;
+}
+
 const surface_data&
 world_lightmap_access::get_surface (const chunk_coordinates& pos)
 {
@@ -22,10 +22,12 @@
 
 #pragma once
 
+#include <memory>
 #include <boost/optional.hpp>
 
 #include "../basic_types.hpp"
 #include "../chunk.hpp"
+#include "voxel_snapshot.hpp"
 
 namespace hexa {
 
@@ -44,6 +46,12 @@ class world_lightmap_access
     chunk_coordinates                   cached_pos_;
     std::reference_wrapper<const chunk> cached_cnk_;
 
+    std::unique_ptr<voxel_snapshot>     snapshot_;
+
+    map_coordinates                     ceiling_pos_;
+    unsigned int                        ceiling_radius_;
+    chunk_height                        ceiling_;
+
     friend class world;
 
 protected:
@@ -65,6 +73,31 @@ public:
     const surface_data&
             get_surface (const chunk_coordinates& pos);
 
+    /** Get a copy of the blocks around a chunk in a flat array.
+     *  The last snapshot is kept, so generators that run one after
+     *  the other on the same chunk can share it.
+     * @param pos     The center chunk
+     * @param border  The minimum number of blocks around the chunk
+     * @return A snapshot of \a pos with at least \a border blocks
+     *         on every side */
+    const voxel_snapshot&
+            get_snapshot (const chunk_coordinates& pos, unsigned int border);
+
+    /** Check if get_snapshot() can hand out the last snapshot again,
+     *  without filling it first. */
+    bool    has_snapshot (const chunk_coordinates& pos,
+                          unsigned int border) const;
+
+    /** Find the height above which there is nothing but air, in the
+     *  area around a chunk.
+     * @param pos     The center chunk
+     * @param radius  The radius of the area, in blocks
+     * @return The lowest chunk z coordinate that is above the coarse
+     *         height map everywhere in the area, or undefined_height
+     *         if that isn't known for part of the area */
+    chunk_height
+            get_ceiling (const chunk_coordinates& pos, unsigned int radius);
+
     const block
             operator[] (const world_coordinates& pos)
     {
@@ -32,7 +32,7 @@ namespace hexa {
 
 world_read::world_read (world &w)
     : w_(w)
-    , lock_(w_.single_lock)
+    , lock_(w_.lock)
 {
 }
 
@@ -60,18 +60,24 @@ world_read::get_surface (chunk_coordinates pos)
     return w_.get_surface(pos);
 }
 
-compressed_data
+shared_compressed_data
 world_read::get_compressed_surface (chunk_coordinates pos)
 {
     return w_.get_compressed_surface(pos);
 }
 
-compressed_data
+shared_compressed_data
 world_read::get_compressed_lightmap(chunk_coordinates pos)
 {
     return w_.get_compressed_lightmap(pos);
 }
 
+shared_compressed_data
+world_read::get_compressed_history (chunk_coordinates pos)
+{
+    return w_.get_compressed_history(pos);
+}
+
 chunk_height
 world_read::get_coarse_height (map_coordinates pos)
 {
@@ -22,10 +22,12 @@
 
 #pragma once
 
-#include <mutex>
 #include <boost/optional.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include <hexa/basic_types.hpp>
+#include <hexa/compression.hpp>
 #include <hexa/surface.hpp>
 #include <hexa/read_write_lockable.hpp>
 
@@ -33,11 +35,13 @@ namespace hexa {
 
 class area_data;
 class chunk;
-class compressed_data;
 class lightmap;
 class world;
 
-/** This object grants read access to the game world. */
+/** This object grants read access to the game world.
+ *  Several threads can have read access at the same time.  Note that a
+ *  thread should never hold a world_read while acquiring a world_write,
+ *  that would make it wait for itself. */
 class world_read
 {
     friend class world;
@@ -67,9 +71,11 @@ public:
 
     chunk_height        get_coarse_height (map_coordinates pos);
 
-    compressed_data     get_compressed_surface(chunk_coordinates pos);
+    shared_compressed_data get_compressed_surface(chunk_coordinates pos);
 
-    compressed_data     get_compressed_lightmap (chunk_coordinates pos);
+    shared_compressed_data get_compressed_lightmap (chunk_coordinates pos);
+
+    shared_compressed_data get_compressed_history (chunk_coordinates pos);
 
     bool    is_area_available (map_coordinates pos, uint16_t index) const;
     bool    is_chunk_available (chunk_coordinates pos) const;
@@ -80,7 +86,7 @@ public:
 
 private:
     world& w_;
-    std::unique_lock<std::mutex>  lock_;
+    boost::shared_lock<boost::shared_mutex> lock_;
 };
 
 } // namespace hexa
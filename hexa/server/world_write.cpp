@@ -21,29 +21,72 @@
 
 #include "world_write.hpp"
 
+#include <array>
 #include "world.hpp"
 
 namespace hexa {
 
+namespace {
+
+/** Beyond this many blocks, a chunk is simply rebuilt completely. */
+const size_t max_tracked_blocks (512);
+
+#ifndef NDEBUG
+/** Hash the blocks of a chunk for tracing, without unpacking it. */
+uint32_t fingerprint (const chunk& cnk)
+{
+    std::array<uint16_t, chunk_volume> types;
+    cnk.copy_types(0, chunk_volume, types.data());
+    return fnv_hash(reinterpret_cast<const uint8_t*>(types.data()),
+                    chunk_volume * sizeof(uint16_t));
+}
+#endif
+
+} // anonymous namespace
+
 world_write::world_write (world& w)
     : w_(w)
-    , lock_(w_.single_lock)
+    , lock_(w_.lock)
 { }
 
 world_write::~world_write()
 {
+    // Chunks that were handed out, but never written to, are left alone.
     for (auto& cnk : cnks_)
     {
-        trace("Write commit chunk %1%, fingerprint %2%", cnk.first, fnv_hash((const uint8_t*)&*cnk.second.begin(), chunk_volume * 2));
-        w_.commit_write(cnk.first);
+        if (changes_.count(cnk.first))
+            trace("Write commit chunk %1%, fingerprint %2%", cnk.first, fingerprint(cnk.second));
     }
+
+    if (!changes_.empty())
+        w_.commit_write(changes_);
 }
 
 void
 world_write::add (const chunk_coordinates& pos, chunk& cnk)
 {
     cnks_.emplace(pos, cnk);
-    trace("Write access to chunk fingerprint %1%", fnv_hash((const uint8_t*)&*cnk.begin(), chunk_volume * 2));
+    trace("Write access to chunk fingerprint %1%", fingerprint(cnk));
+}
+
+void
+world_write::touch (const chunk_coordinates& pos, chunk_index blk)
+{
+    auto& c (changes_[pos]);
+    if (c.everything)
+        return;
+
+    if (c.blocks.size() >= max_tracked_blocks)
+    {
+        c.everything = true;
+        c.blocks.clear();
+        c.blocks.shrink_to_fit();
+        return;
+    }
+
+    // Writing the same block a few times in a row is common.
+    if (c.blocks.empty() || c.blocks.back() != blk)
+        c.blocks.push_back(blk);
 }
 
 } // namespace hexa
@@ -22,8 +22,10 @@
 #pragma once
 
 #include <memory>
-#include <mutex>
 #include <unordered_map>
+#include <vector>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include <hexa/basic_types.hpp>
 #include <hexa/chunk.hpp>
@@ -35,22 +37,40 @@ namespace hexa {
 
 class world;
 
+/** The blocks of a chunk that were handed out for writing.
+ *  world::commit_write() only looks at these blocks and their
+ *  surroundings to bring the surfaces and light maps up to date. */
+struct chunk_changes
+{
+    chunk_changes() : everything (false) { }
+
+    /** Set if the whole chunk was handed out, or so many blocks that
+     *  keeping track of them doesn't pay off. */
+    bool                        everything;
+    /** The blocks that might have changed.  There can be duplicates,
+     *  and blocks that were only written with their old value. */
+    std::vector<chunk_index>    blocks;
+};
+
 /** Write access to the game world.
  *  This class can only be instanced by hexa::world.  The owner of the
  *  instance has unique write access to a number of chunks.  Once world_write
- *  goes out of scope, the chunks become available for reading again.
+ *  goes out of scope, the changes to all of them are committed in one go,
+ *  and the chunks become available for reading again.
  */
 class world_write
 {
     world& w_;
-    std::unique_lock<std::mutex> lock_;
+    boost::unique_lock<boost::shared_mutex> lock_;
     std::unordered_map<chunk_coordinates, chunk&> cnks_;
+    std::unordered_map<chunk_coordinates, chunk_changes> changes_;
 
     friend class world;
 
 protected:
     world_write (world& w);
     void add (const chunk_coordinates& pos, chunk& cnk);
+    void touch (const chunk_coordinates& pos, chunk_index blk);
 
 public:
     world_write(const world_write&) = delete;
@@ -60,19 +80,22 @@ public:
         : w_(m.w_)
         , lock_(std::move(m.lock_))
         , cnks_(std::move(m.cnks_))
+        , changes_(std::move(m.changes_))
     { }
 #else
     world_write(world_write&&) = default;
 #endif
     ~world_write();
 
+    /** Get a whole chunk for writing.
+     *  Since there's no telling which blocks will be changed, the
+     *  surfaces and light maps around it will be rebuilt completely.
+     *  Use operator[] for small changes. */
     chunk& get_chunk(const chunk_coordinates& pos)
     {
-        auto found (cnks_.find(pos));
-        if (found == cnks_.end())
-            throw std::runtime_error("no write access to chunk");
-
-        return found->second;
+        auto& cnk (find(pos));
+        changes_[pos].everything = true;
+        return cnk;
     }
 
     bool has_chunk (const chunk_coordinates& pos) const
@@ -80,9 +103,26 @@ public:
         return cnks_.count(pos) > 0;
     }
 
+    /** Get a single block for writing.
+     *  Only the surroundings of the blocks that were accessed this way
+     *  are updated when the changes are committed. */
     block& operator[] (const world_coordinates& pos)
     {
-        return get_chunk(pos >> cnkshift)[pos % chunk_size];
+        chunk_coordinates cpos (pos >> cnkshift);
+        chunk_index       blk  (pos % chunk_size);
+        auto& cnk (find(cpos));
+        touch(cpos, blk);
+        return cnk[blk];
+    }
+
+private:
+    chunk& find (const chunk_coordinates& pos)
+    {
+        auto found (cnks_.find(pos));
+        if (found == cnks_.end())
+            throw std::runtime_error("no write access to chunk");
+
+        return found->second;
     }
 };
 
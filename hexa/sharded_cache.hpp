@@ -0,0 +1,309 @@
+//---------------------------------------------------------------------------
+/// \file  sharded_cache.hpp
+/// \brief Thread-safe cache, split into independently locked shards.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <utility>
+#include <boost/optional.hpp>
+
+#include "clock_cache.hpp"
+
+namespace hexa {
+
+/** Default weight function for sharded_cache: every element counts as one. */
+struct unit_weight
+{
+    template <class t>
+    size_t operator() (const t&) const { return 1; }
+};
+
+/** A set of clock_caches, each guarded by its own mutex.
+ *  Keys are spread over the shards by their hash value, so threads that
+ *  work on different parts of the world will rarely have to wait for
+ *  each other.  The locks are only held for the duration of a single
+ *  lookup or insertion; the references that are handed out stay valid
+ *  until the element is removed from the cache.  Removing elements that
+ *  might still be in use by another thread is the caller's problem.
+ *
+ *  Every shard keeps track of the total weight of its elements, as
+ *  determined by the function object \a weigher.  This can be used to
+ *  keep the cache within a memory budget, see prune().  The weight of
+ *  an element is taken when it is inserted; if it changes in place
+ *  afterwards, call reweigh().
+ *
+ * Example:
+ * @code
+
+hexa::sharded_cache<chunk_coordinates, surface_data> cache;
+
+auto& srf (cache.emplace(pos, build_surface(pos)));
+if (cache.try_get(pos))
+    std::cout << "found it" << std::endl;
+
+ * @endcode */
+template <class key, class value, class weigher = unit_weight,
+          size_t shard_count = 64>
+class sharded_cache
+{
+    static_assert((shard_count & (shard_count - 1)) == 0,
+                  "shard_count must be a power of two");
+
+public:
+    typedef key                     key_type;
+    typedef value                   mapped_type;
+
+private:
+    /** An element, and the weight it was given. */
+    struct entry
+    {
+        entry() : weight (0) { }
+
+        mapped_type v;
+        size_t      weight;
+    };
+
+public:
+    typedef clock_cache<key, entry> shard_type;
+
+private:
+    struct shard
+    {
+        shard() : weight (0) { }
+
+        mutable std::mutex  lock;
+        shard_type          cache;
+        size_t              weight;
+    };
+
+    typedef std::lock_guard<std::mutex> guard;
+
+public:
+    /** Find out which shard a key belongs to. */
+    static size_t shard_index (const key_type& k)
+    {
+        // The shards use the upper bits of a Fibonacci hash, the hash
+        // tables inside them use the lower bits of the key's own hash.
+        uint64_t h (std::hash<key_type>()(k));
+        return static_cast<size_t>((h * 0x9e3779b97f4a7c15ULL) >> 40)
+               & (shard_count - 1);
+    }
+
+    /** The number of shards. */
+    static constexpr size_t shards() { return shard_count; }
+
+    /** Fetch an element, and mark it as recently used. */
+    boost::optional<mapped_type&> try_get (const key_type& k)
+    {
+        auto& s (shard_for(k));
+        guard lock (s.lock);
+        auto found (s.cache.try_get(k));
+        if (!found)
+            return boost::none;
+
+        return found->v;
+    }
+
+    /** Get an element from the cache without changing its age.
+     *  @throw std::runtime_error if the key is not in the cache */
+    mapped_type& get (const key_type& k) const
+    {
+        auto& s (shard_for(k));
+        guard lock (s.lock);
+        return s.cache.get(k).v;
+    }
+
+    /** Insert an element if the key is not in the cache yet.
+     *  If two threads race to create the same element, the first one
+     *  wins, and both get a reference to that one.
+     * @return A reference to the element in the cache */
+    mapped_type& emplace (const key_type& k, mapped_type&& v)
+    {
+        auto& s (shard_for(k));
+        guard lock (s.lock);
+        if (s.cache.count(k))
+            return s.cache[k].v;
+
+        auto& result (s.cache[k]);
+        result.v = std::move(v);
+        result.weight = weigh_(result.v);
+        s.weight += result.weight;
+        return result.v;
+    }
+
+    /** Insert an element, or overwrite it if it already exists.
+     * @return A reference to the element in the cache */
+    mapped_type& assign (const key_type& k, mapped_type v)
+    {
+        auto& s (shard_for(k));
+        guard lock (s.lock);
+        auto& result (s.cache[k]);
+        s.weight -= result.weight;
+        result.v = std::move(v);
+        result.weight = weigh_(result.v);
+        s.weight += result.weight;
+        return result.v;
+    }
+
+    /** Weigh an element again, after it was changed in place. */
+    void reweigh (const key_type& k)
+    {
+        auto& s (shard_for(k));
+        guard lock (s.lock);
+        auto found (s.cache.try_get(k));
+        if (found)
+        {
+            s.weight -= found->weight;
+            found->weight = weigh_(found->v);
+            s.weight += found->weight;
+        }
+    }
+
+    /** Remove an element from the cache. */
+    void remove (const key_type& k)
+    {
+        auto& s (shard_for(k));
+        guard lock (s.lock);
+        auto old (s.cache.try_get(k));
+        if (old)
+        {
+            s.weight -= old->weight;
+            s.cache.remove(k);
+        }
+    }
+
+    /** Count the number of elements for a given key.
+     *  The returned value is always 0 or 1. */
+    size_t count (const key_type& k) const
+    {
+        auto& s (shard_for(k));
+        guard lock (s.lock);
+        return s.cache.count(k);
+    }
+
+    /** Get the total number of elements in the cache. */
+    size_t size() const
+    {
+        size_t result (0);
+        for (auto& s : shards_)
+        {
+            guard lock (s.lock);
+            result += s.cache.size();
+        }
+        return result;
+    }
+
+    /** Get the total weight of all elements in the cache. */
+    size_t weight() const
+    {
+        size_t result (0);
+        for (auto& s : shards_)
+        {
+            guard lock (s.lock);
+            result += s.weight;
+        }
+        return result;
+    }
+
+    /** Check if the cache is empty. */
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    /** Empty the cache. */
+    void clear()
+    {
+        for (auto& s : shards_)
+        {
+            guard lock (s.lock);
+            s.cache.clear();
+            s.weight = 0;
+        }
+    }
+
+    /** Prune the cache back to a given total weight.
+     *  Every shard gets an equal part of the budget, and elements that
+     *  weren't used recently are removed from a shard until it fits.
+     *  The callback is invoked for every element that is removed, before
+     *  it is destroyed, with the shard's lock held.
+     * @param max_weight  The maximum total weight
+     * @param on_remove   Callback for removed elements
+     * @return The number of elements that were removed */
+    template <class func>
+    size_t prune (size_t max_weight, func on_remove)
+    {
+        const size_t budget (max_weight / shard_count);
+        size_t removed (0);
+        for (auto& s : shards_)
+        {
+            guard lock (s.lock);
+            if (s.weight <= budget)
+                continue;
+
+            removed += s.cache.evict_while([&]{ return s.weight > budget; },
+                                           [&](const key_type& k, entry& e)
+            {
+                s.weight -= e.weight;
+                on_remove(k, e.v);
+            });
+        }
+        return removed;
+    }
+
+    /** Prune the cache back to a given total weight. */
+    size_t prune (size_t max_weight)
+    {
+        return prune(max_weight, [](const key_type&, mapped_type&){ });
+    }
+
+    /** Call a function for every shard, with its lock held.
+     *  This is meant for maintenance tasks, such as pruning the cache. */
+    template <class func>
+    func for_each_shard (func op)
+    {
+        for (auto& s : shards_)
+        {
+            guard lock (s.lock);
+            op(s.cache);
+        }
+        return op;
+    }
+
+private:
+    shard& shard_for (const key_type& k)
+        { return shards_[shard_index(k)]; }
+
+    const shard& shard_for (const key_type& k) const
+        { return shards_[shard_index(k)]; }
+
+private:
+    std::array<shard, shard_count> shards_;
+    weigher                        weigh_;
+};
+
+} // namespace hexa
@@ -80,5 +80,20 @@ size_t count_faces (const surface& s)
     return result;
 }
 
-} // namespace hexa
+bool surface_order (chunk_index a, chunk_index b)
+{
+    auto in_shell ([](chunk_index i)
+    {
+        return    i.x == 0 || i.x == chunk_size - 1
+               || i.y == 0 || i.y == chunk_size - 1
+               || i.z == 0 || i.z == chunk_size - 1;
+    });
+
+    bool sa (in_shell(a)), sb (in_shell(b));
+    if (sa != sb)
+        return sa;
 
+    return a < b;
+}
+
+} // namespace hexa
@@ -26,6 +26,7 @@
 #include <vector>
 #include "basic_types.hpp"
 #include "chunk.hpp"
+#include "pool_allocator.hpp"
 #include "pos_dir.hpp"
 
 namespace hexa {
@@ -58,7 +59,7 @@ public:
 };
 
 /** A list of faces in a chunk. */
-typedef std::vector<faces> surface;
+typedef std::vector<faces, recycling_allocator<faces>> surface;
 
 /** Bundle the surfaces of the opaque and transparent parts in one object. */
 class surface_data
@@ -116,6 +117,12 @@ public:
 /** Count the number of faces in a surface. */
 size_t count_faces (const surface& s);
 
+/** The order of the faces in a surface.
+ *  Blocks in the outer shell of a chunk come before the inner core,
+ *  and then it's z, y, x.  This is the order in which the server's
+ *  extractors emit their faces. */
+bool surface_order (chunk_index a, chunk_index b);
+
 
 } // namespace hexa
 
@@ -0,0 +1,199 @@
+//---------------------------------------------------------------------------
+// surface_delta.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "surface_delta.hpp"
+
+#include <algorithm>
+
+namespace hexa {
+
+namespace {
+
+/** The number of light map entries of a block. */
+inline size_t light_count (const faces& f)
+{
+    size_t result (0);
+    for (int d (0); d < 6; ++d)
+        result += f[d];
+
+    return result;
+}
+
+inline size_t light_count (const surface& s)
+{
+    size_t result (0);
+    for (auto& f : s)
+        result += light_count(f);
+
+    return result;
+}
+
+inline bool is_sorted (const surface& s)
+{
+    return std::is_sorted(s.begin(), s.end(),
+                          [](const faces& a, const faces& b)
+                          { return surface_order(a.pos, b.pos); });
+}
+
+/** Walk through both surfaces at the same time, and the light maps along
+ *  with them. */
+bool diff (const surface& old_srf, const lightmap& old_light,
+           const surface& new_srf, const lightmap& new_light,
+           sequence_patch<faces>& srf_patch,
+           sequence_patch<light>& light_patch)
+{
+    if (   !is_sorted(old_srf) || !is_sorted(new_srf)
+        || old_light.size() != light_count(old_srf)
+        || new_light.size() != light_count(new_srf))
+    {
+        return false;
+    }
+
+    auto a (old_srf.begin()), b (new_srf.begin());
+    auto la (old_light.begin()), lb (new_light.begin());
+    while (a != old_srf.end() || b != new_srf.end())
+    {
+        if (b == new_srf.end() || (a != old_srf.end() && surface_order(a->pos, b->pos)))
+        {
+            // A block that doesn't have any faces anymore.
+            auto n (light_count(*a++));
+            srf_patch.remove(1);
+            light_patch.remove(n);
+            la += n;
+        }
+        else if (a == old_srf.end() || surface_order(b->pos, a->pos))
+        {
+            // A block that didn't have any faces before.
+            auto n (light_count(*b));
+            srf_patch.insert(*b++);
+            for (size_t i (0); i < n; ++i)
+                light_patch.insert(*lb++);
+        }
+        else if (*a == *b && a->type == b->type)
+        {
+            // Same faces, but the light might have changed.
+            auto n (light_count(*a));
+            srf_patch.keep(1);
+            for (size_t i (0); i < n; ++i, ++la, ++lb)
+            {
+                if (*la == *lb)
+                {
+                    light_patch.keep(1);
+                }
+                else
+                {
+                    light_patch.remove(1);
+                    light_patch.insert(*lb);
+                }
+            }
+            ++a;
+            ++b;
+        }
+        else
+        {
+            auto n (light_count(*a++));
+            srf_patch.remove(1);
+            light_patch.remove(n);
+            la += n;
+
+            n = light_count(*b);
+            srf_patch.insert(*b++);
+            for (size_t i (0); i < n; ++i)
+                light_patch.insert(*lb++);
+        }
+    }
+
+    return true;
+}
+
+} // anonymous namespace
+
+bool make_delta (const surface_data& old_srf, const light_data& old_light,
+                 const surface_data& new_srf, const light_data& new_light,
+                 surface_delta& result)
+{
+    result = surface_delta();
+    result.base = old_srf.version;
+    result.version = new_srf.version;
+    result.phase = new_light.phase;
+
+    return    diff(old_srf.opaque, old_light.opaque,
+                   new_srf.opaque, new_light.opaque,
+                   result.opaque, result.opaque_light)
+           && diff(old_srf.transparent, old_light.transparent,
+                   new_srf.transparent, new_light.transparent,
+                   result.transparent, result.transparent_light);
+}
+
+bool apply (const surface_delta& delta, surface_data& srf, light_data& light)
+{
+    if (delta.base != srf.version)
+        return false;
+
+    surface_data s;
+    light_data l;
+    if (   !delta.opaque.apply(srf.opaque, s.opaque)
+        || !delta.transparent.apply(srf.transparent, s.transparent)
+        || !delta.opaque_light.apply(light.opaque.data, l.opaque.data)
+        || !delta.transparent_light.apply(light.transparent.data,
+                                          l.transparent.data)
+        || l.opaque.size() != light_count(s.opaque)
+        || l.transparent.size() != light_count(s.transparent))
+    {
+        return false;
+    }
+
+    s.version = delta.version;
+    l.phase = delta.phase;
+    srf = std::move(s);
+    light = std::move(l);
+
+    return true;
+}
+
+bool apply (const surface_history& history, surface_data& srf,
+            light_data& light)
+{
+    if (history.empty())
+        return true;
+
+    if (srf.version < history.front().base)
+        return false;
+
+    surface_data s (srf);
+    light_data l (light);
+    for (auto& delta : history)
+    {
+        if (delta.base < s.version)
+            continue;
+
+        if (!apply(delta, s, l))
+            return false;
+    }
+
+    srf = std::move(s);
+    light = std::move(l);
+
+    return true;
+}
+
+} // namespace hexa
+
@@ -0,0 +1,179 @@
+//---------------------------------------------------------------------------
+/// \file   surface_delta.hpp
+/// \brief  The difference between two versions of a surface and light map
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "lightmap.hpp"
+#include "surface.hpp"
+
+namespace hexa {
+
+/** An edit script that turns one sequence into another.
+ *  The script is a list of runs.  Every run keeps a number of elements
+ *  of the old sequence, skips a number of them, and then inserts a
+ *  number of new ones.  Whatever is left of the old sequence after the
+ *  last run is kept as well. */
+template <typename t>
+class sequence_patch
+{
+public:
+    /** Triples of: elements to keep, elements to skip, and elements to
+     *  take from \a inserted. */
+    std::vector<uint32_t>   runs;
+    /** The new elements. */
+    std::vector<t>          inserted;
+
+public:
+    bool empty() const { return runs.empty(); }
+
+    /** Keep the next \a n elements. */
+    void keep (uint32_t n)
+    {
+        if (n == 0)
+            return;
+
+        if (runs.empty() || runs[runs.size() - 2] != 0 || runs.back() != 0)
+            runs.insert(runs.end(), { n, 0, 0 });
+        else
+            runs[runs.size() - 3] += n;
+    }
+
+    /** Skip the next \a n elements. */
+    void remove (uint32_t n)
+    {
+        if (n == 0)
+            return;
+
+        if (runs.empty() || runs.back() != 0)
+            runs.insert(runs.end(), { 0, n, 0 });
+        else
+            runs[runs.size() - 2] += n;
+    }
+
+    /** Insert a new element. */
+    void insert (const t& element)
+    {
+        if (runs.empty())
+            runs.insert(runs.end(), { 0, 0, 0 });
+
+        ++runs.back();
+        inserted.push_back(element);
+    }
+
+    /** Apply the script.
+     * @param in   The old sequence
+     * @param out  The new sequence
+     * @return False if the script doesn't fit the old sequence */
+    template <class alloc>
+    bool apply (const std::vector<t, alloc>& in,
+                std::vector<t, alloc>& out) const
+    {
+        out.clear();
+        out.reserve(in.size() + inserted.size());
+
+        auto src (in.begin());
+        auto ins (inserted.begin());
+        for (size_t i (0); i + 2 < runs.size(); i += 3)
+        {
+            if (   uint64_t(runs[i]) + runs[i + 1] > size_t(in.end() - src)
+                || runs[i + 2] > size_t(inserted.end() - ins))
+            {
+                return false;
+            }
+
+            out.insert(out.end(), src, src + runs[i]);
+            src += runs[i] + runs[i + 1];
+            out.insert(out.end(), ins, ins + runs[i + 2]);
+            ins += runs[i + 2];
+        }
+        out.insert(out.end(), src, in.end());
+
+        return runs.size() % 3 == 0 && ins == inserted.end();
+    }
+
+    template <class archive>
+    archive& serialize(archive& ar)
+        { return ar(runs)(inserted); }
+};
+
+/** The difference between two versions of a chunk's surface and light
+ *  map.  These are sent to the clients instead of the whole thing when
+ *  only a couple of blocks changed.
+ *
+ *  The light map is patched after the surface.  A delta that only
+ *  changes the light has the same base and new version; applying it
+ *  more than once doesn't do any harm. */
+class surface_delta
+{
+public:
+    /** The surface version this delta applies to. */
+    uint32_t    base;
+    /** The surface version after applying it. */
+    uint32_t    version;
+    /** The phase of the new light map. */
+    uint16_t    phase;
+
+    sequence_patch<faces>   opaque;
+    sequence_patch<faces>   transparent;
+    sequence_patch<light>   opaque_light;
+    sequence_patch<light>   transparent_light;
+
+public:
+    surface_delta() : base (0), version (0), phase (0) { }
+
+    template <class archive>
+    archive& serialize(archive& ar)
+    {
+        return ar(base)(version)(phase)(opaque)(transparent)
+                 (opaque_light)(transparent_light);
+    }
+};
+
+/** A number of deltas in a row, oldest first. */
+typedef std::vector<surface_delta> surface_history;
+
+/** Find the difference between two versions of a surface and light map.
+ *  Both surfaces have to be sorted in surface_order().
+ * @param old_srf, old_light  The old version
+ * @param new_srf, new_light  The new version
+ * @param result              The delta
+ * @return False if the surfaces weren't sorted */
+bool make_delta (const surface_data& old_srf, const light_data& old_light,
+                 const surface_data& new_srf, const light_data& new_light,
+                 surface_delta& result);
+
+/** Apply a single delta.
+ * @return False if it doesn't fit the surface and light map, in which
+ *         case they are left as they were */
+bool apply (const surface_delta& delta, surface_data& srf, light_data& light);
+
+/** Bring a surface and light map up to date.
+ *  The deltas that come before the surface's version are skipped.
+ * @return False if the surface is too old for the first delta, or one
+ *         of the deltas didn't fit */
+bool apply (const surface_history& history, surface_data& srf,
+            light_data& light);
+
+} // namespace hexa
+
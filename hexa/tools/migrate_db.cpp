@@ -0,0 +1,118 @@
+//---------------------------------------------------------------------------
+// tools/migrate_db.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Offline conversion of a world.leveldb file to another key layout.
+// The server must not be running while this is done.
+
+#include <iostream>
+#include <string>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include <hexa/persistence_leveldb.hpp>
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+using namespace hexa;
+
+int main (int argc, char* argv[])
+{
+    po::options_description options("Options");
+    options.add_options()
+        ("help", "show help message")
+        ("from", po::value<std::string>(), "the database to convert")
+        ("to", po::value<std::string>(), "where to write the converted database")
+        ("layout", po::value<std::string>()->default_value("morton"),
+            "the key layout of the new database, 'morton' or 'legacy'")
+        ;
+
+    po::variables_map vm;
+    try
+    {
+        po::store(po::parse_command_line(argc, argv, options), vm);
+        po::notify(vm);
+    }
+    catch (po::error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (vm.count("help") || !vm.count("from") || !vm.count("to"))
+    {
+        std::cout << "Usage: hexahedra-migrate-db --from <db> --to <db>" << std::endl;
+        std::cout << options << std::endl;
+        return vm.count("help") ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    fs::path from (vm["from"].as<std::string>());
+    fs::path to   (vm["to"].as<std::string>());
+    std::string layout_name (vm["layout"].as<std::string>());
+
+    persistence_leveldb::key_layout layout;
+    if (layout_name == "morton")
+        layout = persistence_leveldb::key_layout::morton;
+    else if (layout_name == "legacy")
+        layout = persistence_leveldb::key_layout::legacy;
+    else
+    {
+        std::cerr << "Unknown key layout '" << layout_name << "'" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!fs::is_directory(from))
+    {
+        std::cerr << "Database " << from.string() << " does not exist" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (fs::exists(to))
+    {
+        std::cerr << "Refusing to overwrite " << to.string() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        persistence_leveldb source (from);
+        persistence_leveldb dest (to, 8192, 0, layout);
+
+        std::cout << "Converting " << from.string() << " to " << to.string()
+                  << " (" << layout_name << " layout)" << std::endl;
+
+        auto count (dest.import(source, [](size_t n)
+        {
+            std::cout << "\r" << n << " records" << std::flush;
+        }));
+
+        std::cout << std::endl << "Done, copied " << count << " records" << std::endl;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << std::endl << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -308,7 +308,12 @@ struct hash <hexa::vector2<type>>
     : public std::unary_function<hexa::vector2<type>, size_t>
 {
     size_t operator() (const hexa::vector2<type>& v) const
-        { return v.x ^ (v.y << 9) ^ (v.y >> 21); }
+    {
+        // See hash<vector3>.
+        uint64_t h (  uint32_t(v.x) * 0x9e3779b97f4a7c15ULL
+                    ^ uint32_t(v.y) * 0xc2b2ae3d27d4eb4fULL);
+        return static_cast<size_t>(h ^ (h >> 29));
+    }
 };
 
 template <>
@@ -469,7 +469,14 @@ struct hash <hexa::vector3<t>>
     : public std::unary_function<hexa::vector3<t>, size_t>
 {
     size_t operator() (const hexa::vector3<t>& v) const
-        { return v.x ^ (v.y << 10) ^ (v.y >> 22) ^ (v.z << 20) ^ (v.z >> 12); }
+    {
+        // Every coordinate gets multiplied by a different large odd
+        // number, so neighbors don't end up with neighboring hashes.
+        uint64_t h (  uint32_t(v.x) * 0x9e3779b97f4a7c15ULL
+                    ^ uint32_t(v.y) * 0xc2b2ae3d27d4eb4fULL
+                    ^ uint32_t(v.z) * 0x165667b19e3779f9ULL);
+        return static_cast<size_t>(h ^ (h >> 29));
+    }
 };
 
 
@@ -3,6 +3,8 @@
 #include <boost/test/unit_test.hpp>
 
 #include <chrono>
+#include <cstring>
+#include <map>
 #include <random>
 #include <set>
 #include <thread>
@@ -13,21 +15,27 @@
 #include <hexa/aabb.hpp>
 #include <hexa/algorithm.hpp>
 #include <hexa/chunk.hpp>
+#include <hexa/clock_cache.hpp>
 #include <hexa/collision.hpp>
 #include <hexa/compression.hpp>
 #include <hexa/concurrent_queue.hpp>
 #include <hexa/crypto.hpp>
+#include <hexa/flat_ray_bundle.hpp>
 #include <hexa/geometric.hpp>
 #include <hexa/hotbar_slot.hpp>
 #include <hexa/lru_cache.hpp>
+#include <hexa/morton.hpp>
 #include <hexa/persistence_leveldb.hpp>
 #include <hexa/persistence_null.hpp>
+#include <hexa/persistence_regionfile.hpp>
+#include <hexa/pool_allocator.hpp>
 #include <hexa/protocol.hpp>
 #include <hexa/quaternion.hpp>
 #include <hexa/server/random.hpp>
 #include <hexa/ray.hpp>
 #include <hexa/ray_bundle.hpp>
 #include <hexa/serialize.hpp>
+#include <hexa/sharded_cache.hpp>
 #include <hexa/surface.hpp>
 #include <hexa/trace.hpp>
 #include <hexa/vector3.hpp>
@@ -453,6 +461,204 @@ BOOST_AUTO_TEST_CASE (lrucache_test)
 }
 
 
+BOOST_AUTO_TEST_CASE (clockcache_test)
+{
+    clock_cache<int, std::string> cache;
+
+    cache[1] = "one";
+    cache[8] = "eight";
+    cache[5] = "five";
+
+    BOOST_CHECK_EQUAL(cache.size(), 3);
+    BOOST_CHECK_EQUAL(cache.count(2), 0);
+    BOOST_CHECK_EQUAL(cache.count(5), 1);
+    BOOST_CHECK_EQUAL(cache.get(1), "one");
+    BOOST_CHECK_EQUAL(*cache.try_get(8), "eight");
+    BOOST_CHECK(!cache.try_get(2));
+
+    // 8 was used, so it gets a second chance.
+    std::vector<int> keys;
+    cache.prune(2, [&](int k, std::string&){ keys.push_back(k); });
+    BOOST_CHECK_EQUAL(cache.size(), 2);
+    BOOST_CHECK_EQUAL(keys.size(), 1);
+    BOOST_CHECK(keys[0] != 8);
+    BOOST_CHECK_EQUAL(cache.count(8), 1);
+
+    // References stay valid while the table grows.
+    std::string& eight (cache.get(8));
+    for (int i (100); i < 1100; ++i)
+        cache[i] = std::to_string(i);
+
+    BOOST_CHECK_EQUAL(cache.size(), 1002);
+    BOOST_CHECK_EQUAL(&eight, &cache.get(8));
+    for (int i (100); i < 1100; i += 2)
+        cache.remove(i);
+
+    BOOST_CHECK_EQUAL(cache.size(), 502);
+    for (int i (101); i < 1100; i += 2)
+        BOOST_REQUIRE_EQUAL(cache.get(i), std::to_string(i));
+
+    // Removed slots are reused.
+    cache[2000] = "two thousand";
+    BOOST_CHECK_EQUAL(cache.get(2000), "two thousand");
+
+    size_t count (0);
+    cache.for_each([&](int, const std::string&){ ++count; });
+    BOOST_CHECK_EQUAL(count, cache.size());
+
+    size_t weight (cache.size() * 10);
+    auto removed (cache.evict_while([&]{ return weight > 1000; },
+                                    [&](int, std::string&){ weight -= 10; }));
+    BOOST_CHECK_EQUAL(cache.size(), 100);
+    BOOST_CHECK_EQUAL(removed, 403);
+
+    cache.prune(0);
+    BOOST_CHECK(cache.empty());
+    cache.clear();
+    cache[3] = "three";
+    BOOST_CHECK_EQUAL(cache.get(3), "three");
+}
+
+BOOST_AUTO_TEST_CASE (shardedcache_test)
+{
+    sharded_cache<chunk_coordinates, std::string> cache;
+
+    cache.emplace({1, 2, 3}, "one");
+    cache.emplace({4, 5, 6}, "four");
+    BOOST_CHECK_EQUAL(cache.size(), 2);
+    BOOST_CHECK_EQUAL(cache.count({1, 2, 3}), 1);
+    BOOST_CHECK_EQUAL(cache.count({7, 8, 9}), 0);
+
+    // The first insert wins.
+    BOOST_CHECK_EQUAL(cache.emplace({1, 2, 3}, "uno"), "one");
+    BOOST_CHECK_EQUAL(cache.assign({1, 2, 3}, "uno"), "uno");
+    BOOST_CHECK_EQUAL(cache.get({1, 2, 3}), "uno");
+    BOOST_CHECK_EQUAL(*cache.try_get({4, 5, 6}), "four");
+    BOOST_CHECK(!cache.try_get({7, 8, 9}));
+
+    cache.remove({4, 5, 6});
+    BOOST_CHECK_EQUAL(cache.size(), 1);
+
+    // Hammer it from a couple of threads.
+    std::vector<std::thread> threads;
+    for (int t (0); t < 4; ++t)
+    {
+        threads.emplace_back([&]
+        {
+            for (uint32_t i (0); i < 1000; ++i)
+            {
+                chunk_coordinates p (i, i * 3, 7);
+                cache.emplace(p, std::to_string(i));
+                BOOST_CHECK_EQUAL(cache.get(p), std::to_string(i));
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    BOOST_CHECK_EQUAL(cache.size(), 1001);
+
+    cache.clear();
+    BOOST_CHECK(cache.empty());
+}
+
+struct string_length
+{
+    size_t operator() (const std::string& s) const { return s.size(); }
+};
+
+BOOST_AUTO_TEST_CASE (shardedcache_prune_test)
+{
+    sharded_cache<chunk_coordinates, std::string, string_length, 4> cache;
+
+    for (uint32_t i (0); i < 100; ++i)
+        cache.emplace({i, 0, 0}, std::string(10, 'x'));
+
+    BOOST_CHECK_EQUAL(cache.weight(), 1000);
+
+    cache.assign({0, 0, 0}, std::string(20, 'x'));
+    BOOST_CHECK_EQUAL(cache.weight(), 1010);
+    cache.remove({0, 0, 0});
+    BOOST_CHECK_EQUAL(cache.weight(), 990);
+
+    // Touch one element, so it's the last one to be evicted.
+    cache.try_get({1, 0, 0});
+
+    std::vector<chunk_coordinates> removed;
+    auto count (cache.prune(400, [&](const chunk_coordinates& k, std::string&)
+    {
+        removed.push_back(k);
+    }));
+
+    BOOST_CHECK_EQUAL(count, removed.size());
+    BOOST_CHECK_EQUAL(cache.size(), 99 - count);
+    BOOST_CHECK(cache.weight() <= 400);
+    BOOST_CHECK(cache.count({1, 0, 0}));
+
+    cache.prune(0);
+    BOOST_CHECK(cache.empty());
+    BOOST_CHECK_EQUAL(cache.weight(), 0);
+}
+
+BOOST_AUTO_TEST_CASE (pool_allocator_test)
+{
+    auto& pool (slab_pool::get(1000));
+    BOOST_CHECK_EQUAL(&pool, &slab_pool::get(1000));
+
+    // Freed blocks are handed out again.
+    void* a (pool.allocate());
+    void* b (pool.allocate());
+    BOOST_CHECK(a != b);
+    pool.deallocate(b);
+    BOOST_CHECK_EQUAL(pool.allocate(), b);
+    BOOST_CHECK_EQUAL(pool.stats().in_use, 2);
+
+    std::vector<void*> blocks { a, b };
+    for (int i (0); i < 1000; ++i)
+        blocks.push_back(pool.allocate());
+
+    auto before (pool.stats());
+    BOOST_CHECK_EQUAL(before.in_use, 1002);
+    BOOST_CHECK(before.system_allocations > 1);
+    BOOST_CHECK(before.bytes_reserved >= 1002 * 1000);
+
+    for (auto p : blocks)
+        pool.deallocate(p);
+
+    // Only one empty slab is kept.
+    auto after (pool.stats());
+    BOOST_CHECK_EQUAL(after.in_use, 0);
+    BOOST_CHECK(after.bytes_reserved < before.bytes_reserved / 2);
+
+    // Churning containers don't go to the system every time.
+    typedef std::vector<uint16_t, pool_allocator<uint16_t, 500>> array_t;
+    for (int i (0); i < 100; ++i)
+    {
+        array_t v (500, i);
+        BOOST_CHECK_EQUAL(v[499], i);
+    }
+    after = pool.stats();
+    BOOST_CHECK_EQUAL(after.allocations, before.allocations + 100);
+    BOOST_CHECK_EQUAL(after.system_allocations, before.system_allocations);
+
+    // Other sizes, and variable sized buffers, come from the arena.
+    auto& arena (recycling_arena::get());
+    auto arena_before (arena.stats());
+    for (int i (0); i < 100; ++i)
+    {
+        std::vector<char, recycling_allocator<char>> buf (300 + i);
+        array_t v (20);
+    }
+    auto arena_after (arena.stats());
+    BOOST_CHECK_EQUAL(arena_after.allocations, arena_before.allocations + 200);
+    BOOST_CHECK(arena_after.system_allocations - arena_before.system_allocations <= 2);
+    BOOST_CHECK_EQUAL(arena_after.in_use, arena_before.in_use);
+
+    auto all (allocator_stats());
+    BOOST_CHECK(std::any_of(all.begin(), all.end(),
+        [](const allocator_statistics& s){ return s.name == "1000 byte blocks"; }));
+}
+
 BOOST_AUTO_TEST_CASE (crypto_test)
 {
     for (int i = 0; i < 100; ++i)
@@ -582,6 +788,285 @@ BOOST_AUTO_TEST_CASE (persistent_storage_test)
     boost::filesystem::remove_all(tmpdb);
 }
 
+BOOST_AUTO_TEST_CASE (persistent_storage_queue_test)
+{
+    boost::filesystem::path tmpdb ("queuetest.leveldb");
+    boost::filesystem::remove_all (tmpdb);
+
+    binary_data first  { 1, 2, 3 };
+    binary_data second { 4, 5, 6, 7 };
+    chunk_coordinates pos (10, 20, 30);
+
+    {
+    persistence_leveldb ldb (tmpdb, 16);
+    BOOST_CHECK(!ldb.is_available(persistent_storage_i::chunk, pos));
+
+    // Writes are visible right away, and later writes replace earlier
+    // ones while they're still in the queue.
+    {
+    auto t (ldb.transaction());
+    ldb.store(persistent_storage_i::chunk, pos, compress(first));
+    BOOST_CHECK(ldb.is_available(persistent_storage_i::chunk, pos));
+    ldb.store(persistent_storage_i::chunk, pos, compress(second));
+
+    // The backlog limit doesn't apply inside a transaction.
+    for (uint32_t i (0); i < 100; ++i)
+        ldb.store(map_coordinates(i, 0), i);
+    }
+
+    BOOST_CHECK(decompress(ldb.retrieve(persistent_storage_i::chunk, pos)) == second);
+
+    // Hit the backlog limit outside a transaction.
+    for (uint32_t i (0); i < 100; ++i)
+        ldb.store(map_coordinates(i, 1), i + 1);
+
+    ldb.flush();
+    BOOST_CHECK_EQUAL(ldb.retrieve(map_coordinates(99, 0)), 99);
+    BOOST_CHECK_THROW(ldb.retrieve(map_coordinates(1, 2)), not_in_storage_error);
+    }
+
+    {
+    persistence_leveldb ldb (tmpdb);
+    BOOST_CHECK(decompress(ldb.retrieve(persistent_storage_i::chunk, pos)) == second);
+    for (uint32_t i (0); i < 100; ++i)
+    {
+        BOOST_CHECK_EQUAL(ldb.retrieve(map_coordinates(i, 0)), i);
+        BOOST_CHECK_EQUAL(ldb.retrieve(map_coordinates(i, 1)), i + 1);
+    }
+    }
+
+    boost::filesystem::remove_all(tmpdb);
+}
+
+BOOST_AUTO_TEST_CASE (persistent_storage_lookup_test)
+{
+    boost::filesystem::path tmpdb ("lookuptest.leveldb");
+    boost::filesystem::remove_all (tmpdb);
+
+    const auto type (persistent_storage_i::surface);
+    std::vector<chunk_coordinates> list;
+    for (uint32_t i (0); i < 50; ++i)
+        list.emplace_back(i * 7, 1000 - i, i % 3);
+
+    {
+    persistence_leveldb ldb (tmpdb);
+    for (size_t i (0); i < list.size(); i += 2)
+        ldb.store(type, list[i], compress(binary_data(i + 1, uint8_t(i))));
+    }
+
+    persistence_leveldb ldb (tmpdb);
+
+    // Some of these come from the queue, the rest from the database.
+    ldb.store(type, list[10], compress(binary_data(3, 42)));
+    ldb.store(type, list[11], compress(binary_data(3, 43)));
+
+    auto found (ldb.try_retrieve(type, list));
+    BOOST_CHECK_EQUAL(found.size(), list.size());
+    for (size_t i (0); i < list.size(); ++i)
+    {
+        if (i == 10 || i == 11)
+        {
+            BOOST_CHECK(decompress(*found[i]) == binary_data(3, 42 + i - 10));
+        }
+        else if (i % 2 == 0)
+        {
+            BOOST_CHECK(found[i]);
+            BOOST_CHECK(decompress(*found[i]) == binary_data(i + 1, uint8_t(i)));
+        }
+        else
+        {
+            BOOST_CHECK(!found[i]);
+            BOOST_CHECK(!ldb.try_retrieve(type, list[i]));
+        }
+    }
+
+    // Storing a key that was remembered as missing makes it show up.
+    BOOST_CHECK(!ldb.try_retrieve(type, list[1]));
+    ldb.store(type, list[1], compress(binary_data(5, 5)));
+    ldb.flush();
+    BOOST_CHECK(ldb.try_retrieve(type, list[1]));
+    BOOST_CHECK(ldb.is_available(type, list[1]));
+
+    BOOST_CHECK(!ldb.try_retrieve(map_coordinates(1, 2)));
+    ldb.store(map_coordinates(1, 2), 17);
+    BOOST_CHECK_EQUAL(*ldb.try_retrieve(map_coordinates(1, 2)), 17);
+
+    ldb.close();
+    boost::filesystem::remove_all(tmpdb);
+}
+
+BOOST_AUTO_TEST_CASE (morton_test)
+{
+    uint8_t a[morton_code_size], b[morton_code_size];
+
+    morton_encode(chunk_coordinates(1, 0, 0), a);
+    morton_encode(chunk_coordinates(0, 1, 1), b);
+    BOOST_CHECK(std::memcmp(a, b, morton_code_size) > 0);
+
+    uint32_t rn (1234);
+    for (int i (0); i < 1000; ++i)
+    {
+        chunk_coordinates p (prng_next(rn), prng_next(rn), prng_next(rn));
+        morton_encode(p, a);
+        BOOST_CHECK_EQUAL(morton_decode(a), p);
+
+        map_coordinates m (prng_next(rn), prng_next(rn));
+        BOOST_CHECK_EQUAL(morton_decode(morton_encode(m)), m);
+    }
+}
+
+BOOST_AUTO_TEST_CASE (persistent_storage_region_test)
+{
+    boost::filesystem::path olddb ("region_old.leveldb"), newdb ("region_new.leveldb");
+    boost::filesystem::remove_all(olddb);
+    boost::filesystem::remove_all(newdb);
+
+    const auto type (persistent_storage_i::chunk);
+    const chunk_coordinates center (world_chunk_center);
+    std::map<chunk_coordinates, binary_data> stored;
+
+    {
+    persistence_leveldb legacy (olddb, 8192, 65536,
+                                persistence_leveldb::key_layout::legacy);
+    BOOST_CHECK(legacy.layout() == persistence_leveldb::key_layout::legacy);
+
+    uint32_t rn (4242);
+    for (int i (0); i < 2000; ++i)
+    {
+        auto pos (center + chunk_coordinates(prng_next(rn) % 40, prng_next(rn) % 40,
+                                             prng_next(rn) % 40) - chunk_coordinates(20, 20, 20));
+        binary_data buf (1 + prng_next(rn) % 50, uint8_t(i));
+        legacy.store(type, pos, compress(buf));
+        stored[pos] = buf;
+    }
+    legacy.store(map_coordinates(5, 6), 7);
+
+    persistence_leveldb converted (newdb);
+    BOOST_CHECK(converted.layout() == persistence_leveldb::key_layout::morton);
+    BOOST_CHECK_EQUAL(converted.import(legacy), stored.size() + 1);
+    }
+
+    persistence_leveldb ldb (newdb);
+    BOOST_CHECK(ldb.layout() == persistence_leveldb::key_layout::morton);
+    BOOST_CHECK_EQUAL(ldb.retrieve(map_coordinates(5, 6)), 7);
+    for (auto& kv : stored)
+        BOOST_CHECK(decompress(ldb.retrieve(type, kv.first)) == kv.second);
+
+    // This one is still in the write queue when the region is scanned.
+    auto extra (center + chunk_coordinates(1, 2, 3));
+    ldb.store(type, extra, compress(binary_data(3, 99)));
+    stored[extra] = binary_data(3, 99);
+
+    aabb<chunk_coordinates> box (center - chunk_coordinates(7, 3, 11),
+                                 center + chunk_coordinates(5, 9, 4));
+    std::map<chunk_coordinates, binary_data> found;
+    ldb.for_each_in_region(type, box, [&](chunk_coordinates pos, compressed_data&& data)
+    {
+        BOOST_CHECK(found.count(pos) == 0);
+        found[pos] = decompress(data);
+    });
+
+    std::map<chunk_coordinates, binary_data> expected;
+    for (auto& kv : stored)
+    {
+        auto& p (kv.first);
+        if (   p.x >= box.first.x && p.x < box.second.x
+            && p.y >= box.first.y && p.y < box.second.y
+            && p.z >= box.first.z && p.z < box.second.z)
+            expected.insert(kv);
+    }
+    BOOST_CHECK(!expected.empty());
+    BOOST_CHECK(found == expected);
+
+    ldb.close();
+    boost::filesystem::remove_all(olddb);
+    boost::filesystem::remove_all(newdb);
+}
+
+BOOST_AUTO_TEST_CASE (persistent_storage_regionfile_test)
+{
+    boost::filesystem::path dir ("regionfile_test");
+    boost::filesystem::remove_all(dir);
+
+    const auto type (persistent_storage_i::surface);
+    const chunk_coordinates center (world_chunk_center);
+    std::map<chunk_coordinates, binary_data> stored;
+
+    {
+    persistence_regionfile db (dir, 2);
+
+    // Spread out over a few regions, so the files get closed and opened
+    // again along the way.
+    uint32_t rn (1234);
+    for (int i (0); i < 3000; ++i)
+    {
+        auto pos (center + chunk_coordinates(prng_next(rn) % 40, prng_next(rn) % 40,
+                                             prng_next(rn) % 40) - chunk_coordinates(20, 20, 20));
+        binary_data buf (1 + prng_next(rn) % 2000, uint8_t(i));
+        db.store(type, pos, compress(buf));
+        stored[pos] = buf;
+        if (i % 500 == 0)
+            db.cleanup();
+    }
+    db.store(map_coordinates(5, 6), 7);
+
+    BOOST_CHECK(!db.is_available(persistent_storage_i::chunk, center));
+    BOOST_CHECK(!db.try_retrieve(map_coordinates(5, 7)));
+    BOOST_CHECK_THROW(db.retrieve(type, center + chunk_coordinates(100, 0, 0)),
+                      not_in_storage_error);
+
+    // A mapped blob must survive its element being overwritten.
+    auto pos (stored.begin()->first);
+    auto blob (db.retrieve_mapped(type, pos));
+    BOOST_REQUIRE(blob);
+    db.store(type, pos, compress(binary_data(5000, 1)));
+    compressed_data old (blob->copy());
+    BOOST_CHECK(decompress(old) == stored[pos]);
+    stored[pos] = binary_data(5000, 1);
+
+    // Also when the file was remapped in the meantime.  Fill the region
+    // with data that doesn't compress, so the file has to grow.
+    chunk_coordinates corner (pos.x & ~15u, pos.y & ~15u, pos.z & ~15u);
+    for (uint32_t i (0); i < 32; ++i)
+    {
+        binary_data noise (60000);
+        for (auto& b : noise)
+            b = uint8_t(prng_next(rn));
+
+        auto p (corner + chunk_coordinates(i % 16, 15 - i / 16, 15));
+        if (p == pos)
+            continue;
+
+        db.store(type, p, compress(noise));
+        stored[p] = noise;
+    }
+    db.store(type, pos, compress(binary_data(5000, 2)));
+    BOOST_CHECK(decompress(blob->copy()) == binary_data(5000, 1));
+    stored[pos] = binary_data(5000, 2);
+    }
+
+    persistence_regionfile db (dir);
+    BOOST_CHECK_EQUAL(db.retrieve(map_coordinates(5, 6)), 7);
+    for (auto& kv : stored)
+        BOOST_CHECK(decompress(db.retrieve(type, kv.first)) == kv.second);
+
+    db.close();
+
+    // Closing files doesn't touch the regions that blobs point into.
+    {
+    persistence_regionfile none_open (dir, 0);
+    auto pos (stored.begin()->first);
+    auto blob (none_open.retrieve_mapped(type, pos));
+    BOOST_REQUIRE(blob);
+    none_open.cleanup();
+    none_open.store(type, pos, compress(binary_data(5000, 3)));
+    BOOST_CHECK(decompress(blob->copy()) == stored[pos]);
+    BOOST_CHECK(decompress(none_open.retrieve(type, pos)) == binary_data(5000, 3));
+    }
+
+    boost::filesystem::remove_all(dir);
+}
+
 BOOST_AUTO_TEST_CASE (es_loadsave_test)
 {
     es::storage st;
@@ -775,6 +1260,16 @@ BOOST_AUTO_TEST_CASE (protocol_test)
     upds2.serialize(arch4);
 
     BOOST_CHECK(upds.terrain == upds2.terrain);
+
+    // Building the packet straight from shared data must give the same
+    // result as going through the message object.
+    upds.position = chunk_coordinates(1, 2, 3);
+    upds.light = compress(binary_data(100, 7));
+    auto shared_terrain (share(compressed_data(upds.terrain)));
+    auto shared_light   (share(compressed_data(upds.light)));
+    BOOST_CHECK(msg::serialize_surface_update(upds.position, *shared_terrain,
+                                              *shared_light)
+                == msg::serialize_packet(upds));
 }
 
 BOOST_AUTO_TEST_CASE (protocol2_test)
@@ -849,6 +1344,40 @@ BOOST_AUTO_TEST_CASE (raybundle_test)
     BOOST_CHECK_EQUAL(two.branches[0].trunk[0], world_vector(2,2,2));
 }
 
+BOOST_AUTO_TEST_CASE (flat_raybundle_test)
+{
+    ray_bundle tree { { {0,0,0}, {1,1,1}, {2,2,2} }, 1.0f };
+    tree.add({{0,0,0}, {1,1,1}, {2,2,3}, {3,3,4}}, 0.5f);
+    tree.add({{0,0,0}, {1,0,-1}}, 0.25f);
+
+    flat_ray_bundle flat (tree);
+
+    BOOST_CHECK_EQUAL(flat.voxels.size(), 6);
+    BOOST_REQUIRE_EQUAL(flat.nodes.size(), 5);
+
+    // Depth-first: the root, the branch through (1,1,1) and its two
+    // children, then the branch through (1,0,-1).
+    BOOST_CHECK_EQUAL(flat.voxels[flat.nodes[0].first], world_vector(0,0,0));
+    BOOST_CHECK_EQUAL(flat.nodes[0].skip, 5);
+    BOOST_CHECK_EQUAL(flat.voxels[flat.nodes[1].first], world_vector(1,1,1));
+    BOOST_CHECK_EQUAL(flat.nodes[1].skip, 4);
+    BOOST_CHECK_EQUAL(flat.nodes[2].skip, 3);
+    BOOST_CHECK_EQUAL(flat.nodes[3].last - flat.nodes[3].first, 2);
+    BOOST_CHECK_EQUAL(flat.nodes[3].weight, 0.5f);
+    BOOST_CHECK_EQUAL(flat.voxels[flat.nodes[4].first], world_vector(1,0,-1));
+    BOOST_CHECK_EQUAL(flat.nodes[4].skip, 5);
+    BOOST_CHECK_EQUAL(flat.nodes[4].weight, 0.25f);
+
+    // Lowest point from here on, within the same subtree.
+    BOOST_CHECK_EQUAL(flat.lowest[0], -1);
+    BOOST_CHECK_EQUAL(flat.lowest[flat.nodes[1].first], 1);
+    BOOST_CHECK_EQUAL(flat.lowest[flat.nodes[3].first], 3);
+
+    auto offsets (flat.offsets(10, 100));
+    BOOST_CHECK_EQUAL(offsets[flat.nodes[1].first], 111);
+    BOOST_CHECK_EQUAL(offsets[flat.nodes[4].first], -99);
+}
+
 
 BOOST_AUTO_TEST_CASE (quaternion_test)
 {
@@ -22,12 +22,18 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
 #include <random>
 #include <set>
 #include <thread>
 #include <boost/range/algorithm.hpp>
 #include <boost/filesystem/operations.hpp>
+#include <boost/math/constants/constants.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
@@ -35,13 +41,23 @@
 #include <hexanoise/simple_global_variables.hpp>
 
 #include <hexa/block_types.hpp>
+#include <hexa/entity_snapshot.hpp>
 #include <hexa/voxel_range.hpp>
 #include <hexa/persistence_leveldb.hpp>
+#include <hexa/server/chunk_pipeline.hpp>
+#include <hexa/server/entity_replicator.hpp>
 #include <hexa/server/init_terrain_generators.hpp>
+#include <hexa/server/lightmap_refiner.hpp>
 #include <hexa/server/world.hpp>
 #include <hexa/server/random.hpp>
+#include <hexa/server/request_queue.hpp>
+#include <hexa/server/update_queue.hpp>
 #include <hexa/server/extract_surface.hpp>
 #include <hexa/server/voxel_shapes.hpp>
+#include <hexa/server/voxel_snapshot.hpp>
+#include <hexa/server/lightmap/ambient_occlusion_lightmap.hpp>
+#include <hexa/server/lightmap/lamp_lightmap.hpp>
+#include <hexa/server/lightmap/sun_lightmap.hpp>
 #include <hexa/server/terrain/testpattern_generator.hpp>
 
 using namespace hexa;
@@ -107,6 +123,64 @@ void check_chunk_index (const chunk_index pos)
     BOOST_CHECK(pos.z < chunk_size);
 }
 
+// Check that two surfaces have the same faces, in the same order, and
+// with the same materials.
+bool identical (const surface& a, const surface& b)
+{
+    return    a.size() == b.size()
+           && std::equal(a.begin(), a.end(), b.begin(),
+                         [](const faces& x, const faces& y)
+                         { return x == y && x.type == y.type; });
+}
+
+// Light map generator that marks every face with the phase it was
+// generated at.
+class phase_lightmap : public lightmap_generator_i
+{
+public:
+    phase_lightmap (world& w)
+        : lightmap_generator_i (w, pt::ptree())
+    { }
+
+    lightmap& generate (world_lightmap_access&, const chunk_coordinates&,
+                        const surface&, lightmap& map,
+                        unsigned int phase) const override
+    {
+        for (auto& l : map)
+            l.sunlight = phase + 1;
+
+        return map;
+    }
+
+    unsigned int phases() const override { return 3; }
+};
+
+// Terrain generator that fails to estimate the height of one row of
+// columns.
+class broken_estimate : public terrain_generator_i
+{
+public:
+    broken_estimate (world& w, uint32_t x)
+        : terrain_generator_i (w), x_ (x)
+    { }
+
+    void generate (world_terraingen_access&, const chunk_coordinates&,
+                   chunk&) override
+    { }
+
+    chunk_height estimate_height (world_terraingen_access&, map_coordinates xy,
+                                  chunk_height) const override
+    {
+        if (xy.x == x_)
+            throw std::runtime_error("broken_estimate");
+
+        return undefined_height;
+    }
+
+private:
+    uint32_t x_;
+};
+
 //---------------------------------------------------------------------------
 
 BOOST_FIXTURE_TEST_SUITE(terrain, fixture)
@@ -403,6 +477,53 @@ BOOST_AUTO_TEST_CASE (voxel_shape_1_test)
 
 }
 
+BOOST_AUTO_TEST_CASE (voxel_shape_rasterize_test)
+{
+    std::mt19937 rng (42);
+    std::uniform_real_distribution<float> rnd (-1.0f, 1.0f);
+
+    for (int i (0); i < 2000; ++i)
+    {
+        // Shapes in the same ranges as the cave generator uses, some of
+        // them with a steep axis, and chunks at all sorts of offsets.
+        vec3f pos (100.0f * rnd(rng), 100.0f * rnd(rng), 100.0f * rnd(rng));
+        vec3f dir (rnd(rng), rnd(rng), rnd(rng) * (i % 4 == 1 ? 4.0f : 1.0f));
+        float r1 (std::abs(rnd(rng)) * 9.0f + 0.5f);
+        float r2 (std::abs(rnd(rng)) * 9.0f + 0.5f);
+
+        std::unique_ptr<csg::shape> s;
+        if (i % 2 == 0)
+            s.reset(new csg::sphere(pos, r1));
+        else
+            s.reset(new csg::truncated_cone(pos, r1, pos + dir * 10.0f, r2));
+
+        vec3f origin (std::floor(pos.x + 16.0f * rnd(rng)) - 8.0f,
+                      std::floor(pos.y + 16.0f * rnd(rng)) - 8.0f,
+                      std::floor(pos.z + 16.0f * rnd(rng)) - 8.0f);
+
+        csg::chunk_mask mask;
+        mask.fill(0);
+        s->rasterize(origin, mask);
+
+        int mismatches (0);
+        for (auto k : every_block_in_chunk)
+        {
+            bool expected (s->is_inside(origin + vec3f(k)));
+            bool found ((mask[k.x + k.y * chunk_size] >> k.z) & 1);
+            if (expected != found)
+                ++mismatches;
+        }
+        BOOST_CHECK_EQUAL(mismatches, 0);
+    }
+
+    // Bits that were already set stay set.
+    csg::chunk_mask mask;
+    mask.fill(0xffff);
+    csg::sphere({8, 8, 8}, 3).rasterize({0, 0, 0}, mask);
+    BOOST_CHECK(std::all_of(mask.begin(), mask.end(),
+                            [](csg::chunk_column c){ return c == 0xffff; }));
+}
+
 //---------------------------------------------------------------------------
 
 BOOST_AUTO_TEST_CASE (restore_test)
@@ -456,6 +577,1173 @@ BOOST_AUTO_TEST_CASE (restore_test)
 
 //---------------------------------------------------------------------------
 
+BOOST_AUTO_TEST_CASE (compressed_cache_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+
+    chunk_coordinates pos (30, 30, 30);
+    shared_compressed_data first;
+    {
+    auto proxy (w.acquire_read_access());
+    first = proxy.get_compressed_surface(pos);
+    BOOST_CHECK(deserialize_as<surface_data>(decompress(*first)) == proxy.get_surface(pos));
+
+    // The second time around, it should come from memory.
+    auto s (w.statistics());
+    BOOST_CHECK(proxy.get_compressed_surface(pos) == first);
+    BOOST_CHECK_EQUAL(w.statistics().compressed_hits, s.compressed_hits + 1);
+    BOOST_CHECK(proxy.get_compressed_lightmap(pos));
+    }
+
+    // Changing a block must replace the cached data.
+    {
+    auto proxy (w.acquire_write_access(pos));
+    auto& blk (proxy[pos * chunk_size]);
+    blk = blk == 0 ? 1 : 0;
+    }
+
+    auto proxy (w.acquire_read_access());
+    auto second (proxy.get_compressed_surface(pos));
+    BOOST_CHECK(second != first);
+    auto srf (deserialize_as<surface_data>(decompress(*second)));
+    BOOST_CHECK(srf == proxy.get_surface(pos));
+    BOOST_CHECK_EQUAL(srf.version,
+                      deserialize_as<surface_data>(decompress(*first)).version + 1);
+    BOOST_CHECK(w.statistics().compressed.entries >= 2);
+}
+
+//---------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE (contention_test)
+{
+    // A few reader threads keep fetching surfaces that are already in the
+    // cache, while other threads trigger terrain generation elsewhere.
+    // The readers have to see the same surfaces all the time.  (See
+    // benchmarks/world_contention.cpp for the throughput.)
+
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+
+    const int readers (4), generators (2), rounds (200), new_chunks (16);
+
+    std::vector<chunk_coordinates> hot;
+    std::unordered_map<chunk_coordinates, surface_data> expected;
+    {
+    auto proxy (w.acquire_read_access());
+    for (uint32_t i (0); i < 16; ++i)
+    {
+        chunk_coordinates p (100 + i, 100, 100);
+        expected[p] = proxy.get_surface(p);
+        hot.push_back(p);
+    }
+    }
+
+    std::atomic<size_t> reads (0), generated (0), mismatches (0);
+    std::vector<std::thread> threads;
+
+    for (int t (0); t < readers; ++t)
+    {
+        threads.emplace_back([&]
+        {
+            for (int i (0); i < rounds; ++i)
+            {
+                auto proxy (w.acquire_read_access());
+                for (auto& p : hot)
+                {
+                    if (!(proxy.get_surface(p) == expected[p]))
+                        ++mismatches;
+                }
+                reads += hot.size();
+            }
+        });
+    }
+
+    for (int t (0); t < generators; ++t)
+    {
+        threads.emplace_back([&,t]
+        {
+            for (int i (0); i < new_chunks; ++i)
+            {
+                auto proxy (w.acquire_read_access());
+                proxy.get_surface(chunk_coordinates(200 + t * 50 + i, 200, 200));
+                ++generated;
+            }
+        });
+    }
+
+    for (auto& t : threads)
+        t.join();
+
+    BOOST_CHECK_EQUAL(mismatches, 0);
+    BOOST_CHECK_EQUAL(generated, generators * new_chunks);
+    BOOST_CHECK_EQUAL(reads, readers * rounds * hot.size());
+
+    auto proxy (w.acquire_read_access());
+    for (int t (0); t < generators; ++t)
+    {
+        for (int i (0); i < new_chunks; ++i)
+            BOOST_CHECK(proxy.is_surface_available(chunk_coordinates(200 + t * 50 + i, 200, 200)));
+    }
+}
+
+//---------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE (chunk_pipeline_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+
+    chunk_pipeline pipeline (w, 4);
+
+    std::mutex lock;
+    std::map<chunk_coordinates, int> done;
+    int owner_a, owner_b;
+    auto count ([&](chunk_coordinates p)
+    {
+        std::lock_guard<std::mutex> l (lock);
+        ++done[p];
+    });
+
+    std::vector<chunk_coordinates> wanted;
+    for (auto p : cube_range<world_vector>(2))
+        wanted.push_back(chunk_coordinates(300, 300, 300) + p);
+
+    // Every chunk is asked for twice by the same owner, and once by
+    // someone else.
+    for (auto& p : wanted)
+    {
+        pipeline.request(p, &owner_a, count);
+        pipeline.request(p, &owner_a, count);
+        pipeline.request(p, &owner_b, count);
+    }
+    pipeline.wait_idle();
+
+    // A chunk can be finished before the next request for it comes in,
+    // in which case it is done again (but without its dependencies).
+    auto s (pipeline.stats());
+    BOOST_CHECK_EQUAL(s.pending[chunk_pipeline::lightmap], 0);
+    BOOST_CHECK_GE(s.finished[chunk_pipeline::lightmap], wanted.size());
+    BOOST_CHECK_LE(s.finished[chunk_pipeline::lightmap], 3 * wanted.size());
+    // A 5x5x5 cube of surfaces needs the terrain of a 7x7x7 cube, minus
+    // the corners and edges.
+    BOOST_CHECK_EQUAL(s.finished[chunk_pipeline::surface], wanted.size());
+    BOOST_CHECK_EQUAL(s.finished[chunk_pipeline::terrain], 125 + 6 * 25);
+
+    auto proxy (w.acquire_read_access());
+    for (auto& p : wanted)
+    {
+        BOOST_CHECK(done[p] >= 1 && done[p] <= 3);
+        BOOST_CHECK(proxy.is_surface_available(p));
+        BOOST_CHECK(proxy.is_lightmap_available(p));
+    }
+}
+
+BOOST_AUTO_TEST_CASE (chunk_pipeline_error_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+    w.add_terrain_generator(std::unique_ptr<terrain_generator_i>(
+        new broken_estimate(w, 500)));
+
+    chunk_pipeline pipeline (w, 2);
+    int owner;
+    std::atomic<int> done (0);
+    auto count ([&](chunk_coordinates){ ++done; });
+
+    // A failed lookup doesn't leave anything behind.
+    BOOST_CHECK_THROW(pipeline.request(chunk_coordinates(500, 300, 300), &owner, count),
+                      std::runtime_error);
+    BOOST_CHECK_EQUAL(pipeline.stats().lookups, 0);
+    BOOST_CHECK(pipeline.is_idle());
+
+    pipeline.request(chunk_coordinates(300, 300, 300), &owner, count);
+    pipeline.wait_idle();
+    BOOST_CHECK_EQUAL(done, 1);
+    BOOST_CHECK_EQUAL(pipeline.stats().lookups, 0);
+}
+
+//---------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE (request_queue_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+
+    const chunk_coordinates c (400, 400, 400);
+    const yaw_pitch north (0, boost::math::constants::half_pi<float>());
+    const auto dir (from_spherical(north));
+
+    BOOST_CHECK_EQUAL(request_queue::priority(c, dir, c), 0);
+    BOOST_CHECK_CLOSE(request_queue::priority(c, dir, c + world_vector(0, 3, 0)), 3, 0.01);
+    BOOST_CHECK_CLOSE(request_queue::priority(c, dir, c + world_vector(3, 0, 0)), 6, 0.01);
+    BOOST_CHECK_CLOSE(request_queue::priority(c, dir, c + world_vector(0,-3, 0)), 9, 0.01);
+
+    chunk_pipeline pipeline (w, 1);
+    std::mutex lock;
+    std::vector<std::pair<int, chunk_coordinates>> done;
+    auto record ([&](int who)
+    {
+        return [&, who](chunk_coordinates p)
+        {
+            std::lock_guard<std::mutex> l (lock);
+            done.emplace_back(who, p);
+        };
+    });
+
+    // One slot in the pipeline, so everything is handled in order of
+    // priority.  The last one is outside the view radius.
+    {
+    request_queue queue (pipeline, 8, 1);
+    int owner;
+    queue.update_viewer(&owner, c, north);
+    queue.request(&owner, c + world_vector(0,-3, 0), record(0));
+    queue.request(&owner, c + world_vector(3, 0, 0), record(0));
+    queue.request(&owner, c + world_vector(0, 3, 0), record(0));
+    queue.request(&owner, c + world_vector(0,20, 0), record(0));
+    queue.dispatch();
+    pipeline.wait_idle();
+
+    BOOST_REQUIRE_EQUAL(done.size(), 3);
+    BOOST_CHECK_EQUAL(done[0].second, c + world_vector(0, 3, 0));
+    BOOST_CHECK_EQUAL(done[1].second, c + world_vector(3, 0, 0));
+    BOOST_CHECK_EQUAL(done[2].second, c + world_vector(0,-3, 0));
+
+    auto s (queue.stats());
+    BOOST_CHECK_EQUAL(s.queued, 0);
+    BOOST_CHECK_EQUAL(s.in_flight, 0);
+    BOOST_CHECK_EQUAL(s.dispatched, 3);
+    BOOST_CHECK_EQUAL(s.out_of_range, 1);
+    }
+
+    // Two players take turns, even though the first one asked for
+    // everything before the second one did.
+    done.clear();
+    {
+    request_queue queue (pipeline, 8, 1);
+    int owner_a, owner_b;
+    for (int i (0); i < 3; ++i)
+        queue.request(&owner_a, c + world_vector(i, 0, 2), record(1));
+    for (int i (0); i < 3; ++i)
+        queue.request(&owner_b, c + world_vector(i, 0, 4), record(2));
+
+    queue.dispatch();
+    pipeline.wait_idle();
+
+    BOOST_REQUIRE_EQUAL(done.size(), 6);
+    for (size_t i (1); i < done.size(); ++i)
+        BOOST_CHECK(done[i].first != done[i - 1].first);
+    }
+
+    // Requests that are too old are dropped.
+    done.clear();
+    {
+    request_queue queue (pipeline, 8, 1, 1, std::chrono::seconds(10));
+    int owner;
+    queue.request(&owner, c + world_vector(0, 0, 6), record(0));
+    queue.request(&owner, c + world_vector(1, 0, 6), record(0));
+    queue.dispatch(request_queue::clock::now() + std::chrono::seconds(11));
+    pipeline.wait_idle();
+
+    BOOST_CHECK(done.empty());
+    BOOST_CHECK_EQUAL(queue.stats().expired, 2);
+    }
+}
+
+//---------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE (update_queue_test)
+{
+    const chunk_coordinates c (400, 400, 400);
+    const auto start (update_queue::clock::now());
+    const auto tick (std::chrono::milliseconds(100));
+
+    std::vector<std::pair<const void*, chunk_coordinates>> sent;
+    auto send ([&](const void* owner, chunk_coordinates p) -> size_t
+    {
+        sent.emplace_back(owner, p);
+        return 1000;
+    });
+
+    // A budget of two and a half messages per second.
+    update_queue queue (8, 2500);
+    int near, far, nowhere;
+    queue.update_viewer(&near, c);
+    queue.update_viewer(&far, c + world_vector(20, 0, 0));
+
+    // Changing the same chunk over and over only sends it once, and
+    // players without a position don't get anything.
+    queue.changed(c + world_vector(0, 0, 3));
+    queue.changed(c + world_vector(0, 0, 1));
+    queue.changed(c + world_vector(0, 0, 3));
+    queue.changed(c + world_vector(0, 0, 2));
+    queue.changed(c + world_vector(0, 0, 1));
+    BOOST_CHECK_EQUAL(queue.stats().pending, 3);
+    BOOST_CHECK_EQUAL(queue.stats().coalesced, 2);
+    BOOST_CHECK_EQUAL(queue.stats().out_of_range, 5);
+
+    // The closest chunks go first, until the budget runs out.
+    queue.flush(start, send);
+    BOOST_REQUIRE_EQUAL(sent.size(), 3);
+    BOOST_CHECK(sent[0].first == &near);
+    BOOST_CHECK_EQUAL(sent[0].second, c + world_vector(0, 0, 1));
+    BOOST_CHECK_EQUAL(sent[1].second, c + world_vector(0, 0, 2));
+    BOOST_CHECK_EQUAL(sent[2].second, c + world_vector(0, 0, 3));
+
+    for (int i (0); i < 4; ++i)
+        queue.changed(c + world_vector(i, 1, 0));
+
+    // Half a kilobyte over budget, so the next one has to wait a bit.
+    // After that, a message goes out every 400 ms.
+    sent.clear();
+    queue.flush(start + tick * 1, send);
+    BOOST_CHECK(sent.empty());
+    queue.flush(start + tick * 4, send);
+    BOOST_CHECK_EQUAL(sent.size(), 1);
+    queue.flush(start + tick * 5, send);
+    BOOST_CHECK_EQUAL(sent.size(), 1);
+    queue.flush(start + tick * 7, send);
+    BOOST_CHECK_EQUAL(sent.size(), 2);
+    BOOST_CHECK(queue.stats().throttled > 0);
+
+    // Moving away drops what hasn't been sent yet.
+    queue.update_viewer(&near, c + world_vector(0, 20, 0));
+    queue.flush(start + tick * 100, send);
+    BOOST_CHECK_EQUAL(sent.size(), 2);
+    BOOST_CHECK_EQUAL(queue.stats().pending, 0);
+    BOOST_CHECK_EQUAL(queue.stats().sent, 5);
+    BOOST_CHECK_EQUAL(queue.stats().bytes, 5000);
+
+    queue.remove(&far);
+    queue.remove(&nowhere);
+}
+
+//---------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE (entity_replication_test)
+{
+    // Positions are rounded to 1/256th of a block, which might end up in
+    // the next block.
+    const world_coordinates w0 (world_center);
+    entity_state st (wfpos(w0, vector(0.5f, 0.25f, 0.999f)),
+                     vector(1.f, -2.5f, 0.f));
+    BOOST_CHECK_EQUAL(st.position().pos, w0 + world_vector(0, 0, 1));
+    BOOST_CHECK_EQUAL(st.position().frac, vector(0.5f, 0.25f, 0.f));
+    BOOST_CHECK_EQUAL(st.speed(), vector(1.f, -2.5f, 0.f));
+
+    const wfpos origin (w0, vector(0.5f, 0.5f, 0.5f));
+    const yaw_pitch north (0.f, boost::math::constants::pi<float>() / 2);
+    std::vector<entity_replicator::entity> all
+    {
+        { 1,  origin,                          vector(0, 0, 0) },
+        { 2,  origin + vector(200, 0, 0),      vector(0, 0, 0) },
+        { 10, origin + vector(0, -5, 0),       vector(0, 0, 0) },
+        { 11, origin + vector(0, 20, 0),       vector(1, 0, 0) },
+        { 12, origin + vector(0, -20, 0),      vector(0, 0, 0) },
+        { 13, origin + vector(0, 50, 0),       vector(0, 0, 0) },
+        { 14, origin + vector(0, 100, 0),      vector(0, 0, 0) }
+    };
+
+    entity_replicator rep (64.f, 8.f, 1.0f, 4);
+    int a, b;
+    rep.update_viewer(&a, 1, origin, north);
+    rep.update_viewer(&b, 2, all[1].pos, north);
+
+    std::map<const void*, msg::entity_snapshot> sent;
+    auto tick ([&]
+    {
+        sent.clear();
+        rep.tick(all, [&](const void* owner, msg::entity_snapshot& m)
+        {
+            // Go through the wire format, to be sure.
+            auto buf (serialize_packet(m));
+            BOOST_CHECK_EQUAL(buf[0], msg::entity_snapshot::msg_id);
+            auto ar (make_deserializer(buf.begin() + 1, buf.end()));
+            sent[owner].serialize(ar);
+        });
+    });
+    auto ids ([](const msg::entity_snapshot& m)
+    {
+        std::set<uint32_t> result;
+        for (auto& u : m.updates)
+            result.insert(u.entity_id);
+        return result;
+    });
+    auto expected ([&](std::set<uint32_t> which)
+    {
+        entity_states result;
+        for (auto& e : all)
+        {
+            if (which.count(e.id))
+                result[e.id] = entity_state(e.pos, e.velocity);
+        }
+        return result;
+    });
+
+    // Everything close by or in front of the player, and nothing else.
+    tick();
+    BOOST_REQUIRE_EQUAL(sent.size(), 2);
+    BOOST_CHECK_EQUAL(sent[&a].baseline, 0);
+    BOOST_CHECK(ids(sent[&a]) == std::set<uint32_t>({ 1, 10, 11, 13 }));
+    BOOST_CHECK(ids(sent[&b]) == std::set<uint32_t>({ 2 }));
+
+    entity_states client_a;
+    BOOST_REQUIRE(apply_snapshot(sent[&a], entity_states(), client_a));
+    BOOST_CHECK(client_a == expected({ 1, 10, 11, 13 }));
+    rep.acknowledge(&a, sent[&a].sequence);
+    const auto acked (sent[&a].sequence);
+
+    // Only what moved is sent, as a small delta.  Entities further away
+    // have to wait their turn.
+    for (auto i : { 2, 3, 5 })
+        all[i].pos += vector(0.1f, 0, 0);
+
+    tick();
+    BOOST_CHECK_EQUAL(sent[&a].baseline, acked);
+    BOOST_CHECK(ids(sent[&a]) == std::set<uint32_t>({ 10 }));
+    BOOST_CHECK_EQUAL(sent[&a].updates[0].flags,
+                      msg::entity_snapshot::value::moved);
+    BOOST_CHECK(sent[&a].removed.empty());
+
+    // The player that never acknowledged anything gets it all again.
+    BOOST_CHECK_EQUAL(sent[&b].baseline, 0);
+
+    // Until it is acknowledged, the snapshots build on the same one.
+    tick();
+    BOOST_CHECK_EQUAL(sent[&a].baseline, acked);
+    BOOST_CHECK(ids(sent[&a]) == std::set<uint32_t>({ 10, 11, 13 }));
+    entity_states next;
+    BOOST_REQUIRE(apply_snapshot(sent[&a], client_a, next));
+    BOOST_CHECK(next == expected({ 1, 10, 11, 13 }));
+    rep.acknowledge(&a, sent[&a].sequence);
+    client_a = next;
+
+    // Entities that come into view are sent in full, the ones that left
+    // are removed.
+    all[4].pos = origin + vector(0, 10, 0);
+    all.erase(all.begin() + 2);
+    tick();
+    BOOST_CHECK(ids(sent[&a]) == std::set<uint32_t>({ 12 }));
+    BOOST_CHECK_EQUAL(sent[&a].updates[0].flags,
+                      msg::entity_snapshot::value::absolute);
+    BOOST_CHECK(sent[&a].removed == std::vector<uint32_t>({ 10 }));
+    BOOST_REQUIRE(apply_snapshot(sent[&a], client_a, next));
+    BOOST_CHECK(next == expected({ 1, 11, 12, 13 }));
+    BOOST_CHECK(vanished_entities(client_a, next) == std::vector<uint32_t>({ 10 }));
+
+    // A full snapshot replaces everything; what it leaves out is gone.
+    msg::entity_snapshot full;
+    for (auto& e : all)
+    {
+        if (e.id == 1 || e.id == 12)
+            full.updates.push_back(encode_entity(e.id, entity_state(e.pos, e.velocity), nullptr));
+    }
+    entity_states reset;
+    BOOST_REQUIRE(apply_snapshot(full, entity_states(), reset));
+    auto gone (vanished_entities(next, reset));
+    BOOST_CHECK(std::set<uint32_t>(gone.begin(), gone.end()) == std::set<uint32_t>({ 11, 13 }));
+
+    // A delta against a snapshot the client doesn't have is no good.
+    sent[&a].updates[0].flags = msg::entity_snapshot::value::moved;
+    BOOST_CHECK(!apply_snapshot(sent[&a], client_a, next));
+
+    // If the client doesn't acknowledge anything for too long, the
+    // server starts over.
+    for (int i (0); i < 5; ++i)
+    {
+        all[1].pos += vector(1, 0, 0);
+        all[0].pos += vector(1, 0, 0);
+        tick();
+    }
+    BOOST_CHECK_EQUAL(sent[&a].baseline, 0);
+
+    auto s (rep.stats());
+    BOOST_CHECK(s.postponed > 0);
+    BOOST_CHECK(s.ignored > 0);
+    BOOST_CHECK(s.unchanged > 0);
+    BOOST_CHECK(s.full > 0);
+
+    rep.remove(&a);
+    rep.remove(&b);
+}
+
+//---------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE (lightmap_refiner_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(new phase_lightmap(w)));
+    BOOST_CHECK_EQUAL(w.lightmap_phases(), 3);
+
+    const chunk_coordinates near (500, 500, 500);
+    const chunk_coordinates far  (near + world_vector(3, 0, 0));
+    const chunk_coordinates away (near + world_vector(10, 0, 0));
+
+    for (auto p : { near, far, away })
+    {
+        prepare_for_player(w, p);
+        auto proxy (w.acquire_read_access());
+        auto lm (deserialize_as<light_data>(decompress(*proxy.get_compressed_lightmap(p))));
+        BOOST_CHECK_EQUAL(lm.phase, 0);
+        BOOST_CHECK(!lm.opaque.empty());
+        BOOST_CHECK_EQUAL(lm.opaque.data[0].sunlight, 1);
+    }
+
+    chunk_pipeline pipeline (w, 1);
+    std::vector<std::pair<chunk_coordinates, light_data>> sent;
+    lightmap_refiner refiner (w, pipeline,
+        [&](chunk_coordinates pos, const shared_compressed_data& light,
+            const std::vector<const void*>& owners)
+        {
+            BOOST_CHECK_EQUAL(owners.size(), 1);
+            sent.emplace_back(pos, deserialize_as<light_data>(decompress(*light)));
+        }, 4);
+
+    int owner;
+    refiner.update_viewer(&owner, near);
+    for (auto p : { far, near, away })
+        refiner.add(&owner, p);
+
+    while (refiner.refine_one())
+        ;
+
+    // The closest chunk goes first, the one out of range is skipped.
+    BOOST_REQUIRE_EQUAL(sent.size(), 4);
+    BOOST_CHECK_EQUAL(sent[0].first, near);
+    BOOST_CHECK_EQUAL(sent[0].second.phase, 1);
+    BOOST_CHECK_EQUAL(sent[1].first, near);
+    BOOST_CHECK_EQUAL(sent[1].second.phase, 2);
+    BOOST_CHECK_EQUAL(sent[1].second.opaque.data[0].sunlight, 3);
+    BOOST_CHECK_EQUAL(sent[2].first, far);
+    BOOST_CHECK_EQUAL(sent[3].first, far);
+    BOOST_CHECK_EQUAL(refiner.refined(), 4);
+    BOOST_CHECK_EQUAL(refiner.queued(), 0);
+
+    // The refined light maps replace the old ones.
+    auto proxy (w.acquire_read_access());
+    auto lm (deserialize_as<light_data>(decompress(*proxy.get_compressed_lightmap(far))));
+    BOOST_CHECK_EQUAL(lm.phase, 2);
+    lm = deserialize_as<light_data>(decompress(*proxy.get_compressed_lightmap(away)));
+    BOOST_CHECK_EQUAL(lm.phase, 0);
+}
+
+//---------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE (lamp_lightmap_test)
+{
+    setup("terrain_test_3.json");
+    auto& wall (register_new_material(1));
+    wall.is_solid = true;
+    wall.transparency = 0;
+    auto& lamp (register_new_material(2));
+    lamp.is_solid = true;
+    lamp.transparency = 0;
+    lamp.light_emission = 255;
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new lamp_lightmap(w, pt::ptree())));
+
+    const chunk_coordinates cp (600, 600, 600);
+    const world_coordinates origin (cp * chunk_size);
+    const chunk_index lamp_pos (4, 8, 8), wall_pos (8, 8, 8);
+    prepare_for_player(w, cp);
+
+    // The light level on the west face of the wall.
+    auto wall_light ([&]
+    {
+        auto proxy (w.acquire_read_access());
+        auto& srf (proxy.get_surface(cp));
+        auto lm (deserialize_as<light_data>(decompress(*proxy.get_compressed_lightmap(cp))));
+        auto li (lm.opaque.begin());
+        for (auto& f : srf.opaque)
+        {
+            for (int d (0); d < 6; ++d)
+            {
+                if (!f[d])
+                    continue;
+
+                if (f.pos == wall_pos && d == dir_west)
+                    return int(li->artificial);
+
+                ++li;
+            }
+        }
+        return -1;
+    });
+
+    // Empty out the chunk, and put a lamp four blocks from the wall.
+    {
+    auto proxy (w.acquire_write_access(cp));
+    for (auto p : every_block_in_chunk)
+        proxy[origin + p] = type::air;
+
+    proxy[origin + lamp_pos] = 2;
+    proxy[origin + wall_pos] = 1;
+    }
+    BOOST_CHECK_EQUAL(wall_light(), 12);
+
+    // Block the direct path, the light has to go around.
+    {
+    auto proxy (w.acquire_write_access(cp));
+    proxy[origin + lamp_pos + world_vector(1, 0, 0)] = 1;
+    }
+    BOOST_CHECK_EQUAL(wall_light(), 10);
+
+    // Switch off the lamp.
+    {
+    auto proxy (w.acquire_write_access(cp));
+    proxy[origin + lamp_pos] = type::air;
+    }
+    BOOST_CHECK_EQUAL(wall_light(), 0);
+
+    lamp.light_emission = 0;
+}
+
+//---------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE (voxel_snapshot_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+
+    auto proxy (w.acquire_read_access());
+    const chunk_coordinates cp (10, 10, 10);
+    const world_coordinates origin (cp * chunk_size);
+
+    // A border of 20 blocks spans two chunks in every direction.
+    voxel_snapshot snap;
+    snap.fill(cp, 20, [&](chunk_coordinates p) { return &proxy.get_chunk(p); });
+    BOOST_CHECK_EQUAL(snap.side(), chunk_size + 40);
+
+    for (auto p : cube_range<world_vector>(chunk_size / 2 + 20))
+    {
+        world_vector rel (p + world_vector(8, 8, 8));
+        if (!snap.contains(rel))
+            continue;
+
+        auto i (snap.index(rel));
+        BOOST_CHECK_EQUAL(snap.type(i), proxy.get_block(origin + rel));
+        BOOST_CHECK_EQUAL(snap.opacity(i), snap.type(i) == 1 ? 1.0f : 0.0f);
+    }
+
+    // Stepping through the array is the same as stepping through the
+    // world.
+    auto i (snap.index(world_vector(-19, 5, 34)));
+    for (int d (0); d < 6; ++d)
+    {
+        BOOST_CHECK_EQUAL(snap.type(i + snap.offset(dir_vector[d])),
+            proxy.get_block(origin + world_vector(-19, 5, 34) + dir_vector[d]));
+    }
+
+    // Surface extraction only needs a border of one block.
+    voxel_snapshot nbh;
+    nbh.fill(cp, 1, [&](chunk_coordinates p) { return &proxy.get_chunk(p); });
+    BOOST_CHECK(extract_opaque_surface(nbh) == proxy.get_surface(cp).opaque);
+}
+
+BOOST_AUTO_TEST_CASE (palette_chunk_test)
+{
+    chunk cnk;
+    BOOST_CHECK_EQUAL(cnk.bits_per_block(), 0);
+    BOOST_CHECK(cnk.is_air());
+
+    // Every palette size is read back the same, and takes fewer bits
+    // per block than the raw array.
+    std::mt19937 rng (1234);
+    std::vector<uint16_t> expected (chunk_volume);
+    for (unsigned int materials : { 2, 3, 16, 200, 300 })
+    {
+        chunk c;
+        for (size_t i (0); i < chunk_volume; ++i)
+        {
+            expected[i] = static_cast<uint16_t>(i < materials ? i : rng() % materials);
+            c[i] = expected[i];
+        }
+        BOOST_CHECK_EQUAL(c.bits_per_block(), 16);
+        const size_t raw_size (c.memory_usage());
+
+        c.compact();
+        const chunk& cc (c);
+        BOOST_CHECK_EQUAL(cc.palette_size(), materials > 256 ? 0 : materials);
+        BOOST_CHECK_EQUAL(cc.bits_per_block(),   materials <= 2 ? 1
+                                               : materials <= 4 ? 2
+                                               : materials <= 16 ? 4
+                                               : materials <= 256 ? 8 : 16);
+        if (materials <= 256)
+            BOOST_CHECK_LT(cc.memory_usage(), raw_size);
+
+        for (size_t i (0); i < chunk_volume; ++i)
+            BOOST_REQUIRE_EQUAL(cc[i], expected[i]);
+
+        BOOST_CHECK(std::equal(cc.begin(), cc.end(), expected.begin()));
+        std::vector<uint16_t> types (100);
+        cc.copy_types(1000, 100, &types[0]);
+        BOOST_CHECK(std::equal(types.begin(), types.end(), expected.begin() + 1000));
+
+        // Serialization stores the raw array, and compacts when loading.
+        auto copy (deserialize_as<chunk>(serialize(c)));
+        BOOST_CHECK_EQUAL(copy.bits_per_block(), c.bits_per_block());
+        BOOST_CHECK(copy == c);
+
+        // Writing to a packed chunk unpacks it first.
+        c(1, 2, 3) = 7;
+        BOOST_CHECK_EQUAL(c.bits_per_block(), 16);
+        BOOST_CHECK_EQUAL(c(1, 2, 3), 7);
+        BOOST_CHECK(!(copy == c));
+    }
+
+    // A chunk with only one type of block doesn't need any storage.
+    chunk solid;
+    solid.clear(5);
+    solid[100] = 6;
+    solid.compact();
+    BOOST_CHECK_EQUAL(solid.bits_per_block(), 1);
+    solid[100] = 5;
+    solid.compact();
+    BOOST_CHECK_EQUAL(solid.bits_per_block(), 0);
+    BOOST_CHECK_EQUAL(solid(15, 15, 15), 5);
+    BOOST_CHECK(!solid.is_air());
+}
+
+// Two kinds of glass that look different, one that looks the same as
+// the first, and a custom block.  Returns a mix of these, air, and rock.
+std::vector<uint16_t> glass_palette()
+{
+    auto& glass (register_new_material(10));
+    glass.transparency = 100;
+    glass.textures.fill(3);
+    auto& tinted (register_new_material(11));
+    tinted.transparency = 100;
+    tinted.textures.fill(4);
+    auto& same (register_new_material(12));
+    same.transparency = 50;
+    same.textures.fill(3);
+    auto& fence (register_new_material(13));
+    fence.model.resize(1);
+
+    return { 0, 0, 0, 1, 1, 10, 11, 12, 13 };
+}
+
+BOOST_AUTO_TEST_CASE (surface_mask_test)
+{
+    const auto palette (glass_palette());
+    const chunk_coordinates cp (world_chunk_center);
+
+    std::mt19937 rng (7);
+    for (int density (1); density <= 8; density *= 2)
+    {
+        std::map<chunk_coordinates, chunk> chunks;
+        for (auto& rel : neumann_neighborhood)
+        {
+            auto& cnk (chunks[cp + rel]);
+            for (auto p : every_block_in_chunk)
+            {
+                auto pick (rng() % (palette.size() * 8));
+                cnk[p] = pick < palette.size() * density
+                         ? palette[pick % palette.size()] : type::air;
+            }
+        }
+
+        voxel_snapshot snap;
+        snap.fill(cp, 1, [&](chunk_coordinates p) -> const chunk*
+        {
+            auto found (chunks.find(p));
+            return found == chunks.end() ? nullptr : &found->second;
+        });
+
+        auto masked (extract_surface(snap));
+        BOOST_CHECK(identical(masked.opaque, extract_opaque_surface(snap)));
+        BOOST_CHECK(identical(masked.transparent, extract_transparent_surface(snap)));
+        BOOST_CHECK(!masked.transparent.empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE (patch_surface_test)
+{
+    const auto palette (glass_palette());
+    const chunk_coordinates cp (world_chunk_center);
+
+    std::mt19937 rng (11);
+    std::map<chunk_coordinates, chunk> chunks;
+    for (auto& rel : neumann_neighborhood)
+    {
+        auto& cnk (chunks[cp + rel]);
+        for (auto p : every_block_in_chunk)
+            cnk[p] = palette[rng() % palette.size()];
+    }
+
+    voxel_snapshot snap;
+    auto refill ([&]
+    {
+        snap.fill(cp, 1, [&](chunk_coordinates p) -> const chunk*
+        {
+            auto found (chunks.find(p));
+            return found == chunks.end() ? nullptr : &found->second;
+        });
+    });
+
+    refill();
+    auto srf (extract_surface(snap));
+    for (int i (0); i < 100; ++i)
+    {
+        // Change a few blocks.  Every now and then, one of them is in
+        // the chunk next door.
+        std::vector<chunk_index> blocks;
+        for (int j (0); j <= i % 4; ++j)
+        {
+            world_vector b (rng() % chunk_size, rng() % chunk_size,
+                            rng() % chunk_size);
+            if (rng() % 4 == 0)
+                b[rng() % 3] = rng() % 2 ? -1 : chunk_size;
+
+            world_coordinates wb (cp * chunk_size + b);
+            chunks[wb >> cnkshift][wb % chunk_size] = palette[rng() % palette.size()];
+
+            for (int d (-1); d < 6; ++d)
+            {
+                world_vector n (d < 0 ? b : b + dir_vector[d]);
+                if (   n.x >= 0 && n.y >= 0 && n.z >= 0
+                    && n.x < chunk_size && n.y < chunk_size && n.z < chunk_size)
+                {
+                    blocks.emplace_back(n.x, n.y, n.z);
+                }
+            }
+        }
+
+        refill();
+        auto patched (patch_surface(srf, snap, blocks));
+        srf = extract_surface(snap);
+        BOOST_CHECK(identical(patched.opaque, srf.opaque));
+        BOOST_CHECK(identical(patched.transparent, srf.transparent));
+    }
+}
+
+BOOST_AUTO_TEST_CASE (incremental_update_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new sun_lightmap(w, pt::ptree())));
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new ambient_occlusion_lightmap(w, pt::ptree())));
+
+    // To the east of the center, the test pattern is random noise.
+    // Thin it out a bit, so the light gets further.
+    const chunk_coordinates cp (world_chunk_center + world_vector(4, 0, 0));
+    const world_coordinates origin (cp * chunk_size);
+    std::mt19937 rng (3);
+    for (auto rel : cube_range<world_vector>(2))
+    {
+        auto proxy (w.acquire_write_access(cp + rel));
+        for (auto& blk : proxy.get_chunk(cp + rel))
+        {
+            if (rng() % 8 != 0)
+                blk = type::air;
+        }
+    }
+    // Handing out whole chunks rebuilds everything from scratch.
+    auto rebuild ([&]
+    {
+        for (auto rel : cube_range<world_vector>(1))
+            w.acquire_write_access(cp + rel).get_chunk(cp + rel);
+    });
+    rebuild();
+
+    auto version ([&](chunk_coordinates p)
+    {
+        return w.acquire_read_access().get_surface(p).version;
+    });
+
+    // The surfaces and light maps around the chunk, as they are now.
+    typedef std::map<chunk_coordinates, std::pair<surface_data, light_data>> state;
+    auto current ([&]
+    {
+        state result;
+        auto proxy (w.acquire_read_access());
+        for (auto rel : cube_range<world_vector>(1))
+        {
+            auto p (cp + rel);
+            result[p].first = proxy.get_surface(p);
+            result[p].second = deserialize_as<light_data>(
+                decompress(*proxy.get_compressed_lightmap(p)));
+        }
+        return result;
+    });
+
+    // A block in the middle, one on the western border, and one in a
+    // corner.
+    const world_vector west (-1, 0, 0), east (1, 0, 0);
+    for (auto b : { chunk_index(8, 8, 8), chunk_index(0, 5, 9),
+                    chunk_index(15, 15, 0) })
+    {
+        auto west_version (version(cp + west));
+        auto east_version (version(cp + east));
+        {
+        auto proxy (w.acquire_write_access(cp));
+        auto& blk (proxy[origin + b]);
+        blk = (blk == type::air) ? 1 : type::air;
+        }
+        auto patched (current());
+
+        // The neighbors only get a new surface if the block was on the
+        // border they share.
+        BOOST_CHECK_EQUAL(version(cp + west), west_version + (b.x == 0));
+        BOOST_CHECK_EQUAL(version(cp + east), east_version + (b.x == 15));
+
+        // Rebuilding everything gives the same result.
+        rebuild();
+        for (auto& rebuilt : current())
+        {
+            auto& p (patched[rebuilt.first]);
+            BOOST_CHECK(identical(p.first.opaque, rebuilt.second.first.opaque));
+            BOOST_CHECK(identical(p.first.transparent, rebuilt.second.first.transparent));
+            BOOST_CHECK(p.second.opaque == rebuilt.second.second.opaque);
+            BOOST_CHECK(p.second.transparent == rebuilt.second.second.transparent);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE (write_back_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+
+    const chunk_coordinates cp (world_chunk_center + world_vector(6, 0, 0));
+    const world_coordinates b (cp * chunk_size + world_vector(5, 5, 5));
+    {
+    auto proxy (w.acquire_read_access());
+    proxy.get_surface(cp);
+    proxy.get_compressed_lightmap(cp);
+    }
+
+    auto stored ([&](persistent_storage_i::data_type t)
+        { return decompress(store.retrieve(t, cp)); });
+
+    const auto chunk_before (stored(persistent_storage_i::chunk));
+    const auto surface_before (stored(persistent_storage_i::surface));
+    const auto light_before (stored(persistent_storage_i::light));
+
+    set_blocks(w, { { b, get_block(w, b) == 1 ? type::air : uint16_t(1) } });
+
+    // Nothing of the change reaches the storage before the write-back...
+    BOOST_CHECK(stored(persistent_storage_i::chunk) == chunk_before);
+    BOOST_CHECK(stored(persistent_storage_i::surface) == surface_before);
+    BOOST_CHECK(stored(persistent_storage_i::light) == light_before);
+
+    // ...and then the chunk, its surface, and its light map all do.
+    w.flush();
+    BOOST_CHECK(stored(persistent_storage_i::chunk) != chunk_before);
+    BOOST_CHECK(stored(persistent_storage_i::surface) != surface_before);
+
+    auto proxy (w.acquire_read_access());
+    BOOST_CHECK(stored(persistent_storage_i::surface)
+                == decompress(*proxy.get_compressed_surface(cp)));
+    BOOST_CHECK(stored(persistent_storage_i::light)
+                == decompress(*proxy.get_compressed_lightmap(cp)));
+}
+
+BOOST_AUTO_TEST_CASE (bulk_edit_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new sun_lightmap(w, pt::ptree())));
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new ambient_occlusion_lightmap(w, pt::ptree())));
+
+    const chunk_coordinates cp (world_chunk_center + world_vector(4, 0, 0));
+    const world_coordinates origin (cp * chunk_size);
+    auto rebuild ([&]
+    {
+        for (auto rel : cube_range<world_vector>(1))
+            w.acquire_write_access(cp + rel).get_chunk(cp + rel);
+    });
+    rebuild();
+
+    // A hollow 10x10x10 box, with its corner sticking into seven of
+    // the neighboring chunks.
+    std::vector<std::pair<world_coordinates, uint16_t>> blocks;
+    for (auto b : make_range(origin + world_coordinates(10, 10, 10),
+                             origin + world_coordinates(20, 20, 20)))
+    {
+        auto r (b - origin);
+        bool shell (   r.x == 10 || r.x == 19 || r.y == 10 || r.y == 19
+                    || r.z == 10 || r.z == 19);
+        blocks.emplace_back(b, shell ? 1 : type::air);
+    }
+
+    std::map<chunk_coordinates, int> updates;
+    {
+    boost::signals2::scoped_connection counter (
+        w.on_update_surface.connect([&](chunk_coordinates p){ ++updates[p]; }));
+
+    set_blocks(w, blocks);
+    }
+
+    // Every surface around the box is sent out only once.
+    BOOST_CHECK(updates.count(cp));
+    BOOST_CHECK(updates.count(cp + world_vector(1, 1, 1)));
+    for (auto& u : updates)
+        BOOST_CHECK_EQUAL(u.second, 1);
+
+    for (auto& b : blocks)
+        BOOST_CHECK_EQUAL(get_block(w, b.first), b.second);
+
+    // Rebuilding everything gives the same result.
+    typedef std::map<chunk_coordinates, std::pair<surface_data, light_data>> state;
+    auto current ([&]
+    {
+        state result;
+        auto proxy (w.acquire_read_access());
+        for (auto rel : cube_range<world_vector>(1))
+        {
+            auto p (cp + rel);
+            result[p].first = proxy.get_surface(p);
+            result[p].second = deserialize_as<light_data>(
+                decompress(*proxy.get_compressed_lightmap(p)));
+        }
+        return result;
+    });
+
+    auto patched (current());
+    rebuild();
+    for (auto& rebuilt : current())
+    {
+        auto& p (patched[rebuilt.first]);
+        BOOST_CHECK(identical(p.first.opaque, rebuilt.second.first.opaque));
+        BOOST_CHECK(identical(p.first.transparent, rebuilt.second.first.transparent));
+        BOOST_CHECK(p.second.opaque == rebuilt.second.second.opaque);
+        BOOST_CHECK(p.second.transparent == rebuilt.second.second.transparent);
+    }
+}
+
+//---------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE (surface_delta_test)
+{
+    setup("terrain_test_3.json");
+    auto& m (register_new_material(1));
+    m.is_solid = true;
+    m.transparency = 0;
+    w.add_lightmap_generator(std::unique_ptr<lightmap_generator_i>(
+        new ambient_occlusion_lightmap(w, pt::ptree())));
+
+    const chunk_coordinates cp (world_chunk_center + world_vector(4, 0, 0));
+    const world_coordinates origin (cp * chunk_size);
+
+    typedef std::pair<surface_data, light_data> state;
+    auto current ([&]
+    {
+        auto proxy (w.acquire_read_access());
+        return state(proxy.get_surface(cp), deserialize_as<light_data>(
+                         decompress(*proxy.get_compressed_lightmap(cp))));
+    });
+    auto history ([&]
+    {
+        auto packed (w.acquire_read_access().get_compressed_history(cp));
+        BOOST_REQUIRE(packed);
+        return deserialize_as<surface_history>(decompress(*packed));
+    });
+    auto check_same ([](const state& a, const state& b)
+    {
+        BOOST_CHECK_EQUAL(a.first.version, b.first.version);
+        BOOST_CHECK(identical(a.first.opaque, b.first.opaque));
+        BOOST_CHECK(identical(a.first.transparent, b.first.transparent));
+        BOOST_CHECK(a.second.opaque == b.second.opaque);
+        BOOST_CHECK(a.second.transparent == b.second.transparent);
+    });
+
+    current();
+    BOOST_CHECK(!w.acquire_read_access().get_compressed_history(cp));
+
+    // Make some room first; the test pattern is half full.
+    std::vector<std::pair<world_coordinates, uint16_t>> room;
+    for (auto b : make_range(origin + world_coordinates(6, 6, 6),
+                             origin + world_coordinates(11, 11, 11)))
+        room.emplace_back(b, type::air);
+
+    set_blocks(w, room);
+    auto v0 (current());
+    BOOST_CHECK_EQUAL(history().size(), 1);
+
+    // A single block turns into a single insert, and a couple of light
+    // values around it.
+    set_blocks(w, { { origin + world_coordinates(8, 8, 8), 1 } });
+    auto v1 (current());
+    auto h1 (history());
+    BOOST_REQUIRE_EQUAL(h1.size(), 2);
+    BOOST_CHECK_EQUAL(h1[1].base, v0.first.version);
+    BOOST_CHECK_EQUAL(h1[1].version, v1.first.version);
+    BOOST_CHECK_EQUAL(h1[1].opaque.inserted.size(), 1);
+
+    auto s (v0);
+    BOOST_CHECK(apply(h1, s.first, s.second));
+    check_same(s, v1);
+
+    // A client that is two versions behind can catch up in one go, and
+    // one that is up to date doesn't mind getting the deltas again.
+    set_blocks(w, { { origin + world_coordinates(8, 9, 8), 1 },
+                    { origin + world_coordinates(3, 3, 3), 1 } });
+    auto v2 (current());
+    auto h2 (history());
+    BOOST_CHECK_EQUAL(h2.size(), 3);
+
+    s = v0;
+    BOOST_CHECK(apply(h2, s.first, s.second));
+    check_same(s, v2);
+    s = v1;
+    BOOST_CHECK(apply(h2, s.first, s.second));
+    check_same(s, v2);
+    s = v2;
+    BOOST_CHECK(apply(h2, s.first, s.second));
+    check_same(s, v2);
+
+    // One that is too far behind has to get the whole thing.
+    s = v0;
+    s.first.version = h2.front().base - 1;
+    BOOST_CHECK(!apply(h2, s.first, s.second));
+    BOOST_CHECK_EQUAL(s.first.version + 1, h2.front().base);
+
+    // Only the light changed.
+    surface_delta light_only;
+    auto lit (v2);
+    lit.second.opaque.data.front() = light(15, 15, 15);
+    BOOST_REQUIRE(make_delta(v2.first, v2.second, lit.first, lit.second,
+                             light_only));
+    BOOST_CHECK(light_only.opaque.inserted.empty());
+    BOOST_CHECK_EQUAL(light_only.opaque_light.inserted.size(), 1);
+    s = v2;
+    BOOST_CHECK(apply(light_only, s.first, s.second));
+    check_same(s, lit);
+
+    // A delta that doesn't fit leaves everything as it was.
+    s = v1;
+    BOOST_CHECK(!apply(light_only, s.first, s.second));
+    check_same(s, v1);
+}
+
+//---------------------------------------------------------------------------
+
 BOOST_AUTO_TEST_CASE (soil_test)
 {
     setup("terrain_test_6.json");